@@ -0,0 +1,662 @@
+#pragma once
+
+#include "capabilities.h"
+#include "logger.h"
+#include <climits>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Device memory stuff
+namespace utils {
+enum class MemoryUsage {
+  eGpuOnly,  // Device local, never touched by the CPU
+  eCpuToGpu, // Host visible and coherent, written by the CPU (staging, uniforms)
+  eGpuToCpu, // Host visible, cached when possible, read back by the CPU
+  eLazy,     // Transient attachments, lazily allocated where the device has such memory
+};
+
+enum class BlockStrategy {
+  eFreeList, // Best fit over a free list that coalesces neighbours, allocations are freed individually
+  eLinear,   // Bump allocation, allocations are only released all at once through resetPool
+};
+
+// Buffers and linear images never share a block with optimal images, so bufferImageGranularity never applies
+enum class ResourceKind {
+  eLinear,
+  eOptimal,
+};
+
+struct MemoryBlock {
+  vk::DeviceMemory memory;
+  vk::DeviceSize   size { 0 };
+  uint32_t         memoryType { 0 };
+  void*            mapped { nullptr }; // Host visible blocks stay mapped for their whole lifetime
+  vk::DeviceSize   used { 0 };
+  uint32_t         allocationCount { 0 };
+  vk::DeviceSize   linearHead { 0 };
+
+  std::map<vk::DeviceSize, vk::DeviceSize>      freeByOffset; // offset -> size
+  std::multimap<vk::DeviceSize, vk::DeviceSize> freeBySize;   // size -> offset
+};
+
+struct MemoryPool {
+  uint32_t                                  memoryType { 0 };
+  ResourceKind                              kind { ResourceKind::eLinear };
+  BlockStrategy                             strategy { BlockStrategy::eFreeList };
+  vk::DeviceSize                            blockSize { 0 };
+  std::vector<std::unique_ptr<MemoryBlock>> blocks;
+};
+
+struct PoolCreateInfo {
+  MemoryUsage    usage { MemoryUsage::eGpuOnly };
+  ResourceKind   kind { ResourceKind::eLinear };
+  BlockStrategy  strategy { BlockStrategy::eFreeList };
+  vk::DeviceSize blockSize { 0 }; // 0 uses the allocator default
+  uint32_t       memoryTypeBits { ~0u };
+};
+
+struct AllocationCreateInfo {
+  MemoryUsage usage { MemoryUsage::eGpuOnly };
+  bool        dedicated { false }; // Force a separate vkAllocateMemory for this resource
+  MemoryPool* pool { nullptr };    // Allocate from a custom pool instead of the default ones
+};
+
+struct Allocation {
+  vk::DeviceMemory memory;
+  vk::DeviceSize   offset { 0 };
+  vk::DeviceSize   size { 0 };
+  void*            mapped { nullptr };
+  uint32_t         memoryType { 0 };
+  MemoryBlock*     block { nullptr }; // nullptr for dedicated allocations
+  MemoryPool*      pool { nullptr };
+};
+
+// What the driver reports about dedicated allocations for one resource (Vulkan 1.1 devices only), along with the
+// resource itself, which a dedicated allocation names so the driver can place it optimally
+struct DedicatedRequirements {
+  bool       prefersDedicated { false };
+  bool       requiresDedicated { false };
+  vk::Buffer buffer;
+  vk::Image  image;
+};
+
+struct BufferAllocation {
+  vk::Buffer buffer;
+  Allocation allocation;
+};
+
+struct ImageAllocation {
+  vk::Image  image;
+  Allocation allocation;
+};
+
+struct AllocatorStats {
+  vk::DeviceSize bytesAllocated { 0 }; // Device memory owned by the allocator
+  vk::DeviceSize bytesUsed { 0 };      // Handed out to resources
+  vk::DeviceSize totalFree { 0 };      // Free bytes inside blocks
+  vk::DeviceSize largestFree { 0 };    // Largest single free range inside any block
+  uint32_t       blockCount { 0 };
+  uint32_t       dedicatedCount { 0 };
+  uint32_t       allocationCount { 0 };
+
+  // 0 when all free space is one range, approaching 1 as it splinters into small pieces
+  double fragmentation() const {
+    return totalFree == 0 ? 0.0 : 1.0 - static_cast<double>( largestFree ) / static_cast<double>( totalFree );
+  }
+};
+
+vk::DeviceSize alignUp( vk::DeviceSize value, vk::DeviceSize alignment ) {
+  return alignment <= 1 ? value : ( value + alignment - 1 ) / alignment * alignment;
+}
+
+// Sub-allocates resources out of large device memory blocks, one set of blocks per memory type and resource kind.
+// Large resources (and ones the driver prefers or requires that way) get dedicated allocations. Thread safe.
+class DeviceAllocator {
+  public:
+  DeviceAllocator() = default;
+  DeviceAllocator( const DeviceAllocator& ) = delete;
+  DeviceAllocator& operator=( const DeviceAllocator& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities,
+               vk::DeviceSize preferredBlockSize = 64ull << 20 ) {
+    mDevice             = device;
+    mMemoryProperties   = capabilities.memory;
+    mLimits             = capabilities.limits();
+    mPreferredBlockSize = preferredBlockSize;
+    mDedicatedQuery     = capabilities.apiVersion() >= VK_API_VERSION_1_1;
+
+    for ( uint32_t i = 0; i < mMemoryProperties.memoryTypeCount; i++ ) {
+      for ( uint32_t kind = 0; kind < 2; kind++ ) {
+        MemoryPool& pool = mDefaultPools[i][kind];
+        pool.memoryType  = i;
+        pool.kind        = static_cast<ResourceKind>( kind );
+        pool.blockSize   = defaultBlockSize( i );
+      }
+    }
+  }
+
+  // Frees every block, resources still bound to them must already be destroyed
+  void destroy() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    for ( uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++ ) {
+      for ( MemoryPool& pool : mDefaultPools[i] ) {
+        releaseBlocks( pool );
+      }
+    }
+    for ( std::unique_ptr<MemoryPool>& pool : mCustomPools ) {
+      releaseBlocks( *pool );
+    }
+    mCustomPools.clear();
+    if ( mDedicatedCount > 0 ) {
+      VFS_LOG_ERROR << mDedicatedCount << " dedicated allocations were never freed";
+    }
+  }
+
+  const vk::PhysicalDeviceMemoryProperties& memoryProperties() const {
+    return mMemoryProperties;
+  }
+
+  // Memory type that has all of `required`, the most of `preferred` and the least of `avoided`, or UINT32_MAX
+  uint32_t findMemoryType( uint32_t typeBits, vk::MemoryPropertyFlags required,
+                           vk::MemoryPropertyFlags preferred = vk::MemoryPropertyFlags(),
+                           vk::MemoryPropertyFlags avoided   = vk::MemoryPropertyFlags() ) const {
+    uint32_t best      = UINT32_MAX;
+    int      bestScore = INT32_MIN;
+    for ( uint32_t i = 0; i < mMemoryProperties.memoryTypeCount; i++ ) {
+      vk::MemoryPropertyFlags flags = mMemoryProperties.memoryTypes[i].propertyFlags;
+      if ( !( typeBits & ( 1u << i ) ) || ( flags & required ) != required ) {
+        continue;
+      }
+
+      int score = 2 * popcount( static_cast<uint32_t>( flags & preferred ) )
+                - popcount( static_cast<uint32_t>( flags & avoided ) );
+      if ( score > bestScore ) {
+        best      = i;
+        bestScore = score;
+      }
+    }
+    return best;
+  }
+
+  uint32_t findMemoryType( uint32_t typeBits, MemoryUsage usage ) const {
+    vk::MemoryPropertyFlags required;
+    vk::MemoryPropertyFlags preferred;
+    vk::MemoryPropertyFlags avoided;
+    switch ( usage ) {
+    case ( MemoryUsage::eGpuOnly ):
+      preferred = vk::MemoryPropertyFlagBits::eDeviceLocal;
+      avoided   = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eLazilyAllocated;
+      break;
+
+    case ( MemoryUsage::eCpuToGpu ):
+      required = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+      avoided  = vk::MemoryPropertyFlagBits::eHostCached;
+      break;
+
+    case ( MemoryUsage::eGpuToCpu ):
+      required  = vk::MemoryPropertyFlagBits::eHostVisible;
+      preferred = vk::MemoryPropertyFlagBits::eHostCached | vk::MemoryPropertyFlagBits::eHostCoherent;
+      break;
+
+    case ( MemoryUsage::eLazy ):
+      preferred = vk::MemoryPropertyFlagBits::eLazilyAllocated | vk::MemoryPropertyFlagBits::eDeviceLocal;
+      break;
+    }
+    return findMemoryType( typeBits, required, preferred, avoided );
+  }
+
+  MemoryPool* createPool( const PoolCreateInfo& createInfo ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    std::unique_ptr<MemoryPool> pool = std::make_unique<MemoryPool>();
+    pool->memoryType                 = findMemoryType( createInfo.memoryTypeBits, createInfo.usage );
+    pool->kind                       = createInfo.kind;
+    pool->strategy                   = createInfo.strategy;
+    pool->blockSize = createInfo.blockSize > 0 ? createInfo.blockSize : defaultBlockSize( pool->memoryType );
+    if ( pool->memoryType == UINT32_MAX ) {
+      throw std::runtime_error( "No memory type for pool." );
+    }
+
+    mCustomPools.push_back( std::move( pool ) );
+    return mCustomPools.back().get();
+  }
+
+  // Releases every allocation of a linear pool at once, the blocks are kept for reuse
+  void resetPool( MemoryPool* pool ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    for ( std::unique_ptr<MemoryBlock>& block : pool->blocks ) {
+      block->used            = 0;
+      block->allocationCount = 0;
+      block->linearHead      = 0;
+    }
+  }
+
+  void destroyPool( MemoryPool* pool ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    releaseBlocks( *pool );
+    mCustomPools.erase( std::remove_if( mCustomPools.begin(), mCustomPools.end(),
+                                        [pool]( const std::unique_ptr<MemoryPool>& p ) { return p.get() == pool; } ),
+                        mCustomPools.end() );
+  }
+
+  Allocation allocate( const vk::MemoryRequirements& requirements, const AllocationCreateInfo& createInfo,
+                       ResourceKind kind, const DedicatedRequirements& dedicated = {} ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+
+    if ( createInfo.pool ) {
+      if ( dedicated.requiresDedicated ) {
+        throw std::runtime_error( "Resource requires a dedicated allocation and can not live in a pool." );
+      }
+      return allocateFromPool( *createInfo.pool, requirements );
+    }
+
+    uint32_t memoryType = findMemoryType( requirements.memoryTypeBits, createInfo.usage );
+    if ( memoryType == UINT32_MAX ) {
+      throw std::runtime_error( "No memory type satisfies the allocation." );
+    }
+
+    MemoryPool& pool = mDefaultPools[memoryType][static_cast<uint32_t>( kind )];
+    if ( createInfo.dedicated || dedicated.prefersDedicated || dedicated.requiresDedicated
+         || requirements.size > pool.blockSize / 2 ) {
+      return allocateDedicated( requirements.size, memoryType, dedicated.buffer, dedicated.image );
+    }
+    return allocateFromPool( pool, requirements );
+  }
+
+  void free( Allocation& allocation ) {
+    if ( !allocation.memory ) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    if ( !allocation.block ) {
+      mDevice.freeMemory( allocation.memory );
+      mDedicatedBytes -= allocation.size;
+      mDedicatedCount--;
+      mAllocationCount--;
+    } else if ( allocation.pool->strategy == BlockStrategy::eFreeList ) {
+      MemoryBlock* block = allocation.block;
+      block->used -= allocation.size;
+      block->allocationCount--;
+      insertFreeRange( *block, allocation.offset, allocation.size );
+      trimEmptyBlocks( *allocation.pool );
+    }
+    // Linear allocations are only released by resetPool
+
+    allocation = Allocation();
+  }
+
+  BufferAllocation createBuffer( const vk::BufferCreateInfo& bufferInfo, const AllocationCreateInfo& createInfo ) {
+    BufferAllocation result;
+    result.buffer = mDevice.createBuffer( bufferInfo );
+
+    vk::MemoryRequirements requirements;
+    DedicatedRequirements  dedicated = {};
+    dedicated.buffer                 = result.buffer;
+    if ( mDedicatedQuery ) {
+      vk::StructureChain<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements> chain =
+          mDevice.getBufferMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>(
+              vk::BufferMemoryRequirementsInfo2( result.buffer ) );
+      requirements                = chain.get<vk::MemoryRequirements2>().memoryRequirements;
+      dedicated.prefersDedicated  = chain.get<vk::MemoryDedicatedRequirements>().prefersDedicatedAllocation;
+      dedicated.requiresDedicated = chain.get<vk::MemoryDedicatedRequirements>().requiresDedicatedAllocation;
+    } else {
+      requirements = mDevice.getBufferMemoryRequirements( result.buffer );
+    }
+
+    try {
+      result.allocation = allocate( requirements, createInfo, ResourceKind::eLinear, dedicated );
+    } catch ( ... ) {
+      mDevice.destroyBuffer( result.buffer );
+      throw;
+    }
+    mDevice.bindBufferMemory( result.buffer, result.allocation.memory, result.allocation.offset );
+    return result;
+  }
+
+  ImageAllocation createImage( const vk::ImageCreateInfo& imageInfo, const AllocationCreateInfo& createInfo ) {
+    ImageAllocation result;
+    result.image = mDevice.createImage( imageInfo );
+
+    vk::MemoryRequirements requirements;
+    DedicatedRequirements  dedicated = {};
+    dedicated.image                  = result.image;
+    if ( mDedicatedQuery ) {
+      vk::StructureChain<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements> chain =
+          mDevice.getImageMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>(
+              vk::ImageMemoryRequirementsInfo2( result.image ) );
+      requirements                = chain.get<vk::MemoryRequirements2>().memoryRequirements;
+      dedicated.prefersDedicated  = chain.get<vk::MemoryDedicatedRequirements>().prefersDedicatedAllocation;
+      dedicated.requiresDedicated = chain.get<vk::MemoryDedicatedRequirements>().requiresDedicatedAllocation;
+    } else {
+      requirements = mDevice.getImageMemoryRequirements( result.image );
+    }
+
+    ResourceKind kind =
+        imageInfo.tiling == vk::ImageTiling::eLinear ? ResourceKind::eLinear : ResourceKind::eOptimal;
+    try {
+      result.allocation = allocate( requirements, createInfo, kind, dedicated );
+    } catch ( ... ) {
+      mDevice.destroyImage( result.image );
+      throw;
+    }
+    mDevice.bindImageMemory( result.image, result.allocation.memory, result.allocation.offset );
+    return result;
+  }
+
+  // Makes GPU writes visible to the CPU, only does something for non coherent memory
+  void invalidate( const Allocation& allocation ) {
+    if ( !isCoherent( allocation ) ) {
+      mDevice.invalidateMappedMemoryRanges( vk::MappedMemoryRange( allocation.memory, 0, VK_WHOLE_SIZE ) );
+    }
+  }
+
+  // Makes CPU writes visible to the GPU, only does something for non coherent memory
+  void flush( const Allocation& allocation ) {
+    if ( !isCoherent( allocation ) ) {
+      mDevice.flushMappedMemoryRanges( vk::MappedMemoryRange( allocation.memory, 0, VK_WHOLE_SIZE ) );
+    }
+  }
+
+  // Same for [offset, offset + size) of the allocation only, widened to whole non coherent atoms
+  void flush( const Allocation& allocation, vk::DeviceSize offset, vk::DeviceSize size ) {
+    if ( isCoherent( allocation ) || size == 0 ) {
+      return;
+    }
+    vk::DeviceSize atom       = mLimits.nonCoherentAtomSize;
+    vk::DeviceSize memorySize = allocation.block ? allocation.block->size : allocation.size;
+    vk::DeviceSize begin      = ( allocation.offset + offset ) / atom * atom;
+    vk::DeviceSize end        = alignUp( allocation.offset + offset + size, atom );
+    mDevice.flushMappedMemoryRanges(
+        vk::MappedMemoryRange( allocation.memory, begin, end >= memorySize ? VK_WHOLE_SIZE : end - begin ) );
+  }
+
+  bool isCoherent( const Allocation& allocation ) const {
+    return static_cast<bool>( mMemoryProperties.memoryTypes[allocation.memoryType].propertyFlags
+                              & vk::MemoryPropertyFlagBits::eHostCoherent );
+  }
+
+  void destroyBuffer( BufferAllocation& buffer ) {
+    mDevice.destroyBuffer( buffer.buffer );
+    free( buffer.allocation );
+    buffer.buffer = nullptr;
+  }
+
+  void destroyImage( ImageAllocation& image ) {
+    mDevice.destroyImage( image.image );
+    free( image.allocation );
+    image.image = nullptr;
+  }
+
+  AllocatorStats stats() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    AllocatorStats              stats;
+    stats.bytesAllocated  = mDedicatedBytes;
+    stats.bytesUsed       = mDedicatedBytes;
+    stats.dedicatedCount  = mDedicatedCount;
+    stats.allocationCount = mDedicatedCount;
+
+    auto addPool = [&stats]( const MemoryPool& pool ) {
+      for ( const std::unique_ptr<MemoryBlock>& block : pool.blocks ) {
+        stats.blockCount++;
+        stats.bytesAllocated += block->size;
+        stats.bytesUsed += block->used;
+        stats.allocationCount += block->allocationCount;
+        if ( pool.strategy == BlockStrategy::eLinear ) {
+          stats.totalFree += block->size - block->linearHead;
+          stats.largestFree = std::max( stats.largestFree, block->size - block->linearHead );
+        } else {
+          for ( const std::pair<const vk::DeviceSize, vk::DeviceSize>& range : block->freeByOffset ) {
+            stats.totalFree += range.second;
+            stats.largestFree = std::max( stats.largestFree, range.second );
+          }
+        }
+      }
+    };
+
+    for ( uint32_t i = 0; i < mMemoryProperties.memoryTypeCount; i++ ) {
+      for ( const MemoryPool& pool : mDefaultPools[i] ) {
+        addPool( pool );
+      }
+    }
+    for ( const std::unique_ptr<MemoryPool>& pool : mCustomPools ) {
+      addPool( *pool );
+    }
+    return stats;
+  }
+
+  void report() {
+    AllocatorStats current = stats();
+    VFS_LOG_INFO << "Device memory:";
+    VFS_LOG_INFO << "\tAllocated: " << current.bytesAllocated / 1024 << " KiB in " << current.blockCount << " blocks + "
+                 << current.dedicatedCount << " dedicated";
+    VFS_LOG_INFO << "\tUsed: " << current.bytesUsed / 1024 << " KiB by " << current.allocationCount << " allocations";
+    VFS_LOG_INFO << "\tFree: " << current.totalFree / 1024 << " KiB, largest range " << current.largestFree / 1024
+                 << " KiB, fragmentation " << current.fragmentation() * 100.0 << "%";
+  }
+
+  private:
+  static int popcount( uint32_t bits ) {
+    int count = 0;
+    for ( ; bits; bits &= bits - 1 ) {
+      count++;
+    }
+    return count;
+  }
+
+  vk::DeviceSize defaultBlockSize( uint32_t memoryType ) const {
+    // Small heaps (e.g. 256 MiB BAR memory) get smaller blocks so a few blocks don't exhaust them
+    vk::DeviceSize heapSize = mMemoryProperties.memoryHeaps[mMemoryProperties.memoryTypes[memoryType].heapIndex].size;
+    if ( heapSize <= ( 1ull << 30 ) ) {
+      return std::min( mPreferredBlockSize, heapSize / 8 );
+    }
+    return mPreferredBlockSize;
+  }
+
+  vk::DeviceMemory allocateMemory( vk::DeviceSize size, uint32_t memoryType, const void* next = nullptr ) {
+    if ( mAllocationCount >= mLimits.maxMemoryAllocationCount ) {
+      throw std::runtime_error( "maxMemoryAllocationCount reached." );
+    }
+
+    vk::MemoryAllocateInfo allocInfo = {};
+    allocInfo.allocationSize         = size;
+    allocInfo.memoryTypeIndex        = memoryType;
+    allocInfo.pNext                  = next;
+
+    vk::DeviceMemory memory;
+    try {
+      memory = mDevice.allocateMemory( allocInfo );
+    } catch ( vk::SystemError err ) {
+      throw std::runtime_error( "Failed to allocate device memory." );
+    }
+    mAllocationCount++;
+    return memory;
+  }
+
+  void* mapIfHostVisible( vk::DeviceMemory memory, uint32_t memoryType ) {
+    if ( mMemoryProperties.memoryTypes[memoryType].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible ) {
+      return mDevice.mapMemory( memory, 0, VK_WHOLE_SIZE );
+    }
+    return nullptr;
+  }
+
+  // Names the resource to the driver when there is one and the device knows dedicated allocations
+  Allocation allocateDedicated( vk::DeviceSize size, uint32_t memoryType, vk::Buffer buffer = nullptr,
+                                vk::Image image = nullptr ) {
+    vk::MemoryDedicatedAllocateInfo dedicatedInfo( image, buffer );
+    bool                            named = mDedicatedQuery && ( buffer || image );
+
+    Allocation allocation;
+    allocation.memory     = allocateMemory( size, memoryType, named ? &dedicatedInfo : nullptr );
+    allocation.size       = size;
+    allocation.memoryType = memoryType;
+    allocation.mapped     = mapIfHostVisible( allocation.memory, memoryType );
+    mDedicatedBytes += size;
+    mDedicatedCount++;
+    return allocation;
+  }
+
+  Allocation allocateFromPool( MemoryPool& pool, const vk::MemoryRequirements& requirements ) {
+    if ( !( requirements.memoryTypeBits & ( 1u << pool.memoryType ) ) ) {
+      throw std::runtime_error( "Resource can not live in the memory type of this pool." );
+    }
+    if ( requirements.size > pool.blockSize ) {
+      throw std::runtime_error( "Allocation does not fit into a pool block." );
+    }
+
+    Allocation allocation;
+    for ( std::unique_ptr<MemoryBlock>& block : pool.blocks ) {
+      if ( allocateFromBlock( pool, *block, requirements, allocation ) ) {
+        return allocation;
+      }
+    }
+
+    std::unique_ptr<MemoryBlock> block = std::make_unique<MemoryBlock>();
+    block->memory                      = allocateMemory( pool.blockSize, pool.memoryType );
+    block->size                        = pool.blockSize;
+    block->memoryType                  = pool.memoryType;
+    block->mapped                      = mapIfHostVisible( block->memory, pool.memoryType );
+    if ( pool.strategy == BlockStrategy::eFreeList ) {
+      insertFreeRange( *block, 0, block->size );
+    }
+    pool.blocks.push_back( std::move( block ) );
+
+    if ( !allocateFromBlock( pool, *pool.blocks.back(), requirements, allocation ) ) {
+      throw std::runtime_error( "Failed to allocate from a new block." );
+    }
+    return allocation;
+  }
+
+  bool allocateFromBlock( MemoryPool& pool, MemoryBlock& block, const vk::MemoryRequirements& requirements,
+                          Allocation& allocation ) {
+    vk::DeviceSize offset = 0;
+
+    if ( pool.strategy == BlockStrategy::eLinear ) {
+      offset = alignUp( block.linearHead, requirements.alignment );
+      if ( offset + requirements.size > block.size ) {
+        return false;
+      }
+      block.linearHead = offset + requirements.size;
+    } else {
+      // Best fit: the smallest free range that still fits after aligning its start
+      bool found = false;
+      for ( auto range = block.freeBySize.lower_bound( requirements.size ); range != block.freeBySize.end();
+            range++ ) {
+        vk::DeviceSize rangeOffset = range->second;
+        vk::DeviceSize rangeSize   = range->first;
+        offset                     = alignUp( rangeOffset, requirements.alignment );
+        if ( offset + requirements.size > rangeOffset + rangeSize ) {
+          continue;
+        }
+
+        block.freeBySize.erase( range );
+        block.freeByOffset.erase( rangeOffset );
+        if ( offset > rangeOffset ) {
+          insertFreeRange( block, rangeOffset, offset - rangeOffset );
+        }
+        if ( offset + requirements.size < rangeOffset + rangeSize ) {
+          insertFreeRange( block, offset + requirements.size, rangeOffset + rangeSize - offset - requirements.size );
+        }
+        found = true;
+        break;
+      }
+      if ( !found ) {
+        return false;
+      }
+    }
+
+    block.used += requirements.size;
+    block.allocationCount++;
+
+    allocation.memory     = block.memory;
+    allocation.offset     = offset;
+    allocation.size       = requirements.size;
+    allocation.memoryType = block.memoryType;
+    allocation.mapped     = block.mapped ? static_cast<char*>( block.mapped ) + offset : nullptr;
+    allocation.block      = &block;
+    allocation.pool       = &pool;
+    return true;
+  }
+
+  void insertFreeRange( MemoryBlock& block, vk::DeviceSize offset, vk::DeviceSize size ) {
+    auto eraseBySize = [&block]( vk::DeviceSize rangeOffset, vk::DeviceSize rangeSize ) {
+      auto candidates = block.freeBySize.equal_range( rangeSize );
+      for ( auto candidate = candidates.first; candidate != candidates.second; candidate++ ) {
+        if ( candidate->second == rangeOffset ) {
+          block.freeBySize.erase( candidate );
+          return;
+        }
+      }
+    };
+
+    // Merge with the following range
+    auto next = block.freeByOffset.find( offset + size );
+    if ( next != block.freeByOffset.end() ) {
+      size += next->second;
+      eraseBySize( next->first, next->second );
+      block.freeByOffset.erase( next );
+    }
+
+    // Merge with the preceding range
+    auto previous = block.freeByOffset.lower_bound( offset );
+    if ( previous != block.freeByOffset.begin() ) {
+      previous--;
+      if ( previous->first + previous->second == offset ) {
+        offset = previous->first;
+        size += previous->second;
+        eraseBySize( previous->first, previous->second );
+        block.freeByOffset.erase( previous );
+      }
+    }
+
+    block.freeByOffset[offset] = size;
+    block.freeBySize.emplace( size, offset );
+  }
+
+  // Keeps one empty block around so a pool that oscillates around a block boundary doesn't reallocate every time
+  void trimEmptyBlocks( MemoryPool& pool ) {
+    bool keptOne = false;
+    for ( auto block = pool.blocks.begin(); block != pool.blocks.end(); ) {
+      if ( ( *block )->allocationCount > 0 ) {
+        block++;
+      } else if ( !keptOne ) {
+        keptOne = true;
+        block++;
+      } else {
+        freeBlock( **block );
+        block = pool.blocks.erase( block );
+      }
+    }
+  }
+
+  void freeBlock( MemoryBlock& block ) {
+    if ( block.mapped ) {
+      mDevice.unmapMemory( block.memory );
+    }
+    mDevice.freeMemory( block.memory );
+    mAllocationCount--;
+  }
+
+  void releaseBlocks( MemoryPool& pool ) {
+    for ( std::unique_ptr<MemoryBlock>& block : pool.blocks ) {
+      if ( block->allocationCount > 0 && pool.strategy == BlockStrategy::eFreeList ) {
+        VFS_LOG_ERROR << block->allocationCount << " allocations still alive in memory type " << pool.memoryType;
+      }
+      freeBlock( *block );
+    }
+    pool.blocks.clear();
+  }
+
+  vk::Device                               mDevice;
+  vk::PhysicalDeviceMemoryProperties       mMemoryProperties;
+  vk::PhysicalDeviceLimits                 mLimits;
+  vk::DeviceSize                           mPreferredBlockSize { 64ull << 20 };
+  bool                                     mDedicatedQuery { false };
+  std::mutex                               mMutex;
+  MemoryPool                               mDefaultPools[VK_MAX_MEMORY_TYPES][2];
+  std::vector<std::unique_ptr<MemoryPool>> mCustomPools;
+  vk::DeviceSize                           mDedicatedBytes { 0 };
+  uint32_t                                 mDedicatedCount { 0 };
+  uint32_t                                 mAllocationCount { 0 };
+};
+} // namespace utils
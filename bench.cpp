@@ -0,0 +1,428 @@
+#include "offscreen.h"
+#include "utils.h"
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
+// Benchmarks for startup, pipeline creation and frame throughput. Everything runs headless, so a software device
+// works as well as a GPU:
+//   VK_ICD_FILENAMES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json vfs_bench --out bench.json
+// Results are written as JSON, one result per line, and can be compared against an earlier run with --baseline.
+struct BenchSettings {
+  uint32_t               iterations { 20 }; // Repetitions of every init and pipeline benchmark
+  uint64_t               frames { 500 };    // Timed frames per draw count, after a warm up
+  std::vector<uint32_t>  drawCounts { 1, 100, 1000, 10000 };
+  bool                   validation { true }; // Also time instance creation with the validation layer
+  utils::DeviceSelection device;
+  std::string            outputPath;
+  std::string            baselinePath;
+  double                 tolerance { 0.10 }; // Allowed relative regression against the baseline
+};
+
+struct BenchResult {
+  std::string name;
+  std::string unit; // "ms" (lower is better) or "fps" (higher is better)
+  double      median { 0.0 };
+  double      mean { 0.0 };
+  double      min { 0.0 };
+  double      max { 0.0 };
+  size_t      samples { 0 };
+};
+
+BenchResult summarize( const std::string& name, const std::string& unit, std::vector<double> samples ) {
+  BenchResult result;
+  result.name    = name;
+  result.unit    = unit;
+  result.samples = samples.size();
+  if ( samples.empty() ) {
+    return result;
+  }
+
+  std::sort( samples.begin(), samples.end() );
+  result.median = samples[( samples.size() - 1 ) / 2];
+  result.min    = samples.front();
+  result.max    = samples.back();
+  for ( double sample : samples ) {
+    result.mean += sample;
+  }
+  result.mean /= static_cast<double>( samples.size() );
+  return result;
+}
+
+// Runs `body` `iterations` times and returns the wall time of every run in milliseconds
+template <typename Body>
+std::vector<double> timeRuns( uint32_t iterations, Body&& body ) {
+  std::vector<double> samples;
+  for ( uint32_t i = 0; i < iterations; i++ ) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    body();
+    samples.push_back( utils::elapsedMs( start ) );
+  }
+  return samples;
+}
+
+// Directory for the files a benchmark writes (capability snapshots, pipeline caches), removed with its contents on
+// destruction so runs neither start from nor leave behind files in the working directory
+class TemporaryDirectory {
+  public:
+  TemporaryDirectory() {
+    std::string pattern = ( std::filesystem::temp_directory_path() / "vfs_bench_XXXXXX" ).string();
+    if ( !mkdtemp( pattern.data() ) ) {
+      throw std::runtime_error( "Failed to create a temporary directory." );
+    }
+    mPath = pattern;
+  }
+  TemporaryDirectory( const TemporaryDirectory& )            = delete;
+  TemporaryDirectory& operator=( const TemporaryDirectory& ) = delete;
+
+  ~TemporaryDirectory() {
+    std::error_code error;
+    std::filesystem::remove_all( mPath, error );
+  }
+
+  const std::string& path() const {
+    return mPath;
+  }
+
+  private:
+  std::string mPath;
+};
+
+class Bench {
+  public:
+  explicit Bench( const BenchSettings& settings ) : mSettings( settings ) {}
+
+  void run() {
+    benchInstance();
+    mInstance = utils::vkCreateInstance( "vfs_bench", {}, {} );
+    if ( !mInstance ) {
+      throw std::runtime_error( "Failed to create instance." );
+    }
+
+    benchDeviceChoice();
+    benchDevice();
+
+    mDevice        = createDevice();
+    mGraphicsQueue = mDevice.getQueue( mGraphicsFamily, 0 );
+    mAllocator.create( mDevice, mCapabilities );
+    benchPipelines();
+    for ( uint32_t drawCount : mSettings.drawCounts ) {
+      benchFrames( drawCount );
+    }
+
+    mAllocator.destroy();
+    mDevice.destroy();
+    mInstance.destroy();
+  }
+
+  const std::vector<BenchResult>& results() const {
+    return mResults;
+  }
+
+  const vk::PhysicalDeviceProperties& properties() const {
+    return mCapabilities.properties;
+  }
+
+  private:
+  void benchInstance() {
+    mResults.push_back( summarize( "instance_create", "ms", timeRuns( mSettings.iterations, []() {
+                                     vk::Instance instance = utils::vkCreateInstance( "vfs_bench", {}, {} );
+                                     instance.destroy();
+                                   } ) ) );
+
+    std::vector<const char*> extensions = { VK_EXT_DEBUG_UTILS_EXTENSION_NAME };
+    std::vector<const char*> layers     = { "VK_LAYER_KHRONOS_validation" };
+    if ( !mSettings.validation || !utils::supported( extensions, layers ) ) {
+      VFS_LOG_WARN << "Skipping instance_create_validation, the validation layer is not available";
+      return;
+    }
+    mResults.push_back( summarize( "instance_create_validation", "ms",
+                                   timeRuns( mSettings.iterations, [&]() {
+                                     vk::Instance instance = utils::vkCreateInstance( "vfs_bench", extensions, layers );
+                                     instance.destroy();
+                                   } ) ) );
+  }
+
+  void benchDeviceChoice() {
+    utils::DeviceRequirements requirements = {};
+    mResults.push_back( summarize( "choose_physical_device", "ms", timeRuns( mSettings.iterations, [&]() {
+                                     mCapabilities =
+                                         utils::vkChoosePhysicalDevice( mInstance, requirements, mSettings.device );
+                                   } ) ) );
+    if ( !mCapabilities.physicalDevice ) {
+      throw std::runtime_error( "No usable physical device." );
+    }
+
+    // Warm start, an untimed run writes the capability snapshots every timed run loads
+    TemporaryDirectory snapshots;
+    requirements.snapshotDirectory = snapshots.path();
+    utils::vkChoosePhysicalDevice( mInstance, requirements, mSettings.device );
+    mResults.push_back( summarize( "choose_physical_device_snapshot", "ms", timeRuns( mSettings.iterations, [&]() {
+                                     utils::vkChoosePhysicalDevice( mInstance, requirements, mSettings.device );
+                                   } ) ) );
+
+    mGraphicsFamily = utils::vkFindQueueFamilies( mCapabilities, nullptr ).graphicsFamily.value();
+    VFS_LOG_INFO << "Benchmarking on " << mCapabilities.properties.deviceName;
+  }
+
+  void benchDevice() {
+    mResults.push_back( summarize( "device_create", "ms", timeRuns( mSettings.iterations, [&]() {
+                                     vk::Device device = createDevice();
+                                     device.destroy();
+                                   } ) ) );
+  }
+
+  vk::Device createDevice() {
+    float                     queuePriority = 1.0f;
+    vk::DeviceQueueCreateInfo queueInfo( vk::DeviceQueueCreateFlags(), mGraphicsFamily, 1, &queuePriority );
+    vk::DeviceCreateInfo      deviceInfo = {};
+    deviceInfo.queueCreateInfoCount      = 1;
+    deviceInfo.pQueueCreateInfos         = &queueInfo;
+    return mCapabilities.physicalDevice.createDevice( deviceInfo );
+  }
+
+  utils::GraphicsPipelineInBundle triangleSpecification( utils::PipelineCache* cache ) {
+    utils::GraphicsPipelineInBundle specification = {};
+    specification.device                          = mDevice;
+    specification.vertexFilepath                  = "shaders/vert.spv";
+    specification.fragmentFilepath                = "shaders/frag.spv";
+    specification.swapchainExtent                 = kExtent;
+    specification.swapchainImageFormat            = kFormat;
+    specification.finalLayout                     = vk::ImageLayout::eTransferSrcOptimal;
+    specification.pipelineCache                   = cache;
+    return specification;
+  }
+
+  void destroyPipeline( const utils::GraphicsPipelineOutBundle& pipeline ) {
+    mDevice.destroyPipeline( pipeline.pipeline );
+    mDevice.destroyPipelineLayout( pipeline.layout );
+    mDevice.destroyRenderPass( pipeline.renderPass );
+  }
+
+  // Cold builds go without an application cache (drivers with their own disk cache, such as Mesa, need
+  // MESA_SHADER_CACHE_DISABLE=true to stay cold). Warm builds use a cache that already holds the pipeline.
+  void benchPipelines() {
+    mResults.push_back( summarize( "pipeline_create_cold", "ms", timeRuns( mSettings.iterations, [&]() {
+                                     destroyPipeline( utils::makeGraphicsPipeline( triangleSpecification( nullptr ) ) );
+                                   } ) ) );
+
+    // An empty directory, so create() can not load a pipeline_cache_*.bin the application left in "." and the cache
+    // only holds what the untimed build below puts into it
+    TemporaryDirectory   cacheDirectory;
+    utils::PipelineCache cache;
+    cache.create( mDevice, mCapabilities, cacheDirectory.path(),
+                  utils::supportsPipelineCreationFeedback( mCapabilities ) );
+    destroyPipeline( utils::makeGraphicsPipeline( triangleSpecification( &cache ) ) );
+    mResults.push_back( summarize( "pipeline_create_warm", "ms", timeRuns( mSettings.iterations, [&]() {
+                                     destroyPipeline( utils::makeGraphicsPipeline( triangleSpecification( &cache ) ) );
+                                   } ) ) );
+    cache.destroy();
+  }
+
+  // Steady state throughput of the triangle with `drawCount` draws per frame, two frames in flight
+  void benchFrames( uint32_t drawCount ) {
+    constexpr uint32_t kFramesInFlight = 2;
+
+    utils::GraphicsPipelineOutBundle pipeline = utils::makeGraphicsPipeline( triangleSpecification( nullptr ) );
+    utils::OffscreenBundle           targets =
+        utils::vkCreateOffscreenTargets( mDevice, mAllocator, kFormat, kExtent, kFramesInFlight );
+    utils::makeFramebuffers( mDevice, pipeline.renderPass, kExtent, targets.frames );
+    vk::CommandPool                   commandPool = utils::makeCommandPool( mDevice, mGraphicsFamily );
+    std::vector<utils::FrameInFlight> frames = utils::makeFramesInFlight( mDevice, commandPool, kFramesInFlight );
+
+    auto drawFrame = [&]( uint64_t frameNumber ) {
+      utils::FrameInFlight& frame = frames[frameNumber % kFramesInFlight];
+      if ( mDevice.waitForFences( frame.inFlight, VK_TRUE, UINT64_MAX ) != vk::Result::eSuccess ) {
+        throw std::runtime_error( "Failed waiting for frame fence." );
+      }
+      mDevice.resetFences( frame.inFlight );
+      frame.commandBuffer.reset();
+
+      vk::CommandBufferBeginInfo beginInfo = {};
+      beginInfo.flags                      = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+      frame.commandBuffer.begin( beginInfo );
+
+      vk::ClearValue          clearColor     = vk::ClearColorValue( std::array<float, 4> { 0.0f, 0.0f, 0.0f, 1.0f } );
+      vk::RenderPassBeginInfo renderPassInfo = {};
+      renderPassInfo.renderPass              = pipeline.renderPass;
+      renderPassInfo.framebuffer             = targets.frames[frameNumber % kFramesInFlight].framebuffer;
+      renderPassInfo.renderArea.extent       = kExtent;
+      renderPassInfo.clearValueCount         = 1;
+      renderPassInfo.pClearValues            = &clearColor;
+      frame.commandBuffer.beginRenderPass( renderPassInfo, vk::SubpassContents::eInline );
+      frame.commandBuffer.bindPipeline( vk::PipelineBindPoint::eGraphics, pipeline.pipeline );
+      frame.commandBuffer.setViewport(
+          0, vk::Viewport( 0.0f, 0.0f, static_cast<float>( kExtent.width ), static_cast<float>( kExtent.height ),
+                           0.0f, 1.0f ) );
+      frame.commandBuffer.setScissor( 0, vk::Rect2D( vk::Offset2D( 0, 0 ), kExtent ) );
+      for ( uint32_t i = 0; i < drawCount; i++ ) {
+        frame.commandBuffer.draw( 3, 1, 0, 0 );
+      }
+      frame.commandBuffer.endRenderPass();
+      frame.commandBuffer.end();
+
+      vk::SubmitInfo submitInfo     = {};
+      submitInfo.commandBufferCount = 1;
+      submitInfo.pCommandBuffers    = &frame.commandBuffer;
+      mGraphicsQueue.submit( submitInfo, frame.inFlight );
+    };
+
+    // Warm up first, so lazy driver work and first touch of the targets stay out of the timing
+    uint64_t warmUp = std::max<uint64_t>( mSettings.frames / 10, kFramesInFlight );
+    for ( uint64_t i = 0; i < warmUp; i++ ) {
+      drawFrame( i );
+    }
+    mDevice.waitIdle();
+
+    std::vector<double>                   frameMs;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for ( uint64_t i = 0; i < mSettings.frames; i++ ) {
+      std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+      drawFrame( i );
+      frameMs.push_back( utils::elapsedMs( frameStart ) );
+    }
+    mDevice.waitIdle();
+    double seconds = utils::elapsedMs( start ) / 1000.0;
+
+    std::string name = "frames_" + std::to_string( drawCount ) + "_draws";
+    BenchResult fps  = summarize( name + "_fps", "fps", { static_cast<double>( mSettings.frames ) / seconds } );
+    mResults.push_back( fps );
+    mResults.push_back( summarize( name + "_frame_time", "ms", frameMs ) );
+
+    utils::destroyFramesInFlight( mDevice, frames );
+    mDevice.destroyCommandPool( commandPool );
+    utils::destroyOffscreenTargets( mDevice, mAllocator, targets );
+    destroyPipeline( pipeline );
+  }
+
+  static constexpr vk::Format   kFormat = vk::Format::eR8G8B8A8Unorm;
+  static constexpr vk::Extent2D kExtent = vk::Extent2D( 800, 600 );
+
+  BenchSettings             mSettings;
+  std::vector<BenchResult>  mResults;
+  vk::Instance              mInstance;
+  utils::DeviceCapabilities mCapabilities;
+  uint32_t                  mGraphicsFamily { 0 };
+  vk::Device                mDevice;
+  vk::Queue                 mGraphicsQueue;
+  utils::DeviceAllocator    mAllocator;
+};
+
+// JSON stuff
+// One result per line, so the file diffs well and readBaseline() does not need a full JSON parser
+bool writeResults( const std::string& path, const vk::PhysicalDeviceProperties& properties,
+                   const std::vector<BenchResult>& results ) {
+  std::ofstream file( path, std::ios::trunc );
+  if ( !file.is_open() ) {
+    VFS_LOG_ERROR << "Failed to open \"" << path << "\" for writing";
+    return false;
+  }
+
+  file << "{\n\"device\": \"" << properties.deviceName << "\",\n\"results\": [\n";
+  for ( size_t i = 0; i < results.size(); i++ ) {
+    const BenchResult& result = results[i];
+    file << "{\"name\": \"" << result.name << "\", \"unit\": \"" << result.unit << "\", \"median\": " << result.median
+         << ", \"mean\": " << result.mean << ", \"min\": " << result.min << ", \"max\": " << result.max
+         << ", \"samples\": " << result.samples << "}" << ( i + 1 < results.size() ? "," : "" ) << "\n";
+  }
+  file << "]\n}\n";
+  VFS_LOG_INFO << "Wrote " << results.size() << " results to \"" << path << "\"";
+  return static_cast<bool>( file );
+}
+
+// Median per result name from a file written by writeResults()
+std::map<std::string, double> readBaseline( const std::string& path ) {
+  std::map<std::string, double> medians;
+  std::ifstream                 file( path );
+  std::string                   line;
+  while ( std::getline( file, line ) ) {
+    size_t name   = line.find( "\"name\": \"" );
+    size_t median = line.find( "\"median\": " );
+    if ( name == std::string::npos || median == std::string::npos ) {
+      continue;
+    }
+    name += std::strlen( "\"name\": \"" );
+    medians[line.substr( name, line.find( '"', name ) - name )] =
+        std::stod( line.substr( median + std::strlen( "\"median\": " ) ) );
+  }
+  return medians;
+}
+
+// Number of results that got worse than the tolerance allows
+uint32_t compareBaseline( const std::map<std::string, double>& baseline, const std::vector<BenchResult>& results,
+                          double tolerance ) {
+  uint32_t regressions = 0;
+  for ( const BenchResult& result : results ) {
+    auto found = baseline.find( result.name );
+    if ( found == baseline.end() || found->second <= 0.0 ) {
+      continue;
+    }
+
+    double change    = ( result.median - found->second ) / found->second;
+    bool   regressed = result.unit == "fps" ? change < -tolerance : change > tolerance;
+    if ( regressed ) {
+      VFS_LOG_ERROR << "Regression in " << result.name << ": " << found->second << " -> " << result.median << " "
+                    << result.unit;
+      regressions++;
+    }
+  }
+  return regressions;
+}
+
+std::vector<uint32_t> parseList( const std::string& text ) {
+  std::vector<uint32_t> values;
+  std::stringstream     stream( text );
+  std::string           value;
+  while ( std::getline( stream, value, ',' ) ) {
+    values.push_back( static_cast<uint32_t>( std::stoul( value ) ) );
+  }
+  return values;
+}
+
+int main( int argc, char** argv ) {
+  BenchSettings settings; // The device falls back to VFS_DEVICE like the application
+  for ( int i = 1; i < argc; i++ ) {
+    if ( std::strcmp( argv[i], "--iterations" ) == 0 && i + 1 < argc ) {
+      settings.iterations = static_cast<uint32_t>( std::stoul( argv[++i] ) );
+    } else if ( std::strcmp( argv[i], "--frames" ) == 0 && i + 1 < argc ) {
+      settings.frames = std::stoull( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--draws" ) == 0 && i + 1 < argc ) {
+      settings.drawCounts = parseList( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--no-validation" ) == 0 ) {
+      settings.validation = false;
+    } else if ( std::strcmp( argv[i], "--device" ) == 0 && i + 1 < argc ) {
+      settings.device = utils::parseDeviceSelection( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--out" ) == 0 && i + 1 < argc ) {
+      settings.outputPath = argv[++i];
+    } else if ( std::strcmp( argv[i], "--baseline" ) == 0 && i + 1 < argc ) {
+      settings.baselinePath = argv[++i];
+    } else if ( std::strcmp( argv[i], "--tolerance" ) == 0 && i + 1 < argc ) {
+      settings.tolerance = std::stod( argv[++i] );
+    }
+  }
+
+  try {
+    Bench bench( settings );
+    bench.run();
+
+    for ( const BenchResult& result : bench.results() ) {
+      VFS_LOG_INFO << result.name << ": " << result.median << " " << result.unit << " (min " << result.min << ", max "
+                   << result.max << ")";
+    }
+    if ( !settings.outputPath.empty() ) {
+      writeResults( settings.outputPath, bench.properties(), bench.results() );
+    }
+    if ( !settings.baselinePath.empty()
+         && compareBaseline( readBaseline( settings.baselinePath ), bench.results(), settings.tolerance ) > 0 ) {
+      utils::Logger::instance().flush();
+      return EXIT_FAILURE;
+    }
+  } catch ( const std::exception& e ) {
+    VFS_LOG_ERROR << e.what();
+    utils::Logger::instance().flush();
+    return EXIT_FAILURE;
+  }
+  utils::Logger::instance().flush();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "logger.h"
+#include <cstdio>
+#include <fstream>
+#include <unordered_set>
+
+// Device capability stuff
+namespace utils {
+// Version the instance is created with: the newest the loader supports, up to 1.3
+uint32_t instanceApiVersion() {
+  uint32_t version = VK_API_VERSION_1_0;
+  vkEnumerateInstanceVersion( &version );
+  return std::min( version, VK_API_VERSION_1_3 );
+}
+
+// Everything the application asks a physical device, queried once and read by every subsystem instead of the driver.
+// Surface support is not part of it as it depends on the surface, it is queried where a surface is at hand.
+struct DeviceCapabilities {
+  // Core formats, up to the last ASTC one, are looked up in a table
+  static constexpr size_t kFormatTableSize = static_cast<size_t>( vk::Format::eAstc12x12SrgbBlock ) + 1;
+
+  vk::PhysicalDevice                     physicalDevice;
+  vk::PhysicalDeviceProperties           properties;
+  uint32_t                               instanceVersion { VK_API_VERSION_1_0 };
+  std::string                            uuid; // 32 lowercase hex digits, empty when the device cannot report it
+  vk::PhysicalDeviceFeatures             features;
+  vk::PhysicalDeviceMemoryProperties     memory;
+  std::vector<vk::QueueFamilyProperties> queueFamilies;
+  std::unordered_set<std::string>        extensions;
+  std::vector<vk::FormatProperties>      formats; // Indexed by format
+
+  // Chained into Features2/Properties2 (Vulkan 1.1), all false or zero when the device does not have them
+  vk::PhysicalDeviceDescriptorIndexingFeatures   descriptorIndexing;
+  vk::PhysicalDeviceDescriptorIndexingProperties descriptorIndexingProperties;
+  vk::PhysicalDeviceDynamicRenderingFeatures     dynamicRendering;
+
+  // Version both the device and the instance support, device functionality past the instance's is not enabled
+  uint32_t apiVersion() const {
+    return std::min( properties.apiVersion, instanceVersion );
+  }
+
+  const vk::PhysicalDeviceLimits& limits() const {
+    return properties.limits;
+  }
+
+  bool hasExtension( const char* name ) const {
+    return extensions.count( name ) > 0;
+  }
+
+  vk::FormatProperties formatProperties( vk::Format format ) const {
+    size_t index = static_cast<size_t>( format );
+    if ( index < formats.size() ) {
+      return formats[index];
+    }
+    return physicalDevice.getFormatProperties( format ); // Extension formats are not in the table
+  }
+};
+
+// Device UUID as 32 lowercase hex digits, empty when the device cannot report it (Vulkan 1.0 devices or instances)
+std::string getDeviceUuid( vk::PhysicalDevice device, uint32_t instanceVersion ) {
+  if ( std::min( device.getProperties().apiVersion, instanceVersion ) < VK_API_VERSION_1_1 ) {
+    return "";
+  }
+
+  vk::StructureChain<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties> chain = device.getProperties2<
+      vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>();
+  const vk::PhysicalDeviceIDProperties& idProperties = chain.get<vk::PhysicalDeviceIDProperties>();
+
+  static const char digits[] = "0123456789abcdef";
+  std::string       uuid;
+  for ( uint8_t byte : idProperties.deviceUUID ) {
+    uuid.push_back( digits[byte >> 4] );
+    uuid.push_back( digits[byte & 0xf] );
+  }
+  return uuid;
+}
+
+DeviceCapabilities queryDeviceCapabilities( vk::PhysicalDevice physicalDevice ) {
+  DeviceCapabilities capabilities;
+  capabilities.physicalDevice  = physicalDevice;
+  capabilities.properties      = physicalDevice.getProperties();
+  capabilities.instanceVersion = instanceApiVersion();
+  capabilities.uuid            = getDeviceUuid( physicalDevice, capabilities.instanceVersion );
+  capabilities.features        = physicalDevice.getFeatures();
+  capabilities.memory          = physicalDevice.getMemoryProperties();
+  capabilities.queueFamilies   = physicalDevice.getQueueFamilyProperties();
+  for ( const vk::ExtensionProperties& extension : physicalDevice.enumerateDeviceExtensionProperties() ) {
+    capabilities.extensions.insert( extension.extensionName.data() );
+  }
+
+  capabilities.formats.resize( DeviceCapabilities::kFormatTableSize );
+  for ( size_t i = 1; i < capabilities.formats.size(); i++ ) { // Undefined has no properties
+    capabilities.formats[i] = physicalDevice.getFormatProperties( static_cast<vk::Format>( i ) );
+  }
+
+  // Features2 would need VK_KHR_get_physical_device_properties2 on a 1.0 instance, a 1.1 device is not enough
+  if ( capabilities.apiVersion() < VK_API_VERSION_1_1 ) {
+    return capabilities;
+  }
+
+  // Only structures of features the device has may be chained
+  vk::PhysicalDeviceFeatures2   features   = {};
+  vk::PhysicalDeviceProperties2 properties = {};
+  if ( capabilities.apiVersion() >= VK_API_VERSION_1_2
+       || capabilities.hasExtension( VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME ) ) {
+    capabilities.descriptorIndexing.pNext           = features.pNext;
+    features.pNext                                  = &capabilities.descriptorIndexing;
+    capabilities.descriptorIndexingProperties.pNext = properties.pNext;
+    properties.pNext                                = &capabilities.descriptorIndexingProperties;
+  }
+  if ( capabilities.apiVersion() >= VK_API_VERSION_1_3
+       || capabilities.hasExtension( VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME ) ) {
+    capabilities.dynamicRendering.pNext = features.pNext;
+    features.pNext                      = &capabilities.dynamicRendering;
+  }
+  physicalDevice.getFeatures2( &features );
+  physicalDevice.getProperties2( &properties );
+
+  // The chain pointed into locals and into the structure itself, neither survives a copy
+  capabilities.descriptorIndexing.pNext           = nullptr;
+  capabilities.descriptorIndexingProperties.pNext = nullptr;
+  capabilities.dynamicRendering.pNext             = nullptr;
+  return capabilities;
+}
+
+// Snapshot files: header, the fixed size structures, then the queue families, extension names and format table. A
+// snapshot is only used for the device, driver and device and instance API versions it was taken with.
+struct DeviceCapabilitiesHeader {
+  char     magic[4] = { 'V', 'C', 'A', 'P' };
+  uint32_t version { 2 };
+  uint32_t vendorID { 0 };
+  uint32_t deviceID { 0 };
+  uint32_t driverVersion { 0 };
+  uint32_t apiVersion { 0 };
+  uint32_t instanceVersion { 0 };
+  uint8_t  pipelineCacheUUID[VK_UUID_SIZE] = {};
+};
+
+DeviceCapabilitiesHeader deviceCapabilitiesHeader( const vk::PhysicalDeviceProperties& properties,
+                                                   uint32_t                            instanceVersion ) {
+  DeviceCapabilitiesHeader header;
+  header.vendorID        = properties.vendorID;
+  header.deviceID        = properties.deviceID;
+  header.driverVersion   = properties.driverVersion;
+  header.apiVersion      = properties.apiVersion;
+  header.instanceVersion = instanceVersion;
+  std::memcpy( header.pipelineCacheUUID, properties.pipelineCacheUUID.data(), VK_UUID_SIZE );
+  return header;
+}
+
+bool saveDeviceCapabilities( const std::string& path, const DeviceCapabilities& capabilities ) {
+  std::string   temporaryPath = path + ".tmp";
+  std::ofstream file( temporaryPath, std::ios::binary | std::ios::trunc );
+  auto          write = [&file]( const void* data, size_t size ) {
+    file.write( reinterpret_cast<const char*>( data ), static_cast<std::streamsize>( size ) );
+  };
+
+  DeviceCapabilitiesHeader header = deviceCapabilitiesHeader( capabilities.properties, capabilities.instanceVersion );
+  write( &header, sizeof( header ) );
+  write( &capabilities.properties, sizeof( capabilities.properties ) );
+  write( &capabilities.features, sizeof( capabilities.features ) );
+  write( &capabilities.memory, sizeof( capabilities.memory ) );
+  write( &capabilities.descriptorIndexing, sizeof( capabilities.descriptorIndexing ) );
+  write( &capabilities.descriptorIndexingProperties, sizeof( capabilities.descriptorIndexingProperties ) );
+  write( &capabilities.dynamicRendering, sizeof( capabilities.dynamicRendering ) );
+
+  uint32_t count = static_cast<uint32_t>( capabilities.queueFamilies.size() );
+  write( &count, sizeof( count ) );
+  write( capabilities.queueFamilies.data(), count * sizeof( vk::QueueFamilyProperties ) );
+
+  count = static_cast<uint32_t>( capabilities.extensions.size() );
+  write( &count, sizeof( count ) );
+  for ( const std::string& extension : capabilities.extensions ) {
+    uint32_t length = static_cast<uint32_t>( extension.size() );
+    write( &length, sizeof( length ) );
+    write( extension.data(), length );
+  }
+
+  count = static_cast<uint32_t>( capabilities.formats.size() );
+  write( &count, sizeof( count ) );
+  write( capabilities.formats.data(), count * sizeof( vk::FormatProperties ) );
+
+  file.close();
+  if ( !file.good() || std::rename( temporaryPath.c_str(), path.c_str() ) != 0 ) {
+    VFS_LOG_WARN << "Failed to save device capabilities to \"" << path << "\"";
+    return false;
+  }
+  return true;
+}
+
+// Fills `capabilities` from the snapshot at `path` when it was taken with the device, driver and API version in
+// `properties` (the one query a warm start still makes)
+bool loadDeviceCapabilities( const std::string& path, vk::PhysicalDevice physicalDevice,
+                             const vk::PhysicalDeviceProperties& properties, DeviceCapabilities& capabilities ) {
+  std::ifstream file( path, std::ios::binary );
+  if ( !file ) {
+    return false;
+  }
+  auto read = [&file]( void* data, size_t size ) {
+    file.read( reinterpret_cast<char*>( data ), static_cast<std::streamsize>( size ) );
+    return file.good();
+  };
+
+  uint32_t                 instanceVersion = instanceApiVersion();
+  DeviceCapabilitiesHeader expected        = deviceCapabilitiesHeader( properties, instanceVersion );
+  DeviceCapabilitiesHeader header;
+  if ( !read( &header, sizeof( header ) ) || std::memcmp( &header, &expected, sizeof( header ) ) != 0 ) {
+    VFS_LOG_INFO << "Device capability snapshot \"" << path << "\" is from another device or driver";
+    return false;
+  }
+
+  DeviceCapabilities loaded;
+  bool               complete = read( &loaded.properties, sizeof( loaded.properties ) )
+                  && read( &loaded.features, sizeof( loaded.features ) )
+                  && read( &loaded.memory, sizeof( loaded.memory ) )
+                  && read( &loaded.descriptorIndexing, sizeof( loaded.descriptorIndexing ) )
+                  && read( &loaded.descriptorIndexingProperties, sizeof( loaded.descriptorIndexingProperties ) )
+                  && read( &loaded.dynamicRendering, sizeof( loaded.dynamicRendering ) );
+
+  uint32_t count = 0;
+  complete       = complete && read( &count, sizeof( count ) ) && count <= 64;
+  if ( complete ) {
+    loaded.queueFamilies.resize( count );
+    complete = read( loaded.queueFamilies.data(), count * sizeof( vk::QueueFamilyProperties ) );
+  }
+
+  complete = complete && read( &count, sizeof( count ) ) && count <= 4096;
+  for ( uint32_t i = 0; complete && i < count; i++ ) {
+    uint32_t length = 0;
+    complete        = read( &length, sizeof( length ) ) && length <= VK_MAX_EXTENSION_NAME_SIZE;
+    if ( complete ) {
+      std::string extension( length, '\0' );
+      complete = read( &extension[0], length );
+      loaded.extensions.insert( std::move( extension ) );
+    }
+  }
+
+  complete = complete && read( &count, sizeof( count ) ) && count == DeviceCapabilities::kFormatTableSize;
+  if ( complete ) {
+    loaded.formats.resize( count );
+    complete = read( loaded.formats.data(), count * sizeof( vk::FormatProperties ) );
+  }
+
+  if ( !complete ) {
+    VFS_LOG_WARN << "Device capability snapshot \"" << path << "\" is truncated or corrupt";
+    return false;
+  }
+
+  // Pointers written by the query are meaningless here, the UUID identifies this very device so it is asked again
+  loaded.physicalDevice                     = physicalDevice;
+  loaded.instanceVersion                    = instanceVersion;
+  loaded.uuid                               = getDeviceUuid( physicalDevice, instanceVersion );
+  loaded.descriptorIndexing.pNext           = nullptr;
+  loaded.descriptorIndexingProperties.pNext = nullptr;
+  loaded.dynamicRendering.pNext             = nullptr;
+  capabilities                              = std::move( loaded );
+  return true;
+}
+
+// Capabilities of `physicalDevice`, from a snapshot in `snapshotDirectory` when there is a matching one. Fresh
+// queries are saved there for the next start; an empty directory always queries.
+DeviceCapabilities getDeviceCapabilities( vk::PhysicalDevice physicalDevice, const std::string& snapshotDirectory ) {
+  if ( snapshotDirectory.empty() ) {
+    return queryDeviceCapabilities( physicalDevice );
+  }
+
+  vk::PhysicalDeviceProperties properties = physicalDevice.getProperties();
+  char                         filename[64];
+  std::snprintf( filename, sizeof( filename ), "device_capabilities_%04x_%04x.bin", properties.vendorID,
+                 properties.deviceID );
+  std::string path = snapshotDirectory + "/" + filename;
+
+  DeviceCapabilities capabilities;
+  if ( loadDeviceCapabilities( path, physicalDevice, properties, capabilities ) ) {
+    VFS_LOG_DEBUG << "Loaded capabilities of " << properties.deviceName << " from \"" << path << "\"";
+    return capabilities;
+  }
+  capabilities = queryDeviceCapabilities( physicalDevice );
+  saveDeviceCapabilities( path, capabilities );
+  return capabilities;
+}
+} // namespace utils
@@ -0,0 +1,269 @@
+#pragma once
+
+#include "utils.h"
+
+// Compute pipeline stuff
+namespace utils {
+struct ComputePipelineInBundle {
+  vk::Device                           device;
+  std::string                          shaderFilepath;
+  SpecializationConstants              specialization;
+  vk::PipelineLayout                   layout;                    // Shared layout, made from the fields below if null
+  std::vector<vk::DescriptorSetLayout> setLayouts;                // Set 0 first, see DescriptorLayoutCache
+  std::vector<vk::PushConstantRange>   pushConstantRanges;
+  PipelineCache*                       pipelineCache { nullptr }; // Optional, compiled from scratch without it
+  ShaderModuleRegistry*                shaderModules { nullptr }; // Optional, modules are shared through it when set
+};
+
+// The layout is the caller's, whether it was passed in or created
+struct ComputePipelineOutBundle {
+  vk::PipelineLayout layout;
+  vk::Pipeline       pipeline;
+};
+
+ComputePipelineOutBundle makeComputePipeline( const ComputePipelineInBundle& specification ) {
+  // A layout created here is owned until the end, so a missing shader does not leak it
+  Owned<vk::PipelineLayout> createdLayout;
+  if ( !specification.layout ) {
+    createdLayout = Owned<vk::PipelineLayout>(
+        specification.device,
+        makePipelineLayout( specification.device, specification.setLayouts, specification.pushConstantRanges ) );
+  }
+  ComputePipelineOutBundle output = {};
+  output.layout                   = specification.layout ? specification.layout : createdLayout.get();
+
+  VFS_LOG_DEBUG << "Creating compute shader module";
+  vk::ShaderModule shader = specification.shaderModules
+                              ? specification.shaderModules->acquire( specification.shaderFilepath )
+                              : createModule( specification.shaderFilepath, specification.device );
+
+  vk::SpecializationInfo            specializationInfo = specification.specialization.info();
+  vk::PipelineShaderStageCreateInfo shaderInfo         = {};
+  shaderInfo.stage                                     = vk::ShaderStageFlagBits::eCompute;
+  shaderInfo.module                                    = shader;
+  shaderInfo.pName                                     = "main";
+  shaderInfo.pSpecializationInfo = specification.specialization.empty() ? nullptr : &specializationInfo;
+
+  vk::ComputePipelineCreateInfo pipelineInfo = {};
+  pipelineInfo.stage                         = shaderInfo;
+  pipelineInfo.layout                        = output.layout;
+
+  try {
+    if ( specification.pipelineCache ) {
+      output.pipeline = specification.pipelineCache->createComputePipeline( pipelineInfo );
+    } else {
+      output.pipeline = specification.device.createComputePipeline( nullptr, pipelineInfo ).value;
+    }
+  } catch ( const vk::SystemError& ) {
+    output.pipeline = nullptr;
+  }
+
+  // The pipeline keeps what it needs from the module
+  if ( specification.shaderModules ) {
+    specification.shaderModules->release( shader );
+  } else {
+    specification.device.destroyShaderModule( shader );
+  }
+  if ( !output.pipeline ) {
+    throw std::runtime_error( "Failed to create compute pipeline." ); // The created layout is destroyed on the way out
+  }
+  createdLayout.release();
+  return output;
+}
+
+// Work groups needed to cover `items` with groups of `groupSize`
+uint32_t groupCount( uint32_t items, uint32_t groupSize ) {
+  return ( items + groupSize - 1 ) / groupSize;
+}
+
+// Records and submits compute work once per frame, on the compute only queue family when the device has one, so it
+// overlaps the graphics work of the previous frame. The graphics submission of the same frame waits on semaphore()
+// at waitStages(), and recordAcquires() takes over the resources released to it (queue family ownership transfers
+// are only recorded when the families differ).
+//
+//   cb = beginFrame( frame ); dispatch ...; releaseBuffer( ... ); submit();
+//   graphics: recordAcquires( cb ); ... submit waiting on semaphore() at waitStages()
+//
+// Each frame slot has a fence of its own, beginFrame() waits for the slot's previous submission before reusing its
+// command pool, so compute work nobody on the graphics queue reads never stalls graphics. A released resource makes
+// the graphics submission wait on semaphore(), which it has to, or the semaphore could be signaled twice. Resources
+// written every frame belong to a frame slot as well, their previous contents are never transferred back.
+class AsyncCompute {
+  public:
+  AsyncCompute() = default;
+  AsyncCompute( const AsyncCompute& )            = delete;
+  AsyncCompute& operator=( const AsyncCompute& ) = delete;
+
+  void create( vk::Device device, vk::Queue queue, uint32_t queueFamily, uint32_t graphicsFamily,
+               uint32_t framesInFlight ) {
+    mDevice         = device;
+    mQueue          = queue;
+    mQueueFamily    = queueFamily;
+    mGraphicsFamily = graphicsFamily;
+
+    for ( uint32_t i = 0; i < framesInFlight; i++ ) {
+      vk::CommandPoolCreateInfo poolInfo = {};
+      poolInfo.flags                     = vk::CommandPoolCreateFlagBits::eTransient;
+      poolInfo.queueFamilyIndex          = mQueueFamily;
+
+      Frame frame;
+      frame.pool = mDevice.createCommandPool( poolInfo );
+
+      vk::CommandBufferAllocateInfo allocInfo = {};
+      allocInfo.commandPool                   = frame.pool;
+      allocInfo.level                         = vk::CommandBufferLevel::ePrimary;
+      allocInfo.commandBufferCount            = 1;
+      frame.commandBuffer                     = mDevice.allocateCommandBuffers( allocInfo ).front();
+      frame.finished                          = mDevice.createSemaphore( vk::SemaphoreCreateInfo() );
+
+      // Signaled, the first beginFrame() of the slot has nothing to wait for
+      frame.done = mDevice.createFence( vk::FenceCreateInfo( vk::FenceCreateFlagBits::eSignaled ) );
+      mFrames.push_back( frame );
+    }
+
+    VFS_LOG_INFO << "Compute queue on family " << mQueueFamily
+                 << ( async() ? " (async)" : " (shared with graphics)" );
+  }
+
+  void destroy() {
+    for ( Frame& frame : mFrames ) {
+      mDevice.destroyFence( frame.done );
+      mDevice.destroySemaphore( frame.finished );
+      mDevice.destroyCommandPool( frame.pool ); // Frees the command buffer
+    }
+    mFrames.clear();
+  }
+
+  // Whether the work runs on a queue family of its own
+  bool async() const {
+    return mQueueFamily != mGraphicsFamily;
+  }
+
+  uint32_t queueFamily() const {
+    return mQueueFamily;
+  }
+
+  // Starts recording the compute work of `frame`, once the slot's previous submission finished
+  vk::CommandBuffer beginFrame( uint32_t frame ) {
+    mFrame         = frame;
+    Frame& current = mFrames[mFrame];
+    if ( mDevice.waitForFences( current.done, VK_TRUE, UINT64_MAX ) != vk::Result::eSuccess ) {
+      throw std::runtime_error( "Failed to wait for the compute fence." );
+    }
+    mDevice.resetFences( current.done );
+    current.used   = false;
+    mAcquireStages = vk::PipelineStageFlags();
+    mBufferAcquires.clear();
+    mImageAcquires.clear();
+    mDevice.resetCommandPool( current.pool );
+
+    vk::CommandBufferBeginInfo beginInfo = {};
+    beginInfo.flags                      = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    current.commandBuffer.begin( beginInfo );
+    return current.commandBuffer;
+  }
+
+  // Hands a buffer written by this frame's compute work to the graphics queue, which reads it at `dstStages`
+  void releaseBuffer( vk::Buffer buffer, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess,
+                      vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE ) {
+    mAcquireStages |= dstStages;
+    if ( !async() ) {
+      return; // Same family: the semaphore already makes the writes visible
+    }
+
+    vk::BufferMemoryBarrier release = {};
+    release.srcAccessMask           = vk::AccessFlagBits::eShaderWrite;
+    release.srcQueueFamilyIndex     = mQueueFamily;
+    release.dstQueueFamilyIndex     = mGraphicsFamily;
+    release.buffer                  = buffer;
+    release.offset                  = offset;
+    release.size                    = size;
+    mFrames[mFrame].commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eComputeShader,
+                                                   vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(),
+                                                   nullptr, release, nullptr );
+
+    vk::BufferMemoryBarrier acquire = release;
+    acquire.srcAccessMask           = vk::AccessFlags();
+    acquire.dstAccessMask           = dstAccess;
+    mBufferAcquires.push_back( acquire );
+  }
+
+  // Same for an image, which also moves from `oldLayout` to `newLayout`
+  void releaseImage( vk::Image image, const vk::ImageSubresourceRange& range, vk::ImageLayout oldLayout,
+                     vk::ImageLayout newLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess ) {
+    mAcquireStages |= dstStages;
+
+    // The transition happens once, as part of the release when there is one and in recordAcquires() otherwise
+    vk::ImageMemoryBarrier acquire = {};
+    acquire.oldLayout              = oldLayout;
+    acquire.newLayout              = newLayout;
+    acquire.srcQueueFamilyIndex    = async() ? mQueueFamily : VK_QUEUE_FAMILY_IGNORED;
+    acquire.dstQueueFamilyIndex    = async() ? mGraphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+    acquire.image                  = image;
+    acquire.subresourceRange       = range;
+    acquire.dstAccessMask          = dstAccess;
+    mImageAcquires.push_back( acquire );
+
+    if ( async() ) {
+      vk::ImageMemoryBarrier release = acquire;
+      release.srcAccessMask          = vk::AccessFlagBits::eShaderWrite;
+      release.dstAccessMask          = vk::AccessFlags();
+      mFrames[mFrame].commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eComputeShader,
+                                                     vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(),
+                                                     nullptr, nullptr, release );
+    }
+  }
+
+  // Submits the frame's compute work, which signals semaphore() when anything was released to graphics
+  void submit() {
+    Frame& current = mFrames[mFrame];
+    current.commandBuffer.end();
+    current.used = static_cast<bool>( mAcquireStages );
+
+    vk::SubmitInfo submitInfo       = {};
+    submitInfo.commandBufferCount   = 1;
+    submitInfo.pCommandBuffers      = &current.commandBuffer;
+    submitInfo.signalSemaphoreCount = current.used ? 1 : 0;
+    submitInfo.pSignalSemaphores    = &current.finished;
+    mQueue.submit( submitInfo, current.done );
+  }
+
+  // Null when this frame released nothing, graphics then has nothing to wait for
+  vk::Semaphore semaphore() const {
+    return mFrames[mFrame].used ? mFrames[mFrame].finished : vk::Semaphore( nullptr );
+  }
+
+  vk::PipelineStageFlags waitStages() const {
+    return mAcquireStages;
+  }
+
+  // Takes over what this frame released, record into the graphics command buffer before the commands that read it
+  void recordAcquires( vk::CommandBuffer commandBuffer ) {
+    if ( mBufferAcquires.empty() && mImageAcquires.empty() ) {
+      return;
+    }
+    // The semaphore wait happens at the acquire stages, the barrier chains onto it there
+    commandBuffer.pipelineBarrier( mAcquireStages, mAcquireStages, vk::DependencyFlags(), nullptr, mBufferAcquires,
+                                   mImageAcquires );
+  }
+
+  private:
+  struct Frame {
+    vk::CommandPool   pool;
+    vk::CommandBuffer commandBuffer;
+    vk::Semaphore     finished;
+    vk::Fence         done;
+    bool              used { false };
+  };
+
+  vk::Device                           mDevice;
+  vk::Queue                            mQueue;
+  uint32_t                             mQueueFamily { 0 };
+  uint32_t                             mGraphicsFamily { 0 };
+  std::vector<Frame>                   mFrames;
+  uint32_t                             mFrame { 0 };
+  vk::PipelineStageFlags               mAcquireStages;
+  std::vector<vk::BufferMemoryBarrier> mBufferAcquires;
+  std::vector<vk::ImageMemoryBarrier>  mImageAcquires;
+};
+} // namespace utils
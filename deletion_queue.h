@@ -0,0 +1,139 @@
+#pragma once
+
+#include "allocator.h"
+#include <deque>
+#include <functional>
+
+// Resource lifetime stuff
+namespace utils {
+// Owns one device object and destroys it when it goes out of scope, unless it was released first. Creation helpers
+// hold their intermediate objects in these so an exception halfway through does not leak what was already created.
+template <typename T>
+class Owned {
+  public:
+  Owned() = default;
+  Owned( vk::Device device, T handle ) : mDevice( device ), mHandle( handle ) {}
+  Owned( const Owned& )            = delete;
+  Owned& operator=( const Owned& ) = delete;
+
+  Owned( Owned&& other ) noexcept : mDevice( other.mDevice ), mHandle( other.release() ) {}
+
+  Owned& operator=( Owned&& other ) noexcept {
+    if ( this != &other ) {
+      reset();
+      mDevice = other.mDevice;
+      mHandle = other.release();
+    }
+    return *this;
+  }
+
+  ~Owned() {
+    reset();
+  }
+
+  T get() const {
+    return mHandle;
+  }
+
+  explicit operator bool() const {
+    return static_cast<bool>( mHandle );
+  }
+
+  // Hands ownership to the caller (or to a DeletionQueue)
+  T release() {
+    T handle = mHandle;
+    mHandle  = nullptr;
+    return handle;
+  }
+
+  void reset() {
+    if ( mHandle ) {
+      mDevice.destroy( mHandle );
+      mHandle = nullptr;
+    }
+  }
+
+  private:
+  vk::Device mDevice;
+  T          mHandle;
+};
+
+// Destroys retired objects once no frame in flight can reference them anymore. Something retired while recording
+// frame N is destroyed at the start of frame N + framesInFlight, after that slot's fence was waited on, which is the
+// first point where every frame that could have used it has finished. Nothing has to wait for the device to idle.
+//
+//   beginFrame( frameNumber ) after the frame fence wait; retire( ... ) whenever an object is replaced
+class DeletionQueue {
+  public:
+  DeletionQueue() = default;
+  DeletionQueue( const DeletionQueue& )            = delete;
+  DeletionQueue& operator=( const DeletionQueue& ) = delete;
+
+  void create( vk::Device device, DeviceAllocator* allocator, uint32_t framesInFlight ) {
+    mDevice         = device;
+    mAllocator      = allocator;
+    mFramesInFlight = framesInFlight;
+  }
+
+  // Destroys everything still queued, the device has to be idle
+  void destroy() {
+    while ( !mEntries.empty() ) {
+      mEntries.front().deleter();
+      mEntries.pop_front();
+    }
+  }
+
+  // Call once the fence of `frameNumber`'s slot signaled, before anything of the frame is recorded
+  void beginFrame( uint64_t frameNumber ) {
+    mFrameNumber = frameNumber;
+    while ( !mEntries.empty() && mFrameNumber >= mEntries.front().retiredAt + mFramesInFlight ) {
+      mEntries.front().deleter();
+      mEntries.pop_front();
+    }
+  }
+
+  // Any handle vk::Device::destroy accepts, null handles are ignored
+  template <typename T>
+  void retire( T handle ) {
+    if ( handle ) {
+      vk::Device device = mDevice;
+      defer( [device, handle]() { device.destroy( handle ); } );
+    }
+  }
+
+  void retire( BufferAllocation buffer ) {
+    if ( buffer.buffer ) {
+      DeviceAllocator* allocator = mAllocator;
+      defer( [allocator, buffer]() mutable { allocator->destroyBuffer( buffer ); } );
+    }
+  }
+
+  void retire( ImageAllocation image ) {
+    if ( image.image ) {
+      DeviceAllocator* allocator = mAllocator;
+      defer( [allocator, image]() mutable { allocator->destroyImage( image ); } );
+    }
+  }
+
+  // For objects with their own destruction (descriptor sets going back to a pool, registry references, ...)
+  void defer( std::function<void()> deleter ) {
+    mEntries.push_back( Entry { mFrameNumber, std::move( deleter ) } );
+  }
+
+  size_t pending() const {
+    return mEntries.size();
+  }
+
+  private:
+  struct Entry {
+    uint64_t              retiredAt { 0 }; // Frame that was recording when the object was retired
+    std::function<void()> deleter;
+  };
+
+  vk::Device        mDevice;
+  DeviceAllocator*  mAllocator { nullptr };
+  uint32_t          mFramesInFlight { 1 };
+  uint64_t          mFrameNumber { 0 };
+  std::deque<Entry> mEntries;
+};
+} // namespace utils
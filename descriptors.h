@@ -0,0 +1,405 @@
+#pragma once
+
+#include "capabilities.h"
+#include "logger.h"
+#include <array>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+// Descriptor stuff
+namespace utils {
+// Hands out one DescriptorSetLayout per distinct binding list, so pipelines built from the same description share a
+// layout and stay compatible for set binding. Owns every layout it created.
+class DescriptorLayoutCache {
+  public:
+  DescriptorLayoutCache() = default;
+  DescriptorLayoutCache( const DescriptorLayoutCache& )            = delete;
+  DescriptorLayoutCache& operator=( const DescriptorLayoutCache& ) = delete;
+
+  void create( vk::Device device ) {
+    mDevice = device;
+  }
+
+  void destroy() {
+    for ( std::pair<const Key, vk::DescriptorSetLayout>& layout : mLayouts ) {
+      mDevice.destroyDescriptorSetLayout( layout.second );
+    }
+    mLayouts.clear();
+  }
+
+  // `bindingFlags` is either empty or has one entry per binding (descriptor indexing)
+  vk::DescriptorSetLayout get( std::vector<vk::DescriptorSetLayoutBinding> bindings,
+                               vk::DescriptorSetLayoutCreateFlags          flags        = {},
+                               std::vector<vk::DescriptorBindingFlags>     bindingFlags = {} ) {
+    // Binding order does not matter to Vulkan, so it does not matter to the key either
+    std::vector<size_t> order( bindings.size() );
+    for ( size_t i = 0; i < order.size(); i++ ) {
+      order[i] = i;
+    }
+    std::sort( order.begin(), order.end(),
+               [&]( size_t a, size_t b ) { return bindings[a].binding < bindings[b].binding; } );
+
+    Key key;
+    key.flags = static_cast<uint32_t>( flags );
+    for ( size_t i : order ) {
+      const vk::DescriptorSetLayoutBinding& binding = bindings[i];
+      key.bindings.push_back( { binding.binding, static_cast<uint32_t>( binding.descriptorType ),
+                                binding.descriptorCount, static_cast<uint32_t>( binding.stageFlags ),
+                                bindingFlags.empty() ? 0u : static_cast<uint32_t>( bindingFlags[i] ) } );
+    }
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    auto                        found = mLayouts.find( key );
+    if ( found != mLayouts.end() ) {
+      return found->second;
+    }
+
+    vk::DescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {};
+    flagsInfo.bindingCount                                  = static_cast<uint32_t>( bindingFlags.size() );
+    flagsInfo.pBindingFlags                                 = bindingFlags.data();
+
+    vk::DescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.flags                             = flags;
+    layoutInfo.bindingCount                      = static_cast<uint32_t>( bindings.size() );
+    layoutInfo.pBindings                         = bindings.data();
+    layoutInfo.pNext                             = bindingFlags.empty() ? nullptr : &flagsInfo;
+
+    vk::DescriptorSetLayout layout = mDevice.createDescriptorSetLayout( layoutInfo );
+    mLayouts[key]                  = layout;
+    return layout;
+  }
+
+  size_t size() const {
+    return mLayouts.size();
+  }
+
+  private:
+  struct Key {
+    uint32_t                             flags { 0 };
+    std::vector<std::array<uint32_t, 5>> bindings; // binding, type, count, stages, binding flags
+
+    bool operator<( const Key& other ) const {
+      return std::tie( flags, bindings ) < std::tie( other.flags, other.bindings );
+    }
+  };
+
+  vk::Device                             mDevice;
+  std::mutex                             mMutex;
+  std::map<Key, vk::DescriptorSetLayout> mLayouts;
+};
+
+// Pool size per set, multiplied by the number of sets a pool is created for
+struct DescriptorPoolRatio {
+  vk::DescriptorType type;
+  float              perSet;
+};
+
+// Transient descriptor sets, valid for one frame. Each frame in flight owns a list of pools; when a pool runs out
+// the next one is taken (or created with twice the sets), and beginFrame() resets the whole list at once, so sets
+// are never freed one by one.
+class DescriptorAllocator {
+  public:
+  DescriptorAllocator() = default;
+  DescriptorAllocator( const DescriptorAllocator& )            = delete;
+  DescriptorAllocator& operator=( const DescriptorAllocator& ) = delete;
+
+  void create( vk::Device device, uint32_t framesInFlight, uint32_t initialSets = 64,
+               std::vector<DescriptorPoolRatio> ratios = defaultRatios() ) {
+    mDevice      = device;
+    mRatios      = std::move( ratios );
+    mInitialSets = initialSets;
+    mFrames.resize( framesInFlight );
+  }
+
+  void destroy() {
+    for ( Frame& frame : mFrames ) {
+      for ( vk::DescriptorPool pool : frame.pools ) {
+        mDevice.destroyDescriptorPool( pool );
+      }
+    }
+    mFrames.clear();
+  }
+
+  // Recycles every set allocated the last time `frame` was used, call after its fence signaled
+  void beginFrame( uint32_t frame ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mFrame = frame;
+    for ( vk::DescriptorPool pool : mFrames[mFrame].pools ) {
+      mDevice.resetDescriptorPool( pool );
+    }
+    mFrames[mFrame].current = 0;
+  }
+
+  vk::DescriptorSet allocate( vk::DescriptorSetLayout layout ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    Frame&                      frame = mFrames[mFrame];
+
+    vk::DescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.descriptorSetCount            = 1;
+    allocInfo.pSetLayouts                   = &layout;
+    while ( true ) {
+      bool created = frame.current == frame.pools.size();
+      if ( created ) {
+        uint32_t sets = std::max( frame.nextSets, mInitialSets );
+        frame.pools.push_back( createPool( sets ) );
+        frame.nextSets = std::min( sets * 2, 4096u );
+      }
+
+      allocInfo.descriptorPool = frame.pools[frame.current];
+      try {
+        return mDevice.allocateDescriptorSets( allocInfo ).front();
+      } catch ( vk::OutOfPoolMemoryError& ) {
+      } catch ( vk::FragmentedPoolError& ) {
+      }
+      if ( created ) {
+        throw std::runtime_error( "Descriptor set does not fit into an empty pool, check the pool ratios." );
+      }
+      frame.current++; // Full, the rest of the frame allocates from the next pool
+    }
+  }
+
+  static std::vector<DescriptorPoolRatio> defaultRatios() {
+    return { { vk::DescriptorType::eUniformBuffer, 1.0f },        { vk::DescriptorType::eUniformBufferDynamic, 1.0f },
+             { vk::DescriptorType::eCombinedImageSampler, 4.0f }, { vk::DescriptorType::eStorageBuffer, 1.0f },
+             { vk::DescriptorType::eStorageImage, 1.0f } };
+  }
+
+  private:
+  struct Frame {
+    std::vector<vk::DescriptorPool> pools;
+    size_t                          current { 0 };
+    uint32_t                        nextSets { 0 };
+  };
+
+  vk::DescriptorPool createPool( uint32_t sets ) {
+    std::vector<vk::DescriptorPoolSize> sizes;
+    for ( const DescriptorPoolRatio& ratio : mRatios ) {
+      sizes.push_back( { ratio.type, std::max( 1u, static_cast<uint32_t>( ratio.perSet * sets ) ) } );
+    }
+
+    vk::DescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.maxSets                      = sets;
+    poolInfo.poolSizeCount                = static_cast<uint32_t>( sizes.size() );
+    poolInfo.pPoolSizes                   = sizes.data();
+    return mDevice.createDescriptorPool( poolInfo );
+  }
+
+  vk::Device                       mDevice;
+  std::mutex                       mMutex;
+  std::vector<DescriptorPoolRatio> mRatios;
+  uint32_t                         mInitialSets { 64 };
+  std::vector<Frame>               mFrames;
+  uint32_t                         mFrame { 0 };
+};
+
+// Bindless stuff
+// Descriptor indexing is core in 1.2, before that it needs VK_EXT_descriptor_indexing (which needs maintenance3)
+std::vector<const char*> bindlessExtensions( const DeviceCapabilities& capabilities ) {
+  uint32_t apiVersion = capabilities.apiVersion();
+  if ( apiVersion >= VK_API_VERSION_1_2 ) {
+    return {};
+  }
+  std::vector<const char*> extensions = { VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME };
+  if ( apiVersion < VK_API_VERSION_1_1 ) {
+    extensions.push_back( VK_KHR_MAINTENANCE3_EXTENSION_NAME );
+  }
+  return extensions;
+}
+
+// The subset of descriptor indexing BindlessDescriptors relies on, to be chained into DeviceCreateInfo
+vk::PhysicalDeviceDescriptorIndexingFeatures bindlessFeatures() {
+  vk::PhysicalDeviceDescriptorIndexingFeatures features  = {};
+  features.runtimeDescriptorArray                        = VK_TRUE;
+  features.descriptorBindingPartiallyBound               = VK_TRUE;
+  features.shaderSampledImageArrayNonUniformIndexing     = VK_TRUE;
+  features.shaderStorageBufferArrayNonUniformIndexing    = VK_TRUE;
+  features.descriptorBindingSampledImageUpdateAfterBind  = VK_TRUE;
+  features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+  features.descriptorBindingUpdateUnusedWhilePending     = VK_TRUE;
+  return features;
+}
+
+bool supportsBindless( const DeviceCapabilities& capabilities ) {
+  if ( capabilities.apiVersion() < VK_API_VERSION_1_1 ) {
+    return false; // Features2 would need VK_KHR_get_physical_device_properties2 on the instance
+  }
+  for ( const char* extension : bindlessExtensions( capabilities ) ) {
+    if ( !capabilities.hasExtension( extension ) ) {
+      return false;
+    }
+  }
+
+  const vk::PhysicalDeviceDescriptorIndexingFeatures& supported = capabilities.descriptorIndexing;
+  vk::PhysicalDeviceDescriptorIndexingFeatures        required  = bindlessFeatures();
+  return supported.runtimeDescriptorArray >= required.runtimeDescriptorArray
+         && supported.descriptorBindingPartiallyBound >= required.descriptorBindingPartiallyBound
+         && supported.shaderSampledImageArrayNonUniformIndexing >= required.shaderSampledImageArrayNonUniformIndexing
+         && supported.shaderStorageBufferArrayNonUniformIndexing >= required.shaderStorageBufferArrayNonUniformIndexing
+         && supported.descriptorBindingSampledImageUpdateAfterBind
+                >= required.descriptorBindingSampledImageUpdateAfterBind
+         && supported.descriptorBindingStorageBufferUpdateAfterBind
+                >= required.descriptorBindingStorageBufferUpdateAfterBind
+         && supported.descriptorBindingUpdateUnusedWhilePending >= required.descriptorBindingUpdateUnusedWhilePending;
+}
+
+// One set, bound once per command buffer, holding every texture (binding 0) and storage buffer (binding 1). Shaders
+// index the arrays with the handles returned by addTexture()/addBuffer(), so changing materials needs no rebinds.
+// Freed slots are reused only after every frame that could still read them finished.
+class BindlessDescriptors {
+  public:
+  static constexpr uint32_t kTextureBinding = 0;
+  static constexpr uint32_t kBufferBinding  = 1;
+
+  BindlessDescriptors() = default;
+  BindlessDescriptors( const BindlessDescriptors& )            = delete;
+  BindlessDescriptors& operator=( const BindlessDescriptors& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities, DescriptorLayoutCache& layouts,
+               uint32_t framesInFlight, uint32_t maxTextures = 4096, uint32_t maxBuffers = 1024 ) {
+    mDevice         = device;
+    mFramesInFlight = framesInFlight;
+
+    const vk::PhysicalDeviceDescriptorIndexingProperties& indexing = capabilities.descriptorIndexingProperties;
+    // Combined image samplers count as sampled images and as samplers, every binding is visible to every stage
+    mMaxTextures = std::min( { maxTextures, indexing.maxDescriptorSetUpdateAfterBindSampledImages,
+                               indexing.maxDescriptorSetUpdateAfterBindSamplers,
+                               indexing.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                               indexing.maxPerStageDescriptorUpdateAfterBindSamplers } );
+    mMaxBuffers  = std::min( { maxBuffers, indexing.maxDescriptorSetUpdateAfterBindStorageBuffers,
+                               indexing.maxPerStageDescriptorUpdateAfterBindStorageBuffers } );
+
+    vk::ShaderStageFlags                        stages   = vk::ShaderStageFlagBits::eAll;
+    std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+      { kTextureBinding, vk::DescriptorType::eCombinedImageSampler, mMaxTextures, stages },
+      { kBufferBinding, vk::DescriptorType::eStorageBuffer, mMaxBuffers, stages },
+    };
+    vk::DescriptorBindingFlags bindingFlags = vk::DescriptorBindingFlagBits::ePartiallyBound
+                                              | vk::DescriptorBindingFlagBits::eUpdateAfterBind
+                                              | vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending;
+    mLayout = layouts.get( bindings, vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool,
+                           { bindingFlags, bindingFlags } );
+
+    std::array<vk::DescriptorPoolSize, 2> sizes = {
+      vk::DescriptorPoolSize( vk::DescriptorType::eCombinedImageSampler, mMaxTextures ),
+      vk::DescriptorPoolSize( vk::DescriptorType::eStorageBuffer, mMaxBuffers ),
+    };
+    vk::DescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.flags                        = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind;
+    poolInfo.maxSets                      = 1;
+    poolInfo.poolSizeCount                = static_cast<uint32_t>( sizes.size() );
+    poolInfo.pPoolSizes                   = sizes.data();
+    mPool                                 = mDevice.createDescriptorPool( poolInfo );
+
+    vk::DescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.descriptorPool                = mPool;
+    allocInfo.descriptorSetCount            = 1;
+    allocInfo.pSetLayouts                   = &mLayout;
+    mSet                                    = mDevice.allocateDescriptorSets( allocInfo ).front();
+    VFS_LOG_INFO << "Bindless descriptors: " << mMaxTextures << " textures, " << mMaxBuffers << " buffers";
+  }
+
+  // The layout belongs to the layout cache
+  void destroy() {
+    mDevice.destroyDescriptorPool( mPool ); // Frees the set
+    mPool = nullptr;
+    mSet  = nullptr;
+  }
+
+  bool enabled() const {
+    return static_cast<bool>( mSet );
+  }
+
+  vk::DescriptorSetLayout layout() const {
+    return mLayout;
+  }
+
+  vk::DescriptorSet set() const {
+    return mSet;
+  }
+
+  // Releases slots freed at least a full round of frames ago, call once per frame after waiting for the fence
+  void beginFrame( uint64_t frameNumber ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mFrameNumber = frameNumber;
+    mTextures.collect( mFrameNumber, mFramesInFlight );
+    mBuffers.collect( mFrameNumber, mFramesInFlight );
+  }
+
+  uint32_t addTexture( vk::ImageView view, vk::Sampler sampler,
+                       vk::ImageLayout layout = vk::ImageLayout::eShaderReadOnlyOptimal ) {
+    vk::DescriptorImageInfo imageInfo( sampler, view, layout );
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    uint32_t                    index = mTextures.acquire( mMaxTextures );
+    vk::WriteDescriptorSet      write( mSet, kTextureBinding, index, 1, vk::DescriptorType::eCombinedImageSampler,
+                                       &imageInfo );
+    mDevice.updateDescriptorSets( write, nullptr );
+    return index;
+  }
+
+  uint32_t addBuffer( vk::Buffer buffer, vk::DeviceSize offset = 0, vk::DeviceSize range = VK_WHOLE_SIZE ) {
+    vk::DescriptorBufferInfo bufferInfo( buffer, offset, range );
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    uint32_t                    index = mBuffers.acquire( mMaxBuffers );
+    vk::WriteDescriptorSet      write( mSet, kBufferBinding, index, 1, vk::DescriptorType::eStorageBuffer, nullptr,
+                                       &bufferInfo );
+    mDevice.updateDescriptorSets( write, nullptr );
+    return index;
+  }
+
+  void removeTexture( uint32_t index ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mTextures.release( index, mFrameNumber );
+  }
+
+  void removeBuffer( uint32_t index ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mBuffers.release( index, mFrameNumber );
+  }
+
+  private:
+  struct Slots {
+    uint32_t                                  next { 0 };
+    std::vector<uint32_t>                     free;
+    std::deque<std::pair<uint32_t, uint64_t>> retired; // Index and the frame it was removed in
+
+    uint32_t acquire( uint32_t capacity ) {
+      if ( !free.empty() ) {
+        uint32_t index = free.back();
+        free.pop_back();
+        return index;
+      }
+      if ( next == capacity ) {
+        throw std::runtime_error( "Bindless descriptor array is full." );
+      }
+      return next++;
+    }
+
+    void release( uint32_t index, uint64_t frameNumber ) {
+      retired.push_back( { index, frameNumber } );
+    }
+
+    void collect( uint64_t frameNumber, uint32_t framesInFlight ) {
+      while ( !retired.empty() && frameNumber >= retired.front().second + framesInFlight ) {
+        free.push_back( retired.front().first );
+        retired.pop_front();
+      }
+    }
+  };
+
+  vk::Device              mDevice;
+  vk::DescriptorSetLayout mLayout;
+  vk::DescriptorPool      mPool;
+  vk::DescriptorSet       mSet;
+  uint32_t                mMaxTextures { 0 };
+  uint32_t                mMaxBuffers { 0 };
+  uint32_t                mFramesInFlight { 1 };
+  uint64_t                mFrameNumber { 0 };
+  std::mutex              mMutex;
+  Slots                   mTextures;
+  Slots                   mBuffers;
+};
+} // namespace utils
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "capabilities.h"
+#include "logger.h"
+
+// Dynamic rendering stuff
+namespace utils {
+// Dynamic rendering is core in 1.3, before that it needs VK_KHR_dynamic_rendering (which needs depth stencil resolve,
+// core in 1.2, and through it create_renderpass2)
+std::vector<const char*> dynamicRenderingExtensions( const DeviceCapabilities& capabilities ) {
+  uint32_t apiVersion = capabilities.apiVersion();
+  if ( apiVersion >= VK_API_VERSION_1_3 ) {
+    return {};
+  }
+  std::vector<const char*> extensions = { VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME };
+  if ( apiVersion < VK_API_VERSION_1_2 ) {
+    extensions.push_back( VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME );
+    extensions.push_back( VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME );
+  }
+  return extensions;
+}
+
+// To be chained into DeviceCreateInfo
+vk::PhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeatures() {
+  vk::PhysicalDeviceDynamicRenderingFeatures features = {};
+  features.dynamicRendering                           = VK_TRUE;
+  return features;
+}
+
+bool supportsDynamicRendering( const DeviceCapabilities& capabilities ) {
+  if ( capabilities.apiVersion() < VK_API_VERSION_1_1 ) {
+    return false; // Features2 would need VK_KHR_get_physical_device_properties2 on the instance
+  }
+  for ( const char* extension : dynamicRenderingExtensions( capabilities ) ) {
+    if ( !capabilities.hasExtension( extension ) ) {
+      return false;
+    }
+  }
+  return capabilities.dynamicRendering.dynamicRendering == VK_TRUE;
+}
+
+// Renders into a single color target without render pass or framebuffer objects. Pipelines are created against the
+// attachment format (GraphicsPipelineInBundle::dynamicRendering), so nothing has to be rebuilt when the swapchain
+// is recreated. The layout transitions a render pass would do are recorded as barriers by begin() and end().
+class DynamicRendering {
+  public:
+  DynamicRendering() = default;
+  DynamicRendering( const DynamicRendering& )            = delete;
+  DynamicRendering& operator=( const DynamicRendering& ) = delete;
+
+  // Entry points are loaded here, the extension ones are not exported by the loader
+  void create( vk::Device device, const DeviceCapabilities& capabilities, vk::Format colorFormat,
+               vk::ImageLayout finalLayout ) {
+    bool core    = capabilities.apiVersion() >= VK_API_VERSION_1_3;
+    mColorFormat = colorFormat;
+    mFinalLayout = finalLayout;
+
+    const char* beginName = core ? "vkCmdBeginRendering" : "vkCmdBeginRenderingKHR";
+    const char* endName   = core ? "vkCmdEndRendering" : "vkCmdEndRenderingKHR";
+    mBeginRendering       = reinterpret_cast<PFN_vkCmdBeginRendering>( device.getProcAddr( beginName ) );
+    mEndRendering         = reinterpret_cast<PFN_vkCmdEndRendering>( device.getProcAddr( endName ) );
+    if ( !mBeginRendering || !mEndRendering ) {
+      throw std::runtime_error( "Dynamic rendering entry points are missing, was the extension enabled?" );
+    }
+
+    mInheritance.colorAttachmentCount    = 1;
+    mInheritance.pColorAttachmentFormats = &mColorFormat;
+    mInheritance.rasterizationSamples    = vk::SampleCountFlagBits::e1;
+  }
+
+  bool enabled() const {
+    return mBeginRendering != nullptr;
+  }
+
+  // Transitions `image` for rendering (its contents are discarded, like a render pass with an undefined initial
+  // layout) and begins rendering into `view`, clearing it. The wait on the acquire semaphore happens at the color
+  // output stage, which is where the transition waits as well.
+  void begin( vk::CommandBuffer commandBuffer, vk::Image image, vk::ImageView view, vk::Extent2D extent,
+              vk::ClearColorValue clearColor, bool secondaries ) const {
+    vk::ImageMemoryBarrier barrier( {}, vk::AccessFlagBits::eColorAttachmentWrite, vk::ImageLayout::eUndefined,
+                                    vk::ImageLayout::eColorAttachmentOptimal, VK_QUEUE_FAMILY_IGNORED,
+                                    VK_QUEUE_FAMILY_IGNORED, image,
+                                    vk::ImageSubresourceRange( vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 ) );
+    commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                                   vk::PipelineStageFlagBits::eColorAttachmentOutput, {}, nullptr, nullptr, barrier );
+
+    vk::RenderingAttachmentInfo colorAttachment = {};
+    colorAttachment.imageView                   = view;
+    colorAttachment.imageLayout                 = vk::ImageLayout::eColorAttachmentOptimal;
+    colorAttachment.loadOp                      = vk::AttachmentLoadOp::eClear;
+    colorAttachment.storeOp                     = vk::AttachmentStoreOp::eStore;
+    colorAttachment.clearValue                  = clearColor;
+
+    vk::RenderingInfo renderingInfo    = {};
+    renderingInfo.renderArea.extent    = extent;
+    renderingInfo.layerCount           = 1;
+    renderingInfo.colorAttachmentCount = 1;
+    renderingInfo.pColorAttachments    = &colorAttachment;
+    if ( secondaries ) {
+      renderingInfo.flags = vk::RenderingFlagBits::eContentsSecondaryCommandBuffers;
+    }
+    mBeginRendering( static_cast<VkCommandBuffer>( commandBuffer ),
+                     reinterpret_cast<const VkRenderingInfo*>( &renderingInfo ) );
+  }
+
+  // Ends rendering and leaves `image` in the final layout (present or transfer source)
+  void end( vk::CommandBuffer commandBuffer, vk::Image image ) const {
+    mEndRendering( static_cast<VkCommandBuffer>( commandBuffer ) );
+
+    vk::ImageMemoryBarrier barrier( vk::AccessFlagBits::eColorAttachmentWrite, {},
+                                    vk::ImageLayout::eColorAttachmentOptimal, mFinalLayout, VK_QUEUE_FAMILY_IGNORED,
+                                    VK_QUEUE_FAMILY_IGNORED, image,
+                                    vk::ImageSubresourceRange( vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 ) );
+    commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                                   vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr, barrier );
+  }
+
+  // What secondaries recorded for begin( ..., true ) inherit instead of a render pass
+  const vk::CommandBufferInheritanceRenderingInfo& inheritance() const {
+    return mInheritance;
+  }
+
+  private:
+  vk::Format                                mColorFormat { vk::Format::eUndefined };
+  vk::ImageLayout                           mFinalLayout { vk::ImageLayout::ePresentSrcKHR };
+  vk::CommandBufferInheritanceRenderingInfo mInheritance;
+  PFN_vkCmdBeginRendering                   mBeginRendering { nullptr };
+  PFN_vkCmdEndRendering                     mEndRendering { nullptr };
+};
+} // namespace utils
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "logger.h"
+#include <cmath>
+#include <thread>
+
+// Frame pacing stuff
+namespace utils {
+struct PacingPercentiles {
+  double p50 { 0.0 };
+  double p99 { 0.0 };
+  double max { 0.0 };
+};
+
+// Keeps the last `window` frames and reports frame time and latency percentiles. The latency is the CPU side part of
+// input to photon: from the start of acquire (where input for the frame is sampled) until present returned.
+class FramePacingMonitor {
+  public:
+  explicit FramePacingMonitor( size_t window = 1024, uint64_t reportInterval = 240 )
+      : mWindow( window ), mReportInterval( reportInterval ) {}
+
+  void record( double frameMs, double latencyMs ) {
+    if ( mFrameMs.size() < mWindow ) {
+      mFrameMs.push_back( frameMs );
+      mLatencyMs.push_back( latencyMs );
+    } else {
+      mFrameMs[mNext]   = frameMs;
+      mLatencyMs[mNext] = latencyMs;
+    }
+    mNext = ( mNext + 1 ) % mWindow;
+    mRecorded++;
+
+    if ( mReportInterval > 0 && mRecorded % mReportInterval == 0 ) {
+      report();
+    }
+  }
+
+  PacingPercentiles frameTimes() const {
+    return percentiles( mFrameMs );
+  }
+
+  PacingPercentiles latencies() const {
+    return percentiles( mLatencyMs );
+  }
+
+  // Standard deviation of the frame time, the number that shows up as stutter even when the average is fine
+  double frameTimeDeviation() const {
+    if ( mFrameMs.empty() ) {
+      return 0.0;
+    }
+    double mean = 0.0;
+    for ( double sample : mFrameMs ) {
+      mean += sample;
+    }
+    mean /= static_cast<double>( mFrameMs.size() );
+
+    double variance = 0.0;
+    for ( double sample : mFrameMs ) {
+      variance += ( sample - mean ) * ( sample - mean );
+    }
+    return std::sqrt( variance / static_cast<double>( mFrameMs.size() ) );
+  }
+
+  void report() const {
+    if ( mFrameMs.empty() ) {
+      return;
+    }
+
+    PacingPercentiles frame   = frameTimes();
+    PacingPercentiles latency = latencies();
+    VFS_LOG_INFO << "Frame pacing over the last " << mFrameMs.size() << " frames (p50 / p99 / max ms):";
+    VFS_LOG_INFO << "\tFrame time:         " << frame.p50 << " / " << frame.p99 << " / " << frame.max
+                 << " (stddev " << frameTimeDeviation() << ")";
+    VFS_LOG_INFO << "\tAcquire to present: " << latency.p50 << " / " << latency.p99 << " / " << latency.max;
+  }
+
+  private:
+  static PacingPercentiles percentiles( std::vector<double> samples ) {
+    PacingPercentiles result;
+    if ( samples.empty() ) {
+      return result;
+    }
+
+    std::sort( samples.begin(), samples.end() );
+    size_t last = samples.size() - 1;
+    result.p50  = samples[last * 50 / 100];
+    result.p99  = samples[last * 99 / 100];
+    result.max  = samples[last];
+    return result;
+  }
+
+  size_t              mWindow;
+  uint64_t            mReportInterval;
+  std::vector<double> mFrameMs;
+  std::vector<double> mLatencyMs;
+  size_t              mNext { 0 };
+  uint64_t            mRecorded { 0 };
+};
+
+// Holds frames to a fixed rate. Sleeps for most of the remaining time and spins the last stretch, since sleeps
+// routinely overshoot by a millisecond or more.
+class FrameLimiter {
+  public:
+  void setTarget( double framesPerSecond ) {
+    mInterval = framesPerSecond > 0.0
+                  ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>( 1.0 / framesPerSecond ) )
+                  : std::chrono::steady_clock::duration::zero();
+    mNext = std::chrono::steady_clock::now();
+  }
+
+  bool enabled() const {
+    return mInterval != std::chrono::steady_clock::duration::zero();
+  }
+
+  // Call once per frame, right before sampling input / acquiring, so the wait does not add latency to the frame
+  void wait() {
+    if ( !enabled() ) {
+      return;
+    }
+
+    const std::chrono::microseconds spinThreshold( 1500 );
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if ( mNext - now > spinThreshold ) {
+      std::this_thread::sleep_until( mNext - spinThreshold );
+    }
+    while ( std::chrono::steady_clock::now() < mNext ) {
+      std::this_thread::yield();
+    }
+
+    // A frame that ran late restarts the schedule rather than trying to catch up with a burst
+    mNext = std::max( mNext, now ) + mInterval;
+  }
+
+  private:
+  std::chrono::steady_clock::duration   mInterval { std::chrono::steady_clock::duration::zero() };
+  std::chrono::steady_clock::time_point mNext;
+};
+} // namespace utils
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "pch.h"
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+// Lowest level that is compiled in: 0 debug, 1 info, 2 warning, 3 error. Statements below it are discarded at
+// compile time, including the formatting of their arguments.
+#ifndef VFS_LOG_LEVEL
+#ifdef NDEBUG
+#define VFS_LOG_LEVEL 1
+#else
+#define VFS_LOG_LEVEL 0
+#endif
+#endif
+
+#define VFS_LOG( level )                                                   \
+  if constexpr ( utils::LogLevel::level < utils::kMinimumLogLevel ) {       \
+  } else                                                                    \
+    utils::LogLine( utils::LogLevel::level )
+#define VFS_LOG_DEBUG VFS_LOG( eDebug )
+#define VFS_LOG_INFO  VFS_LOG( eInfo )
+#define VFS_LOG_WARN  VFS_LOG( eWarning )
+#define VFS_LOG_ERROR VFS_LOG( eError )
+
+// Logging stuff
+namespace utils {
+enum class LogLevel { eDebug, eInfo, eWarning, eError };
+
+constexpr LogLevel kMinimumLogLevel = static_cast<LogLevel>( VFS_LOG_LEVEL );
+
+// Lines are queued by the caller and written by a background thread, which flushes once per batch. Errors wait until
+// everything before them was written, so nothing is lost when an error is followed by an exception or abort.
+class Logger {
+  public:
+  static Logger& instance() {
+    static Logger logger;
+    return logger;
+  }
+
+  Logger( const Logger& )            = delete;
+  Logger& operator=( const Logger& ) = delete;
+
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock( mMutex );
+      mStopping = true;
+    }
+    mWake.notify_one();
+    mWriter.join();
+  }
+
+  void write( LogLevel level, std::string line ) {
+    {
+      std::lock_guard<std::mutex> lock( mMutex );
+      mPending.push_back( { level, std::move( line ) } );
+      mQueued++;
+    }
+    mWake.notify_one();
+    if ( level == LogLevel::eError ) {
+      flush();
+    }
+  }
+
+  // Blocks until every line queued so far is written
+  void flush() {
+    std::unique_lock<std::mutex> lock( mMutex );
+    uint64_t                     target = mQueued;
+    mWritten.wait( lock, [this, target]() { return mWrittenCount >= target; } );
+  }
+
+  private:
+  struct Entry {
+    LogLevel    level;
+    std::string line;
+  };
+
+  Logger() : mWriter( [this]() { run(); } ) {}
+
+  void run() {
+    std::unique_lock<std::mutex> lock( mMutex );
+    while ( true ) {
+      mWake.wait( lock, [this]() { return !mPending.empty() || mStopping; } );
+      if ( mPending.empty() ) {
+        return; // Stopping and drained
+      }
+
+      std::vector<Entry> batch;
+      batch.swap( mPending );
+      lock.unlock();
+
+      std::string out, err;
+      for ( Entry& entry : batch ) {
+        std::string& target = entry.level >= LogLevel::eWarning ? err : out;
+        target += entry.line;
+        target += '\n';
+      }
+      if ( !out.empty() ) {
+        std::cout.write( out.data(), static_cast<std::streamsize>( out.size() ) );
+        std::cout.flush();
+      }
+      if ( !err.empty() ) {
+        std::cerr.write( err.data(), static_cast<std::streamsize>( err.size() ) );
+      }
+
+      lock.lock();
+      mWrittenCount += batch.size();
+      mWritten.notify_all();
+    }
+  }
+
+  std::mutex              mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mWritten;
+  std::vector<Entry>      mPending;
+  uint64_t                mQueued { 0 };
+  uint64_t                mWrittenCount { 0 };
+  bool                    mStopping { false };
+  std::thread             mWriter; // Last, it starts running as soon as it is constructed
+};
+
+// One log line, formatted on the calling thread and queued when it goes out of scope
+class LogLine {
+  public:
+  explicit LogLine( LogLevel level ) : mLevel( level ) {}
+  LogLine( const LogLine& )            = delete;
+  LogLine& operator=( const LogLine& ) = delete;
+
+  ~LogLine() {
+    Logger::instance().write( mLevel, mStream.str() );
+  }
+
+  template <typename T>
+  LogLine& operator<<( const T& value ) {
+    mStream << value;
+    return *this;
+  }
+
+  private:
+  LogLevel           mLevel;
+  std::ostringstream mStream;
+};
+
+// Startup stuff
+// Wall clock time of each startup phase, marked at the end of the phase
+class StartupTimeline {
+  public:
+  StartupTimeline() : mStart( std::chrono::steady_clock::now() ), mLast( mStart ) {}
+
+  void mark( const char* phase ) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    mPhases.push_back( { phase, std::chrono::duration<double, std::milli>( now - mLast ).count() } );
+    mLast = now;
+  }
+
+  double totalMs() const {
+    return std::chrono::duration<double, std::milli>( mLast - mStart ).count();
+  }
+
+  double sinceStartMs() const {
+    return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - mStart ).count();
+  }
+
+  void report() const {
+    VFS_LOG_INFO << "Startup took " << totalMs() << " ms:";
+    for ( const Phase& phase : mPhases ) {
+      VFS_LOG_INFO << "\t" << phase.name << ": " << phase.ms << " ms";
+    }
+  }
+
+  private:
+  struct Phase {
+    const char* name;
+    double      ms;
+  };
+
+  std::chrono::steady_clock::time_point mStart;
+  std::chrono::steady_clock::time_point mLast;
+  std::vector<Phase>                    mPhases;
+};
+} // namespace utils
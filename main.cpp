@@ -1,55 +1,262 @@
+#include "compute.h"
+#include "descriptors.h"
+#include "dynamic_rendering.h"
+#include "frame_pacing.h"
+#include "mesh.h"
+#include "offscreen.h"
+#include "parallel_recording.h"
+#include "pipeline_builder.h"
+#include "profiler.h"
+#include "render_graph.h"
+#include "shader_watcher.h"
+#include "texture.h"
+#include "transfer.h"
+#include "uniform_ring.h"
 #include "utils.h"
 #include <GLFW/glfw3.h> #include <asm-generic/errno.h>
+#include <set>
+
+struct ApplicationSettings {
+  uint32_t    framesInFlight { 2 };
+  bool        headless { false };   // Render into device owned images, no window/surface/swapchain
+  bool        validation { true };  // Request VK_LAYER_KHRONOS_validation and the debug messenger
+  uint64_t    frameCount { 0 };     // Frames to render before exiting, 0 runs until the window is closed
+  std::string readbackPath;         // Headless only, dump the last rendered frame as a ppm
+  utils::DeviceSelection device;    // Explicit device override, falls back to VFS_DEVICE and then the best score
+  std::string pipelineCacheDirectory { "." };
+  bool        deviceSnapshot { false }; // Device capabilities from a snapshot in the pipeline cache directory
+  std::string shaderArchive;        // Packed SPIR-V archive (see --pack-shaders), shaders load from files without it
+  utils::VertexStreams vertexStreams { utils::VertexStreams::eInterleaved };
+  uint32_t    drawCount { 1 };     // Draw calls per frame, all of the same triangle
+  uint32_t    recordThreads { 0 }; // Worker threads recording secondary command buffers, 0 records inline
+  utils::PresentPolicy presentPolicy { utils::PresentPolicy::eLowLatency };
+  double               frameCap { 0.0 };           // Frames per second for PresentPolicy::eFrameCap, also when headless
+  std::string          tracePath;                  // Chrome trace of the profiler scopes, needs VFS_PROFILER
+  bool                 bindless { false };         // One descriptor indexing set for every texture and buffer
+  bool                 renderGraph { false };      // Record the frame through the render graph instead of by hand
+  bool                 dynamicRendering { false }; // No render pass or framebuffers, falls back when unsupported
+  uint32_t             particles { 0 };            // Simulated on the compute queue every frame, 0 disables
+  std::string          watchShaders;               // GLSL directory to recompile from and rebuild pipelines on edit
+
+  // Every --texture is a comma separated list of candidate files, the first one the device can sample is loaded
+  std::vector<std::string> textures;
+  uint32_t                 textureBudgetMb { 256 }; // Device memory for texture mip levels
+};
+
 class Application {
   public:
-  Application() {
-    this->initWindow();
+  explicit Application( const ApplicationSettings& settings = ApplicationSettings() ) : mSettings( settings ) {
+    if ( !mSettings.headless ) {
+      this->initWindow();
+      mStartup.mark( "Window" );
+    }
     this->initVulkan();
+    if ( mSettings.presentPolicy == utils::PresentPolicy::eFrameCap ) {
+      mLimiter.setTarget( mSettings.frameCap );
+    }
+    mStartup.report();
   }
 
   ~Application() {
-    mVkDevice.destroyPipeline( mVkPipeline );
-    mVkDevice.destroyPipelineLayout( mVkLayout );
-    mVkDevice.destroyRenderPass( mVkRenderPass );
+    mShaderWatcher.stop();
+    mVkDevice.waitIdle();
+    mFrameStats.report();
+    mPacing.report();
 
-    for ( utils::SwapchainFrame frame : mVkSwapchainFrames ) {
-      mVkDevice.destroyImageView( frame.imageView );
+    // Collect the GPU scopes of the frames that never came around again
+    for ( uint32_t slot = 0; slot < mFramesInFlight; slot++ ) {
+      mProfiler.beginFrame( slot );
+    }
+    mProfiler.report();
+    if ( !mSettings.tracePath.empty() ) {
+      mProfiler.writeChromeTrace( mSettings.tracePath );
+    }
+
+    if ( mSettings.headless && !mSettings.readbackPath.empty() && mFrameNumber > 0 ) {
+      uint32_t             lastTarget = static_cast<uint32_t>( ( mFrameNumber - 1 ) % mVkSwapchainFrames.size() );
+      std::vector<uint8_t> pixels     = utils::readbackImage( mVkDevice, mAllocator, mVkGraphicsQueue,
+                                                              mVkCommandPool, mVkSwapchainFrames[lastTarget].image,
+                                                              mVkSwapchainExtent );
+      utils::writePpm( mSettings.readbackPath, pixels, mVkSwapchainExtent, mVkSwapchainFormat );
+      VFS_LOG_INFO << "Wrote \"" << mSettings.readbackPath << "\"";
+    }
+
+    // Everything retired while running goes first, the device is idle now
+    mDeletionQueue.destroy();
+    if ( !mTextureHandles.empty() ) {
+      mTextures.report();
     }
+    mTextures.destroy();
+    mSamplers.destroy();
+    mRecorder.destroy();
+    mRenderGraph.destroy();
+    destroySimulation();
+    mProfiler.destroy();
+    utils::destroyFramesInFlight( mVkDevice, mFrames );
+    mVkDevice.destroyCommandPool( mVkCommandPool );
+
+    // Builds still running must finish before their pipelines and the cache can go away
+    mPipelineVariants.report();
+    mPipelineVariants.destroy();
+    for ( utils::PipelineHandle& replaced : mReplacedPipelines ) {
+      utils::destroyPipeline( mVkDevice, replaced );
+    }
+    mPipelineBuilder.destroy();
+    mDescriptors.destroy();
+    mBindless.destroy();
+    mFrameRing.destroy();
+    mDescriptorLayouts.destroy();
+    mShaderModules.report();
+    mShaderModules.destroy();
+    if ( !mSettings.watchShaders.empty() ) {
+      mShaderWatcher.report();
+    }
+
+    mPipelineCache.save();
+    mPipelineCache.report();
+    mPipelineCache.destroy();
+
+    if ( mSettings.headless ) {
+      utils::destroyOffscreenTargets( mVkDevice, mAllocator, mOffscreen );
+    } else {
+      destroySwapchainResources( mVkSwapchain, mVkSwapchainFrames );
+    }
+
+    if ( mUseMesh ) {
+      utils::destroyMeshBuffers( mAllocator, mMesh );
+    }
+    mTransfer.report();
+    mTransfer.destroy();
+    mAllocator.report();
+    mAllocator.destroy();
 
-    mVkDevice.destroySwapchainKHR( mVkSwapchain );
     mVkDevice.destroy();
-    mVkInstance.destroySurfaceKHR( mVkSurface );
-    mVkInstance.destroyDebugUtilsMessengerEXT( mVkDebugMessenger, nullptr, mVkDldi );
+    if ( mVkSurface ) {
+      mVkInstance.destroySurfaceKHR( mVkSurface );
+    }
+    if ( mVkDebugMessenger ) {
+      mVkInstance.destroyDebugUtilsMessengerEXT( mVkDebugMessenger, nullptr, mVkDldi );
+    }
     mVkInstance.destroy();
-    glfwTerminate();
+    if ( mWindow ) {
+      glfwDestroyWindow( mWindow );
+      glfwTerminate();
+    }
+  }
+
+  void run() {
+    // Headless runs have nothing to close, so they always render a fixed number of frames
+    uint64_t frameCount = mSettings.frameCount;
+    if ( mSettings.headless && frameCount == 0 ) {
+      frameCount = 100;
+    }
+
+    while ( frameCount == 0 || mFrameNumber < frameCount ) {
+      if ( mWindow ) {
+        if ( glfwWindowShouldClose( mWindow ) ) {
+          break;
+        }
+        glfwPollEvents();
+      }
+      drawFrame();
+    }
   }
 
   private:
   void initVulkan() {
     // CREATE INSTANCE (with extensions and debug layers)
     // Required extensions and layers
-    uint32_t                 glfwExtensionCount = 0;
-    const char**             glfwExtensions     = glfwGetRequiredInstanceExtensions( &glfwExtensionCount );
-    std::vector<const char*> requiredExtensions( glfwExtensions, glfwExtensions + glfwExtensionCount );
-    requiredExtensions.push_back( VK_EXT_DEBUG_UTILS_EXTENSION_NAME );
-    std::vector<const char*> requiredLayers = { "VK_LAYER_KHRONOS_validation" };
-    mVkInstance       = utils::vkCreateInstance( "My Application", requiredExtensions, requiredLayers );
-    mVkDldi           = vk::DispatchLoaderDynamic( mVkInstance, vkGetInstanceProcAddr );
-    mVkDebugMessenger = utils::vkCreateDebugUtilsMessengerEXT( mVkInstance, mVkDldi );
-    VkSurfaceKHR c_style_surface;
-    if ( glfwCreateWindowSurface( mVkInstance, mWindow, nullptr, &c_style_surface ) != VK_SUCCESS ) {
-      std::cout << "Could not create window surface.\n";
-    }
-    mVkSurface = c_style_surface;
+    std::vector<const char*> requiredExtensions;
+    if ( !mSettings.headless ) {
+      uint32_t     glfwExtensionCount = 0;
+      const char** glfwExtensions     = glfwGetRequiredInstanceExtensions( &glfwExtensionCount );
+      requiredExtensions.assign( glfwExtensions, glfwExtensions + glfwExtensionCount );
+    }
+    std::vector<const char*> requiredLayers;
+    if ( mSettings.validation ) {
+      requiredExtensions.push_back( VK_EXT_DEBUG_UTILS_EXTENSION_NAME );
+      requiredLayers.push_back( "VK_LAYER_KHRONOS_validation" );
+    }
+    mVkInstance = utils::vkCreateInstance( "My Application", requiredExtensions, requiredLayers );
+    if ( !mVkInstance ) {
+      throw std::runtime_error( "Failed to create instance." );
+    }
+    mVkDldi = vk::DispatchLoaderDynamic( mVkInstance, vkGetInstanceProcAddr );
+    mStartup.mark( "Instance" );
+    if ( mSettings.validation ) {
+      mVkDebugMessenger = utils::vkCreateDebugUtilsMessengerEXT( mVkInstance, mVkDldi );
+      mStartup.mark( "Debug messenger" );
+    }
+    if ( !mSettings.headless ) {
+      VkSurfaceKHR c_style_surface;
+      if ( glfwCreateWindowSurface( mVkInstance, mWindow, nullptr, &c_style_surface ) != VK_SUCCESS ) {
+        VFS_LOG_ERROR << "Could not create window surface.";
+      }
+      mVkSurface = c_style_surface;
+      mStartup.mark( "Surface" );
+    }
+
+    // Specify deviceExtensions (Swapchain, unless rendering offscreen)
+    std::vector<const char*> deviceExtensions;
+    if ( !mSettings.headless ) {
+      deviceExtensions.push_back( VK_KHR_SWAPCHAIN_EXTENSION_NAME );
+    }
 
     // CHOOSE PHYSICAL DEVICE
-    mVkPhysicalDevice = utils::vkChoosePhysicalDevice( mVkInstance );
+    utils::DeviceRequirements requirements = {};
+    requirements.extensions                = deviceExtensions;
+    requirements.surface                   = mVkSurface;
+    if ( mSettings.deviceSnapshot ) {
+      requirements.snapshotDirectory = mSettings.pipelineCacheDirectory;
+    }
+    mCapabilities     = utils::vkChoosePhysicalDevice( mVkInstance, requirements, mSettings.device );
+    mVkPhysicalDevice = mCapabilities.physicalDevice;
+    mStartup.mark( "Device pick" );
+
+    // Cache hit/miss reporting needs creation feedback, which is an extension before 1.3
+    bool creationFeedback = utils::supportsPipelineCreationFeedback( mCapabilities );
+    if ( creationFeedback && mCapabilities.apiVersion() < VK_API_VERSION_1_3 ) {
+      deviceExtensions.push_back( VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME );
+    }
+
+    // Bindless needs descriptor indexing, core in 1.2 and an extension before
+    bool bindless = mSettings.bindless && utils::supportsBindless( mCapabilities );
+    if ( mSettings.bindless && !bindless ) {
+      VFS_LOG_WARN << "Descriptor indexing is not supported, bindless descriptors are disabled";
+    }
+    if ( bindless ) {
+      for ( const char* extension : utils::bindlessExtensions( mCapabilities ) ) {
+        deviceExtensions.push_back( extension );
+      }
+    }
+
+    // Dynamic rendering is core in 1.3 and an extension before, the classic render pass path is the fallback
+    bool dynamicRendering = mSettings.dynamicRendering && utils::supportsDynamicRendering( mCapabilities );
+    if ( mSettings.dynamicRendering && mSettings.renderGraph ) {
+      VFS_LOG_WARN << "The render graph creates its own render passes, dynamic rendering is disabled";
+      dynamicRendering = false;
+    } else if ( mSettings.dynamicRendering && !dynamicRendering ) {
+      VFS_LOG_WARN << "Dynamic rendering is not supported, falling back to render passes";
+    }
+    if ( dynamicRendering ) {
+      for ( const char* extension : utils::dynamicRenderingExtensions( mCapabilities ) ) {
+        deviceExtensions.push_back( extension );
+      }
+    }
 
     // CREATE LOGICAL DEVICE
-    utils::QueueFamilyIndices indices            = utils::vkFindQueueFamilies( mVkPhysicalDevice, mVkSurface );
-    std::vector<uint32_t>     uniqueQueueIndices = { indices.graphicsFamily.value() };
-    if ( indices.graphicsFamily.value() != indices.presentFamily.value() ) {
-      uniqueQueueIndices.push_back( indices.presentFamily.value() );
+    mQueueFamilies                    = utils::vkFindQueueFamilies( mCapabilities, mVkSurface );
+    utils::QueueFamilyIndices indices = mQueueFamilies;
+    if ( !indices.isComplete( !mSettings.headless ) ) {
+      throw std::runtime_error( "Selected device is missing required queue families." );
+    }
+    // A family may only be requested once, however many roles it plays
+    std::set<uint32_t> uniqueQueueIndices = { indices.graphicsFamily.value() };
+    for ( const std::optional<uint32_t>& family :
+          { indices.presentFamily, indices.transferFamily, indices.computeFamily } ) {
+      if ( family.has_value() ) {
+        uniqueQueueIndices.insert( family.value() );
+      }
     }
 
     float                                  queuePriority = 1.0f;
@@ -59,45 +266,598 @@ class Application {
           vk::DeviceQueueCreateInfo( vk::DeviceQueueCreateFlags(), queueFamilyIndex, 1, &queuePriority ) );
     }
 
-    // Specify deviceExtensions (Swapchain)
-    std::vector<const char*> deviceExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
-
-    vk::PhysicalDeviceFeatures deviceFeatures = vk::PhysicalDeviceFeatures();
-    // deviceFeatures.samplerAnisotropy          = true;
+    // Anisotropic filtering and block compressed formats, whichever the device has
+    const vk::PhysicalDeviceFeatures& supportedFeatures = mCapabilities.features;
+    vk::PhysicalDeviceFeatures        deviceFeatures    = vk::PhysicalDeviceFeatures();
+    deviceFeatures.samplerAnisotropy                    = supportedFeatures.samplerAnisotropy;
+    deviceFeatures.textureCompressionBC                 = supportedFeatures.textureCompressionBC;
+    deviceFeatures.textureCompressionASTC_LDR           = supportedFeatures.textureCompressionASTC_LDR;
     vk::DeviceCreateInfo deviceInfo =
         vk::DeviceCreateInfo( vk::DeviceCreateFlags(),                          // Flags
                               queueCreateInfo.size(), queueCreateInfo.data(),   // QueueInfo
                               requiredLayers.size(), requiredLayers.data(),     // Layers
                               deviceExtensions.size(), deviceExtensions.data(), // Device extensions
                               &deviceFeatures );
+    vk::PhysicalDeviceDescriptorIndexingFeatures indexingFeatures = utils::bindlessFeatures();
+    if ( bindless ) {
+      deviceInfo.pNext = &indexingFeatures;
+    }
+    vk::PhysicalDeviceDynamicRenderingFeatures renderingFeatures = utils::dynamicRenderingFeatures();
+    if ( dynamicRendering ) {
+      renderingFeatures.pNext = const_cast<void*>( deviceInfo.pNext );
+      deviceInfo.pNext        = &renderingFeatures;
+    }
     try {
       mVkDevice = mVkPhysicalDevice.createDevice( deviceInfo );
     } catch ( vk::SystemError err ) {
-      std::cout << "Device create failed.\n";
+      VFS_LOG_ERROR << "Device create failed.";
     }
     mVkGraphicsQueue = mVkDevice.getQueue( indices.graphicsFamily.value(), 0 );
-    mVkPresentQueue  = mVkDevice.getQueue( indices.presentFamily.value(), 0 );
+    if ( indices.presentFamily.has_value() ) {
+      mVkPresentQueue = mVkDevice.getQueue( indices.presentFamily.value(), 0 );
+    }
+    mStartup.mark( "Device creation" );
 
-    // Creating swapchain
-    utils::SwapchainBundle bundle =
-        utils::vkCreateSwapchain( mVkDevice, mVkPhysicalDevice, mVkSurface, mWidth, mHeight );
-    mVkSwapchain       = bundle.swapchain;
-    mVkSwapchainFrames = bundle.frames;
-    mVkSwapchainFormat = bundle.format;
-    mVkSwapchainExtent = bundle.extent;
+    // Buffers and images are sub-allocated from large blocks instead of one allocation each
+    mAllocator.create( mVkDevice, mCapabilities );
+
+    // Uploads go through the copy engine when there is one, otherwise they share the graphics queue
+    uint32_t transferFamily = indices.transferFamily.value_or( indices.graphicsFamily.value() );
+    mTransfer.create( mVkDevice, mCapabilities, mAllocator, mVkDevice.getQueue( transferFamily, 0 ), transferFamily,
+                      indices.graphicsFamily.value() );
+    mStartup.mark( "Allocator and transfer queue" );
+
+    // Set layouts are shared through the cache, transient sets come from per frame pools
+    mDescriptorLayouts.create( mVkDevice );
+    mFrameRing.create( mVkDevice, mCapabilities, mAllocator, mDescriptorLayouts,
+                       std::max( mSettings.framesInFlight, 1u ) );
+    if ( bindless ) {
+      mBindless.create( mVkDevice, mCapabilities, mDescriptorLayouts, std::max( mSettings.framesInFlight, 1u ) );
+    }
+
+    if ( mSettings.headless ) {
+      // Creating offscreen targets, one per frame in flight so slots never share an image
+      uint32_t targetCount = std::max( mSettings.framesInFlight, 1u );
+      mOffscreen           = utils::vkCreateOffscreenTargets( mVkDevice, mAllocator, vk::Format::eR8G8B8A8Unorm,
+                                                              vk::Extent2D( mWidth, mHeight ), targetCount );
+      mVkSwapchainFrames = mOffscreen.frames;
+      mVkSwapchainFormat = mOffscreen.format;
+      mVkSwapchainExtent = mOffscreen.extent;
+    } else {
+      // Creating swapchain
+      utils::SwapchainBundle bundle =
+          utils::vkCreateSwapchain( mVkDevice, mVkPhysicalDevice, mVkSurface, indices, mWidth, mHeight, nullptr,
+                                    mSettings.presentPolicy );
+      mVkSwapchain       = bundle.swapchain;
+      mVkSwapchainFrames = bundle.frames;
+      mVkSwapchainFormat = bundle.format;
+      mVkSwapchainExtent = bundle.extent;
+    }
+    mStartup.mark( mSettings.headless ? "Offscreen targets" : "Swapchain" );
+
+    // CREATE PIPELINE (compiled in the background, frames only clear until it is ready)
+    mPipelineCache.create( mVkDevice, mCapabilities, mSettings.pipelineCacheDirectory, creationFeedback );
+    mShaderModules.create( mVkDevice );
+    if ( !mSettings.shaderArchive.empty() ) {
+      mShaderModules.loadArchive( mSettings.shaderArchive );
+    }
+    mPipelineBuilder.create( mVkDevice, &mPipelineCache, &mShaderModules );
+    mPipelineVariants.create( mVkDevice, mPipelineBuilder );
+
+    // The triangle comes from a quantized vertex buffer when the mesh shader was built (needs glslc at build time)
+    utils::VertexLayout vertexLayout = utils::packedVertexLayout( mSettings.vertexStreams );
+    mUseMesh = std::ifstream( "shaders/mesh.vert.spv" ).good() && vertexLayout.supportedBy( mCapabilities );
+    if ( mUseMesh ) {
+      utils::MeshData triangle;
+      triangle.vertices = {
+        { { 0.0f, -0.5f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.5f, 0.0f }, { 1.0f, 0.0f, 0.0f, 1.0f } },
+        { { 0.5f, 0.5f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f, 0.0f, 1.0f } },
+        { { -0.5f, 0.5f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 1.0f }, { 0.0f, 0.0f, 1.0f, 1.0f } },
+      };
+      triangle.indices = { 0, 1, 2 };
+      utils::optimizeVertexFetch( triangle );
+      mMesh = utils::createMeshBuffers( mAllocator, mTransfer, utils::packMesh( triangle, mSettings.vertexStreams ) );
+    }
 
-    // CREATE PIPELINE
     utils::GraphicsPipelineInBundle specification = {};
     specification.device                          = mVkDevice;
-    specification.vertexFilepath                  = "shaders/vert.spv";
+    specification.vertexFilepath                  = mUseMesh ? "shaders/mesh.vert.spv" : "shaders/vert.spv";
     specification.fragmentFilepath                = "shaders/frag.spv";
     specification.swapchainExtent                 = mVkSwapchainExtent;
     specification.swapchainImageFormat            = mVkSwapchainFormat;
-    utils::GraphicsPipelineOutBundle output       = utils::makeGraphicsPipeline( specification );
+    specification.finalLayout =
+        mSettings.headless ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR;
+    specification.pipelineCache    = &mPipelineCache;
+    specification.dynamicRendering = dynamicRendering;
+    if ( mUseMesh ) {
+      specification.vertexLayout       = vertexLayout;
+      specification.pushConstantRanges = {
+        utils::drawDataRange<utils::MeshBounds>( vk::ShaderStageFlagBits::eVertex ),
+      };
+    }
+    specification.setLayouts = { mFrameRing.layout() };
+    if ( mBindless.enabled() ) {
+      specification.setLayouts.push_back( mBindless.layout() );
+    }
+    mPipelineHandles       = { mPipelineVariants.get( specification ) };
+    mPipelineSpecification = specification;
+    if ( !mSettings.watchShaders.empty() ) {
+      // The same mapping the checked in SPIR-V and the build use
+      mShaderWatcher.start( mSettings.watchShaders, { { "shader.vert", "shaders/vert.spv" },
+                                                      { "shader.frag", "shaders/frag.spv" },
+                                                      { "mesh.vert", "shaders/mesh.vert.spv" } } );
+    }
+    if ( dynamicRendering ) {
+      mDynamicRendering.create( mVkDevice, mCapabilities, mVkSwapchainFormat, specification.finalLayout );
+    } else {
+      mVkRenderPass = mPipelineBuilder.renderPass( specification.swapchainImageFormat, specification.finalLayout );
+    }
+    mStartup.mark( "Pipeline" );
+
+    // CREATE FRAMEBUFFERS (only for render passes), COMMAND POOL AND FRAMES IN FLIGHT
+    if ( mVkRenderPass ) {
+      utils::makeFramebuffers( mVkDevice, mVkRenderPass, mVkSwapchainExtent, mVkSwapchainFrames );
+    }
+    if ( mSettings.headless ) {
+      mOffscreen.frames = mVkSwapchainFrames;
+    }
+    mVkCommandPool = utils::makeCommandPool( mVkDevice, indices.graphicsFamily.value() );
+
+    // More slots than images would only queue up behind the swapchain
+    uint32_t imageCount = static_cast<uint32_t>( mVkSwapchainFrames.size() );
+    mFramesInFlight     = std::clamp( mSettings.framesInFlight, 1u, imageCount );
+    mFrames             = utils::makeFramesInFlight( mVkDevice, mVkCommandPool, mFramesInFlight );
+    mImagesInFlight.assign( imageCount, vk::Fence( nullptr ) );
+    mDeletionQueue.create( mVkDevice, &mAllocator, mFramesInFlight );
+    createTextures( deviceFeatures.samplerAnisotropy == VK_TRUE );
+    if ( mSettings.recordThreads > 0 ) {
+      mRecorder.create( mVkDevice, indices.graphicsFamily.value(), mFramesInFlight, mSettings.recordThreads );
+    }
+    mProfiler.create( mVkDevice, mCapabilities, indices.graphicsFamily.value(), mFramesInFlight );
+    mDescriptors.create( mVkDevice, mFramesInFlight );
+    if ( mSettings.renderGraph ) {
+      buildRenderGraph( specification.finalLayout );
+    }
+    if ( mSettings.particles > 0 ) {
+      createSimulation( indices );
+    }
+    VFS_LOG_INFO << "Frames in flight: " << mFramesInFlight << " ("
+                 << ( mSettings.headless ? "offscreen" : "swapchain" ) << " images: " << imageCount << ")";
+    mStartup.mark( "Frames in flight" );
+  }
+
+  // Particles live in a state buffer only the compute queue touches. Every frame the simulation writes their positions
+  // into a buffer of the frame's slot. Nothing draws them yet, so they stay with the compute queue and graphics never
+  // waits for the simulation; a consumer releases the buffer with mCompute.releaseBuffer().
+  void createSimulation( const utils::QueueFamilyIndices& indices ) {
+    if ( !std::ifstream( "shaders/simulate.comp.spv" ).good() ) {
+      VFS_LOG_WARN << "shaders/simulate.comp.spv was not built, the particle simulation is disabled";
+      return;
+    }
+
+    uint32_t computeFamily = indices.computeFamily.value_or( indices.graphicsFamily.value() );
+    mCompute.create( mVkDevice, mVkDevice.getQueue( computeFamily, 0 ), computeFamily,
+                     indices.graphicsFamily.value(), mFramesInFlight );
+
+    vk::ShaderStageFlags stages = vk::ShaderStageFlagBits::eCompute;
+    mSimulationSetLayout        = mDescriptorLayouts.get( {
+        { 0, vk::DescriptorType::eStorageBuffer, 1, stages },
+        { 1, vk::DescriptorType::eStorageBuffer, 1, stages },
+    } );
+
+    // One work group size for every device would either waste lanes or exceed limits, so it is specialized
+    const vk::PhysicalDeviceLimits& limits = mCapabilities.limits();
+    mSimulationGroupSize =
+        std::min( { 256u, limits.maxComputeWorkGroupSize[0], limits.maxComputeWorkGroupInvocations } );
+
+    utils::ComputePipelineInBundle specification = {};
+    specification.device                         = mVkDevice;
+    specification.shaderFilepath                 = "shaders/simulate.comp.spv";
+    specification.setLayouts                     = { mSimulationSetLayout };
+    specification.pushConstantRanges             = { vk::PushConstantRange( stages, 0, sizeof( SimulationStep ) ) };
+    specification.pipelineCache                  = &mPipelineCache;
+    specification.shaderModules                  = &mShaderModules;
+    specification.specialization.set( 0, mSimulationGroupSize ).set( 1, mSettings.particles );
+    mSimulation = utils::makeComputePipeline( specification );
+
+    vk::BufferCreateInfo bufferInfo = {};
+    bufferInfo.size                 = sizeof( float ) * 4 * mSettings.particles;
+    bufferInfo.usage                = vk::BufferUsageFlagBits::eStorageBuffer;
+    bufferInfo.sharingMode          = vk::SharingMode::eExclusive;
+
+    utils::AllocationCreateInfo allocInfo = {};
+    allocInfo.usage                       = utils::MemoryUsage::eGpuOnly;
+    mParticleState                        = mAllocator.createBuffer( bufferInfo, allocInfo );
+
+    bufferInfo.usage |= vk::BufferUsageFlagBits::eVertexBuffer;
+    for ( uint32_t i = 0; i < mFramesInFlight; i++ ) {
+      mParticlePositions.push_back( mAllocator.createBuffer( bufferInfo, allocInfo ) );
+    }
+    mSimulating = true;
+  }
+
+  void destroySimulation() {
+    if ( !mSimulating ) {
+      return;
+    }
+    for ( utils::BufferAllocation& positions : mParticlePositions ) {
+      mAllocator.destroyBuffer( positions );
+    }
+    mAllocator.destroyBuffer( mParticleState );
+    mVkDevice.destroyPipeline( mSimulation.pipeline );
+    mVkDevice.destroyPipelineLayout( mSimulation.layout );
+    mCompute.destroy();
+  }
+
+  // Records and submits the frame's simulation step, before the graphics work of the frame is submitted
+  void simulate( float deltaTime ) {
+    vk::CommandBuffer        commandBuffer = mCompute.beginFrame( mCurrentFrame );
+    utils::BufferAllocation& positions     = mParticlePositions[mCurrentFrame];
+    vk::DescriptorSet        set           = mDescriptors.allocate( mSimulationSetLayout );
+
+    vk::DescriptorBufferInfo              stateInfo( mParticleState.buffer, 0, VK_WHOLE_SIZE );
+    vk::DescriptorBufferInfo              positionsInfo( positions.buffer, 0, VK_WHOLE_SIZE );
+    std::array<vk::WriteDescriptorSet, 2> writes = {
+      vk::WriteDescriptorSet( set, 0, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &stateInfo ),
+      vk::WriteDescriptorSet( set, 1, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &positionsInfo ),
+    };
+    mVkDevice.updateDescriptorSets( writes, nullptr );
+
+    // The previous step wrote the state in an earlier submission on this queue
+    vk::MemoryBarrier stateBarrier( vk::AccessFlagBits::eShaderWrite,
+                                    vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite );
+    commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eComputeShader,
+                                   vk::PipelineStageFlagBits::eComputeShader, {}, stateBarrier, nullptr, nullptr );
+
+    SimulationStep step = { deltaTime, mFrameNumber == 0 ? 1u : 0u };
+    commandBuffer.bindPipeline( vk::PipelineBindPoint::eCompute, mSimulation.pipeline );
+    commandBuffer.bindDescriptorSets( vk::PipelineBindPoint::eCompute, mSimulation.layout, 0, set, nullptr );
+    commandBuffer.pushConstants( mSimulation.layout, vk::ShaderStageFlagBits::eCompute, 0, sizeof( step ), &step );
+    commandBuffer.dispatch( utils::groupCount( mSettings.particles, mSimulationGroupSize ), 1, 1 );
+    mCompute.submit();
+  }
+
+  // One pass drawing into the imported target. Its render pass is compatible with the builder's (same format and
+  // sample count), so the pipelines work in either path.
+  void buildRenderGraph( vk::ImageLayout finalLayout ) {
+    utils::RenderGraphImageDesc target = {};
+    target.format                      = mVkSwapchainFormat;
+    target.extent                      = mVkSwapchainExtent;
+
+    mRenderGraph.create( mVkDevice, mAllocator, mFramesInFlight );
+    mBackbuffer = mRenderGraph.importImage( "Backbuffer", target, vk::ImageLayout::eUndefined, finalLayout );
+    utils::RenderGraph::PassBuilder mainPass = mRenderGraph.addPass( "Main", utils::PassType::eGraphics );
+    mainPass.color( mBackbuffer, vk::ClearColorValue( std::array<float, 4> { 0.0f, 0.0f, 0.0f, 1.0f } ) )
+        .record( [this]( vk::CommandBuffer commandBuffer, const utils::PassContext& context ) {
+          uint32_t drawCount = readyDrawCount();
+          if ( mSettings.recordThreads > 0 ) {
+            mRecorder.record( commandBuffer, context.renderPass, context.subpass, context.framebuffer, drawCount, 64,
+                              [this]( vk::CommandBuffer secondary, uint32_t begin, uint32_t end ) {
+                                recordDraws( secondary, begin, end );
+                              } );
+          } else {
+            recordDraws( commandBuffer, 0, drawCount );
+          }
+        } );
+    if ( mSettings.recordThreads > 0 ) {
+      mainPass.secondary();
+    }
+    mRenderGraph.compile();
+    mRenderGraph.report();
+  }
+
+  void recordDrawCommands( vk::CommandBuffer commandBuffer, uint32_t imageIndex ) {
+    VFS_PROFILE_SCOPE( mProfiler, "Record" );
+
+    vk::CommandBufferBeginInfo beginInfo = {};
+    beginInfo.flags                      = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    commandBuffer.begin( beginInfo );
+    mProfiler.resetQueries( commandBuffer );
+    {
+      VFS_PROFILE_GPU_SCOPE( mProfiler, commandBuffer, "GPU frame" );
+      recordFrame( commandBuffer, imageIndex );
+    }
+    commandBuffer.end();
+  }
+
+  void recordFrame( vk::CommandBuffer commandBuffer, uint32_t imageIndex ) {
+    // Take over whatever finished uploading since the last frame, and this frame's compute results
+    mTransfer.recordAcquires( commandBuffer );
+    if ( mSimulating ) {
+      mCompute.recordAcquires( commandBuffer );
+    }
+    if ( !mTextureHandles.empty() ) {
+      mTextures.update( commandBuffer );
+      bindTextures();
+    }
+
+    if ( mSettings.renderGraph ) {
+      VFS_PROFILE_GPU_SCOPE( mProfiler, commandBuffer, "Render graph" );
+      const utils::SwapchainFrame& target = mVkSwapchainFrames[imageIndex];
+      mRenderGraph.setImage( mBackbuffer, target.image, target.imageView, mVkSwapchainExtent );
+      mRenderGraph.execute( commandBuffer, mCurrentFrame );
+      return;
+    }
+
+    vk::ClearValue clearColor = vk::ClearColorValue( std::array<float, 4> { 0.0f, 0.0f, 0.0f, 1.0f } );
+    uint32_t       drawCount  = readyDrawCount();
+
+    if ( mDynamicRendering.enabled() ) {
+      VFS_PROFILE_GPU_SCOPE( mProfiler, commandBuffer, "Main pass" );
+      const utils::SwapchainFrame& target = mVkSwapchainFrames[imageIndex];
+      mDynamicRendering.begin( commandBuffer, target.image, target.imageView, mVkSwapchainExtent, clearColor.color,
+                               mSettings.recordThreads > 0 );
+      if ( mSettings.recordThreads > 0 ) {
+        mRecorder.record( commandBuffer, mDynamicRendering.inheritance(), drawCount, 64,
+                          [this]( vk::CommandBuffer secondary, uint32_t begin, uint32_t end ) {
+                            recordDraws( secondary, begin, end );
+                          } );
+      } else {
+        recordDraws( commandBuffer, 0, drawCount );
+      }
+      mDynamicRendering.end( commandBuffer, target.image );
+      return;
+    }
+
+    vk::RenderPassBeginInfo renderPassInfo = {};
+    renderPassInfo.renderPass              = mVkRenderPass;
+    renderPassInfo.framebuffer             = mVkSwapchainFrames[imageIndex].framebuffer;
+    renderPassInfo.renderArea.offset.x     = 0;
+    renderPassInfo.renderArea.offset.y     = 0;
+    renderPassInfo.renderArea.extent       = mVkSwapchainExtent;
+    renderPassInfo.clearValueCount         = 1;
+    renderPassInfo.pClearValues            = &clearColor;
+
+    VFS_PROFILE_GPU_SCOPE( mProfiler, commandBuffer, "Main pass" );
+    if ( mSettings.recordThreads > 0 ) {
+      commandBuffer.beginRenderPass( renderPassInfo, vk::SubpassContents::eSecondaryCommandBuffers );
+      mRecorder.record( commandBuffer, mVkRenderPass, 0, renderPassInfo.framebuffer, drawCount, 64,
+                        [this]( vk::CommandBuffer secondary, uint32_t begin, uint32_t end ) {
+                          recordDraws( secondary, begin, end );
+                        } );
+    } else {
+      commandBuffer.beginRenderPass( renderPassInfo, vk::SubpassContents::eInline );
+      recordDraws( commandBuffer, 0, drawCount );
+    }
+    commandBuffer.endRenderPass();
+  }
+
+  // Nothing to draw until the pipeline is built and the geometry uploaded
+  uint32_t readyDrawCount() {
+    bool ready = mVkPipeline && ( !mUseMesh || mTransfer.isComplete( mMesh.ticket ) );
+    return ready ? mSettings.drawCount : 0;
+  }
+
+  // Records draws [begin, end), may run on a recording worker
+  void recordDraws( vk::CommandBuffer commandBuffer, uint32_t begin, uint32_t end ) {
+    if ( begin == end ) {
+      return;
+    }
+    VFS_PROFILE_SCOPE( mProfiler, "Record draws" );
+
+    commandBuffer.bindPipeline( vk::PipelineBindPoint::eGraphics, mVkPipeline );
+    if ( mBindless.enabled() ) {
+      commandBuffer.bindDescriptorSets( vk::PipelineBindPoint::eGraphics, mVkPipelineLayout, kBindlessSet,
+                                        mBindless.set(), nullptr );
+    }
+
+    vk::Viewport viewport( 0.0f, 0.0f, static_cast<float>( mVkSwapchainExtent.width ),
+                           static_cast<float>( mVkSwapchainExtent.height ), 0.0f, 1.0f );
+    vk::Rect2D   scissor( vk::Offset2D( 0, 0 ), mVkSwapchainExtent );
+    commandBuffer.setViewport( 0, viewport );
+    commandBuffer.setScissor( 0, scissor );
+
+    if ( !mUseMesh ) {
+      for ( uint32_t i = begin; i < end; i++ ) {
+        commandBuffer.draw( 3, 1, 0, 0 );
+      }
+      return;
+    }
+
+    utils::pushDrawData( commandBuffer, vk::PipelineBindPoint::eGraphics, mVkPipelineLayout,
+                         vk::ShaderStageFlagBits::eVertex, mMesh.bounds, mFrameRing, kFrameRingSet );
+    utils::bindMesh( commandBuffer, mMesh );
+    for ( uint32_t i = begin; i < end; i++ ) {
+      utils::drawBoundMesh( commandBuffer, mMesh );
+    }
+  }
+
+  // Runs between two frames. A finished rebuild takes over from the current pipeline, which is retired like any other
+  // replaced object; recompiled shaders start new rebuilds on the build service, and until one of them is ready the
+  // current pipeline keeps rendering.
+  void reloadShaders() {
+    if ( mPipelineRebuild.ready() ) {
+      try {
+        utils::GraphicsPipelineOutBundle rebuilt = mPipelineRebuild.get();
+        if ( !rebuilt.pipeline ) {
+          throw std::runtime_error( "Failed to create graphics pipeline." );
+        }
+        vk::Device device = mVkDevice;
+        for ( utils::PipelineHandle& replaced : mReplacedPipelines ) {
+          mDeletionQueue.defer( [device, replaced]() { utils::destroyPipeline( device, replaced ); } );
+        }
+        mReplacedPipelines.clear();
+        mVkPipeline       = rebuilt.pipeline;
+        mVkPipelineLayout = rebuilt.layout;
+        mPipelineHandles  = { mPipelineRebuild };
+        VFS_LOG_INFO << "Pipeline reloaded";
+      } catch ( const std::exception& error ) {
+        VFS_LOG_ERROR << error.what() << " Keeping the previous pipeline";
+      }
+      mPipelineRebuild = {};
+    }
+
+    bool rebuild = false;
+    for ( const std::string& path : mShaderWatcher.takeChanged() ) {
+      mPipelineBuilder.reloadShader( path );
+      for ( utils::PipelineHandle& replaced : mPipelineVariants.invalidate( path ) ) {
+        mReplacedPipelines.push_back( replaced );
+      }
+      rebuild = rebuild || path == mPipelineSpecification.vertexFilepath
+             || path == mPipelineSpecification.fragmentFilepath;
+    }
+    if ( rebuild ) {
+      mPipelineRebuild = mPipelineVariants.get( mPipelineSpecification );
+    }
+  }
+
+  void drawFrame() {
+    // Pick up the pipeline as soon as its background build finished. A failed build is reported once, a shader
+    // reload can still bring a working pipeline.
+    if ( !mVkPipeline && !mPipelineFailed && mPipelineHandles.front().ready() ) {
+      try {
+        utils::GraphicsPipelineOutBundle built = mPipelineHandles.front().get();
+        if ( !built.pipeline ) {
+          throw std::runtime_error( "Failed to create graphics pipeline." );
+        }
+        mVkPipeline       = built.pipeline;
+        mVkPipelineLayout = built.layout;
+        VFS_LOG_INFO << "Pipeline ready " << mStartup.sinceStartMs() << " ms after startup";
+      } catch ( const std::exception& error ) {
+        mPipelineFailed = true;
+        VFS_LOG_ERROR << error.what() << " Nothing will be drawn";
+      }
+    }
+    if ( mShaderWatcher.running() ) {
+      reloadShaders();
+    }
+
+    // The limiter waits before anything of the frame happens, so its sleep never counts as latency
+    mLimiter.wait();
+    VFS_PROFILE_SCOPE( mProfiler, "Frame" );
+
+    utils::FrameInFlight&                 frame        = mFrames[mCurrentFrame];
+    utils::FrameTimings                   timings      = {};
+    std::chrono::steady_clock::time_point frameStart   = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point acquireStart = frameStart;
+
+    // Wait for the GPU to finish the last frame recorded into this slot
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if ( mVkDevice.waitForFences( frame.inFlight, VK_TRUE, UINT64_MAX ) != vk::Result::eSuccess ) {
+      throw std::runtime_error( "Failed waiting for frame fence." );
+    }
+    timings.fenceWaitMs = utils::elapsedMs( start );
+    mDeletionQueue.beginFrame( mFrameNumber );
+    mProfiler.beginFrame( mCurrentFrame );
+    mDescriptors.beginFrame( mCurrentFrame );
+    mFrameRing.beginFrame( mCurrentFrame );
+    if ( mBindless.enabled() ) {
+      mBindless.beginFrame( mFrameNumber );
+    }
+
+    if ( mSettings.recordThreads > 0 ) {
+      mRecorder.beginFrame( mCurrentFrame );
+    }
+
+    // Uploads queued since the last frame go out in one batch, finished ones free their staging space
+    mTransfer.flush();
+    mTransfer.collect();
+
+    // Offscreen targets belong to a single slot, swapchain images have to be acquired
+    uint32_t imageIndex = mCurrentFrame;
+    if ( !mSettings.headless ) {
+      start                              = std::chrono::steady_clock::now();
+      acquireStart                       = start;
+      vk::ResultValue<uint32_t> acquired = { vk::Result::eErrorOutOfDateKHR, 0 };
+      try {
+        acquired = mVkDevice.acquireNextImageKHR( mVkSwapchain, UINT64_MAX, frame.imageAvailable, nullptr );
+      } catch ( vk::OutOfDateKHRError& ) {
+      }
+      timings.acquireMs = utils::elapsedMs( start );
+
+      // Nothing was acquired and the semaphore stays unsignaled, so the slot can simply be retried
+      if ( acquired.result == vk::Result::eErrorOutOfDateKHR ) {
+        recreateSwapchain();
+        return;
+      }
+      if ( acquired.result == vk::Result::eSuboptimalKHR ) {
+        mFramebufferResized = true; // Still presentable, recreate after this frame
+      }
+      imageIndex = acquired.value;
+    }
+
+    // With fewer slots than images, another slot may still be rendering into this image
+    start = std::chrono::steady_clock::now();
+    if ( mImagesInFlight[imageIndex] && mImagesInFlight[imageIndex] != frame.inFlight ) {
+      if ( mVkDevice.waitForFences( mImagesInFlight[imageIndex], VK_TRUE, UINT64_MAX ) != vk::Result::eSuccess ) {
+        throw std::runtime_error( "Failed waiting for image fence." );
+      }
+    }
+    mImagesInFlight[imageIndex] = frame.inFlight;
+    timings.imageWaitMs         = utils::elapsedMs( start );
+
+    // Compute is submitted first, the graphics submission waits on whatever it released
+    if ( mSimulating ) {
+      simulate( mFrameNumber > 0 ? std::chrono::duration<float>( frameStart - mLastFrameStart ).count() : 0.0f );
+    }
+
+    start = std::chrono::steady_clock::now();
+    frame.commandBuffer.reset();
+    recordDrawCommands( frame.commandBuffer, imageIndex );
+    timings.recordMs = utils::elapsedMs( start );
+
+    mFrameRing.endFrame();
+
+    start = std::chrono::steady_clock::now();
+    std::vector<vk::Semaphore>          waitSemaphores;
+    std::vector<vk::PipelineStageFlags> waitStages;
+    if ( !mSettings.headless ) {
+      waitSemaphores.push_back( frame.imageAvailable );
+      waitStages.push_back( vk::PipelineStageFlagBits::eColorAttachmentOutput );
+    }
+    if ( mSimulating && mCompute.semaphore() ) {
+      waitSemaphores.push_back( mCompute.semaphore() );
+      waitStages.push_back( mCompute.waitStages() );
+    }
+
+    vk::SubmitInfo submitInfo     = {};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers    = &frame.commandBuffer;
+    submitInfo.waitSemaphoreCount = static_cast<uint32_t>( waitSemaphores.size() );
+    submitInfo.pWaitSemaphores    = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask  = waitStages.data();
+    if ( !mSettings.headless ) {
+      submitInfo.signalSemaphoreCount = 1;
+      submitInfo.pSignalSemaphores    = &mVkSwapchainFrames[imageIndex].renderFinished;
+    }
 
-    mVkLayout     = output.layout;
-    mVkRenderPass = output.renderPass;
-    mVkPipeline   = output.pipeline;
+    mVkDevice.resetFences( frame.inFlight );
+    mVkGraphicsQueue.submit( submitInfo, frame.inFlight );
+
+    if ( !mSettings.headless ) {
+      vk::PresentInfoKHR presentInfo = {};
+      presentInfo.waitSemaphoreCount = 1;
+      presentInfo.pWaitSemaphores    = &mVkSwapchainFrames[imageIndex].renderFinished;
+      presentInfo.swapchainCount     = 1;
+      presentInfo.pSwapchains        = &mVkSwapchain;
+      presentInfo.pImageIndices      = &imageIndex;
+
+      vk::Result presented = vk::Result::eErrorOutOfDateKHR;
+      try {
+        presented = mVkPresentQueue.presentKHR( presentInfo );
+      } catch ( vk::OutOfDateKHRError& ) {
+      }
+      if ( presented != vk::Result::eSuccess ) {
+        mFramebufferResized = true;
+      }
+    }
+    timings.submitMs = utils::elapsedMs( start );
+
+    timings.frameMs = utils::elapsedMs( frameStart );
+    mFrameStats.record( timings );
+    // Frame time here is start to start, which includes the limiter and any blocking in acquire
+    if ( mFrameNumber > 0 ) {
+      mPacing.record( std::chrono::duration<double, std::milli>( frameStart - mLastFrameStart ).count(),
+                      utils::elapsedMs( acquireStart ) );
+    }
+    mLastFrameStart = frameStart;
+
+    mCurrentFrame = ( mCurrentFrame + 1 ) % mFramesInFlight;
+    mFrameNumber++;
+
+    if ( mFramebufferResized ) {
+      recreateSwapchain();
+    }
   }
 
   void initWindow() {
@@ -107,19 +867,119 @@ class Application {
     }
     // No default rendering client, we will hook vulkan later...
     glfwWindowHint( GLFW_CLIENT_API, GLFW_NO_API );
-    // Support resizing in swapchain before allowing here...
-    glfwWindowHint( GLFW_RESIZABLE, GLFW_FALSE );
+    glfwWindowHint( GLFW_RESIZABLE, GLFW_TRUE );
 
     mWindow = glfwCreateWindow( mWidth, mHeight, "Vulkan Application", nullptr, nullptr );
     if ( !mWindow ) {
       throw std::runtime_error( "glfw: Could not create window." );
     }
+
+    // Out of date is not reported reliably on every platform, so resizes are tracked as well
+    glfwSetWindowUserPointer( mWindow, this );
+    glfwSetFramebufferSizeCallback( mWindow, []( GLFWwindow* window, int, int ) {
+      static_cast<Application*>( glfwGetWindowUserPointer( window ) )->mFramebufferResized = true;
+    } );
+  }
+
+  // Replaces the swapchain without waiting for the device. Only the image views and framebuffers (none with dynamic
+  // rendering) are rebuilt, the render pass and pipelines stay valid because the format does not change and
+  // viewport/scissor are dynamic.
+  void recreateSwapchain() {
+    // A minimized window has no extent to render to, wait until it comes back
+    int width = 0, height = 0;
+    glfwGetFramebufferSize( mWindow, &width, &height );
+    while ( ( width == 0 || height == 0 ) && !glfwWindowShouldClose( mWindow ) ) {
+      glfwWaitEvents();
+      glfwGetFramebufferSize( mWindow, &width, &height );
+    }
+    mFramebufferResized = false;
+
+    std::chrono::steady_clock::time_point start  = std::chrono::steady_clock::now();
+    utils::SwapchainBundle                bundle = utils::vkCreateSwapchain(
+        mVkDevice, mVkPhysicalDevice, mVkSurface, mQueueFamilies, static_cast<uint32_t>( width ),
+        static_cast<uint32_t>( height ), mVkSwapchain, mSettings.presentPolicy );
+    if ( bundle.format != mVkSwapchainFormat ) {
+      throw std::runtime_error( "Swapchain format changed, the render pass is no longer compatible." );
+    }
+
+    // Frames still in flight reference the old swapchain's framebuffers and semaphores, they go once those frames
+    // finished
+    for ( utils::SwapchainFrame& frame : mVkSwapchainFrames ) {
+      if ( mSettings.renderGraph ) {
+        mRenderGraph.releaseImportedView( frame.imageView, mDeletionQueue );
+      }
+      mDeletionQueue.retire( frame.framebuffer );
+      mDeletionQueue.retire( frame.imageView );
+      mDeletionQueue.retire( frame.renderFinished );
+    }
+    mDeletionQueue.retire( mVkSwapchain );
+
+    mVkSwapchain       = bundle.swapchain;
+    mVkSwapchainFrames = bundle.frames;
+    mVkSwapchainExtent = bundle.extent;
+    if ( mVkRenderPass ) {
+      utils::makeFramebuffers( mVkDevice, mVkRenderPass, mVkSwapchainExtent, mVkSwapchainFrames );
+    }
+    mImagesInFlight.assign( mVkSwapchainFrames.size(), vk::Fence( nullptr ) );
+
+    VFS_LOG_INFO << "Swapchain recreated at " << mVkSwapchainExtent.width << "x" << mVkSwapchainExtent.height << " in "
+                 << utils::elapsedMs( start ) << " ms";
+  }
+
+  // Textures stream in over the first frames, their views go into the bindless set when there is one
+  void createTextures( bool anisotropy ) {
+    mSamplers.create( mVkDevice, mCapabilities, anisotropy );
+    mTextures.create( mVkDevice, mCapabilities, mAllocator, mTransfer, mDeletionQueue,
+                      static_cast<vk::DeviceSize>( mSettings.textureBudgetMb ) << 20 );
+    for ( const std::string& list : mSettings.textures ) {
+      std::vector<std::string> candidates;
+      std::stringstream        stream( list );
+      std::string              candidate;
+      while ( std::getline( stream, candidate, ',' ) ) {
+        candidates.push_back( candidate );
+      }
+      mTextureHandles.push_back( mTextures.load( candidates ) );
+    }
+    mTextureSlots.assign( mTextureHandles.size(), UINT32_MAX );
+    mTextureViews.assign( mTextureHandles.size(), vk::ImageView( nullptr ) );
+  }
+
+  // A promoted texture has a new view, its slot is replaced and the old one released once no frame reads it
+  void bindTextures() {
+    if ( !mBindless.enabled() ) {
+      return;
+    }
+    vk::Sampler sampler = mSamplers.get( utils::SamplerDescription() );
+    for ( size_t i = 0; i < mTextureHandles.size(); i++ ) {
+      vk::ImageView view = mTextures.view( mTextureHandles[i] );
+      if ( view == mTextureViews[i] ) {
+        continue;
+      }
+      if ( mTextureSlots[i] != UINT32_MAX ) {
+        mBindless.removeTexture( mTextureSlots[i] );
+      }
+      mTextureSlots[i] = mBindless.addTexture( view, sampler );
+      mTextureViews[i] = view;
+    }
+  }
+
+  void destroySwapchainResources( vk::SwapchainKHR swapchain, std::vector<utils::SwapchainFrame>& frames ) {
+    for ( utils::SwapchainFrame& frame : frames ) {
+      mVkDevice.destroyFramebuffer( frame.framebuffer );
+      mVkDevice.destroyImageView( frame.imageView );
+      mVkDevice.destroySemaphore( frame.renderFinished );
+    }
+    frames.clear();
+    mVkDevice.destroySwapchainKHR( swapchain );
   }
 
   private:
-  uint32_t    mWidth { 800 };
-  uint32_t    mHeight { 600 };
-  GLFWwindow* mWindow { nullptr };
+  ApplicationSettings    mSettings;
+  utils::StartupTimeline mStartup; // Starts with the application, phases are marked as initialization goes
+  uint32_t               mWidth { 800 };
+  uint32_t               mHeight { 600 };
+  GLFWwindow*            mWindow { nullptr };
+  bool                   mFramebufferResized { false };
 
   // Vulkan vars
   // Instance related vars
@@ -128,23 +988,152 @@ class Application {
   vk::DispatchLoaderDynamic  mVkDldi;
   vk::SurfaceKHR             mVkSurface;
   // Device related vars
-  vk::PhysicalDevice mVkPhysicalDevice { nullptr };
-  vk::Device         mVkDevice { nullptr };
-  vk::Queue          mVkGraphicsQueue { nullptr };
-  vk::Queue          mVkPresentQueue { nullptr };
-  // Swapchain related vars
+  vk::PhysicalDevice        mVkPhysicalDevice { nullptr };
+  utils::DeviceCapabilities mCapabilities; // Queried once, subsystems read the device from it
+  utils::QueueFamilyIndices mQueueFamilies;
+  vk::Device                mVkDevice { nullptr };
+  vk::Queue                 mVkGraphicsQueue { nullptr };
+  vk::Queue                 mVkPresentQueue { nullptr };
+  // Memory related vars
+  utils::DeviceAllocator mAllocator;
+  utils::TransferQueue   mTransfer;
+  // Geometry related vars
+  utils::MeshBuffers mMesh;
+  bool               mUseMesh { false };
+  // Swapchain related vars (offscreen targets fill the same frames when headless)
   vk::SwapchainKHR                   mVkSwapchain;
   std::vector<utils::SwapchainFrame> mVkSwapchainFrames;
   vk::Format                         mVkSwapchainFormat;
   vk::Extent2D                       mVkSwapchainExtent;
+  utils::OffscreenBundle             mOffscreen;
   // Pipeline related vars
-  vk::PipelineLayout mVkLayout;
-  vk::RenderPass     mVkRenderPass;
-  vk::Pipeline       mVkPipeline;
+  vk::RenderPass                     mVkRenderPass; // Null with dynamic rendering
+  utils::DynamicRendering            mDynamicRendering;
+  vk::Pipeline                       mVkPipeline;
+  vk::PipelineLayout                 mVkPipelineLayout;
+  utils::PipelineCache               mPipelineCache;
+  utils::ShaderModuleRegistry        mShaderModules;
+  utils::PipelineBuildService        mPipelineBuilder;
+  utils::PipelineVariants            mPipelineVariants;
+  std::vector<utils::PipelineHandle> mPipelineHandles;          // Owned by mPipelineVariants
+  bool                               mPipelineFailed { false }; // The initial build failed, its handle is not polled
+  utils::GraphicsPipelineInBundle    mPipelineSpecification;
+  utils::ShaderWatcher               mShaderWatcher;
+  utils::PipelineHandle              mPipelineRebuild;   // Takes over from mVkPipeline once it is ready
+  std::vector<utils::PipelineHandle> mReplacedPipelines; // Invalidated by a reload, retired when the rebuild swaps in
+  // Descriptor related vars (set 0 is the frame ring, set 1 the bindless set when enabled)
+  static constexpr uint32_t    kFrameRingSet = 0;
+  static constexpr uint32_t    kBindlessSet  = 1;
+  utils::DescriptorLayoutCache mDescriptorLayouts;
+  utils::DescriptorAllocator   mDescriptors;
+  utils::BindlessDescriptors   mBindless;
+  utils::FrameRing             mFrameRing;
+  // Texture related vars
+  utils::SamplerCache               mSamplers;
+  utils::TextureStreamer            mTextures;
+  std::vector<utils::TextureHandle> mTextureHandles;
+  std::vector<uint32_t>             mTextureSlots; // Bindless slot per texture, UINT32_MAX until it is ready
+  std::vector<vk::ImageView>        mTextureViews; // View the slot was written with
+  // Compute related vars
+  struct SimulationStep {
+    float    deltaTime;
+    uint32_t reset;
+  };
+  utils::AsyncCompute                  mCompute;
+  utils::ComputePipelineOutBundle      mSimulation;
+  vk::DescriptorSetLayout              mSimulationSetLayout;
+  uint32_t                             mSimulationGroupSize { 64 };
+  utils::BufferAllocation              mParticleState;
+  std::vector<utils::BufferAllocation> mParticlePositions; // One per frame in flight
+  bool                                 mSimulating { false };
+  // Render graph related vars
+  utils::RenderGraph         mRenderGraph;
+  utils::RenderGraphResource mBackbuffer { 0 };
+  // Frame related vars
+  vk::CommandPool                   mVkCommandPool;
+  uint32_t                          mFramesInFlight { 0 };
+  uint32_t                          mCurrentFrame { 0 };
+  uint64_t                          mFrameNumber { 0 };
+  std::vector<utils::FrameInFlight> mFrames;
+  std::vector<vk::Fence>            mImagesInFlight;
+  utils::DeletionQueue              mDeletionQueue; // Objects replaced while running, see recreateSwapchain
+  utils::ParallelRecorder           mRecorder;
+  utils::FrameStats                 mFrameStats;
+  utils::Profiler                   mProfiler;
+  // Pacing related vars
+  utils::FramePacingMonitor             mPacing;
+  utils::FrameLimiter                   mLimiter;
+  std::chrono::steady_clock::time_point mLastFrameStart;
 };
 
-int main() {
-  Application app;
+int main( int argc, char** argv ) {
+  ApplicationSettings settings;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( std::strcmp( argv[i], "--frames-in-flight" ) == 0 && i + 1 < argc ) {
+      settings.framesInFlight = static_cast<uint32_t>( std::stoul( argv[++i] ) );
+    } else if ( std::strcmp( argv[i], "--headless" ) == 0 ) {
+      settings.headless = true;
+    } else if ( std::strcmp( argv[i], "--draws" ) == 0 && i + 1 < argc ) {
+      settings.drawCount = static_cast<uint32_t>( std::stoul( argv[++i] ) );
+    } else if ( std::strcmp( argv[i], "--record-threads" ) == 0 && i + 1 < argc ) {
+      settings.recordThreads = static_cast<uint32_t>( std::stoul( argv[++i] ) );
+    } else if ( std::strcmp( argv[i], "--present" ) == 0 && i + 1 < argc ) {
+      std::string policy = argv[++i];
+      if ( policy == "low-latency" ) {
+        settings.presentPolicy = utils::PresentPolicy::eLowLatency;
+      } else if ( policy == "power-saving" ) {
+        settings.presentPolicy = utils::PresentPolicy::ePowerSaving;
+      } else if ( policy == "fifo-relaxed" ) {
+        settings.presentPolicy = utils::PresentPolicy::eFifoRelaxed;
+      } else {
+        VFS_LOG_ERROR << "Unknown present policy \"" << policy << "\"";
+        return 1;
+      }
+    } else if ( std::strcmp( argv[i], "--frame-cap" ) == 0 && i + 1 < argc ) {
+      settings.presentPolicy = utils::PresentPolicy::eFrameCap;
+      settings.frameCap      = std::stod( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--bindless" ) == 0 ) {
+      settings.bindless = true;
+    } else if ( std::strcmp( argv[i], "--render-graph" ) == 0 ) {
+      settings.renderGraph = true;
+    } else if ( std::strcmp( argv[i], "--dynamic-rendering" ) == 0 ) {
+      settings.dynamicRendering = true;
+    } else if ( std::strcmp( argv[i], "--particles" ) == 0 && i + 1 < argc ) {
+      settings.particles = static_cast<uint32_t>( std::stoul( argv[++i] ) );
+    } else if ( std::strcmp( argv[i], "--watch-shaders" ) == 0 && i + 1 < argc ) {
+      settings.watchShaders = argv[++i];
+    } else if ( std::strcmp( argv[i], "--texture" ) == 0 && i + 1 < argc ) {
+      settings.textures.push_back( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--texture-budget" ) == 0 && i + 1 < argc ) {
+      settings.textureBudgetMb = static_cast<uint32_t>( std::stoul( argv[++i] ) );
+    } else if ( std::strcmp( argv[i], "--trace" ) == 0 && i + 1 < argc ) {
+      settings.tracePath = argv[++i];
+    } else if ( std::strcmp( argv[i], "--split-streams" ) == 0 ) {
+      settings.vertexStreams = utils::VertexStreams::eSplit;
+    } else if ( std::strcmp( argv[i], "--no-validation" ) == 0 ) {
+      settings.validation = false;
+    } else if ( std::strcmp( argv[i], "--frames" ) == 0 && i + 1 < argc ) {
+      settings.frameCount = std::stoull( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--readback" ) == 0 && i + 1 < argc ) {
+      settings.readbackPath = argv[++i];
+    } else if ( std::strcmp( argv[i], "--device" ) == 0 && i + 1 < argc ) {
+      settings.device = utils::parseDeviceSelection( argv[++i] );
+    } else if ( std::strcmp( argv[i], "--pipeline-cache-dir" ) == 0 && i + 1 < argc ) {
+      settings.pipelineCacheDirectory = argv[++i];
+    } else if ( std::strcmp( argv[i], "--device-snapshot" ) == 0 ) {
+      settings.deviceSnapshot = true;
+    } else if ( std::strcmp( argv[i], "--shader-archive" ) == 0 && i + 1 < argc ) {
+      settings.shaderArchive = argv[++i];
+    } else if ( std::strcmp( argv[i], "--pack-shaders" ) == 0 && i + 2 < argc ) {
+      // vfs --pack-shaders out.pack shaders/vert.spv shaders/frag.spv ...
+      std::string              archivePath = argv[++i];
+      std::vector<std::string> files( argv + i + 1, argv + argc );
+      return utils::writeShaderArchive( archivePath, files ) ? 0 : 1;
+    }
+  }
+
+  Application app( settings );
+  app.run();
 
   return 0;
 }
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "transfer.h"
+#include "vertex.h"
+
+// Mesh stuff
+namespace utils {
+// Device local vertex streams and index buffer of a packed mesh. Usable once `ticket` completed on the transfer queue.
+struct MeshBuffers {
+  std::vector<BufferAllocation> vertexBuffers; // One per layout binding
+  BufferAllocation              indexBuffer;   // Null for meshes without indices, drawn non indexed
+  vk::IndexType                 indexType { vk::IndexType::eUint32 };
+  uint32_t                      indexCount { 0 };
+  uint32_t                      vertexCount { 0 };
+  MeshBounds                    bounds;
+  uint64_t                      ticket { 0 };
+};
+
+MeshBuffers createMeshBuffers( DeviceAllocator& allocator, TransferQueue& transfer, const PackedMesh& mesh ) {
+  MeshBuffers buffers;
+  buffers.indexType  = mesh.indexType;
+  buffers.indexCount  = mesh.indexCount;
+  buffers.vertexCount = mesh.vertexCount;
+  buffers.bounds      = mesh.bounds;
+
+  AllocationCreateInfo allocInfo = {};
+  allocInfo.usage                = MemoryUsage::eGpuOnly;
+
+  vk::BufferCreateInfo bufferInfo = {};
+  bufferInfo.sharingMode          = vk::SharingMode::eExclusive;
+
+  for ( const std::vector<uint8_t>& stream : mesh.streams ) {
+    bufferInfo.size  = stream.size();
+    bufferInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst;
+    buffers.vertexBuffers.push_back( allocator.createBuffer( bufferInfo, allocInfo ) );
+    buffers.ticket = transfer.uploadBuffer( buffers.vertexBuffers.back().buffer, 0, stream.data(), stream.size(),
+                                            vk::PipelineStageFlagBits::eVertexInput,
+                                            vk::AccessFlagBits::eVertexAttributeRead );
+  }
+
+  if ( mesh.indexCount == 0 ) {
+    return buffers;
+  }
+
+  bufferInfo.size     = mesh.indices.size();
+  bufferInfo.usage    = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst;
+  buffers.indexBuffer = allocator.createBuffer( bufferInfo, allocInfo );
+  buffers.ticket      = transfer.uploadBuffer( buffers.indexBuffer.buffer, 0, mesh.indices.data(), mesh.indices.size(),
+                                               vk::PipelineStageFlagBits::eVertexInput,
+                                               vk::AccessFlagBits::eIndexRead );
+  return buffers;
+}
+
+void destroyMeshBuffers( DeviceAllocator& allocator, MeshBuffers& buffers ) {
+  for ( BufferAllocation& vertexBuffer : buffers.vertexBuffers ) {
+    allocator.destroyBuffer( vertexBuffer );
+  }
+  buffers.vertexBuffers.clear();
+  allocator.destroyBuffer( buffers.indexBuffer );
+}
+
+void bindMesh( vk::CommandBuffer commandBuffer, const MeshBuffers& buffers ) {
+  std::vector<vk::Buffer>     vertexBuffers;
+  std::vector<vk::DeviceSize> offsets( buffers.vertexBuffers.size(), 0 );
+  for ( const BufferAllocation& vertexBuffer : buffers.vertexBuffers ) {
+    vertexBuffers.push_back( vertexBuffer.buffer );
+  }
+
+  commandBuffer.bindVertexBuffers( 0, vertexBuffers, offsets );
+  if ( buffers.indexBuffer.buffer ) {
+    commandBuffer.bindIndexBuffer( buffers.indexBuffer.buffer, 0, buffers.indexType );
+  }
+}
+
+// Draws a mesh bound with bindMesh(), indexed when it has an index buffer
+void drawBoundMesh( vk::CommandBuffer commandBuffer, const MeshBuffers& buffers ) {
+  if ( buffers.indexBuffer.buffer ) {
+    commandBuffer.drawIndexed( buffers.indexCount, 1, 0, 0, 0 );
+  } else {
+    commandBuffer.draw( buffers.vertexCount, 1, 0, 0 );
+  }
+}
+
+void drawMesh( vk::CommandBuffer commandBuffer, const MeshBuffers& buffers ) {
+  bindMesh( commandBuffer, buffers );
+  drawBoundMesh( commandBuffer, buffers );
+}
+} // namespace utils
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "allocator.h"
+#include "utils.h"
+#include <fstream>
+
+// Headless rendering stuff (device owned render targets instead of a swapchain)
+namespace utils {
+struct OffscreenBundle {
+  std::vector<SwapchainFrame>  frames;
+  std::vector<ImageAllocation> images;
+  vk::Format                   format;
+  vk::Extent2D                 extent;
+};
+
+OffscreenBundle vkCreateOffscreenTargets( vk::Device logicalDevice, DeviceAllocator& allocator, vk::Format format,
+                                          vk::Extent2D extent, uint32_t count ) {
+  OffscreenBundle bundle {};
+  bundle.format = format;
+  bundle.extent = extent;
+  bundle.frames.resize( count );
+  bundle.images.resize( count );
+
+  for ( uint32_t i = 0; i < count; i++ ) {
+    // Transfer source so the rendered pixels can be read back
+    vk::ImageCreateInfo imageInfo = {};
+    imageInfo.imageType           = vk::ImageType::e2D;
+    imageInfo.format              = format;
+    imageInfo.extent              = vk::Extent3D( extent.width, extent.height, 1 );
+    imageInfo.mipLevels           = 1;
+    imageInfo.arrayLayers         = 1;
+    imageInfo.samples             = vk::SampleCountFlagBits::e1;
+    imageInfo.tiling              = vk::ImageTiling::eOptimal;
+    imageInfo.usage       = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc;
+    imageInfo.sharingMode = vk::SharingMode::eExclusive;
+    imageInfo.initialLayout = vk::ImageLayout::eUndefined;
+
+    AllocationCreateInfo allocInfo = {};
+    allocInfo.usage                = MemoryUsage::eGpuOnly;
+    try {
+      bundle.images[i] = allocator.createImage( imageInfo, allocInfo );
+    } catch ( vk::SystemError err ) {
+      throw std::runtime_error( "Failed to create offscreen image." );
+    }
+    vk::Image image = bundle.images[i].image;
+
+    vk::ImageViewCreateInfo viewInfo         = {};
+    viewInfo.image                           = image;
+    viewInfo.viewType                        = vk::ImageViewType::e2D;
+    viewInfo.format                          = format;
+    viewInfo.subresourceRange.aspectMask     = vk::ImageAspectFlagBits::eColor;
+    viewInfo.subresourceRange.baseMipLevel   = 0;
+    viewInfo.subresourceRange.levelCount     = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount     = 1;
+
+    bundle.frames[i].image     = image;
+    bundle.frames[i].imageView = logicalDevice.createImageView( viewInfo );
+  }
+
+  return bundle;
+}
+
+void destroyOffscreenTargets( vk::Device device, DeviceAllocator& allocator, OffscreenBundle& bundle ) {
+  for ( size_t i = 0; i < bundle.frames.size(); i++ ) {
+    device.destroyFramebuffer( bundle.frames[i].framebuffer );
+    device.destroyImageView( bundle.frames[i].imageView );
+    allocator.destroyImage( bundle.images[i] );
+  }
+  bundle.frames.clear();
+  bundle.images.clear();
+}
+
+// Copies a color image (expected in eTransferSrcOptimal after its render pass) into host memory as tightly packed
+// 4 byte texels. Blocks until the copy finished, so only use it outside the frame loop.
+std::vector<uint8_t> readbackImage( vk::Device device, DeviceAllocator& allocator, vk::Queue queue,
+                                    vk::CommandPool commandPool, vk::Image image, vk::Extent2D extent ) {
+  vk::DeviceSize size = static_cast<vk::DeviceSize>( extent.width ) * extent.height * 4;
+
+  vk::BufferCreateInfo bufferInfo = {};
+  bufferInfo.size                 = size;
+  bufferInfo.usage                = vk::BufferUsageFlagBits::eTransferDst;
+  bufferInfo.sharingMode          = vk::SharingMode::eExclusive;
+
+  AllocationCreateInfo allocInfo = {};
+  allocInfo.usage                = MemoryUsage::eGpuToCpu;
+  BufferAllocation staging       = allocator.createBuffer( bufferInfo, allocInfo );
+  vk::Buffer       buffer        = staging.buffer;
+
+  vk::CommandBufferAllocateInfo commandInfo = {};
+  commandInfo.commandPool                   = commandPool;
+  commandInfo.level                         = vk::CommandBufferLevel::ePrimary;
+  commandInfo.commandBufferCount            = 1;
+  vk::CommandBuffer commandBuffer           = device.allocateCommandBuffers( commandInfo ).front();
+
+  vk::CommandBufferBeginInfo beginInfo = {};
+  beginInfo.flags                      = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+  commandBuffer.begin( beginInfo );
+
+  // Make the color attachment writes of the render pass visible to the copy
+  vk::ImageMemoryBarrier barrier          = {};
+  barrier.srcAccessMask                   = vk::AccessFlagBits::eColorAttachmentWrite;
+  barrier.dstAccessMask                   = vk::AccessFlagBits::eTransferRead;
+  barrier.oldLayout                       = vk::ImageLayout::eTransferSrcOptimal;
+  barrier.newLayout                       = vk::ImageLayout::eTransferSrcOptimal;
+  barrier.srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image                           = image;
+  barrier.subresourceRange.aspectMask     = vk::ImageAspectFlagBits::eColor;
+  barrier.subresourceRange.baseMipLevel   = 0;
+  barrier.subresourceRange.levelCount     = 1;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount     = 1;
+  commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                                 vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlags(), nullptr, nullptr,
+                                 barrier );
+
+  vk::BufferImageCopy region             = {};
+  region.bufferOffset                    = 0;
+  region.bufferRowLength                 = 0;
+  region.bufferImageHeight               = 0;
+  region.imageSubresource.aspectMask     = vk::ImageAspectFlagBits::eColor;
+  region.imageSubresource.mipLevel       = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount     = 1;
+  region.imageOffset                     = vk::Offset3D( 0, 0, 0 );
+  region.imageExtent                     = vk::Extent3D( extent.width, extent.height, 1 );
+  commandBuffer.copyImageToBuffer( image, vk::ImageLayout::eTransferSrcOptimal, buffer, region );
+
+  commandBuffer.end();
+
+  vk::SubmitInfo submitInfo     = {};
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers    = &commandBuffer;
+  vk::Fence fence               = device.createFence( vk::FenceCreateInfo() );
+  queue.submit( submitInfo, fence );
+  if ( device.waitForFences( fence, VK_TRUE, UINT64_MAX ) != vk::Result::eSuccess ) {
+    throw std::runtime_error( "Failed waiting for readback." );
+  }
+
+  std::vector<uint8_t> pixels( size );
+  allocator.invalidate( staging.allocation );
+  std::memcpy( pixels.data(), staging.allocation.mapped, size );
+
+  device.destroyFence( fence );
+  device.freeCommandBuffers( commandPool, commandBuffer );
+  allocator.destroyBuffer( staging );
+
+  return pixels;
+}
+
+void writePpm( const std::string& filename, const std::vector<uint8_t>& pixels, vk::Extent2D extent,
+               vk::Format format ) {
+  std::ofstream file( filename, std::ios::binary );
+  if ( !file.is_open() ) {
+    VFS_LOG_ERROR << "Failed to open \"" << filename << "\" for writing";
+    return;
+  }
+
+  bool swizzle = format == vk::Format::eB8G8R8A8Unorm || format == vk::Format::eB8G8R8A8Srgb;
+
+  file << "P6\n" << extent.width << " " << extent.height << "\n255\n";
+  std::vector<char> row( static_cast<size_t>( extent.width ) * 3 );
+  for ( uint32_t y = 0; y < extent.height; y++ ) {
+    const uint8_t* src = pixels.data() + static_cast<size_t>( y ) * extent.width * 4;
+    for ( uint32_t x = 0; x < extent.width; x++ ) {
+      row[x * 3 + 0] = static_cast<char>( src[x * 4 + ( swizzle ? 2 : 0 )] );
+      row[x * 3 + 1] = static_cast<char>( src[x * 4 + 1] );
+      row[x * 3 + 2] = static_cast<char>( src[x * 4 + ( swizzle ? 0 : 2 )] );
+    }
+    file.write( row.data(), row.size() );
+  }
+}
+} // namespace utils
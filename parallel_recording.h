@@ -0,0 +1,149 @@
+#pragma once
+
+#include "logger.h"
+#include "thread_pool.h"
+#include <memory>
+
+// Parallel recording stuff
+namespace utils {
+// Records one render pass from several threads. Every worker lane owns a command pool per frame in flight, so lanes
+// never share a pool and a frame's pools are reset in one call once its fence signaled instead of freeing buffers.
+// Secondary buffers are executed in lane order, the result does not depend on which thread finished first.
+class ParallelRecorder {
+  public:
+  ParallelRecorder() = default;
+  ParallelRecorder( const ParallelRecorder& )            = delete;
+  ParallelRecorder& operator=( const ParallelRecorder& ) = delete;
+
+  void create( vk::Device device, uint32_t queueFamilyIndex, uint32_t framesInFlight, uint32_t threadCount = 0 ) {
+    mDevice = device;
+    mPool   = std::make_unique<ThreadPool>( threadCount );
+    mFrames.resize( framesInFlight );
+
+    vk::CommandPoolCreateInfo poolInfo = {};
+    poolInfo.flags                     = vk::CommandPoolCreateFlagBits::eTransient;
+    poolInfo.queueFamilyIndex          = queueFamilyIndex;
+    for ( std::vector<Lane>& lanes : mFrames ) {
+      lanes.resize( mPool->size() );
+      for ( Lane& lane : lanes ) {
+        lane.pool = mDevice.createCommandPool( poolInfo );
+      }
+    }
+    VFS_LOG_INFO << "Recording on " << mPool->size() << " threads";
+  }
+
+  void destroy() {
+    mPool.reset();
+    for ( std::vector<Lane>& lanes : mFrames ) {
+      for ( Lane& lane : lanes ) {
+        mDevice.destroyCommandPool( lane.pool ); // Frees its command buffers too
+      }
+    }
+    mFrames.clear();
+  }
+
+  uint32_t threadCount() const {
+    return mPool ? mPool->size() : 0;
+  }
+
+  // Recycles every secondary buffer of `frame`, call after its fence signaled and before recording into it again
+  void beginFrame( uint32_t frame ) {
+    mFrame = frame;
+    for ( Lane& lane : mFrames[mFrame] ) {
+      mDevice.resetCommandPool( lane.pool );
+      lane.used = 0;
+    }
+  }
+
+  // Splits `itemCount` items into contiguous ranges, calls `record( secondary, begin, end )` for each range on a
+  // worker and executes the results in range order into `primary`. The render pass has to be begun with
+  // vk::SubpassContents::eSecondaryCommandBuffers, and every range has to bind its own pipeline and state.
+  template <typename RecordFn>
+  void record( vk::CommandBuffer primary, vk::RenderPass renderPass, uint32_t subpass, vk::Framebuffer framebuffer,
+               uint32_t itemCount, uint32_t minItemsPerRange, RecordFn&& record ) {
+    vk::CommandBufferInheritanceInfo inheritance = {};
+    inheritance.renderPass                       = renderPass;
+    inheritance.subpass                          = subpass;
+    inheritance.framebuffer                      = framebuffer;
+    recordInherited( primary, inheritance, itemCount, minItemsPerRange, record );
+  }
+
+  // Same for dynamic rendering, begun with vk::RenderingFlagBits::eContentsSecondaryCommandBuffers
+  template <typename RecordFn>
+  void record( vk::CommandBuffer primary, const vk::CommandBufferInheritanceRenderingInfo& rendering,
+               uint32_t itemCount, uint32_t minItemsPerRange, RecordFn&& record ) {
+    vk::CommandBufferInheritanceInfo inheritance = {};
+    inheritance.pNext                            = &rendering;
+    recordInherited( primary, inheritance, itemCount, minItemsPerRange, record );
+  }
+
+  private:
+  template <typename RecordFn>
+  void recordInherited( vk::CommandBuffer primary, const vk::CommandBufferInheritanceInfo& inheritance,
+                        uint32_t itemCount, uint32_t minItemsPerRange, RecordFn& record ) {
+    std::vector<Lane>& lanes      = mFrames[mFrame];
+    uint32_t           rangeSize  = std::max( minItemsPerRange, 1u );
+    uint32_t           rangeCount = std::min<uint32_t>( static_cast<uint32_t>( lanes.size() ),
+                                                        ( itemCount + rangeSize - 1 ) / rangeSize );
+    if ( rangeCount == 0 ) {
+      return;
+    }
+    // Spread the items evenly, which can leave fewer ranges than lanes (5 items on 4 lanes is 3 ranges of 2)
+    rangeSize  = ( itemCount + rangeCount - 1 ) / rangeCount;
+    rangeCount = ( itemCount + rangeSize - 1 ) / rangeSize;
+
+    std::vector<vk::CommandBuffer> secondaries( rangeCount );
+    std::vector<std::future<void>> recorded;
+    recorded.reserve( rangeCount );
+    for ( uint32_t i = 0; i < rangeCount; i++ ) {
+      uint32_t begin = i * rangeSize;
+      uint32_t end   = std::min( begin + rangeSize, itemCount );
+      recorded.push_back( mPool->submit( [this, &lanes, &secondaries, &inheritance, &record, i, begin, end]() {
+        vk::CommandBuffer secondary = nextBuffer( lanes[i] );
+
+        vk::CommandBufferBeginInfo beginInfo = {};
+        beginInfo.flags            = vk::CommandBufferUsageFlagBits::eRenderPassContinue;
+        beginInfo.flags           |= vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        beginInfo.pInheritanceInfo = &inheritance;
+        secondary.begin( beginInfo );
+        record( secondary, begin, end );
+        secondary.end();
+
+        secondaries[i] = secondary;
+      } ) );
+    }
+
+    // Every worker references locals of this function, so all of them have to finish before a failure can unwind
+    // it; get() then rethrows the first thing a worker threw
+    for ( std::future<void>& future : recorded ) {
+      future.wait();
+    }
+    for ( std::future<void>& future : recorded ) {
+      future.get();
+    }
+    primary.executeCommands( secondaries );
+  }
+
+  struct Lane {
+    vk::CommandPool                pool;
+    std::vector<vk::CommandBuffer> buffers; // Allocated once, reused after every pool reset
+    size_t                         used { 0 };
+  };
+
+  vk::CommandBuffer nextBuffer( Lane& lane ) {
+    if ( lane.used == lane.buffers.size() ) {
+      vk::CommandBufferAllocateInfo allocInfo = {};
+      allocInfo.commandPool                   = lane.pool;
+      allocInfo.level                         = vk::CommandBufferLevel::eSecondary;
+      allocInfo.commandBufferCount            = 1;
+      lane.buffers.push_back( mDevice.allocateCommandBuffers( allocInfo ).front() );
+    }
+    return lane.buffers[lane.used++];
+  }
+
+  vk::Device                     mDevice;
+  std::unique_ptr<ThreadPool>    mPool;
+  std::vector<std::vector<Lane>> mFrames; // [frame in flight][lane]
+  uint32_t                       mFrame { 0 };
+};
+} // namespace utils
@@ -0,0 +1,408 @@
+#pragma once
+
+#include "logger.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Parallel pipeline build stuff
+namespace utils {
+// Result of a submitted build. The layout and render pass in the bundle are shared between pipelines and owned by
+// the service, only the pipeline itself belongs to the caller.
+struct PipelineHandle {
+  std::shared_future<GraphicsPipelineOutBundle> future;
+
+  bool ready() const {
+    return future.valid() && future.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+  }
+
+  GraphicsPipelineOutBundle get() const {
+    return future.get();
+  }
+};
+
+// Compiles batches of pipelines on a thread pool. Shader modules (by path, and by content through the registry),
+// pipeline layouts (by set layouts and push constant ranges) and render passes (by format and final layout, none for
+// dynamic rendering specifications) are created once and shared by every pipeline that agrees on them.
+class PipelineBuildService {
+  public:
+  PipelineBuildService() = default;
+  PipelineBuildService( const PipelineBuildService& )            = delete;
+  PipelineBuildService& operator=( const PipelineBuildService& ) = delete;
+
+  void create( vk::Device device, PipelineCache* pipelineCache, ShaderModuleRegistry* shaderModules,
+               uint32_t threadCount = 0 ) {
+    mDevice        = device;
+    mPipelineCache = pipelineCache;
+    mShaderModules = shaderModules;
+    mPool          = std::make_unique<ThreadPool>( threadCount );
+    VFS_LOG_INFO << "Pipeline build service running on " << mPool->size() << " threads";
+  }
+
+  // Waits for pending builds and destroys the shared objects, pipelines are left to their owners
+  void destroy() {
+    wait();
+    mPool.reset();
+
+    for ( std::pair<const std::string, std::shared_ptr<Shared<vk::ShaderModule>>>& module : mModules ) {
+      releaseModule( module.second->object );
+    }
+    for ( std::shared_ptr<Shared<vk::ShaderModule>>& module : mRetiredModules ) {
+      releaseModule( module->object );
+    }
+    for ( std::pair<const uint64_t, std::shared_ptr<Shared<vk::RenderPass>>>& renderPass : mRenderPasses ) {
+      mDevice.destroyRenderPass( renderPass.second->object );
+    }
+    for ( std::pair<const LayoutKey, std::shared_ptr<Shared<vk::PipelineLayout>>>& layout : mLayouts ) {
+      mDevice.destroyPipelineLayout( layout.second->object );
+    }
+    mModules.clear();
+    mRetiredModules.clear();
+    mRenderPasses.clear();
+    mLayouts.clear();
+  }
+
+  std::vector<PipelineHandle> submit( const std::vector<GraphicsPipelineInBundle>& batch ) {
+    std::vector<PipelineHandle> handles;
+    handles.reserve( batch.size() );
+    for ( const GraphicsPipelineInBundle& specification : batch ) {
+      handles.push_back( submit( specification, PipelineHandle() ) );
+    }
+    return handles;
+  }
+
+  // Builds a derivative of `parent`, which has to be built with allowDerivatives. The worker waits for the parent,
+  // which never blocks the pool as the parent was queued first.
+  PipelineHandle submit( const GraphicsPipelineInBundle& specification, const PipelineHandle& parent ) {
+    // Look up (or reserve) the shared objects now, they are created by whichever worker gets there first
+    std::shared_ptr<Shared<vk::ShaderModule>>   vertex     = lookup( mModules, specification.vertexFilepath );
+    std::shared_ptr<Shared<vk::ShaderModule>>   fragment   = lookup( mModules, specification.fragmentFilepath );
+    std::shared_ptr<Shared<vk::RenderPass>>     renderPass = nullptr;
+    std::shared_ptr<Shared<vk::PipelineLayout>> layout     = lookup( mLayouts, layoutKey( specification ) );
+    if ( !specification.dynamicRendering ) {
+      renderPass = lookup( mRenderPasses, renderPassKey( specification ) );
+    }
+
+    std::shared_future<GraphicsPipelineOutBundle> base = parent.future;
+    std::future<GraphicsPipelineOutBundle>        future =
+        mPool->submit( [this, specification, vertex, fragment, renderPass, layout, base]() {
+          GraphicsPipelineOutBundle output = {};
+
+          std::call_once( vertex->once, [&]() { vertex->object = acquireModule( specification.vertexFilepath ); } );
+          std::call_once( fragment->once,
+                          [&]() { fragment->object = acquireModule( specification.fragmentFilepath ); } );
+          std::call_once( layout->once, [&]() {
+            layout->object = makePipelineLayout( specification.device, specification.setLayouts,
+                                                 specification.pushConstantRanges );
+          } );
+          if ( renderPass ) {
+            std::call_once( renderPass->once, [&]() {
+              renderPass->object = makeRenderPass( specification.device, specification.swapchainImageFormat,
+                                                   specification.finalLayout );
+            } );
+            output.renderPass = renderPass->object;
+          }
+
+          GraphicsPipelineInBundle build = specification;
+          if ( base.valid() ) {
+            // Built without a parent if the parent failed, whether to a null pipeline or with an exception
+            try {
+              build.basePipeline = base.get().pipeline;
+            } catch ( const std::exception& ) {
+              build.basePipeline = nullptr; // The parent's own handle reports the failure
+            }
+          }
+
+          vk::PipelineCache cache = mPipelineCache ? mPipelineCache->threadCache() : vk::PipelineCache( nullptr );
+          output.layout           = layout->object;
+          output.pipeline         = compileGraphicsPipeline( build, vertex->object, fragment->object, layout->object,
+                                                             output.renderPass, cache );
+          return output;
+        } );
+
+    PipelineHandle handle;
+    handle.future = future.share();
+
+    // Only unfinished builds are kept for wait(), finished ones would hold on to their results for the whole session
+    std::lock_guard<std::mutex> lock( mMutex );
+    mPending.erase( std::remove_if( mPending.begin(), mPending.end(),
+                                    []( const std::shared_future<GraphicsPipelineOutBundle>& pending ) {
+                                      return pending.wait_for( std::chrono::seconds( 0 ) )
+                                             == std::future_status::ready;
+                                    } ),
+                    mPending.end() );
+    mPending.push_back( handle.future );
+    return handle;
+  }
+
+  // Render pass every pipeline with this format and final layout is compatible with, created on the spot if needed
+  vk::RenderPass renderPass( vk::Format format, vk::ImageLayout finalLayout ) {
+    GraphicsPipelineInBundle specification = {};
+    specification.swapchainImageFormat     = format;
+    specification.finalLayout              = finalLayout;
+
+    std::shared_ptr<Shared<vk::RenderPass>> renderPass = lookup( mRenderPasses, renderPassKey( specification ) );
+    std::call_once( renderPass->once,
+                    [&]() { renderPass->object = makeRenderPass( mDevice, format, finalLayout ); } );
+    return renderPass->object;
+  }
+
+  // Makes later submits load the SPIR-V at `path` again, for files rewritten at runtime. The previous module is
+  // released once no queued build uses it anymore.
+  void reloadShader( const std::string& path ) {
+    if ( mShaderModules ) {
+      mShaderModules->invalidate( path );
+    }
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    auto                        module = mModules.find( path );
+    if ( module != mModules.end() ) {
+      mRetiredModules.push_back( module->second );
+      mModules.erase( module );
+    }
+    // Builds hold a reference until their task is gone, so the service's is the last one once they are done
+    for ( size_t i = 0; i < mRetiredModules.size(); ) {
+      if ( mRetiredModules[i].use_count() == 1 ) {
+        releaseModule( mRetiredModules[i]->object );
+        mRetiredModules.erase( mRetiredModules.begin() + i );
+      } else {
+        i++;
+      }
+    }
+  }
+
+  void wait() {
+    std::vector<std::shared_future<GraphicsPipelineOutBundle>> pending;
+    {
+      std::lock_guard<std::mutex> lock( mMutex );
+      pending.swap( mPending );
+    }
+    for ( std::shared_future<GraphicsPipelineOutBundle>& future : pending ) {
+      future.wait();
+    }
+  }
+
+  private:
+  vk::ShaderModule acquireModule( const std::string& path ) {
+    return mShaderModules ? mShaderModules->acquire( path ) : createModule( path, mDevice );
+  }
+
+  void releaseModule( vk::ShaderModule module ) {
+    if ( mShaderModules ) {
+      mShaderModules->release( module );
+    } else {
+      mDevice.destroyShaderModule( module );
+    }
+  }
+
+  template <typename T>
+  struct Shared {
+    std::once_flag once;
+    T              object;
+  };
+
+  template <typename Key, typename T>
+  std::shared_ptr<Shared<T>> lookup( std::map<Key, std::shared_ptr<Shared<T>>>& objects, const Key& key ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    std::shared_ptr<Shared<T>>& entry = objects[key];
+    if ( !entry ) {
+      entry = std::make_shared<Shared<T>>();
+    }
+    return entry;
+  }
+
+  static uint64_t renderPassKey( const GraphicsPipelineInBundle& specification ) {
+    return ( static_cast<uint64_t>( specification.swapchainImageFormat ) << 32 )
+         | static_cast<uint32_t>( specification.finalLayout );
+  }
+
+  // Set layouts in set order, then every push constant range as stage flags, offset and size
+  using LayoutKey = std::pair<std::vector<VkDescriptorSetLayout>, std::vector<uint32_t>>;
+
+  static LayoutKey layoutKey( const GraphicsPipelineInBundle& specification ) {
+    LayoutKey key;
+    for ( vk::DescriptorSetLayout setLayout : specification.setLayouts ) {
+      key.first.push_back( setLayout );
+    }
+    for ( const vk::PushConstantRange& range : specification.pushConstantRanges ) {
+      key.second.insert( key.second.end(), { static_cast<uint32_t>( range.stageFlags ), range.offset, range.size } );
+    }
+    return key;
+  }
+
+  vk::Device                                                       mDevice;
+  PipelineCache*                                                   mPipelineCache { nullptr };
+  ShaderModuleRegistry*                                            mShaderModules { nullptr };
+  std::unique_ptr<ThreadPool>                                      mPool;
+  std::mutex                                                       mMutex;
+  std::map<std::string, std::shared_ptr<Shared<vk::ShaderModule>>> mModules;
+  std::vector<std::shared_ptr<Shared<vk::ShaderModule>>>           mRetiredModules; // Replaced by reloadShader
+  std::map<uint64_t, std::shared_ptr<Shared<vk::RenderPass>>>      mRenderPasses;
+  std::map<LayoutKey, std::shared_ptr<Shared<vk::PipelineLayout>>> mLayouts;
+  std::vector<std::shared_future<GraphicsPipelineOutBundle>>       mPending;
+};
+} // namespace utils
+
+// Pipeline variant stuff
+namespace utils {
+// Identifies a pipeline by everything that goes into it, so equal keys mean interchangeable pipelines
+struct PipelineStateKey {
+  uint64_t shaders { 0 };        // Vertex and fragment shader paths
+  uint64_t interface { 0 };      // Vertex layout, set layouts and push constant ranges
+  uint64_t specialization { 0 }; // Constant ids, sizes and values
+  uint64_t target { 0 };         // Color format and final layout
+  uint64_t state { 0 };          // PipelineState::pack(), dynamic rendering in bit 32
+
+  bool operator==( const PipelineStateKey& other ) const {
+    return shaders == other.shaders && interface == other.interface && specialization == other.specialization
+           && target == other.target && state == other.state;
+  }
+
+  // Pipelines of one family differ only in specialization and fixed function state, one of them is the parent of
+  // all others
+  PipelineStateKey family() const {
+    PipelineStateKey key = *this;
+    key.specialization   = 0;
+    key.state            = state & ( 1ull << 32 );
+    return key;
+  }
+};
+
+struct PipelineStateKeyHash {
+  size_t operator()( const PipelineStateKey& key ) const {
+    return static_cast<size_t>( hashBytes( &key, sizeof( PipelineStateKey ) ) );
+  }
+};
+
+PipelineStateKey pipelineStateKey( const GraphicsPipelineInBundle& specification ) {
+  PipelineStateKey key;
+  key.shaders = hashBytes( specification.vertexFilepath.data(), specification.vertexFilepath.size() );
+  key.shaders = hashBytes( specification.fragmentFilepath.data(), specification.fragmentFilepath.size() + 1,
+                           key.shaders ); // Includes the terminator, so moving characters between paths changes it
+
+  const VertexLayout& vertexLayout = specification.vertexLayout;
+  key.interface = hashBytes( vertexLayout.bindings().data(),
+                             vertexLayout.bindings().size() * sizeof( vk::VertexInputBindingDescription ) );
+  key.interface = hashBytes( vertexLayout.attributes().data(),
+                             vertexLayout.attributes().size() * sizeof( vk::VertexInputAttributeDescription ),
+                             key.interface );
+  key.interface = hashBytes( specification.setLayouts.data(),
+                             specification.setLayouts.size() * sizeof( vk::DescriptorSetLayout ), key.interface );
+  key.interface = hashBytes( specification.pushConstantRanges.data(),
+                             specification.pushConstantRanges.size() * sizeof( vk::PushConstantRange ),
+                             key.interface );
+
+  key.specialization = specification.specialization.hash();
+  key.target         = ( static_cast<uint64_t>( specification.swapchainImageFormat ) << 32 )
+             | static_cast<uint32_t>( specification.finalLayout );
+  key.state          = specification.state.pack() | ( specification.dynamicRendering ? 1ull << 32 : 0 );
+  return key;
+}
+
+// Destroys the pipeline behind `handle`. A build that failed has nothing to destroy, its error is logged instead of
+// rethrown so one bad shader does not stop the remaining pipelines from being destroyed.
+void destroyPipeline( vk::Device device, const PipelineHandle& handle ) {
+  try {
+    device.destroyPipeline( handle.get().pipeline );
+  } catch ( const std::exception& error ) {
+    VFS_LOG_ERROR << "Pipeline build had failed: " << error.what();
+  }
+}
+
+// Returns the pipeline for a specification, building each distinct key once. The first pipeline of a family is
+// built with allowDerivatives and every later variant of the family derives from it. Owns every pipeline it built
+// that was not invalidated; layouts and render passes stay with the build service.
+class PipelineVariants {
+  public:
+  PipelineVariants() = default;
+  PipelineVariants( const PipelineVariants& )            = delete;
+  PipelineVariants& operator=( const PipelineVariants& ) = delete;
+
+  void create( vk::Device device, PipelineBuildService& builder ) {
+    mDevice  = device;
+    mBuilder = &builder;
+  }
+
+  // Waits for builds still running, the pipelines must no longer be in use
+  void destroy() {
+    mBuilder->wait();
+    for ( std::pair<const PipelineStateKey, Variant>& variant : mVariants ) {
+      destroyPipeline( mDevice, variant.second.handle );
+    }
+    mVariants.clear();
+    mParents.clear();
+  }
+
+  PipelineHandle get( const GraphicsPipelineInBundle& specification ) {
+    PipelineStateKey key = pipelineStateKey( specification );
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    auto                        found = mVariants.find( key );
+    if ( found != mVariants.end() ) {
+      mHits++;
+      return found->second.handle;
+    }
+
+    PipelineHandle handle;
+    auto           parent = mParents.find( key.family() );
+    if ( parent == mParents.end() ) {
+      GraphicsPipelineInBundle parentSpecification = specification;
+      parentSpecification.allowDerivatives         = true;
+      handle                                       = mBuilder->submit( parentSpecification, PipelineHandle() );
+      mParents[key.family()]                       = handle;
+    } else {
+      handle = mBuilder->submit( specification, parent->second );
+      mDerivatives++;
+    }
+    mVariants[key] = Variant { handle, specification.vertexFilepath, specification.fragmentFilepath };
+    return handle;
+  }
+
+  // Forgets every variant built from the shader at `path`, the next get() builds them again (call
+  // PipelineBuildService::reloadShader first). The pipelines are handed to the caller, which destroys them once no
+  // frame uses them anymore.
+  std::vector<PipelineHandle> invalidate( const std::string& path ) {
+    std::vector<PipelineHandle> invalidated;
+    std::lock_guard<std::mutex> lock( mMutex );
+    for ( auto variant = mVariants.begin(); variant != mVariants.end(); ) {
+      if ( variant->second.vertexFilepath == path || variant->second.fragmentFilepath == path ) {
+        invalidated.push_back( variant->second.handle );
+        mParents.erase( variant->first.family() ); // Families share their shaders, so the whole family goes
+        variant = mVariants.erase( variant );
+      } else {
+        ++variant;
+      }
+    }
+    return invalidated;
+  }
+
+  size_t size() const {
+    return mVariants.size();
+  }
+
+  void report() const {
+    VFS_LOG_INFO << "Pipeline variants: " << mVariants.size() << " built (" << mParents.size() << " parents, "
+                 << mDerivatives << " derivatives), " << mHits << " requests served from the table";
+  }
+
+  private:
+  struct Variant {
+    PipelineHandle handle;
+    std::string    vertexFilepath;
+    std::string    fragmentFilepath;
+  };
+
+  vk::Device                                                                 mDevice;
+  PipelineBuildService*                                                      mBuilder { nullptr };
+  std::mutex                                                                 mMutex;
+  std::unordered_map<PipelineStateKey, Variant, PipelineStateKeyHash>        mVariants;
+  std::unordered_map<PipelineStateKey, PipelineHandle, PipelineStateKeyHash> mParents; // By family
+  uint64_t                                                                   mHits { 0 };
+  uint64_t                                                                   mDerivatives { 0 };
+};
+} // namespace utils
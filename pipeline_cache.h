@@ -0,0 +1,250 @@
+#pragma once
+
+#include "capabilities.h"
+#include "logger.h"
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Pipeline cache stuff
+namespace utils {
+struct PipelineCacheStats {
+  std::atomic<uint64_t> hits { 0 };
+  std::atomic<uint64_t> misses { 0 };
+  std::atomic<uint64_t> unknown { 0 };   // Creation feedback not available on this device
+  std::atomic<uint64_t> compileNs { 0 }; // Time spent inside pipeline creation
+  double                loadMs { 0.0 };
+  double                saveMs { 0.0 };
+  size_t                loadedBytes { 0 };
+  size_t                savedBytes { 0 };
+};
+
+// True when pipeline creation can report whether the cache was hit (core in 1.3, extension before that)
+bool supportsPipelineCreationFeedback( const DeviceCapabilities& capabilities ) {
+  return capabilities.apiVersion() >= VK_API_VERSION_1_3
+         || capabilities.hasExtension( VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME );
+}
+
+// On disk VkPipelineCache. The blob is only handed to the driver when its header matches this device and driver,
+// pipelines created from worker threads go into per thread caches that are merged back before saving.
+class PipelineCache {
+  public:
+  PipelineCache() = default;
+  PipelineCache( const PipelineCache& ) = delete;
+  PipelineCache& operator=( const PipelineCache& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities, const std::string& directory,
+               bool creationFeedback ) {
+    mDevice           = device;
+    mProperties       = capabilities.properties;
+    mCreationFeedback = creationFeedback;
+
+    // Keyed by device, the header check below catches driver updates
+    char filename[64];
+    std::snprintf( filename, sizeof( filename ), "pipeline_cache_%04x_%04x.bin", mProperties.vendorID,
+                   mProperties.deviceID );
+    mPath = directory.empty() ? std::string( filename ) : directory + "/" + filename;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<char>                     blob  = loadBlob();
+
+    vk::PipelineCacheCreateInfo cacheInfo = {};
+    cacheInfo.initialDataSize             = blob.size();
+    cacheInfo.pInitialData                = blob.empty() ? nullptr : blob.data();
+    try {
+      mCache = mDevice.createPipelineCache( cacheInfo );
+    } catch ( vk::SystemError err ) {
+      // A blob the driver refuses is no worse than a cold start
+      VFS_LOG_WARN << "Pipeline cache rejected by the driver, starting empty.";
+      mCache = mDevice.createPipelineCache( vk::PipelineCacheCreateInfo() );
+      blob.clear();
+    }
+
+    mStats.loadedBytes = blob.size();
+    mStats.loadMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+  }
+
+  void destroy() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    for ( std::pair<const std::thread::id, vk::PipelineCache>& threadCache : mThreadCaches ) {
+      mDevice.destroyPipelineCache( threadCache.second );
+    }
+    mThreadCaches.clear();
+    mDevice.destroyPipelineCache( mCache );
+    mCache = nullptr;
+  }
+
+  vk::PipelineCache handle() const {
+    return mCache;
+  }
+
+  // Private cache for the calling thread so workers never contend on one cache, merged into the main one on save
+  vk::PipelineCache threadCache() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    std::thread::id             id = std::this_thread::get_id();
+
+    auto found = mThreadCaches.find( id );
+    if ( found != mThreadCaches.end() ) {
+      return found->second;
+    }
+
+    vk::PipelineCache cache = mDevice.createPipelineCache( vk::PipelineCacheCreateInfo() );
+    mThreadCaches[id]       = cache;
+    return cache;
+  }
+
+  vk::Pipeline createGraphicsPipeline( vk::GraphicsPipelineCreateInfo pipelineInfo,
+                                       vk::PipelineCache cache = nullptr ) {
+    vk::PipelineCreationFeedback              pipelineFeedback = {};
+    std::vector<vk::PipelineCreationFeedback> stageFeedback( pipelineInfo.stageCount );
+    vk::PipelineCreationFeedbackCreateInfo    feedbackInfo = {};
+    if ( mCreationFeedback ) {
+      feedbackInfo.pPipelineCreationFeedback          = &pipelineFeedback;
+      feedbackInfo.pipelineStageCreationFeedbackCount = pipelineInfo.stageCount;
+      feedbackInfo.pPipelineStageCreationFeedbacks    = stageFeedback.data();
+      feedbackInfo.pNext                              = pipelineInfo.pNext;
+      pipelineInfo.pNext                              = &feedbackInfo;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    vk::Pipeline pipeline = mDevice.createGraphicsPipeline( cache ? cache : mCache, pipelineInfo ).value;
+    mStats.compileNs += static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                   std::chrono::steady_clock::now() - start )
+                                                   .count() );
+
+    record( pipelineFeedback );
+    return pipeline;
+  }
+
+  vk::Pipeline createComputePipeline( vk::ComputePipelineCreateInfo pipelineInfo, vk::PipelineCache cache = nullptr ) {
+    vk::PipelineCreationFeedback           pipelineFeedback = {};
+    vk::PipelineCreationFeedback           stageFeedback    = {};
+    vk::PipelineCreationFeedbackCreateInfo feedbackInfo     = {};
+    if ( mCreationFeedback ) {
+      feedbackInfo.pPipelineCreationFeedback          = &pipelineFeedback;
+      feedbackInfo.pipelineStageCreationFeedbackCount = 1;
+      feedbackInfo.pPipelineStageCreationFeedbacks    = &stageFeedback;
+      feedbackInfo.pNext                              = pipelineInfo.pNext;
+      pipelineInfo.pNext                              = &feedbackInfo;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    vk::Pipeline pipeline = mDevice.createComputePipeline( cache ? cache : mCache, pipelineInfo ).value;
+    mStats.compileNs += static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                   std::chrono::steady_clock::now() - start )
+                                                   .count() );
+
+    record( pipelineFeedback );
+    return pipeline;
+  }
+
+  // Merges the per thread caches into the main cache and atomically replaces the file on disk
+  void save() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex>    lock( mMutex );
+      std::vector<vk::PipelineCache> sources;
+      for ( std::pair<const std::thread::id, vk::PipelineCache>& threadCache : mThreadCaches ) {
+        sources.push_back( threadCache.second );
+      }
+      if ( !sources.empty() ) {
+        mDevice.mergePipelineCaches( mCache, sources );
+      }
+    }
+
+    std::vector<uint8_t> data = mDevice.getPipelineCacheData( mCache );
+
+    // Write next to the target and rename over it, a crash mid write never leaves a truncated cache behind
+    std::string   tempPath = mPath + ".tmp";
+    std::ofstream file( tempPath, std::ios::binary | std::ios::trunc );
+    if ( !file.is_open() ) {
+      VFS_LOG_ERROR << "Failed to write pipeline cache \"" << tempPath << "\"";
+      return;
+    }
+    file.write( reinterpret_cast<const char*>( data.data() ), data.size() );
+    file.close();
+    if ( !file || std::rename( tempPath.c_str(), mPath.c_str() ) != 0 ) {
+      VFS_LOG_ERROR << "Failed to replace pipeline cache \"" << mPath << "\"";
+      std::remove( tempPath.c_str() );
+      return;
+    }
+
+    mStats.savedBytes = data.size();
+    mStats.saveMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+  }
+
+  const PipelineCacheStats& stats() const {
+    return mStats;
+  }
+
+  void report() const {
+    VFS_LOG_INFO << "Pipeline cache \"" << mPath << "\":";
+    VFS_LOG_INFO << "\tLoaded " << mStats.loadedBytes << " bytes in " << mStats.loadMs << " ms";
+    VFS_LOG_INFO << "\tSaved " << mStats.savedBytes << " bytes in " << mStats.saveMs << " ms";
+    VFS_LOG_INFO << "\tHits: " << mStats.hits << ", misses: " << mStats.misses << ", unknown: " << mStats.unknown;
+    VFS_LOG_INFO << "\tTime in pipeline creation: " << mStats.compileNs / 1e6 << " ms";
+  }
+
+  private:
+  std::vector<char> loadBlob() {
+    std::ifstream file( mPath, std::ios::ate | std::ios::binary );
+    if ( !file.is_open() ) {
+      return {};
+    }
+
+    std::vector<char> blob( static_cast<size_t>( file.tellg() ) );
+    file.seekg( 0 );
+    file.read( blob.data(), blob.size() );
+
+    if ( !validHeader( blob ) ) {
+      VFS_LOG_WARN << "Pipeline cache \"" << mPath << "\" belongs to another device or driver, ignoring it.";
+      return {};
+    }
+    return blob;
+  }
+
+  bool validHeader( const std::vector<char>& blob ) const {
+    // VkPipelineCacheHeaderVersionOne
+    struct Header {
+      uint32_t headerSize;
+      uint32_t headerVersion;
+      uint32_t vendorID;
+      uint32_t deviceID;
+      uint8_t  pipelineCacheUUID[VK_UUID_SIZE];
+    };
+
+    if ( blob.size() < sizeof( Header ) ) {
+      return false;
+    }
+
+    Header header;
+    std::memcpy( &header, blob.data(), sizeof( Header ) );
+    return header.headerSize >= sizeof( Header ) && header.headerSize <= blob.size()
+        && header.headerVersion == static_cast<uint32_t>( vk::PipelineCacheHeaderVersion::eOne )
+        && header.vendorID == mProperties.vendorID && header.deviceID == mProperties.deviceID
+        && std::memcmp( header.pipelineCacheUUID, mProperties.pipelineCacheUUID.data(), VK_UUID_SIZE ) == 0;
+  }
+
+  void record( const vk::PipelineCreationFeedback& feedback ) {
+    if ( !mCreationFeedback || !( feedback.flags & vk::PipelineCreationFeedbackFlagBits::eValid ) ) {
+      mStats.unknown++;
+    } else if ( feedback.flags & vk::PipelineCreationFeedbackFlagBits::eApplicationPipelineCacheHit ) {
+      mStats.hits++;
+    } else {
+      mStats.misses++;
+    }
+  }
+
+  vk::Device                                   mDevice;
+  vk::PhysicalDeviceProperties                 mProperties;
+  vk::PipelineCache                            mCache;
+  bool                                         mCreationFeedback { false };
+  std::string                                  mPath;
+  std::mutex                                   mMutex;
+  std::map<std::thread::id, vk::PipelineCache> mThreadCaches;
+  PipelineCacheStats                           mStats;
+};
+} // namespace utils
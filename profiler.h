@@ -0,0 +1,311 @@
+#pragma once
+
+#include "capabilities.h"
+#include "logger.h"
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+// Set by CMake (VFS_ENABLE_PROFILER, never for Release builds). Without it every scope macro expands to nothing and
+// Profiler is an empty shell, so instrumented code costs nothing.
+#ifndef VFS_PROFILER
+#define VFS_PROFILER 0
+#endif
+
+#define VFS_PROFILE_CONCAT_( a, b ) a##b
+#define VFS_PROFILE_CONCAT( a, b )  VFS_PROFILE_CONCAT_( a, b )
+
+#if VFS_PROFILER
+#define VFS_PROFILE_SCOPE( profiler, name ) \
+  utils::CpuScope VFS_PROFILE_CONCAT( vfsProfileScope, __LINE__ )( profiler, name )
+#define VFS_PROFILE_GPU_SCOPE( profiler, commandBuffer, name ) \
+  utils::GpuScope VFS_PROFILE_CONCAT( vfsProfileGpuScope, __LINE__ )( profiler, commandBuffer, name )
+#else
+#define VFS_PROFILE_SCOPE( profiler, name )                    ( (void)0 )
+#define VFS_PROFILE_GPU_SCOPE( profiler, commandBuffer, name ) ( (void)0 )
+#endif
+
+// Profiling stuff
+namespace utils {
+#if VFS_PROFILER
+// CPU scopes from any thread plus GPU scopes from timestamp queries. Every frame in flight has its own query pool,
+// which is read back when the slot comes around again (its fence was waited on), so reading never stalls. Scopes
+// are aggregated by name for report() and kept as events for writeChromeTrace().
+class Profiler {
+  public:
+  Profiler() = default;
+  Profiler( const Profiler& )            = delete;
+  Profiler& operator=( const Profiler& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities, uint32_t queueFamilyIndex,
+               uint32_t framesInFlight, uint32_t maxGpuScopes = 256 ) {
+    mDevice          = device;
+    mOrigin          = std::chrono::steady_clock::now();
+    mTimestampPeriod = capabilities.limits().timestampPeriod;
+    mMaxQueries      = maxGpuScopes * 2;
+
+    // A family without valid timestamp bits cannot time anything, CPU scopes still work
+    uint32_t validBits = capabilities.queueFamilies[queueFamilyIndex].timestampValidBits;
+    mTimestampMask     = validBits >= 64 ? ~0ull : ( 1ull << validBits ) - 1;
+    if ( validBits == 0 ) {
+      VFS_LOG_WARN << "Queue family " << queueFamilyIndex << " has no timestamps, GPU scopes are disabled";
+      return;
+    }
+
+    vk::QueryPoolCreateInfo poolInfo = {};
+    poolInfo.queryType               = vk::QueryType::eTimestamp;
+    poolInfo.queryCount              = mMaxQueries;
+    mSlots.resize( framesInFlight );
+    for ( Slot& slot : mSlots ) {
+      slot.pool = mDevice.createQueryPool( poolInfo );
+    }
+  }
+
+  void destroy() {
+    for ( Slot& slot : mSlots ) {
+      mDevice.destroyQueryPool( slot.pool );
+    }
+    mSlots.clear();
+  }
+
+  // Collects the GPU scopes the slot recorded last time around. Call after waiting for the slot's fence.
+  void beginFrame( uint32_t slot ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mSlot = slot;
+    if ( mSlots.empty() ) {
+      return;
+    }
+
+    Slot& current = mSlots[mSlot];
+    if ( current.queryCount > 0 && current.submitted ) {
+      vk::ResultValue<std::vector<uint64_t>> results = mDevice.getQueryPoolResults<uint64_t>(
+          current.pool, 0, current.queryCount, current.queryCount * sizeof( uint64_t ), sizeof( uint64_t ),
+          vk::QueryResultFlagBits::e64 );
+      if ( results.result == vk::Result::eSuccess ) {
+        collectGpuScopes( current, results.value );
+      }
+    }
+    current.queryCount = 0;
+    current.scopes.clear();
+    current.submitted  = false;
+  }
+
+  // Has to be the first thing recorded into the frame's primary command buffer
+  void resetQueries( vk::CommandBuffer commandBuffer ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    if ( mSlots.empty() ) {
+      return;
+    }
+    commandBuffer.resetQueryPool( mSlots[mSlot].pool, 0, mMaxQueries );
+    mSlots[mSlot].submitted = true;
+    mSlots[mSlot].cpuStart  = nowUs();
+  }
+
+  int32_t gpuBegin( vk::CommandBuffer commandBuffer, const char* name ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    if ( mSlots.empty() || mSlots[mSlot].queryCount + 2 > mMaxQueries ) {
+      return -1;
+    }
+
+    Slot&    slot  = mSlots[mSlot];
+    uint32_t query = slot.queryCount;
+    slot.queryCount += 2;
+    slot.scopes.push_back( { name, query } );
+    commandBuffer.writeTimestamp( vk::PipelineStageFlagBits::eTopOfPipe, slot.pool, query );
+    return static_cast<int32_t>( query );
+  }
+
+  void gpuEnd( vk::CommandBuffer commandBuffer, int32_t query ) {
+    if ( query < 0 ) {
+      return;
+    }
+    commandBuffer.writeTimestamp( vk::PipelineStageFlagBits::eBottomOfPipe, mSlots[mSlot].pool,
+                                  static_cast<uint32_t>( query ) + 1 );
+  }
+
+  double nowUs() const {
+    return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - mOrigin ).count();
+  }
+
+  void cpuScope( const char* name, double startUs, double endUs ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    Aggregate& aggregate = mCpuAggregates[name];
+    aggregate.add( ( endUs - startUs ) / 1000.0 );
+    addEvent( name, startUs, endUs - startUs, threadIndex( std::this_thread::get_id() ) );
+  }
+
+  // Average and maximum per scope since the last report
+  void report() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    printAggregates( "CPU scopes", mCpuAggregates );
+    printAggregates( "GPU scopes", mGpuAggregates );
+    mCpuAggregates.clear();
+    mGpuAggregates.clear();
+  }
+
+  // Chrome trace event format, opens in chrome://tracing and ui.perfetto.dev. The GPU track is placed on the CPU
+  // timeline by aligning each frame's first timestamp with the time its commands were recorded, so it is approximate.
+  bool writeChromeTrace( const std::string& path ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    std::ofstream               file( path, std::ios::trunc );
+    if ( !file.is_open() ) {
+      VFS_LOG_ERROR << "Failed to open \"" << path << "\" for writing";
+      return false;
+    }
+
+    file << "{\"traceEvents\":[\n";
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}}";
+    for ( const Event& event : mEvents ) {
+      file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+           << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs << "}";
+    }
+    file << "\n]}\n";
+    VFS_LOG_INFO << "Wrote " << mEvents.size() << " trace events to \"" << path << "\"";
+    return static_cast<bool>( file );
+  }
+
+  private:
+  struct GpuScopeRecord {
+    const char* name;
+    uint32_t    query;
+  };
+
+  struct Slot {
+    vk::QueryPool               pool;
+    uint32_t                    queryCount { 0 };
+    bool                        submitted { false };
+    double                      cpuStart { 0.0 };
+    std::vector<GpuScopeRecord> scopes;
+  };
+
+  struct Aggregate {
+    uint64_t count { 0 };
+    double   totalMs { 0.0 };
+    double   maxMs { 0.0 };
+
+    void add( double ms ) {
+      count++;
+      totalMs += ms;
+      maxMs = std::max( maxMs, ms );
+    }
+  };
+
+  struct Event {
+    std::string name;
+    double      startUs;
+    double      durationUs;
+    uint32_t    thread; // 0 is the GPU
+  };
+
+  void collectGpuScopes( const Slot& slot, const std::vector<uint64_t>& timestamps ) {
+    if ( slot.scopes.empty() ) {
+      return;
+    }
+
+    uint64_t origin = timestamps[slot.scopes.front().query] & mTimestampMask;
+    for ( const GpuScopeRecord& scope : slot.scopes ) {
+      uint64_t begin = timestamps[scope.query] & mTimestampMask;
+      uint64_t end   = timestamps[scope.query + 1] & mTimestampMask;
+      if ( end < begin ) {
+        continue; // Counter wrapped inside the scope
+      }
+
+      double durationUs = static_cast<double>( end - begin ) * mTimestampPeriod / 1000.0;
+      double offsetUs   = static_cast<double>( begin - std::min( begin, origin ) ) * mTimestampPeriod / 1000.0;
+      mGpuAggregates[scope.name].add( durationUs / 1000.0 );
+      addEvent( scope.name, slot.cpuStart + offsetUs, durationUs, 0 );
+    }
+  }
+
+  void addEvent( const char* name, double startUs, double durationUs, uint32_t thread ) {
+    if ( mEvents.size() < mMaxEvents ) {
+      mEvents.push_back( { name, startUs, durationUs, thread } );
+    }
+  }
+
+  uint32_t threadIndex( std::thread::id id ) {
+    auto found = mThreads.find( id );
+    if ( found != mThreads.end() ) {
+      return found->second;
+    }
+    uint32_t index = static_cast<uint32_t>( mThreads.size() ) + 1;
+    mThreads[id]   = index;
+    return index;
+  }
+
+  static void printAggregates( const char* title, const std::map<std::string, Aggregate>& aggregates ) {
+    if ( aggregates.empty() ) {
+      return;
+    }
+    VFS_LOG_INFO << title << " (count, avg / max ms):";
+    for ( const std::pair<const std::string, Aggregate>& entry : aggregates ) {
+      VFS_LOG_INFO << "\t" << entry.first << ": " << entry.second.count << ", "
+                   << entry.second.totalMs / static_cast<double>( entry.second.count ) << " / " << entry.second.maxMs;
+    }
+  }
+
+  vk::Device                            mDevice;
+  std::chrono::steady_clock::time_point mOrigin;
+  float                                 mTimestampPeriod { 1.0f };
+  uint64_t                              mTimestampMask { ~0ull };
+  uint32_t                              mMaxQueries { 0 };
+  std::vector<Slot>                     mSlots;
+  uint32_t                              mSlot { 0 };
+  std::mutex                            mMutex;
+  std::map<std::string, Aggregate>      mCpuAggregates;
+  std::map<std::string, Aggregate>      mGpuAggregates;
+  std::vector<Event>                    mEvents;
+  size_t                                mMaxEvents { 1u << 20 };
+  std::map<std::thread::id, uint32_t>   mThreads;
+};
+
+class CpuScope {
+  public:
+  CpuScope( Profiler& profiler, const char* name ) : mProfiler( profiler ), mName( name ), mStart( profiler.nowUs() ) {}
+  CpuScope( const CpuScope& )            = delete;
+  CpuScope& operator=( const CpuScope& ) = delete;
+
+  ~CpuScope() {
+    mProfiler.cpuScope( mName, mStart, mProfiler.nowUs() );
+  }
+
+  private:
+  Profiler&   mProfiler;
+  const char* mName;
+  double      mStart;
+};
+
+class GpuScope {
+  public:
+  GpuScope( Profiler& profiler, vk::CommandBuffer commandBuffer, const char* name )
+      : mProfiler( profiler ), mCommandBuffer( commandBuffer ), mQuery( profiler.gpuBegin( commandBuffer, name ) ) {}
+  GpuScope( const GpuScope& )            = delete;
+  GpuScope& operator=( const GpuScope& ) = delete;
+
+  ~GpuScope() {
+    mProfiler.gpuEnd( mCommandBuffer, mQuery );
+  }
+
+  private:
+  Profiler&         mProfiler;
+  vk::CommandBuffer mCommandBuffer;
+  int32_t           mQuery;
+};
+#else
+// Profiling compiled out, same interface without any work behind it
+class Profiler {
+  public:
+  void create( vk::Device, const DeviceCapabilities&, uint32_t, uint32_t, uint32_t = 256 ) {}
+  void destroy() {}
+  void beginFrame( uint32_t ) {}
+  void resetQueries( vk::CommandBuffer ) {}
+  void report() {}
+  bool writeChromeTrace( const std::string& ) {
+    VFS_LOG_WARN << "Built without VFS_PROFILER, no trace written";
+    return false;
+  }
+};
+#endif
+} // namespace utils
@@ -0,0 +1,1032 @@
+#pragma once
+
+#include "allocator.h"
+#include "deletion_queue.h"
+#include "logger.h"
+#include <functional>
+#include <map>
+#include <set>
+
+// Render graph stuff
+namespace utils {
+using RenderGraphResource = uint32_t;
+
+enum class PassType {
+  eGraphics,
+  eCompute,
+  eTransfer,
+};
+
+enum class ResourceUsage {
+  eColorAttachment,
+  eDepthAttachment,
+  eInputAttachment,
+  eSampled,
+  eStorageRead,
+  eStorageWrite,
+  eTransferSrc,
+  eTransferDst,
+  eUniform,     // Buffers only
+  eVertexInput, // Buffers only, vertex and index reads
+  eIndirect,    // Buffers only
+};
+
+struct UsageInfo {
+  vk::PipelineStageFlags stages;
+  vk::AccessFlags        access;
+  vk::ImageLayout        layout { vk::ImageLayout::eUndefined };
+  bool                   write { false };
+};
+
+UsageInfo usageInfo( ResourceUsage usage, PassType type ) {
+  vk::PipelineStageFlags shaderStages = type == PassType::eCompute
+                                          ? vk::PipelineStageFlags( vk::PipelineStageFlagBits::eComputeShader )
+                                          : vk::PipelineStageFlagBits::eVertexShader
+                                                | vk::PipelineStageFlagBits::eFragmentShader;
+  switch ( usage ) {
+  case ( ResourceUsage::eColorAttachment ):
+    return { vk::PipelineStageFlagBits::eColorAttachmentOutput,
+             vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
+             vk::ImageLayout::eColorAttachmentOptimal, true };
+  case ( ResourceUsage::eDepthAttachment ):
+    return { vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests,
+             vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+             vk::ImageLayout::eDepthStencilAttachmentOptimal, true };
+  case ( ResourceUsage::eInputAttachment ):
+    return { vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eInputAttachmentRead,
+             vk::ImageLayout::eShaderReadOnlyOptimal, false };
+  case ( ResourceUsage::eSampled ):
+    return { shaderStages, vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eShaderReadOnlyOptimal, false };
+  case ( ResourceUsage::eStorageRead ):
+    return { shaderStages, vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eGeneral, false };
+  case ( ResourceUsage::eStorageWrite ):
+    return { shaderStages, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+             vk::ImageLayout::eGeneral, true };
+  case ( ResourceUsage::eTransferSrc ):
+    return { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead,
+             vk::ImageLayout::eTransferSrcOptimal, false };
+  case ( ResourceUsage::eTransferDst ):
+    return { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite,
+             vk::ImageLayout::eTransferDstOptimal, true };
+  case ( ResourceUsage::eUniform ):
+    return { shaderStages, vk::AccessFlagBits::eUniformRead, vk::ImageLayout::eUndefined, false };
+  case ( ResourceUsage::eVertexInput ):
+    return { vk::PipelineStageFlagBits::eVertexInput,
+             vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead, vk::ImageLayout::eUndefined,
+             false };
+  case ( ResourceUsage::eIndirect ):
+    return { vk::PipelineStageFlagBits::eDrawIndirect, vk::AccessFlagBits::eIndirectCommandRead,
+             vk::ImageLayout::eUndefined, false };
+  }
+  return {};
+}
+
+bool isAttachmentUsage( ResourceUsage usage ) {
+  return usage == ResourceUsage::eColorAttachment || usage == ResourceUsage::eDepthAttachment
+         || usage == ResourceUsage::eInputAttachment;
+}
+
+vk::ImageAspectFlags aspectOf( vk::Format format ) {
+  switch ( format ) {
+  case ( vk::Format::eD16Unorm ):
+  case ( vk::Format::eX8D24UnormPack32 ):
+  case ( vk::Format::eD32Sfloat ):
+    return vk::ImageAspectFlagBits::eDepth;
+  case ( vk::Format::eD16UnormS8Uint ):
+  case ( vk::Format::eD24UnormS8Uint ):
+  case ( vk::Format::eD32SfloatS8Uint ):
+    return vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+  case ( vk::Format::eS8Uint ):
+    return vk::ImageAspectFlagBits::eStencil;
+  default:
+    return vk::ImageAspectFlagBits::eColor;
+  }
+}
+
+struct RenderGraphImageDesc {
+  vk::Format              format { vk::Format::eUndefined };
+  vk::Extent2D            extent;
+  vk::SampleCountFlagBits samples { vk::SampleCountFlagBits::e1 };
+};
+
+// What a pass callback needs to record: the render pass and subpass it runs in (for pipelines and secondary
+// inheritance) or nothing for compute and transfer passes.
+struct PassContext {
+  vk::RenderPass  renderPass;
+  uint32_t        subpass { 0 };
+  vk::Framebuffer framebuffer;
+  vk::Extent2D    extent;
+};
+
+// Passes declare what they read and write, compile() turns that into render passes and barriers:
+//   - passes whose results nobody uses are culled (imported images count as used, see sideEffects())
+//   - consecutive graphics passes on same sized attachments that only read each other's output as input
+//     attachments become subpasses of one render pass
+//   - barriers are only emitted for real hazards, read after read in the same layout needs none, and layout
+//     transitions go into the render pass where they can
+//   - transient images get their own memory per frame in flight; images whose lifetimes do not overlap share it,
+//     attachment only images are created transient and placed in lazily allocated memory when the device has it
+// The graph is compiled once; imported images are bound per frame with setImage() before execute().
+class RenderGraph {
+  public:
+  using RecordFn = std::function<void( vk::CommandBuffer, const PassContext& )>;
+
+  class PassBuilder {
+    public:
+    PassBuilder( RenderGraph* graph, uint32_t pass ) : mGraph( graph ), mPass( pass ) {}
+
+    PassBuilder& color( RenderGraphResource image, std::optional<vk::ClearColorValue> clear = std::nullopt ) {
+      return access( image, ResourceUsage::eColorAttachment, clear ? vk::ClearValue( *clear ) : vk::ClearValue(),
+                     clear.has_value() );
+    }
+
+    PassBuilder& depth( RenderGraphResource image, std::optional<vk::ClearDepthStencilValue> clear = std::nullopt ) {
+      return access( image, ResourceUsage::eDepthAttachment, clear ? vk::ClearValue( *clear ) : vk::ClearValue(),
+                     clear.has_value() );
+    }
+
+    PassBuilder& read( RenderGraphResource resource, ResourceUsage usage ) {
+      return access( resource, usage, vk::ClearValue(), false );
+    }
+
+    PassBuilder& write( RenderGraphResource resource, ResourceUsage usage ) {
+      return access( resource, usage, vk::ClearValue(), false );
+    }
+
+    // Never culled, for passes that have effects the graph does not see (readbacks, queries, ...)
+    PassBuilder& sideEffects() {
+      mGraph->mPasses[mPass].sideEffects = true;
+      return *this;
+    }
+
+    // The callback records into secondary command buffers (SubpassContents::eSecondaryCommandBuffers)
+    PassBuilder& secondary() {
+      mGraph->mPasses[mPass].secondary = true;
+      return *this;
+    }
+
+    PassBuilder& record( RecordFn fn ) {
+      mGraph->mPasses[mPass].record = std::move( fn );
+      return *this;
+    }
+
+    private:
+    PassBuilder& access( RenderGraphResource resource, ResourceUsage usage, vk::ClearValue clearValue, bool clear ) {
+      mGraph->mPasses[mPass].accesses.push_back( { resource, usage, clearValue, clear } );
+      return *this;
+    }
+
+    RenderGraph* mGraph;
+    uint32_t     mPass;
+  };
+
+  RenderGraph() = default;
+  RenderGraph( const RenderGraph& )            = delete;
+  RenderGraph& operator=( const RenderGraph& ) = delete;
+
+  void create( vk::Device device, DeviceAllocator& allocator, uint32_t framesInFlight ) {
+    mDevice         = device;
+    mAllocator      = &allocator;
+    mFramesInFlight = std::max( framesInFlight, 1u );
+  }
+
+  // Destroys everything compile() created and forgets its plan, the declared passes and resources stay, so compile()
+  // can run again (after transient extents changed, say)
+  void destroy() {
+    for ( std::pair<const FramebufferKey, vk::Framebuffer>& framebuffer : mFramebuffers ) {
+      mDevice.destroyFramebuffer( framebuffer.second );
+    }
+    mFramebuffers.clear();
+    for ( Step& step : mSteps ) {
+      mDevice.destroyRenderPass( step.renderPass );
+    }
+    mSteps.clear();
+    for ( Resource& resource : mResources ) {
+      for ( vk::ImageView view : resource.views ) {
+        mDevice.destroyImageView( view );
+      }
+      for ( vk::Image image : resource.images ) {
+        mDevice.destroyImage( image );
+      }
+      resource.views.clear();
+      resource.images.clear();
+      resource.usage      = vk::ImageUsageFlags();
+      resource.memorySize = 0;
+      resource.firstStep  = UINT32_MAX;
+      resource.lastStep   = 0;
+      resource.aliasOf    = -1;
+    }
+    for ( Allocation& memory : mMemory ) {
+      mAllocator->free( memory );
+    }
+    mMemory.clear();
+    mFinalBarriers.clear();
+    mFinalSrcStages = vk::PipelineStageFlags();
+  }
+
+  RenderGraphResource createImage( const std::string& name, const RenderGraphImageDesc& desc ) {
+    Resource resource;
+    resource.name    = name;
+    resource.isImage = true;
+    resource.desc    = desc;
+    mResources.push_back( resource );
+    return static_cast<RenderGraphResource>( mResources.size() - 1 );
+  }
+
+  // An image owned by someone else (a swapchain image, say). It is in `initialLayout` at the start of every frame,
+  // its last writer before the graph finished by `initialStages`, and it is left in `finalLayout`.
+  RenderGraphResource importImage( const std::string& name, const RenderGraphImageDesc& desc,
+                                   vk::ImageLayout initialLayout, vk::ImageLayout finalLayout,
+                                   vk::PipelineStageFlags initialStages
+                                   = vk::PipelineStageFlagBits::eColorAttachmentOutput ) {
+    RenderGraphResource handle = createImage( name, desc );
+    Resource&           image  = mResources[handle];
+    image.imported             = true;
+    image.initialLayout        = initialLayout;
+    image.finalLayout          = finalLayout;
+    image.initialStages        = initialStages;
+    return handle;
+  }
+
+  RenderGraphResource importBuffer( const std::string& name ) {
+    Resource resource;
+    resource.name     = name;
+    resource.imported = true;
+    mResources.push_back( resource );
+    return static_cast<RenderGraphResource>( mResources.size() - 1 );
+  }
+
+  // Framebuffers are cached by render pass and views for as long as their views live. Call before an imported view
+  // is destroyed (a recreated swapchain, say), the framebuffers using it go into `deletionQueue` as frames in flight
+  // may still reference them.
+  void releaseImportedView( vk::ImageView view, DeletionQueue& deletionQueue ) {
+    for ( auto it = mFramebuffers.begin(); it != mFramebuffers.end(); ) {
+      const std::vector<VkImageView>& views = it->first.second;
+      if ( std::find( views.begin(), views.end(), static_cast<VkImageView>( view ) ) != views.end() ) {
+        deletionQueue.retire( it->second );
+        it = mFramebuffers.erase( it );
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void setImage( RenderGraphResource handle, vk::Image image, vk::ImageView view, vk::Extent2D extent ) {
+    mResources[handle].image       = image;
+    mResources[handle].view        = view;
+    mResources[handle].desc.extent = extent;
+  }
+
+  void setBuffer( RenderGraphResource handle, vk::Buffer buffer ) {
+    mResources[handle].buffer = buffer;
+  }
+
+  PassBuilder addPass( const std::string& name, PassType type ) {
+    Pass pass;
+    pass.name = name;
+    pass.type = type;
+    mPasses.push_back( pass );
+    return PassBuilder( this, static_cast<uint32_t>( mPasses.size() - 1 ) );
+  }
+
+  void compile() {
+    destroy();
+    cull();
+    buildSteps();
+    createTransients();
+    planSynchronization();
+  }
+
+  // Render pass of the step `pass` ended up in, pipelines for the pass have to be compatible with it
+  vk::RenderPass renderPass( const std::string& pass ) const {
+    for ( const Step& step : mSteps ) {
+      for ( uint32_t index : step.passes ) {
+        if ( mPasses[index].name == pass ) {
+          return step.renderPass;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  void execute( vk::CommandBuffer commandBuffer, uint32_t frame ) {
+    for ( Step& step : mSteps ) {
+      recordBarriers( commandBuffer, step.srcStages, step.dstStages, step.barriers, frame );
+
+      PassContext context;
+      if ( !step.renderPass ) {
+        if ( mPasses[step.passes.front()].record ) {
+          mPasses[step.passes.front()].record( commandBuffer, context );
+        }
+        continue;
+      }
+
+      context.renderPass  = step.renderPass;
+      context.framebuffer = framebuffer( step, frame );
+      context.extent      = mResources[step.attachments.front()].desc.extent;
+
+      vk::RenderPassBeginInfo beginInfo = {};
+      beginInfo.renderPass              = step.renderPass;
+      beginInfo.framebuffer             = context.framebuffer;
+      beginInfo.renderArea.extent       = context.extent;
+      beginInfo.clearValueCount         = static_cast<uint32_t>( step.clearValues.size() );
+      beginInfo.pClearValues            = step.clearValues.data();
+      for ( uint32_t subpass = 0; subpass < step.passes.size(); subpass++ ) {
+        const Pass&         pass     = mPasses[step.passes[subpass]];
+        vk::SubpassContents contents = pass.secondary ? vk::SubpassContents::eSecondaryCommandBuffers
+                                                      : vk::SubpassContents::eInline;
+        if ( subpass == 0 ) {
+          commandBuffer.beginRenderPass( beginInfo, contents );
+        } else {
+          commandBuffer.nextSubpass( contents );
+        }
+        context.subpass = subpass;
+        if ( pass.record ) {
+          pass.record( commandBuffer, context );
+        }
+      }
+      commandBuffer.endRenderPass();
+    }
+    recordBarriers( commandBuffer, mFinalSrcStages, vk::PipelineStageFlagBits::eBottomOfPipe, mFinalBarriers, frame );
+  }
+
+  void report() const {
+    uint32_t culled = 0;
+    for ( const Pass& pass : mPasses ) {
+      culled += pass.culled ? 1 : 0;
+    }
+    size_t barriers = mFinalBarriers.size();
+    for ( const Step& step : mSteps ) {
+      barriers += step.barriers.size();
+    }
+
+    vk::DeviceSize transientBytes = 0, memoryBytes = 0;
+    for ( const Resource& resource : mResources ) {
+      transientBytes += resource.memorySize * resource.images.size();
+    }
+    for ( const Allocation& memory : mMemory ) {
+      memoryBytes += memory.size;
+    }
+
+    VFS_LOG_INFO << "Render graph: " << mPasses.size() - culled << " passes (" << culled << " culled) in "
+                 << mSteps.size() << " steps, " << barriers << " barriers per frame";
+    for ( const Step& step : mSteps ) {
+      std::string names;
+      for ( uint32_t pass : step.passes ) {
+        names += ( names.empty() ? "" : ", " ) + mPasses[pass].name;
+      }
+      VFS_LOG_INFO << "\t" << ( step.renderPass ? "Render pass: " : "Pass: " ) << names;
+    }
+    if ( transientBytes > 0 ) {
+      VFS_LOG_INFO << "\tTransient images: " << transientBytes / 1024 << " KiB in " << memoryBytes / 1024
+                   << " KiB of memory";
+    }
+  }
+
+  private:
+  struct Access {
+    RenderGraphResource resource;
+    ResourceUsage       usage;
+    vk::ClearValue      clearValue;
+    bool                clear { false };
+  };
+
+  struct Pass {
+    std::string         name;
+    PassType            type { PassType::eGraphics };
+    std::vector<Access> accesses;
+    bool                sideEffects { false };
+    bool                secondary { false };
+    bool                culled { false };
+    RecordFn            record;
+  };
+
+  struct Resource {
+    std::string            name;
+    bool                   isImage { false };
+    bool                   imported { false };
+    RenderGraphImageDesc   desc;
+    vk::ImageLayout        initialLayout { vk::ImageLayout::eUndefined };
+    vk::ImageLayout        finalLayout { vk::ImageLayout::eUndefined };
+    vk::PipelineStageFlags initialStages;
+    // Bound per frame for imported resources
+    vk::Image     image;
+    vk::ImageView view;
+    vk::Buffer    buffer;
+    // Created by compile() for transient images, one per frame in flight
+    vk::ImageUsageFlags        usage;
+    std::vector<vk::Image>     images;
+    std::vector<vk::ImageView> views;
+    vk::DeviceSize             memorySize { 0 };
+    uint32_t                   firstStep { UINT32_MAX };
+    uint32_t                   lastStep { 0 };
+    int32_t                    aliasOf { -1 }; // Resource that used the memory before this one
+  };
+
+  struct Barrier {
+    RenderGraphResource resource;
+    vk::ImageLayout     oldLayout;
+    vk::ImageLayout     newLayout;
+    vk::AccessFlags     srcAccess;
+    vk::AccessFlags     dstAccess;
+  };
+
+  struct Step {
+    std::vector<uint32_t>            passes; // Subpasses in order, a single pass for compute and transfer
+    bool                             graphics { false };
+    std::vector<RenderGraphResource> attachments;
+    std::vector<vk::ClearValue>      clearValues;
+    vk::RenderPass                   renderPass;
+    vk::PipelineStageFlags           srcStages;
+    vk::PipelineStageFlags           dstStages;
+    std::vector<Barrier>             barriers;
+  };
+
+  // Synchronization state of a resource while planning
+  struct State {
+    vk::ImageLayout        layout { vk::ImageLayout::eUndefined };
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags        access;
+    bool                   lastWrite { false };
+    bool                   valid { false }; // Holds contents somebody may still read
+  };
+
+  using FramebufferKey = std::pair<VkRenderPass, std::vector<VkImageView>>;
+
+  // Backwards from the imported images: a pass survives when something later needs what it writes
+  void cull() {
+    std::set<RenderGraphResource> needed;
+    for ( RenderGraphResource i = 0; i < mResources.size(); i++ ) {
+      if ( mResources[i].imported && mResources[i].isImage ) {
+        needed.insert( i );
+      }
+    }
+
+    for ( size_t i = mPasses.size(); i-- > 0; ) {
+      Pass& pass  = mPasses[i];
+      pass.culled = !pass.sideEffects;
+      for ( const Access& access : pass.accesses ) {
+        if ( usageInfo( access.usage, pass.type ).write && needed.count( access.resource ) ) {
+          pass.culled = false;
+        }
+      }
+      if ( pass.culled ) {
+        continue;
+      }
+
+      // Cleared attachments do not depend on earlier contents, attachments that are loaded do
+      for ( const Access& access : pass.accesses ) {
+        if ( access.clear ) {
+          needed.erase( access.resource );
+        }
+      }
+      for ( const Access& access : pass.accesses ) {
+        if ( !access.clear ) {
+          needed.insert( access.resource );
+        }
+      }
+    }
+  }
+
+  bool canMerge( const Step& step, const Pass& pass ) const {
+    if ( !step.graphics || pass.type != PassType::eGraphics ) {
+      return false;
+    }
+
+    const Resource& first         = mResources[step.attachments.front()];
+    bool            hasAttachment = false;
+    for ( const Access& access : pass.accesses ) {
+      bool inStepAsAttachment = std::find( step.attachments.begin(), step.attachments.end(), access.resource )
+                                != step.attachments.end();
+      if ( isAttachmentUsage( access.usage ) ) {
+        const Resource& image = mResources[access.resource];
+        if ( image.desc.extent != first.desc.extent || image.desc.samples != first.desc.samples ) {
+          return false;
+        }
+        if ( stepAccessesOutsideAttachments( step, access.resource ) ) {
+          return false;
+        }
+        hasAttachment = true;
+        continue;
+      }
+
+      // Anything else would need a barrier inside the render pass
+      if ( usageInfo( access.usage, pass.type ).write || inStepAsAttachment || stepWrites( step, access.resource ) ) {
+        return false;
+      }
+    }
+    return hasAttachment;
+  }
+
+  bool stepWrites( const Step& step, RenderGraphResource resource ) const {
+    for ( uint32_t index : step.passes ) {
+      for ( const Access& access : mPasses[index].accesses ) {
+        if ( access.resource == resource && usageInfo( access.usage, mPasses[index].type ).write ) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool stepAccessesOutsideAttachments( const Step& step, RenderGraphResource resource ) const {
+    for ( uint32_t index : step.passes ) {
+      for ( const Access& access : mPasses[index].accesses ) {
+        if ( access.resource == resource && !isAttachmentUsage( access.usage ) ) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void buildSteps() {
+    for ( uint32_t i = 0; i < mPasses.size(); i++ ) {
+      const Pass& pass = mPasses[i];
+      if ( pass.culled ) {
+        continue;
+      }
+
+      if ( mSteps.empty() || !canMerge( mSteps.back(), pass ) ) {
+        Step step;
+        step.graphics = pass.type == PassType::eGraphics;
+        mSteps.push_back( step );
+      }
+      Step& step = mSteps.back();
+      step.passes.push_back( i );
+      for ( const Access& access : pass.accesses ) {
+        if ( isAttachmentUsage( access.usage )
+             && std::find( step.attachments.begin(), step.attachments.end(), access.resource )
+                    == step.attachments.end() ) {
+          step.attachments.push_back( access.resource );
+        }
+      }
+      if ( step.graphics && step.attachments.empty() ) {
+        throw std::runtime_error( "Render graph pass \"" + pass.name + "\" is a graphics pass without attachments." );
+      }
+    }
+
+    // Lifetimes in steps, everything in one render pass lives for the whole render pass
+    for ( uint32_t s = 0; s < mSteps.size(); s++ ) {
+      for ( uint32_t index : mSteps[s].passes ) {
+        for ( const Access& access : mPasses[index].accesses ) {
+          Resource& resource = mResources[access.resource];
+          resource.firstStep = std::min( resource.firstStep, s );
+          resource.lastStep  = std::max( resource.lastStep, s );
+          resource.usage    |= imageUsage( access.usage );
+        }
+      }
+    }
+  }
+
+  static vk::ImageUsageFlags imageUsage( ResourceUsage usage ) {
+    switch ( usage ) {
+    case ( ResourceUsage::eColorAttachment ):
+      return vk::ImageUsageFlagBits::eColorAttachment;
+    case ( ResourceUsage::eDepthAttachment ):
+      return vk::ImageUsageFlagBits::eDepthStencilAttachment;
+    case ( ResourceUsage::eInputAttachment ):
+      return vk::ImageUsageFlagBits::eInputAttachment;
+    case ( ResourceUsage::eSampled ):
+      return vk::ImageUsageFlagBits::eSampled;
+    case ( ResourceUsage::eStorageRead ):
+    case ( ResourceUsage::eStorageWrite ):
+      return vk::ImageUsageFlagBits::eStorage;
+    case ( ResourceUsage::eTransferSrc ):
+      return vk::ImageUsageFlagBits::eTransferSrc;
+    case ( ResourceUsage::eTransferDst ):
+      return vk::ImageUsageFlagBits::eTransferDst;
+    default:
+      return {};
+    }
+  }
+
+  // Creates the transient images, then packs them into memory slots greedily by first use. A slot is reused by an
+  // image that starts after the slot's last user ended, as long as their memory types overlap.
+  void createTransients() {
+    struct Slot {
+      vk::MemoryRequirements           requirements;
+      MemoryUsage                      usage;
+      uint32_t                         lastStep;
+      RenderGraphResource              lastUser;
+      std::vector<RenderGraphResource> users;
+    };
+    std::vector<Slot> slots;
+
+    std::vector<RenderGraphResource> transients;
+    for ( RenderGraphResource i = 0; i < mResources.size(); i++ ) {
+      if ( mResources[i].isImage && !mResources[i].imported && mResources[i].firstStep != UINT32_MAX ) {
+        transients.push_back( i );
+      }
+    }
+    std::sort( transients.begin(), transients.end(), [this]( RenderGraphResource a, RenderGraphResource b ) {
+      return mResources[a].firstStep < mResources[b].firstStep;
+    } );
+
+    const vk::ImageUsageFlags attachmentOnly = vk::ImageUsageFlagBits::eColorAttachment
+                                               | vk::ImageUsageFlagBits::eDepthStencilAttachment
+                                               | vk::ImageUsageFlagBits::eInputAttachment;
+    for ( RenderGraphResource handle : transients ) {
+      Resource&   resource = mResources[handle];
+      bool        lazy     = !( resource.usage & ~attachmentOnly );
+      MemoryUsage usage    = lazy ? MemoryUsage::eLazy : MemoryUsage::eGpuOnly;
+      if ( lazy ) {
+        resource.usage |= vk::ImageUsageFlagBits::eTransientAttachment;
+      }
+
+      vk::ImageCreateInfo imageInfo = {};
+      imageInfo.imageType           = vk::ImageType::e2D;
+      imageInfo.format              = resource.desc.format;
+      imageInfo.extent              = vk::Extent3D( resource.desc.extent, 1 );
+      imageInfo.mipLevels           = 1;
+      imageInfo.arrayLayers         = 1;
+      imageInfo.samples             = resource.desc.samples;
+      imageInfo.tiling              = vk::ImageTiling::eOptimal;
+      imageInfo.usage               = resource.usage;
+      imageInfo.sharingMode         = vk::SharingMode::eExclusive;
+      imageInfo.initialLayout       = vk::ImageLayout::eUndefined;
+      for ( uint32_t frame = 0; frame < mFramesInFlight; frame++ ) {
+        resource.images.push_back( mDevice.createImage( imageInfo ) );
+      }
+
+      vk::MemoryRequirements requirements = mDevice.getImageMemoryRequirements( resource.images.front() );
+      resource.memorySize                 = requirements.size;
+
+      Slot* chosen = nullptr;
+      for ( Slot& slot : slots ) {
+        if ( slot.usage == usage && slot.lastStep < resource.firstStep
+             && ( slot.requirements.memoryTypeBits & requirements.memoryTypeBits ) ) {
+          chosen = &slot;
+          break;
+        }
+      }
+      if ( chosen ) {
+        resource.aliasOf                     = static_cast<int32_t>( chosen->lastUser );
+        chosen->requirements.size            = std::max( chosen->requirements.size, requirements.size );
+        chosen->requirements.alignment       = std::max( chosen->requirements.alignment, requirements.alignment );
+        chosen->requirements.memoryTypeBits &= requirements.memoryTypeBits;
+      } else {
+        slots.push_back( { requirements, usage, 0, handle, {} } );
+        chosen = &slots.back();
+      }
+      chosen->lastStep = resource.lastStep;
+      chosen->lastUser = handle;
+      chosen->users.push_back( handle );
+    }
+
+    AllocationCreateInfo allocInfo = {};
+    for ( Slot& slot : slots ) {
+      allocInfo.usage = slot.usage;
+      for ( uint32_t frame = 0; frame < mFramesInFlight; frame++ ) {
+        mMemory.push_back( mAllocator->allocate( slot.requirements, allocInfo, ResourceKind::eOptimal ) );
+        for ( RenderGraphResource user : slot.users ) {
+          Resource& resource = mResources[user];
+          mDevice.bindImageMemory( resource.images[frame], mMemory.back().memory, mMemory.back().offset );
+
+          vk::ImageViewCreateInfo viewInfo = {};
+          viewInfo.image                   = resource.images[frame];
+          viewInfo.viewType                = vk::ImageViewType::e2D;
+          viewInfo.format                  = resource.desc.format;
+          viewInfo.subresourceRange        = vk::ImageSubresourceRange( aspectOf( resource.desc.format ), 0, 1, 0, 1 );
+          resource.views.push_back( mDevice.createImageView( viewInfo ) );
+        }
+      }
+    }
+  }
+
+  // Walks the steps in order with the state of every resource and records what each step has to wait for
+  void planSynchronization() {
+    std::vector<State> states( mResources.size() );
+    for ( RenderGraphResource i = 0; i < mResources.size(); i++ ) {
+      if ( mResources[i].imported ) {
+        states[i].layout    = mResources[i].initialLayout;
+        states[i].stages    = mResources[i].initialStages;
+        states[i].lastWrite = static_cast<bool>( mResources[i].initialStages );
+        states[i].valid     = !mResources[i].isImage || mResources[i].initialLayout != vk::ImageLayout::eUndefined;
+      }
+    }
+
+    for ( uint32_t s = 0; s < mSteps.size(); s++ ) {
+      Step& step = mSteps[s];
+
+      // Memory handed over from an aliased image has to be done with before the new image touches it
+      for ( uint32_t index : step.passes ) {
+        for ( const Access& access : mPasses[index].accesses ) {
+          Resource& resource = mResources[access.resource];
+          if ( resource.aliasOf >= 0 && resource.firstStep == s && !states[access.resource].stages ) {
+            const State& previous            = states[resource.aliasOf];
+            states[access.resource].stages    = previous.stages;
+            states[access.resource].access    = previous.access;
+            states[access.resource].lastWrite = true;
+          }
+        }
+      }
+
+      if ( step.graphics ) {
+        planRenderPass( s, states );
+      } else {
+        const Pass& pass = mPasses[step.passes.front()];
+        for ( const Access& access : pass.accesses ) {
+          transition( step, states[access.resource], access.resource, usageInfo( access.usage, pass.type ),
+                      !access.clear );
+        }
+      }
+    }
+
+    // Imported images end up in their final layout, inside the last render pass when it could, otherwise here
+    for ( RenderGraphResource i = 0; i < mResources.size(); i++ ) {
+      const Resource& resource = mResources[i];
+      const State&    state    = states[i];
+      if ( resource.imported && resource.isImage && state.layout != resource.finalLayout
+           && resource.finalLayout != vk::ImageLayout::eUndefined ) {
+        mFinalSrcStages |= state.stages ? state.stages : vk::PipelineStageFlagBits::eTopOfPipe;
+        mFinalBarriers.push_back( { i, state.layout, resource.finalLayout,
+                                    state.lastWrite ? state.access : vk::AccessFlags(), vk::AccessFlags() } );
+      }
+    }
+  }
+
+  // Adds whatever barrier `info` needs after `state` to the step and advances the state
+  void transition( Step& step, State& state, RenderGraphResource resource, const UsageInfo& info,
+                   bool keepContents ) {
+    bool isImage      = mResources[resource].isImage;
+    bool layoutChange = isImage && state.layout != info.layout;
+    bool hazard       = state.lastWrite || ( info.write && state.stages );
+    if ( layoutChange || hazard ) {
+      vk::ImageLayout oldLayout = keepContents && state.valid ? state.layout : vk::ImageLayout::eUndefined;
+      step.srcStages           |= state.stages ? state.stages : vk::PipelineStageFlagBits::eTopOfPipe;
+      step.dstStages           |= info.stages;
+      step.barriers.push_back( { resource, oldLayout, info.layout,
+                                 state.lastWrite ? state.access : vk::AccessFlags(), info.access } );
+      state.stages = info.stages;
+      state.access = info.access;
+    } else {
+      // Reads after reads only need to be remembered, so the next write waits for all of them
+      state.stages |= info.stages;
+      state.access |= info.access;
+    }
+    state.layout    = info.layout;
+    state.lastWrite = info.write;
+    state.valid     = state.valid || info.write;
+  }
+
+  void planRenderPass( uint32_t s, std::vector<State>& states ) {
+    Step& step = mSteps[s];
+
+    std::vector<vk::AttachmentDescription> attachments;
+    for ( RenderGraphResource handle : step.attachments ) {
+      const Resource& resource = mResources[handle];
+      State&          state    = states[handle];
+
+      // The first access in the render pass decides the load op and the layout it starts in, the last one the layout
+      // it ends in and the last write what the next access has to wait for
+      const Access* first      = nullptr;
+      const Pass*   firstPass  = nullptr;
+      const Access* last       = nullptr;
+      const Pass*   lastPass   = nullptr;
+      const Access* writer     = nullptr;
+      const Pass*   writerPass = nullptr;
+      for ( uint32_t index : step.passes ) {
+        for ( const Access& access : mPasses[index].accesses ) {
+          if ( access.resource == handle ) {
+            first     = first ? first : &access;
+            firstPass = firstPass ? firstPass : &mPasses[index];
+            last      = &access;
+            lastPass  = &mPasses[index];
+            if ( usageInfo( access.usage, mPasses[index].type ).write ) {
+              writer     = &access;
+              writerPass = &mPasses[index];
+            }
+          }
+        }
+      }
+
+      UsageInfo firstInfo = usageInfo( first->usage, firstPass->type );
+      bool      loads     = !first->clear && state.valid;
+
+      vk::AttachmentDescription attachment = {};
+      attachment.format                    = resource.desc.format;
+      attachment.samples                   = resource.desc.samples;
+      attachment.loadOp = first->clear ? vk::AttachmentLoadOp::eClear
+                                       : ( loads ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eDontCare );
+      attachment.storeOp = usedAfter( handle, s ) ? vk::AttachmentStoreOp::eStore : vk::AttachmentStoreOp::eDontCare;
+      if ( aspectOf( resource.desc.format ) & vk::ImageAspectFlagBits::eStencil ) {
+        attachment.stencilLoadOp  = attachment.loadOp;
+        attachment.stencilStoreOp = attachment.storeOp;
+      } else {
+        attachment.stencilLoadOp  = vk::AttachmentLoadOp::eDontCare;
+        attachment.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+      }
+
+      // Untouched images are transitioned by the render pass itself, everything else waits in a barrier first
+      if ( !state.stages ) {
+        attachment.initialLayout = vk::ImageLayout::eUndefined;
+      } else {
+        transition( step, state, handle, firstInfo, loads );
+        attachment.initialLayout = firstInfo.layout;
+      }
+
+      // An imported image used for the last time leaves the render pass in its final layout for free
+      UsageInfo lastInfo     = usageInfo( last->usage, lastPass->type );
+      attachment.finalLayout = lastInfo.layout;
+      if ( resource.imported && !usedAfter( handle, s ) && resource.finalLayout != vk::ImageLayout::eUndefined ) {
+        attachment.finalLayout = resource.finalLayout;
+      }
+      attachments.push_back( attachment );
+      step.clearValues.push_back( first->clearValue );
+
+      // Later subpasses only reading a written attachment (as an input attachment, say) do not change that the next
+      // access has to wait for the write
+      UsageInfo outgoing = writer ? usageInfo( writer->usage, writerPass->type ) : lastInfo;
+      state.layout    = attachment.finalLayout;
+      state.stages    = outgoing.stages;
+      state.access    = outgoing.access;
+      state.lastWrite = outgoing.write;
+      state.valid     = attachment.storeOp == vk::AttachmentStoreOp::eStore;
+    }
+
+    // Everything else the subpasses read was written before the render pass, so it is waited for up front
+    for ( uint32_t index : step.passes ) {
+      for ( const Access& access : mPasses[index].accesses ) {
+        if ( !isAttachmentUsage( access.usage ) ) {
+          transition( step, states[access.resource], access.resource, usageInfo( access.usage, mPasses[index].type ),
+                      true );
+        }
+      }
+    }
+
+    std::vector<std::vector<vk::AttachmentReference>> colorRefs( step.passes.size() );
+    std::vector<std::vector<vk::AttachmentReference>> inputRefs( step.passes.size() );
+    std::vector<vk::AttachmentReference>              depthRefs( step.passes.size() );
+    std::vector<std::vector<uint32_t>>                preserved( step.passes.size() );
+    std::vector<vk::SubpassDescription>               subpasses( step.passes.size() );
+    std::map<std::pair<uint32_t, uint32_t>, vk::SubpassDependency> dependencies;
+    for ( uint32_t subpass = 0; subpass < step.passes.size(); subpass++ ) {
+      const Pass& pass     = mPasses[step.passes[subpass]];
+      bool        hasDepth = false;
+      for ( const Access& access : pass.accesses ) {
+        if ( !isAttachmentUsage( access.usage ) ) {
+          continue;
+        }
+        uint32_t  attachment = attachmentIndex( step, access.resource );
+        UsageInfo info       = usageInfo( access.usage, pass.type );
+        if ( access.usage == ResourceUsage::eColorAttachment ) {
+          colorRefs[subpass].push_back( vk::AttachmentReference( attachment, info.layout ) );
+        } else if ( access.usage == ResourceUsage::eDepthAttachment ) {
+          depthRefs[subpass] = vk::AttachmentReference( attachment, info.layout );
+          hasDepth           = true;
+        } else {
+          inputRefs[subpass].push_back( vk::AttachmentReference( attachment, info.layout ) );
+        }
+
+        // Depend on the latest earlier subpass that touched the attachment, if either side writes
+        for ( uint32_t earlier = subpass; earlier-- > 0; ) {
+          const Pass*   previous = &mPasses[step.passes[earlier]];
+          const Access* found    = nullptr;
+          for ( const Access& candidate : previous->accesses ) {
+            found = candidate.resource == access.resource ? &candidate : found;
+          }
+          if ( !found ) {
+            continue;
+          }
+          UsageInfo previousInfo = usageInfo( found->usage, previous->type );
+          if ( previousInfo.write || info.write ) {
+            vk::SubpassDependency& dependency = dependencies[{ earlier, subpass }];
+            dependency.srcSubpass            = earlier;
+            dependency.dstSubpass            = subpass;
+            dependency.srcStageMask         |= previousInfo.stages;
+            dependency.dstStageMask         |= info.stages;
+            dependency.srcAccessMask        |= previousInfo.write ? previousInfo.access : vk::AccessFlags();
+            dependency.dstAccessMask        |= info.access;
+            dependency.dependencyFlags       = vk::DependencyFlagBits::eByRegion;
+          }
+          break;
+        }
+      }
+
+      // Attachments this subpass does not use keep their contents when a later subpass still needs them
+      for ( uint32_t attachment = 0; attachment < step.attachments.size(); attachment++ ) {
+        RenderGraphResource resource = step.attachments[attachment];
+        if ( passUses( pass, resource ) ) {
+          continue;
+        }
+        bool usedBefore = false, usedLater = false;
+        for ( uint32_t other = 0; other < step.passes.size(); other++ ) {
+          bool uses  = passUses( mPasses[step.passes[other]], resource );
+          usedBefore = usedBefore || ( other < subpass && uses );
+          usedLater  = usedLater || ( other > subpass && uses );
+        }
+        if ( usedBefore && usedLater ) {
+          preserved[subpass].push_back( attachment );
+        }
+      }
+
+      subpasses[subpass].pipelineBindPoint       = vk::PipelineBindPoint::eGraphics;
+      subpasses[subpass].colorAttachmentCount    = static_cast<uint32_t>( colorRefs[subpass].size() );
+      subpasses[subpass].pColorAttachments       = colorRefs[subpass].data();
+      subpasses[subpass].inputAttachmentCount    = static_cast<uint32_t>( inputRefs[subpass].size() );
+      subpasses[subpass].pInputAttachments       = inputRefs[subpass].data();
+      subpasses[subpass].pDepthStencilAttachment = hasDepth ? &depthRefs[subpass] : nullptr;
+      subpasses[subpass].preserveAttachmentCount = static_cast<uint32_t>( preserved[subpass].size() );
+      subpasses[subpass].pPreserveAttachments    = preserved[subpass].data();
+    }
+
+    std::vector<vk::SubpassDependency> dependencyList;
+    for ( std::pair<const std::pair<uint32_t, uint32_t>, vk::SubpassDependency>& dependency : dependencies ) {
+      dependencyList.push_back( dependency.second );
+    }
+
+    vk::RenderPassCreateInfo renderPassInfo = {};
+    renderPassInfo.attachmentCount          = static_cast<uint32_t>( attachments.size() );
+    renderPassInfo.pAttachments             = attachments.data();
+    renderPassInfo.subpassCount             = static_cast<uint32_t>( subpasses.size() );
+    renderPassInfo.pSubpasses               = subpasses.data();
+    renderPassInfo.dependencyCount          = static_cast<uint32_t>( dependencyList.size() );
+    renderPassInfo.pDependencies            = dependencyList.data();
+    step.renderPass                         = mDevice.createRenderPass( renderPassInfo );
+  }
+
+  static bool passUses( const Pass& pass, RenderGraphResource resource ) {
+    return std::any_of( pass.accesses.begin(), pass.accesses.end(),
+                        [resource]( const Access& access ) { return access.resource == resource; } );
+  }
+
+  static uint32_t attachmentIndex( const Step& step, RenderGraphResource resource ) {
+    return static_cast<uint32_t>( std::find( step.attachments.begin(), step.attachments.end(), resource )
+                                  - step.attachments.begin() );
+  }
+
+  // Imported resources are always used after the graph
+  bool usedAfter( RenderGraphResource resource, uint32_t step ) const {
+    return mResources[resource].imported || mResources[resource].lastStep > step;
+  }
+
+  vk::Image imageOf( RenderGraphResource resource, uint32_t frame ) const {
+    const Resource& image = mResources[resource];
+    return image.imported ? image.image : image.images[frame];
+  }
+
+  vk::ImageView viewOf( RenderGraphResource resource, uint32_t frame ) const {
+    const Resource& image = mResources[resource];
+    return image.imported ? image.view : image.views[frame];
+  }
+
+  void recordBarriers( vk::CommandBuffer commandBuffer, vk::PipelineStageFlags srcStages,
+                       vk::PipelineStageFlags dstStages, const std::vector<Barrier>& barriers, uint32_t frame ) {
+    if ( barriers.empty() ) {
+      return;
+    }
+
+    std::vector<vk::ImageMemoryBarrier>  imageBarriers;
+    std::vector<vk::BufferMemoryBarrier> bufferBarriers;
+    for ( const Barrier& barrier : barriers ) {
+      const Resource& resource = mResources[barrier.resource];
+      if ( resource.isImage ) {
+        imageBarriers.push_back( vk::ImageMemoryBarrier(
+            barrier.srcAccess, barrier.dstAccess, barrier.oldLayout, barrier.newLayout, VK_QUEUE_FAMILY_IGNORED,
+            VK_QUEUE_FAMILY_IGNORED, imageOf( barrier.resource, frame ),
+            vk::ImageSubresourceRange( aspectOf( resource.desc.format ), 0, VK_REMAINING_MIP_LEVELS, 0,
+                                       VK_REMAINING_ARRAY_LAYERS ) ) );
+      } else {
+        bufferBarriers.push_back( vk::BufferMemoryBarrier( barrier.srcAccess, barrier.dstAccess,
+                                                           VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                           resource.buffer, 0, VK_WHOLE_SIZE ) );
+      }
+    }
+    commandBuffer.pipelineBarrier( srcStages, dstStages, {}, nullptr, bufferBarriers, imageBarriers );
+  }
+
+  vk::Framebuffer framebuffer( const Step& step, uint32_t frame ) {
+    FramebufferKey key;
+    key.first = static_cast<VkRenderPass>( step.renderPass );
+    for ( RenderGraphResource attachment : step.attachments ) {
+      key.second.push_back( static_cast<VkImageView>( viewOf( attachment, frame ) ) );
+    }
+
+    vk::Framebuffer& cached = mFramebuffers[key];
+    if ( !cached ) {
+      vk::Extent2D              extent          = mResources[step.attachments.front()].desc.extent;
+      vk::FramebufferCreateInfo framebufferInfo = {};
+      framebufferInfo.renderPass                = step.renderPass;
+      framebufferInfo.attachmentCount           = static_cast<uint32_t>( key.second.size() );
+      framebufferInfo.pAttachments              = reinterpret_cast<const vk::ImageView*>( key.second.data() );
+      framebufferInfo.width                     = extent.width;
+      framebufferInfo.height                    = extent.height;
+      framebufferInfo.layers                    = 1;
+      cached                                    = mDevice.createFramebuffer( framebufferInfo );
+    }
+    return cached;
+  }
+
+  vk::Device                                mDevice;
+  DeviceAllocator*                          mAllocator { nullptr };
+  uint32_t                                  mFramesInFlight { 1 };
+  std::vector<Resource>                     mResources;
+  std::vector<Pass>                         mPasses;
+  std::vector<Step>                         mSteps;
+  std::vector<Allocation>                   mMemory;
+  vk::PipelineStageFlags                    mFinalSrcStages;
+  std::vector<Barrier>                      mFinalBarriers;
+  std::map<FramebufferKey, vk::Framebuffer> mFramebuffers;
+};
+} // namespace utils
@@ -0,0 +1,339 @@
+#pragma once
+
+#include "logger.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Shader module registry stuff
+namespace utils {
+// Read only memory mapping of a whole file, the pages are shared with the page cache instead of copied
+class MappedFile {
+  public:
+  MappedFile() = default;
+  MappedFile( const MappedFile& ) = delete;
+  MappedFile& operator=( const MappedFile& ) = delete;
+
+  MappedFile( MappedFile&& other ) noexcept {
+    *this = std::move( other );
+  }
+
+  MappedFile& operator=( MappedFile&& other ) noexcept {
+    if ( this != &other ) {
+      close();
+      std::swap( mData, other.mData );
+      std::swap( mSize, other.mSize );
+    }
+    return *this;
+  }
+
+  ~MappedFile() {
+    close();
+  }
+
+  bool open( const std::string& filename ) {
+    close();
+
+    int fd = ::open( filename.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) {
+      return false;
+    }
+
+    struct stat info;
+    if ( fstat( fd, &info ) != 0 || info.st_size == 0 ) {
+      ::close( fd );
+      return false;
+    }
+
+    void* data = mmap( nullptr, static_cast<size_t>( info.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd ); // The mapping keeps its own reference to the file
+    if ( data == MAP_FAILED ) {
+      return false;
+    }
+
+    mData = data;
+    mSize = static_cast<size_t>( info.st_size );
+    return true;
+  }
+
+  void close() {
+    if ( mData ) {
+      munmap( mData, mSize );
+    }
+    mData = nullptr;
+    mSize = 0;
+  }
+
+  const char* data() const {
+    return static_cast<const char*>( mData );
+  }
+
+  size_t size() const {
+    return mSize;
+  }
+
+  private:
+  void*  mData { nullptr };
+  size_t mSize { 0 };
+};
+
+// 64 bit FNV-1a
+uint64_t hashBytes( const void* data, size_t size, uint64_t seed = 14695981039346656037ull ) {
+  const uint8_t* bytes = static_cast<const uint8_t*>( data );
+  uint64_t       hash  = seed;
+  for ( size_t i = 0; i < size; i++ ) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Packed shader archive: a header, a table of entries and the SPIR-V blobs, each aligned to 4 bytes
+struct ShaderArchiveHeader {
+  char     magic[4] { 'V', 'S', 'P', 'K' };
+  uint32_t version { 1 };
+  uint32_t entryCount { 0 };
+  uint32_t reserved { 0 };
+};
+
+struct ShaderArchiveEntry {
+  char     name[112] {}; // Path the blob was packed from, e.g. "shaders/vert.spv"
+  uint64_t offset { 0 };
+  uint64_t size { 0 };
+};
+
+bool writeShaderArchive( const std::string& archivePath, const std::vector<std::string>& files ) {
+  std::vector<ShaderArchiveEntry> entries( files.size() );
+  std::vector<MappedFile>         blobs( files.size() );
+
+  uint64_t offset = sizeof( ShaderArchiveHeader ) + sizeof( ShaderArchiveEntry ) * files.size();
+  for ( size_t i = 0; i < files.size(); i++ ) {
+    if ( files[i].size() >= sizeof( ShaderArchiveEntry::name ) || !blobs[i].open( files[i] ) ) {
+      VFS_LOG_ERROR << "Failed to pack \"" << files[i] << "\"";
+      return false;
+    }
+    std::memcpy( entries[i].name, files[i].c_str(), files[i].size() );
+    entries[i].offset = offset;
+    entries[i].size   = blobs[i].size();
+    offset            = ( offset + blobs[i].size() + 3 ) & ~uint64_t( 3 );
+  }
+
+  std::ofstream file( archivePath, std::ios::binary | std::ios::trunc );
+  if ( !file.is_open() ) {
+    VFS_LOG_ERROR << "Failed to open \"" << archivePath << "\" for writing";
+    return false;
+  }
+
+  ShaderArchiveHeader header;
+  header.entryCount = static_cast<uint32_t>( entries.size() );
+  file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+  file.write( reinterpret_cast<const char*>( entries.data() ), sizeof( ShaderArchiveEntry ) * entries.size() );
+  for ( size_t i = 0; i < blobs.size(); i++ ) {
+    const char padding[4] = {};
+    file.write( blobs[i].data(), blobs[i].size() );
+    file.write( padding, ( 4 - blobs[i].size() % 4 ) % 4 );
+  }
+
+  return static_cast<bool>( file );
+}
+
+// Creates each distinct SPIR-V blob once. Modules are keyed by the hash of their contents (compared byte for byte on
+// a hit), so the same code loaded through different paths is shared, and destroyed when the last user releases it.
+// Safe to use from any thread.
+class ShaderModuleRegistry {
+  public:
+  ShaderModuleRegistry() = default;
+  ShaderModuleRegistry( const ShaderModuleRegistry& ) = delete;
+  ShaderModuleRegistry& operator=( const ShaderModuleRegistry& ) = delete;
+
+  void create( vk::Device device ) {
+    mDevice = device;
+  }
+
+  // Destroys every module that is still referenced
+  void destroy() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    for ( std::pair<const uint64_t, Entry>& entry : mModules ) {
+      mDevice.destroyShaderModule( entry.second.module );
+    }
+    mModules.clear();
+    mHashByModule.clear();
+    mModuleByPath.clear();
+    mArchiveEntries.clear();
+    mArchive.close();
+  }
+
+  // Serve paths packed into `archivePath` from that single mapping instead of separate files
+  bool loadArchive( const std::string& archivePath ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mArchiveEntries.clear();
+    if ( !mArchive.open( archivePath ) || mArchive.size() < sizeof( ShaderArchiveHeader ) ) {
+      VFS_LOG_ERROR << "Failed to load shader archive \"" << archivePath << "\"";
+      return false;
+    }
+
+    ShaderArchiveHeader header;
+    std::memcpy( &header, mArchive.data(), sizeof( header ) );
+    size_t tableEnd = sizeof( header ) + sizeof( ShaderArchiveEntry ) * static_cast<size_t>( header.entryCount );
+    if ( std::memcmp( header.magic, "VSPK", 4 ) != 0 || header.version != 1 || tableEnd > mArchive.size() ) {
+      VFS_LOG_ERROR << "\"" << archivePath << "\" is not a shader archive";
+      mArchive.close();
+      return false;
+    }
+
+    for ( uint32_t i = 0; i < header.entryCount; i++ ) {
+      ShaderArchiveEntry entry;
+      std::memcpy( &entry, mArchive.data() + sizeof( header ) + i * sizeof( entry ), sizeof( entry ) );
+      entry.name[sizeof( entry.name ) - 1] = '\0';
+      if ( entry.offset + entry.size > mArchive.size() || entry.offset % 4 != 0 ) {
+        VFS_LOG_ERROR << "Corrupt entry \"" << entry.name << "\" in \"" << archivePath << "\"";
+        continue;
+      }
+      mArchiveEntries[entry.name] = entry;
+    }
+
+    VFS_LOG_INFO << "Loaded " << mArchiveEntries.size() << " shaders from \"" << archivePath << "\"";
+    return true;
+  }
+
+  // Module for the SPIR-V at `path` (archive first, then the file system). Every acquire needs a release.
+  vk::ShaderModule acquire( const std::string& path ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+
+    // Paths we have already seen skip the file access entirely while their module is alive
+    auto knownPath = mModuleByPath.find( path );
+    if ( knownPath != mModuleByPath.end() ) {
+      findLocked( knownPath->second )->second.refCount++;
+      mReused++;
+      return knownPath->second;
+    }
+
+    const char* code = nullptr;
+    size_t      size = 0;
+    MappedFile  file;
+
+    auto packed = mArchiveEntries.find( path );
+    if ( packed != mArchiveEntries.end() ) {
+      code = mArchive.data() + packed->second.offset;
+      size = packed->second.size;
+    } else if ( file.open( path ) ) {
+      code = file.data();
+      size = file.size();
+    } else {
+      throw std::runtime_error( "Failed to load shader \"" + path + "\"." );
+    }
+
+    vk::ShaderModule module = acquireLocked( hashBytes( code, size ), code, size, path );
+    mModuleByPath[path]     = module;
+    return module;
+  }
+
+  // Module for SPIR-V already in memory (e.g. compiled at runtime)
+  vk::ShaderModule acquire( const uint32_t* code, size_t size, const std::string& debugName ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    return acquireLocked( hashBytes( code, size ), reinterpret_cast<const char*>( code ), size, debugName );
+  }
+
+  void release( vk::ShaderModule module ) {
+    if ( !module ) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    auto                        hash = mHashByModule.find( module );
+    if ( hash == mHashByModule.end() ) {
+      return;
+    }
+
+    auto entry = findLocked( module );
+    if ( --entry->second.refCount == 0 ) {
+      // The driver may hand out the same handle again, so no path may keep pointing at it
+      for ( auto path = mModuleByPath.begin(); path != mModuleByPath.end(); ) {
+        path = path->second == module ? mModuleByPath.erase( path ) : std::next( path );
+      }
+      mDevice.destroyShaderModule( module );
+      mModules.erase( entry );
+      mHashByModule.erase( hash );
+    }
+  }
+
+  // The next acquire of `path` reads the file again, for SPIR-V rewritten at runtime. The rewritten file also takes
+  // precedence over the archive. Modules already handed out stay valid until they are released.
+  void invalidate( const std::string& path ) {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mModuleByPath.erase( path );
+    mArchiveEntries.erase( path );
+  }
+
+  void report() {
+    std::lock_guard<std::mutex> lock( mMutex );
+    VFS_LOG_INFO << "Shader modules: " << mCreated << " created, " << mReused << " reused, " << mModules.size()
+                 << " alive";
+  }
+
+  private:
+  struct Entry {
+    vk::ShaderModule  module;
+    uint32_t          refCount { 0 };
+    std::vector<char> code; // Compared on hash hits, two blobs with the same hash get their own modules
+  };
+
+  // Entry of a module this registry created
+  std::multimap<uint64_t, Entry>::iterator findLocked( vk::ShaderModule module ) {
+    auto range = mModules.equal_range( mHashByModule.at( module ) );
+    return std::find_if( range.first, range.second, [&]( const std::pair<const uint64_t, Entry>& entry ) {
+      return entry.second.module == module;
+    } );
+  }
+
+  vk::ShaderModule acquireLocked( uint64_t hash, const char* code, size_t size, const std::string& name ) {
+    auto range = mModules.equal_range( hash );
+    for ( auto existing = range.first; existing != range.second; ++existing ) {
+      if ( existing->second.code.size() == size && std::memcmp( existing->second.code.data(), code, size ) == 0 ) {
+        existing->second.refCount++;
+        mReused++;
+        return existing->second.module;
+      }
+    }
+
+    if ( size == 0 || size % 4 != 0 ) {
+      throw std::runtime_error( "\"" + name + "\" is not valid SPIR-V." );
+    }
+
+    vk::ShaderModuleCreateInfo moduleInfo;
+    moduleInfo.flags    = vk::ShaderModuleCreateFlags();
+    moduleInfo.codeSize = size;
+    moduleInfo.pCode    = reinterpret_cast<const uint32_t*>( code );
+
+    Entry entry;
+    try {
+      entry.module = mDevice.createShaderModule( moduleInfo );
+    } catch ( vk::SystemError& err ) {
+      throw std::runtime_error( "Failed to create shader module \"" + name + "\"." );
+    }
+    entry.refCount = 1;
+    entry.code.assign( code, code + size );
+
+    vk::ShaderModule module = entry.module;
+    mHashByModule[module]   = hash;
+    mModules.emplace( hash, std::move( entry ) );
+    mCreated++;
+    return module;
+  }
+
+  vk::Device                                mDevice;
+  std::mutex                                mMutex;
+  std::multimap<uint64_t, Entry>            mModules;
+  std::map<vk::ShaderModule, uint64_t>      mHashByModule;
+  std::map<std::string, vk::ShaderModule>   mModuleByPath;
+  MappedFile                                mArchive;
+  std::map<std::string, ShaderArchiveEntry> mArchiveEntries;
+  uint64_t                                  mCreated { 0 };
+  uint64_t                                  mReused { 0 };
+};
+} // namespace utils
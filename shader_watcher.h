@@ -0,0 +1,227 @@
+#pragma once
+
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#if defined( VFS_SHADERC )
+#include <shaderc/shaderc.hpp>
+#endif
+
+// Shader hot reload stuff
+namespace utils {
+// Compiles one GLSL file to SPIR-V, the stage comes from the extension (.vert, .frag, .comp). Uses shaderc in process
+// when the build found it and the glslc the build found otherwise. The output is written next to its final path and
+// renamed over it, so readers never see a partially written file.
+inline bool compileShader( const std::string& sourcePath, const std::string& spirvPath, std::string& messages ) {
+  std::string temporaryPath = spirvPath + ".tmp";
+  messages.clear();
+
+#if defined( VFS_SHADERC )
+  std::ifstream file( sourcePath );
+  if ( !file ) {
+    messages = "Failed to open \"" + sourcePath + "\"";
+    return false;
+  }
+  std::stringstream source;
+  source << file.rdbuf();
+
+  shaderc_shader_kind kind      = shaderc_glsl_infer_from_source;
+  std::string         extension = sourcePath.substr( sourcePath.find_last_of( '.' ) + 1 );
+  if ( extension == "vert" ) {
+    kind = shaderc_glsl_vertex_shader;
+  } else if ( extension == "frag" ) {
+    kind = shaderc_glsl_fragment_shader;
+  } else if ( extension == "comp" ) {
+    kind = shaderc_glsl_compute_shader;
+  }
+
+  shaderc::Compiler             compiler;
+  shaderc::CompileOptions       options;
+  shaderc::SpvCompilationResult result =
+      compiler.CompileGlslToSpv( source.str(), kind, sourcePath.c_str(), options );
+  messages = result.GetErrorMessage();
+  if ( result.GetCompilationStatus() != shaderc_compilation_status_success ) {
+    return false;
+  }
+
+  std::ofstream output( temporaryPath, std::ios::binary | std::ios::trunc );
+  output.write( reinterpret_cast<const char*>( result.cbegin() ),
+                static_cast<std::streamsize>( ( result.cend() - result.cbegin() ) * sizeof( uint32_t ) ) );
+  if ( !output.good() ) {
+    messages = "Failed to write \"" + temporaryPath + "\"";
+    return false;
+  }
+  output.close();
+#elif defined( VFS_GLSLC )
+  std::string command = std::string( "\"" ) + VFS_GLSLC + "\" \"" + sourcePath + "\" -o \"" + temporaryPath + "\"";
+  FILE*       pipe    = popen( ( command + " 2>&1" ).c_str(), "r" );
+  if ( !pipe ) {
+    messages = "Failed to run " + command;
+    return false;
+  }
+  char buffer[256];
+  while ( std::fgets( buffer, sizeof( buffer ), pipe ) ) {
+    messages += buffer;
+  }
+  if ( pclose( pipe ) != 0 ) {
+    return false;
+  }
+#else
+  messages = "Built without shaderc or glslc, \"" + sourcePath + "\" can not be compiled";
+  return false;
+#endif
+
+  if ( std::rename( temporaryPath.c_str(), spirvPath.c_str() ) != 0 ) {
+    messages = "Failed to replace \"" + spirvPath + "\"";
+    return false;
+  }
+  return true;
+}
+
+// GLSL file inside the watched directory and the SPIR-V it compiles to
+struct WatchedShader {
+  std::string source;
+  std::string spirv;
+};
+
+// Watches a directory with inotify and recompiles the shaders in it that are written to, on its own thread. Editors
+// tend to save in several steps, so a shader is compiled once its directory was quiet for a poll interval. The render
+// thread collects the SPIR-V paths that changed with takeChanged() whenever it suits it; a shader that failed to
+// compile is logged and leaves the previous SPIR-V in place.
+class ShaderWatcher {
+  public:
+  ShaderWatcher() = default;
+  ShaderWatcher( const ShaderWatcher& )            = delete;
+  ShaderWatcher& operator=( const ShaderWatcher& ) = delete;
+
+  ~ShaderWatcher() {
+    stop();
+  }
+
+  bool start( const std::string& directory, const std::vector<WatchedShader>& shaders ) {
+    mInotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( mInotify < 0 ) {
+      VFS_LOG_ERROR << "Failed to initialize inotify, shaders will not be reloaded";
+      return false;
+    }
+    // Close covers editors writing in place, moves the ones writing a temporary file and renaming it
+    if ( inotify_add_watch( mInotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 ) {
+      VFS_LOG_ERROR << "Failed to watch \"" << directory << "\", shaders will not be reloaded";
+      close( mInotify );
+      mInotify = -1;
+      return false;
+    }
+
+    mDirectory = directory;
+    mShaders   = shaders;
+    mRunning   = true;
+    mThread    = std::thread( [this]() { run(); } );
+    VFS_LOG_INFO << "Watching \"" << directory << "\" for shader changes";
+    return true;
+  }
+
+  void stop() {
+    if ( !mRunning ) {
+      return;
+    }
+    mRunning = false;
+    mThread.join();
+    close( mInotify );
+    mInotify = -1;
+  }
+
+  bool running() const {
+    return mRunning;
+  }
+
+  // SPIR-V paths rewritten since the last call
+  std::vector<std::string> takeChanged() {
+    std::vector<std::string>    changed;
+    std::lock_guard<std::mutex> lock( mMutex );
+    changed.swap( mChanged );
+    return changed;
+  }
+
+  void report() const {
+    VFS_LOG_INFO << "Shader hot reload: " << mCompiled << " compiled, " << mFailed << " failed";
+  }
+
+  private:
+  void run() {
+    alignas( inotify_event ) char buffer[4096];
+    std::vector<const WatchedShader*> dirty;
+
+    while ( mRunning ) {
+      pollfd descriptor = { mInotify, POLLIN, 0 };
+      if ( poll( &descriptor, 1, kQuietMs ) <= 0 ) {
+        // Nothing happened for a whole interval, whatever was written is complete now
+        for ( const WatchedShader* shader : dirty ) {
+          compile( *shader );
+        }
+        dirty.clear();
+        continue;
+      }
+
+      ssize_t length;
+      while ( ( length = read( mInotify, buffer, sizeof( buffer ) ) ) > 0 ) {
+        for ( char* next = buffer; next < buffer + length; ) {
+          const inotify_event* event = reinterpret_cast<const inotify_event*>( next );
+          next += sizeof( inotify_event ) + event->len;
+          if ( event->len == 0 ) {
+            continue;
+          }
+          for ( const WatchedShader& shader : mShaders ) {
+            if ( shader.source == event->name && std::find( dirty.begin(), dirty.end(), &shader ) == dirty.end() ) {
+              dirty.push_back( &shader );
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void compile( const WatchedShader& shader ) {
+    std::string                               sourcePath = mDirectory + "/" + shader.source;
+    std::string                               messages;
+    std::chrono::steady_clock::time_point     start   = std::chrono::steady_clock::now();
+    bool                                      success = compileShader( sourcePath, shader.spirv, messages );
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if ( !success ) {
+      mFailed++;
+      VFS_LOG_ERROR << "Failed to compile \"" << sourcePath << "\", keeping the previous version:\n" << messages;
+      return;
+    }
+
+    mCompiled++;
+    VFS_LOG_INFO << "Compiled \"" << sourcePath << "\" to \"" << shader.spirv << "\" in " << elapsed.count() << " ms";
+    if ( !messages.empty() ) {
+      VFS_LOG_WARN << messages;
+    }
+    std::lock_guard<std::mutex> lock( mMutex );
+    if ( std::find( mChanged.begin(), mChanged.end(), shader.spirv ) == mChanged.end() ) {
+      mChanged.push_back( shader.spirv );
+    }
+  }
+
+  static constexpr int kQuietMs = 100;
+
+  int                        mInotify { -1 };
+  std::string                mDirectory;
+  std::vector<WatchedShader> mShaders;
+  std::atomic<bool>          mRunning { false };
+  std::thread                mThread;
+  std::mutex                 mMutex;
+  std::vector<std::string>   mChanged;
+  std::atomic<uint64_t>      mCompiled { 0 };
+  std::atomic<uint64_t>      mFailed { 0 };
+};
+} // namespace utils
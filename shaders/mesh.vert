@@ -0,0 +1,20 @@
+#version 450
+
+// utils::PackedVertex, the normalized and half float formats arrive as floats
+layout(location = 0) in vec4 inPosition; // Normalized into the mesh bounds
+layout(location = 1) in vec4 inNormal;
+layout(location = 2) in vec2 inUV;
+layout(location = 3) in vec4 inColor;
+
+// utils::MeshBounds
+layout(push_constant) uniform Bounds {
+    vec3 center;
+    float extent;
+} bounds;
+
+layout(location = 0) out vec3 fragColor;
+
+void main() {
+    gl_Position = vec4(inPosition.xyz * bounds.extent + bounds.center, 1.0);
+    fragColor = inColor.rgb;
+}
@@ -0,0 +1,567 @@
+#pragma once
+
+#include "deletion_queue.h"
+#include "shader_registry.h"
+#include "transfer.h"
+#include <map>
+#include <tuple>
+
+// Sampler stuff
+namespace utils {
+struct SamplerDescription {
+  vk::Filter             magFilter { vk::Filter::eLinear };
+  vk::Filter             minFilter { vk::Filter::eLinear };
+  vk::SamplerMipmapMode  mipmapMode { vk::SamplerMipmapMode::eLinear };
+  vk::SamplerAddressMode addressModeU { vk::SamplerAddressMode::eRepeat };
+  vk::SamplerAddressMode addressModeV { vk::SamplerAddressMode::eRepeat };
+  vk::SamplerAddressMode addressModeW { vk::SamplerAddressMode::eRepeat };
+  float                  maxAnisotropy { 16.0f }; // 1 turns anisotropic filtering off, clamped to the device limit
+  float                  maxLod { VK_LOD_CLAMP_NONE };
+
+  bool operator<( const SamplerDescription& other ) const {
+    return std::tie( magFilter, minFilter, mipmapMode, addressModeU, addressModeV, addressModeW, maxAnisotropy, maxLod )
+           < std::tie( other.magFilter, other.minFilter, other.mipmapMode, other.addressModeU, other.addressModeV,
+                       other.addressModeW, other.maxAnisotropy, other.maxLod );
+  }
+};
+
+// Hands out one sampler per distinct description and owns all of them. Descriptions are clamped to what the device
+// allows before the lookup, so descriptions that end up the same share a sampler.
+class SamplerCache {
+  public:
+  SamplerCache() = default;
+  SamplerCache( const SamplerCache& )            = delete;
+  SamplerCache& operator=( const SamplerCache& ) = delete;
+
+  // `anisotropy` is whether samplerAnisotropy was enabled on the device
+  void create( vk::Device device, const DeviceCapabilities& capabilities, bool anisotropy ) {
+    mDevice        = device;
+    mMaxAnisotropy = anisotropy ? capabilities.limits().maxSamplerAnisotropy : 1.0f;
+  }
+
+  void destroy() {
+    for ( std::pair<const SamplerDescription, vk::Sampler>& sampler : mSamplers ) {
+      mDevice.destroySampler( sampler.second );
+    }
+    mSamplers.clear();
+  }
+
+  vk::Sampler get( SamplerDescription description ) {
+    description.maxAnisotropy = std::clamp( description.maxAnisotropy, 1.0f, mMaxAnisotropy );
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    auto                        found = mSamplers.find( description );
+    if ( found != mSamplers.end() ) {
+      return found->second;
+    }
+
+    vk::SamplerCreateInfo samplerInfo = {};
+    samplerInfo.magFilter             = description.magFilter;
+    samplerInfo.minFilter             = description.minFilter;
+    samplerInfo.mipmapMode            = description.mipmapMode;
+    samplerInfo.addressModeU          = description.addressModeU;
+    samplerInfo.addressModeV          = description.addressModeV;
+    samplerInfo.addressModeW          = description.addressModeW;
+    samplerInfo.anisotropyEnable      = description.maxAnisotropy > 1.0f ? VK_TRUE : VK_FALSE;
+    samplerInfo.maxAnisotropy         = description.maxAnisotropy;
+    samplerInfo.minLod                = 0.0f;
+    samplerInfo.maxLod                = description.maxLod;
+    samplerInfo.borderColor           = vk::BorderColor::eIntOpaqueBlack;
+
+    vk::Sampler sampler    = mDevice.createSampler( samplerInfo );
+    mSamplers[description] = sampler;
+    return sampler;
+  }
+
+  size_t size() const {
+    return mSamplers.size();
+  }
+
+  private:
+  vk::Device                                mDevice;
+  float                                     mMaxAnisotropy { 1.0f };
+  std::mutex                                mMutex;
+  std::map<SamplerDescription, vk::Sampler> mSamplers;
+};
+} // namespace utils
+
+// Texture file stuff
+namespace utils {
+// A KTX2 file mapped into memory, level data is read straight from the mapping when it is uploaded. Level 0 is the
+// largest one.
+struct Ktx2File {
+  struct Level {
+    uint64_t offset { 0 };
+    uint64_t size { 0 };
+  };
+
+  MappedFile         file;
+  vk::Format         format { vk::Format::eUndefined };
+  vk::Extent2D       extent;
+  std::vector<Level> levels;
+
+  const void* levelData( uint32_t level ) const {
+    return file.data() + levels[level].offset;
+  }
+};
+
+uint32_t mipLevelCount( vk::Extent2D extent ) {
+  uint32_t levels = 1;
+  while ( ( extent.width >> levels ) > 0 || ( extent.height >> levels ) > 0 ) {
+    levels++;
+  }
+  return levels;
+}
+
+vk::Extent2D mipExtent( vk::Extent2D extent, uint32_t level ) {
+  return vk::Extent2D( std::max( extent.width >> level, 1u ), std::max( extent.height >> level, 1u ) );
+}
+
+// Reads 2D, single layer, single face KTX2 files without supercompression, which covers BCn and ASTC payloads
+// written by toktx or compressonator. Basis Universal (vkFormat 0) would need a transcoder and is rejected.
+bool readKtx2( const std::string& filename, Ktx2File& ktx ) {
+  struct Header {
+    uint8_t  identifier[12];
+    uint32_t vkFormat;
+    uint32_t typeSize;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t pixelDepth;
+    uint32_t layerCount;
+    uint32_t faceCount;
+    uint32_t levelCount;
+    uint32_t supercompressionScheme;
+    uint32_t dfdByteOffset;
+    uint32_t dfdByteLength;
+    uint32_t kvdByteOffset;
+    uint32_t kvdByteLength;
+    uint64_t sgdByteOffset;
+    uint64_t sgdByteLength;
+  };
+  static const uint8_t kIdentifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+  if ( !ktx.file.open( filename ) || ktx.file.size() < sizeof( Header ) ) {
+    VFS_LOG_ERROR << "Failed to open \"" << filename << "\"";
+    return false;
+  }
+
+  Header header;
+  std::memcpy( &header, ktx.file.data(), sizeof( Header ) );
+  if ( std::memcmp( header.identifier, kIdentifier, sizeof( kIdentifier ) ) != 0 ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" is not a KTX2 file";
+    return false;
+  }
+  if ( header.vkFormat == 0 || header.supercompressionScheme != 0 ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" is supercompressed (Basis Universal or zstd), which is not supported";
+    return false;
+  }
+  if ( header.pixelDepth > 1 || header.layerCount > 1 || header.faceCount != 1 || header.pixelHeight == 0 ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" is not a plain 2D texture";
+    return false;
+  }
+
+  // 0 means the file only holds level 0, block compressed formats can not be blitted, so only that level is loaded
+  uint32_t levelCount = std::max( header.levelCount, 1u );
+  if ( levelCount > mipLevelCount( vk::Extent2D( header.pixelWidth, header.pixelHeight ) ) ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" has more levels than its extent allows";
+    return false;
+  }
+  size_t indexEnd = sizeof( Header ) + levelCount * sizeof( uint64_t ) * 3;
+  if ( ktx.file.size() < indexEnd ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" is truncated";
+    return false;
+  }
+
+  ktx.format = static_cast<vk::Format>( header.vkFormat );
+  ktx.extent = vk::Extent2D( header.pixelWidth, header.pixelHeight );
+  ktx.levels.resize( levelCount );
+  for ( uint32_t i = 0; i < levelCount; i++ ) {
+    uint64_t entry[3]; // byteOffset, byteLength, uncompressedByteLength
+    std::memcpy( entry, ktx.file.data() + sizeof( Header ) + i * sizeof( entry ), sizeof( entry ) );
+    if ( entry[0] > ktx.file.size() || entry[1] > ktx.file.size() - entry[0] ) { // No overflow on crafted offsets
+      VFS_LOG_ERROR << "\"" << filename << "\" level " << i << " lies outside the file";
+      return false;
+    }
+    ktx.levels[i] = { entry[0], entry[1] };
+  }
+  return true;
+}
+
+// Binary PPM (P6, 8 bit) as tightly packed RGBA8, the format writePpm() produces
+bool readPpm( const std::string& filename, std::vector<uint8_t>& pixels, vk::Extent2D& extent ) {
+  std::ifstream file( filename, std::ios::binary );
+  std::string   magic;
+  uint32_t      maxValue = 0;
+  file >> magic >> extent.width >> extent.height >> maxValue;
+  file.get(); // The single whitespace before the pixel data
+  if ( !file || magic != "P6" || maxValue != 255 || extent.width == 0 || extent.height == 0 ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" is not an 8 bit binary PPM";
+    return false;
+  }
+
+  size_t               texels = static_cast<size_t>( extent.width ) * extent.height;
+  std::vector<uint8_t> rgb( texels * 3 );
+  file.read( reinterpret_cast<char*>( rgb.data() ), rgb.size() );
+  if ( !file ) {
+    VFS_LOG_ERROR << "\"" << filename << "\" is truncated";
+    return false;
+  }
+
+  pixels.resize( texels * 4 );
+  for ( size_t i = 0; i < texels; i++ ) {
+    pixels[i * 4 + 0] = rgb[i * 3 + 0];
+    pixels[i * 4 + 1] = rgb[i * 3 + 1];
+    pixels[i * 4 + 2] = rgb[i * 3 + 2];
+    pixels[i * 4 + 3] = 255;
+  }
+  return true;
+}
+} // namespace utils
+
+// Texture streaming stuff
+namespace utils {
+using TextureHandle = uint32_t;
+
+struct TextureStats {
+  uint64_t       promotions { 0 };    // Times a texture got a finer mip level
+  uint64_t       mipChains { 0 };     // Mip chains generated on the GPU
+  vk::DeviceSize uploadedBytes { 0 };
+  vk::DeviceSize residentBytes { 0 }; // Device memory of every texture image, including ones being replaced
+  vk::DeviceSize budget { 0 };
+};
+
+// Owns every texture and keeps as many mip levels resident as the memory budget allows, coarse to fine across all
+// textures. KTX2 textures start with their levels up to kTailSize texels and gain one finer level at a time: the
+// level and the ones below it are uploaded into a new image, which replaces the old one once the upload completed
+// (the old one goes through the deletion queue). Uploading the coarser levels again costs a third of the new level
+// but keeps the copies on the transfer queue. Uncompressed textures are uploaded whole and get their mip chain from
+// vkCmdBlitImage on the graphics queue.
+//
+// Views change when a texture is promoted, read view() again every frame:
+//   load( ... ); per frame: TransferQueue::recordAcquires( cb ); update( cb ); if ( ready( t ) ) bind view( t )
+class TextureStreamer {
+  public:
+  static constexpr uint32_t kTailSize = 64;
+
+  TextureStreamer() = default;
+  TextureStreamer( const TextureStreamer& )            = delete;
+  TextureStreamer& operator=( const TextureStreamer& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities, DeviceAllocator& allocator,
+               TransferQueue& transfer, DeletionQueue& deletionQueue, vk::DeviceSize budget,
+               vk::DeviceSize uploadBytesPerFrame = 16ull << 20 ) {
+    mDevice              = device;
+    mCapabilities        = &capabilities;
+    mAllocator           = &allocator;
+    mTransfer            = &transfer;
+    mDeletionQueue       = &deletionQueue;
+    mUploadBytesPerFrame = uploadBytesPerFrame;
+    mStats.budget        = budget;
+  }
+
+  // The device has to be idle, images retired earlier belong to the deletion queue
+  void destroy() {
+    for ( Texture& texture : mTextures ) {
+      mDevice.destroyImageView( texture.view );
+      mAllocator->destroyImage( texture.image );
+      if ( texture.pendingImage.image ) {
+        mAllocator->destroyImage( texture.pendingImage );
+      }
+    }
+    mTextures.clear();
+  }
+
+  bool supportsFormat( vk::Format format ) const {
+    return static_cast<bool>( mCapabilities->formatProperties( format ).optimalTilingFeatures
+                              & vk::FormatFeatureFlagBits::eSampledImage );
+  }
+
+  // Loads the first candidate the device can sample: KTX2 files in their own format, PPM files as RGBA8 with a
+  // generated mip chain. List compressed variants first, e.g. { "rock.bc7.ktx2", "rock.astc.ktx2", "rock.ppm" }.
+  TextureHandle load( const std::vector<std::string>& candidates ) {
+    for ( const std::string& path : candidates ) {
+      if ( path.size() > 5 && path.compare( path.size() - 5, 5, ".ktx2" ) == 0 ) {
+        Texture texture;
+        texture.source = std::make_unique<Ktx2File>();
+        if ( !readKtx2( path, *texture.source ) ) {
+          continue;
+        }
+        if ( !supportsFormat( texture.source->format ) ) {
+          VFS_LOG_INFO << "Skipping \"" << path << "\", the device cannot sample "
+                       << vk::to_string( texture.source->format );
+          continue;
+        }
+        texture.name       = path;
+        texture.format     = texture.source->format;
+        texture.extent     = texture.source->extent;
+        texture.levelCount = static_cast<uint32_t>( texture.source->levels.size() );
+        texture.resident   = texture.levelCount;
+        return add( std::move( texture ) );
+      }
+
+      std::vector<uint8_t> pixels;
+      vk::Extent2D         extent;
+      if ( readPpm( path, pixels, extent ) ) {
+        return createTexture( path, pixels.data(), extent );
+      }
+    }
+    throw std::runtime_error( "No usable texture among the candidates." );
+  }
+
+  // RGBA8 texels, uploaded right away and mipmapped on the GPU when the format supports linear blits
+  TextureHandle createTexture( const std::string& name, const void* rgba, vk::Extent2D extent ) {
+    vk::FormatFeatureFlags blit = vk::FormatFeatureFlagBits::eBlitSrc | vk::FormatFeatureFlagBits::eBlitDst
+                                  | vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+    vk::Format     format  = vk::Format::eR8G8B8A8Unorm;
+    bool           blits   = ( mCapabilities->formatProperties( format ).optimalTilingFeatures & blit ) == blit;
+    bool           mipmaps = blits && mipLevelCount( extent ) > 1; // A 1x1 texture has no mips to generate
+    vk::DeviceSize size    = static_cast<vk::DeviceSize>( extent.width ) * extent.height * 4;
+    if ( size > mTransfer->capacity() ) {
+      throw std::runtime_error( "Texture \"" + name + "\" does not fit into the staging ring." );
+    }
+
+    Texture texture;
+    texture.name       = name;
+    texture.format     = format;
+    texture.extent     = extent;
+    texture.levelCount = mipmaps ? mipLevelCount( extent ) : 1;
+    texture.resident   = texture.levelCount;
+    texture.generate   = mipmaps;
+
+    // Level 0 is read by the blits when mips are generated, by shaders otherwise
+    vk::PipelineStageFlags dstStages   = mipmaps ? vk::PipelineStageFlagBits::eTransfer
+                                                 : vk::PipelineStageFlagBits::eFragmentShader;
+    vk::AccessFlags        dstAccess   = mipmaps ? vk::AccessFlagBits::eTransferRead : vk::AccessFlagBits::eShaderRead;
+    vk::ImageLayout        finalLayout = mipmaps ? vk::ImageLayout::eTransferSrcOptimal
+                                                 : vk::ImageLayout::eShaderReadOnlyOptimal;
+    texture.pendingImage               = createImage( texture, 0 );
+    texture.pending                    = 0;
+    texture.ticket = mTransfer->uploadImage( texture.pendingImage.image, vk::Extent3D( extent.width, extent.height, 1 ),
+                                             vk::ImageAspectFlagBits::eColor, rgba, size, dstStages, dstAccess,
+                                             finalLayout );
+    mStats.uploadedBytes += size;
+    return add( std::move( texture ) );
+  }
+
+  // Swaps in completed uploads (recording mip generation into `commandBuffer` where needed) and starts the next
+  // promotions. Record after TransferQueue::recordAcquires() and before anything samples the textures.
+  void update( vk::CommandBuffer commandBuffer ) {
+    for ( Texture& texture : mTextures ) {
+      if ( texture.pendingImage.image && mTransfer->isComplete( texture.ticket ) ) {
+        if ( texture.generate ) {
+          generateMips( commandBuffer, texture );
+        }
+        swap( texture );
+      }
+    }
+    promote();
+  }
+
+  bool ready( TextureHandle handle ) const {
+    return static_cast<bool>( mTextures[handle].view );
+  }
+
+  // Null until ready(), changes whenever a finer level is streamed in
+  vk::ImageView view( TextureHandle handle ) const {
+    return mTextures[handle].view;
+  }
+
+  // Finest mip level of the source that is resident, the level count when nothing is
+  uint32_t residentLevel( TextureHandle handle ) const {
+    return mTextures[handle].resident;
+  }
+
+  const TextureStats& stats() const {
+    return mStats;
+  }
+
+  void report() const {
+    uint32_t complete = 0;
+    for ( const Texture& texture : mTextures ) {
+      complete += texture.resident == 0 ? 1 : 0;
+    }
+    VFS_LOG_INFO << "Textures: " << complete << "/" << mTextures.size() << " fully resident, "
+                 << ( mStats.residentBytes >> 10 ) << " KiB of a " << ( mStats.budget >> 10 ) << " KiB budget, "
+                 << mStats.promotions << " promotions, " << mStats.mipChains << " mip chains generated, "
+                 << ( mStats.uploadedBytes >> 10 ) << " KiB uploaded";
+  }
+
+  private:
+  struct Texture {
+    std::string               name;
+    std::unique_ptr<Ktx2File> source; // Null for textures uploaded whole
+    vk::Format                format { vk::Format::eUndefined };
+    vk::Extent2D              extent;
+    uint32_t                  levelCount { 1 };
+    bool                      generate { false }; // Mips come from blits instead of the source
+    uint32_t                  resident { 0 };     // Source level that is mip 0 of `image`
+    ImageAllocation           image;
+    vk::ImageView             view;
+    uint32_t                  pending { 0 }; // Source level that is mip 0 of `pendingImage`
+    ImageAllocation           pendingImage;
+    uint64_t                  ticket { 0 };
+  };
+
+  TextureHandle add( Texture texture ) {
+    mTextures.push_back( std::move( texture ) );
+    return static_cast<TextureHandle>( mTextures.size() - 1 );
+  }
+
+  // Image holding source levels `firstLevel` to the last one
+  ImageAllocation createImage( const Texture& texture, uint32_t firstLevel ) {
+    vk::Extent2D        extent    = mipExtent( texture.extent, firstLevel );
+    vk::ImageCreateInfo imageInfo = {};
+    imageInfo.imageType           = vk::ImageType::e2D;
+    imageInfo.format              = texture.format;
+    imageInfo.extent              = vk::Extent3D( extent.width, extent.height, 1 );
+    imageInfo.mipLevels           = texture.levelCount - firstLevel;
+    imageInfo.arrayLayers         = 1;
+    imageInfo.samples             = vk::SampleCountFlagBits::e1;
+    imageInfo.tiling              = vk::ImageTiling::eOptimal;
+    imageInfo.usage               = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst;
+    imageInfo.sharingMode         = vk::SharingMode::eExclusive;
+    imageInfo.initialLayout       = vk::ImageLayout::eUndefined;
+    if ( texture.generate ) {
+      imageInfo.usage |= vk::ImageUsageFlagBits::eTransferSrc;
+    }
+
+    AllocationCreateInfo allocInfo = {};
+    allocInfo.usage                = MemoryUsage::eGpuOnly;
+    ImageAllocation image          = mAllocator->createImage( imageInfo, allocInfo );
+    mStats.residentBytes += image.allocation.size;
+    return image;
+  }
+
+  vk::DeviceSize levelBytes( const Texture& texture, uint32_t firstLevel ) const {
+    vk::DeviceSize bytes = 0;
+    for ( uint32_t level = firstLevel; level < texture.levelCount; level++ ) {
+      bytes += texture.source->levels[level].size;
+    }
+    return bytes;
+  }
+
+  // Coarsest textures first, so every texture gets its tail before any texture gets its finest level
+  void promote() {
+    std::vector<Texture*> candidates;
+    for ( Texture& texture : mTextures ) {
+      if ( texture.source && !texture.pendingImage.image && texture.resident > 0 ) {
+        candidates.push_back( &texture );
+      }
+    }
+    std::stable_sort( candidates.begin(), candidates.end(),
+                      []( const Texture* a, const Texture* b ) { return a->resident > b->resident; } );
+
+    vk::DeviceSize uploaded = 0;
+    for ( Texture* texture : candidates ) {
+      uint32_t target = texture->resident - 1;
+      if ( texture->resident == texture->levelCount ) {
+        // Nothing resident yet, start with every level up to the tail size
+        while ( target > 0 ) {
+          vk::Extent2D finer = mipExtent( texture->extent, target - 1 );
+          if ( std::max( finer.width, finer.height ) > kTailSize ) {
+            break;
+          }
+          target--;
+        }
+      }
+
+      // Both images exist until the swap, so the budget has to hold both
+      vk::DeviceSize bytes = levelBytes( *texture, target );
+      if ( mStats.residentBytes + bytes > mStats.budget
+           || texture->source->levels[target].size > mTransfer->capacity() ) {
+        continue;
+      }
+      if ( uploaded > 0 && uploaded + bytes > mUploadBytesPerFrame ) {
+        break;
+      }
+
+      texture->pending      = target;
+      texture->pendingImage = createImage( *texture, target );
+      for ( uint32_t level = target; level < texture->levelCount; level++ ) {
+        vk::Extent2D extent = mipExtent( texture->extent, level );
+        texture->ticket =
+            mTransfer->uploadImage( texture->pendingImage.image, vk::Extent3D( extent.width, extent.height, 1 ),
+                                    vk::ImageAspectFlagBits::eColor, texture->source->levelData( level ),
+                                    texture->source->levels[level].size, vk::PipelineStageFlagBits::eFragmentShader,
+                                    vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eShaderReadOnlyOptimal,
+                                    level - target );
+      }
+      uploaded += bytes;
+      mStats.uploadedBytes += bytes;
+    }
+  }
+
+  // Level 0 arrived in eTransferSrcOptimal, each level is blitted from the one above it
+  void generateMips( vk::CommandBuffer commandBuffer, Texture& texture ) {
+    vk::Image                 image = texture.pendingImage.image;
+    vk::ImageSubresourceRange range( vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 );
+
+    vk::ImageMemoryBarrier start( {}, vk::AccessFlagBits::eTransferWrite, vk::ImageLayout::eUndefined,
+                                  vk::ImageLayout::eTransferDstOptimal, VK_QUEUE_FAMILY_IGNORED,
+                                  VK_QUEUE_FAMILY_IGNORED, image,
+                                  vk::ImageSubresourceRange( vk::ImageAspectFlagBits::eColor, 1,
+                                                             texture.levelCount - 1, 0, 1 ) );
+    commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {},
+                                   nullptr, nullptr, start );
+
+    for ( uint32_t level = 1; level < texture.levelCount; level++ ) {
+      vk::Extent2D  src = mipExtent( texture.extent, level - 1 );
+      vk::Extent2D  dst = mipExtent( texture.extent, level );
+      vk::ImageBlit blit;
+      blit.srcSubresource = vk::ImageSubresourceLayers( vk::ImageAspectFlagBits::eColor, level - 1, 0, 1 );
+      blit.srcOffsets[1]  = vk::Offset3D( static_cast<int32_t>( src.width ), static_cast<int32_t>( src.height ), 1 );
+      blit.dstSubresource = vk::ImageSubresourceLayers( vk::ImageAspectFlagBits::eColor, level, 0, 1 );
+      blit.dstOffsets[1]  = vk::Offset3D( static_cast<int32_t>( dst.width ), static_cast<int32_t>( dst.height ), 1 );
+      commandBuffer.blitImage( image, vk::ImageLayout::eTransferSrcOptimal, image,
+                               vk::ImageLayout::eTransferDstOptimal, blit, vk::Filter::eLinear );
+
+      range.baseMipLevel = level;
+      vk::ImageMemoryBarrier toSource( vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferRead,
+                                       vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eTransferSrcOptimal,
+                                       VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, range );
+      commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {},
+                                     nullptr, nullptr, toSource );
+    }
+
+    vk::ImageMemoryBarrier toShader( vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead,
+                                     vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eShaderReadOnlyOptimal,
+                                     VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image,
+                                     vk::ImageSubresourceRange( vk::ImageAspectFlagBits::eColor, 0,
+                                                                texture.levelCount, 0, 1 ) );
+    commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader,
+                                   {}, nullptr, nullptr, toShader );
+    texture.generate = false;
+    mStats.mipChains++;
+  }
+
+  // Frames in flight may still sample the old image, so it goes through the deletion queue
+  void swap( Texture& texture ) {
+    if ( texture.image.image ) {
+      mStats.residentBytes -= texture.image.allocation.size;
+      mDeletionQueue->retire( texture.view );
+      mDeletionQueue->retire( texture.image );
+      mStats.promotions++;
+    }
+
+    vk::ImageViewCreateInfo viewInfo = {};
+    viewInfo.image                   = texture.pendingImage.image;
+    viewInfo.viewType                = vk::ImageViewType::e2D;
+    viewInfo.format                  = texture.format;
+    viewInfo.subresourceRange        = vk::ImageSubresourceRange( vk::ImageAspectFlagBits::eColor, 0,
+                                                                  texture.levelCount - texture.pending, 0, 1 );
+    texture.view                     = mDevice.createImageView( viewInfo );
+    texture.image                    = texture.pendingImage;
+    texture.resident                 = texture.pending;
+    texture.pendingImage             = ImageAllocation();
+  }
+
+  vk::Device                mDevice;
+  const DeviceCapabilities* mCapabilities { nullptr };
+  DeviceAllocator*          mAllocator { nullptr };
+  TransferQueue*            mTransfer { nullptr };
+  DeletionQueue*            mDeletionQueue { nullptr };
+  vk::DeviceSize            mUploadBytesPerFrame { 0 };
+  std::vector<Texture>      mTextures;
+  TextureStats              mStats;
+};
+} // namespace utils
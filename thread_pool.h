@@ -0,0 +1,83 @@
+#pragma once
+
+#include "pch.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace utils {
+// Fixed size pool of worker threads pulling tasks from a single FIFO queue
+class ThreadPool {
+  public:
+  explicit ThreadPool( uint32_t threadCount = 0 ) {
+    if ( threadCount == 0 ) {
+      threadCount = std::max( std::thread::hardware_concurrency(), 1u );
+    }
+
+    for ( uint32_t i = 0; i < threadCount; i++ ) {
+      mWorkers.emplace_back( [this]() { workerLoop(); } );
+    }
+  }
+
+  ThreadPool( const ThreadPool& )            = delete;
+  ThreadPool& operator=( const ThreadPool& ) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock( mMutex );
+      mStopping = true;
+    }
+    mWakeup.notify_all();
+    for ( std::thread& worker : mWorkers ) {
+      worker.join();
+    }
+  }
+
+  uint32_t size() const {
+    return static_cast<uint32_t>( mWorkers.size() );
+  }
+
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit( F&& task ) {
+    using Result = std::invoke_result_t<F>;
+
+    // packaged_task is move only, std::function needs a copyable target
+    std::shared_ptr<std::packaged_task<Result()>> packaged =
+        std::make_shared<std::packaged_task<Result()>>( std::forward<F>( task ) );
+    std::future<Result> future = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock( mMutex );
+      mTasks.emplace_back( [packaged]() { ( *packaged )(); } );
+    }
+    mWakeup.notify_one();
+    return future;
+  }
+
+  private:
+  void workerLoop() {
+    while ( true ) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock( mMutex );
+        mWakeup.wait( lock, [this]() { return mStopping || !mTasks.empty(); } );
+        if ( mTasks.empty() ) {
+          return;
+        }
+        task = std::move( mTasks.front() );
+        mTasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread>          mWorkers;
+  std::deque<std::function<void()>> mTasks;
+  std::mutex                        mMutex;
+  std::condition_variable           mWakeup;
+  bool                              mStopping { false };
+};
+} // namespace utils
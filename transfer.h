@@ -0,0 +1,402 @@
+#pragma once
+
+#include "allocator.h"
+#include <deque>
+
+// Upload stuff
+namespace utils {
+struct TransferStats {
+  uint64_t       batches { 0 };
+  uint64_t       copies { 0 };
+  vk::DeviceSize bytes { 0 };
+  uint64_t       stalls { 0 }; // Times the ring was full and the CPU had to wait for an old batch
+};
+
+// Streams data to device local buffers and images through one persistently mapped staging ring. Uploads recorded
+// between two flush() calls go to the GPU as a single submission, whose fence is polled from collect() instead of
+// waited on. When the device has a transfer only queue family the copies run there, and ownership of the destination
+// is handed to the graphics family by recordAcquires() once the batch completed.
+//
+// Not thread safe, meant to be driven from the render loop:
+//   ticket = uploadBuffer(...); flush();  ...  collect(); if ( isComplete( ticket ) ) { recordAcquires( cb ); draw }
+class TransferQueue {
+  public:
+  TransferQueue() = default;
+  TransferQueue( const TransferQueue& ) = delete;
+  TransferQueue& operator=( const TransferQueue& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities, DeviceAllocator& allocator, vk::Queue queue,
+               uint32_t queueFamily, uint32_t graphicsFamily, vk::DeviceSize ringSize = 32ull << 20 ) {
+    mDevice         = device;
+    mAllocator      = &allocator;
+    mQueue          = queue;
+    mQueueFamily    = queueFamily;
+    mGraphicsFamily = graphicsFamily;
+    mCopyAlignment  = std::max<vk::DeviceSize>( capabilities.limits().optimalBufferCopyOffsetAlignment, 16 );
+
+    vk::CommandPoolCreateInfo poolInfo = {};
+    poolInfo.flags = vk::CommandPoolCreateFlagBits::eTransient | vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+    poolInfo.queueFamilyIndex = mQueueFamily;
+    mCommandPool              = mDevice.createCommandPool( poolInfo );
+
+    vk::BufferCreateInfo bufferInfo = {};
+    bufferInfo.size                 = ringSize;
+    bufferInfo.usage                = vk::BufferUsageFlagBits::eTransferSrc;
+    bufferInfo.sharingMode          = vk::SharingMode::eExclusive;
+
+    AllocationCreateInfo allocInfo = {};
+    allocInfo.usage                = MemoryUsage::eCpuToGpu;
+    allocInfo.dedicated            = true;
+    mRing                          = mAllocator->createBuffer( bufferInfo, allocInfo );
+    mRingSize                      = ringSize;
+
+    VFS_LOG_INFO << "Transfer queue on family " << mQueueFamily
+                 << ( mQueueFamily != mGraphicsFamily ? " (dedicated)" : " (shared with graphics)" ) << ", "
+                 << ( ringSize >> 20 ) << " MiB staging ring";
+  }
+
+  void destroy() {
+    waitIdle();
+    for ( Batch& batch : mFreeBatches ) {
+      mDevice.destroyFence( batch.fence );
+      mDevice.freeCommandBuffers( mCommandPool, batch.commandBuffer );
+    }
+    mFreeBatches.clear();
+    mDevice.destroyCommandPool( mCommandPool );
+    mAllocator->destroyBuffer( mRing );
+  }
+
+  // Copies `size` bytes into `buffer` at `offset`. `dstStages`/`dstAccess` describe how the graphics queue will read
+  // the buffer. Returns the ticket of the batch the copy went into.
+  uint64_t uploadBuffer( vk::Buffer buffer, vk::DeviceSize offset, const void* data, vk::DeviceSize size,
+                         vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess ) {
+    if ( size == 0 ) {
+      throw std::runtime_error( "Buffer upload is empty." );
+    }
+
+    // Uploads larger than a quarter of the ring are split so one asset can never occupy all of it
+    const uint8_t* bytes     = static_cast<const uint8_t*>( data );
+    vk::DeviceSize chunkSize = std::max<vk::DeviceSize>( mRingSize / 4, mCopyAlignment );
+    for ( vk::DeviceSize done = 0; done < size; done += chunkSize ) {
+      vk::DeviceSize chunk         = std::min( chunkSize, size - done );
+      vk::DeviceSize stagingOffset = stage( bytes + done, chunk, mCopyAlignment );
+
+      vk::BufferCopy region = {};
+      region.srcOffset      = stagingOffset;
+      region.dstOffset      = offset + done;
+      region.size           = chunk;
+      mOpen->commandBuffer.copyBuffer( mRing.buffer, buffer, region );
+      mOpen->copies++;
+    }
+
+    if ( ownershipTransfer() ) {
+      vk::BufferMemoryBarrier release = {};
+      release.srcAccessMask           = vk::AccessFlagBits::eTransferWrite;
+      release.srcQueueFamilyIndex     = mQueueFamily;
+      release.dstQueueFamilyIndex     = mGraphicsFamily;
+      release.buffer                  = buffer;
+      release.offset                  = offset;
+      release.size                    = size;
+      mOpen->commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer,
+                                            vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), nullptr,
+                                            release, nullptr );
+
+      vk::BufferMemoryBarrier acquire = release;
+      acquire.srcAccessMask           = vk::AccessFlags();
+      acquire.dstAccessMask           = dstAccess;
+      mOpen->bufferAcquires.push_back( acquire );
+    }
+    mOpen->dstStages |= dstStages;
+    mOpen->dstAccess |= dstAccess;
+    return mOpen->ticket;
+  }
+
+  // Uploads tightly packed texels (or compressed blocks) into `mipLevel`, layer 0 of `image` and leaves that level in
+  // `finalLayout`. `extent` is the extent of the level, `dstStages`/`dstAccess` describe how the graphics queue will
+  // read it. The data has to fit into the staging ring in one piece, see capacity().
+  uint64_t uploadImage( vk::Image image, vk::Extent3D extent, vk::ImageAspectFlags aspect, const void* data,
+                        vk::DeviceSize size, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess,
+                        vk::ImageLayout finalLayout, uint32_t mipLevel = 0 ) {
+    if ( size > mRingSize ) {
+      throw std::runtime_error( "Image upload does not fit into the staging ring." );
+    }
+    vk::DeviceSize stagingOffset = stage( data, size, mCopyAlignment );
+
+    vk::ImageMemoryBarrier toTransfer          = {};
+    toTransfer.dstAccessMask                   = vk::AccessFlagBits::eTransferWrite;
+    toTransfer.oldLayout                       = vk::ImageLayout::eUndefined;
+    toTransfer.newLayout                       = vk::ImageLayout::eTransferDstOptimal;
+    toTransfer.srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.image                           = image;
+    toTransfer.subresourceRange.aspectMask     = aspect;
+    toTransfer.subresourceRange.baseMipLevel   = mipLevel;
+    toTransfer.subresourceRange.levelCount     = 1;
+    toTransfer.subresourceRange.baseArrayLayer = 0;
+    toTransfer.subresourceRange.layerCount     = 1;
+    mOpen->commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer,
+                                          vk::DependencyFlags(), nullptr, nullptr, toTransfer );
+
+    vk::BufferImageCopy region             = {};
+    region.bufferOffset                    = stagingOffset;
+    region.imageSubresource.aspectMask     = aspect;
+    region.imageSubresource.mipLevel       = mipLevel;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount     = 1;
+    region.imageExtent                     = extent;
+    mOpen->commandBuffer.copyBufferToImage( mRing.buffer, image, vk::ImageLayout::eTransferDstOptimal, region );
+    mOpen->copies++;
+
+    // Without an ownership transfer this is the final transition, with one it is the release half of it
+    vk::ImageMemoryBarrier toFinal = toTransfer;
+    toFinal.srcAccessMask          = vk::AccessFlagBits::eTransferWrite;
+    toFinal.dstAccessMask          = ownershipTransfer() ? vk::AccessFlags() : dstAccess;
+    toFinal.oldLayout              = vk::ImageLayout::eTransferDstOptimal;
+    toFinal.newLayout              = finalLayout;
+    if ( ownershipTransfer() ) {
+      toFinal.srcQueueFamilyIndex = mQueueFamily;
+      toFinal.dstQueueFamilyIndex = mGraphicsFamily;
+      mOpen->commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer,
+                                            vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), nullptr,
+                                            nullptr, toFinal );
+
+      vk::ImageMemoryBarrier acquire = toFinal;
+      acquire.srcAccessMask          = vk::AccessFlags();
+      acquire.dstAccessMask          = dstAccess;
+      mOpen->imageAcquires.push_back( acquire );
+    } else {
+      mOpen->commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, dstStages, vk::DependencyFlags(),
+                                            nullptr, nullptr, toFinal );
+    }
+    mOpen->dstStages |= dstStages;
+    mOpen->dstAccess |= dstAccess;
+    return mOpen->ticket;
+  }
+
+  // Submits everything recorded since the last flush as one batch, never waits
+  void flush() {
+    if ( !mOpen ) {
+      return;
+    }
+
+    mOpen->commandBuffer.end();
+    mAllocator->flush( mRing.allocation );
+
+    vk::SubmitInfo submitInfo     = {};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers    = &mOpen->commandBuffer;
+    mQueue.submit( submitInfo, mOpen->fence );
+
+    mOpen->ringEnd = mHead;
+    mStats.batches++;
+    mStats.copies += mOpen->copies;
+    mInFlight.push_back( std::move( *mOpen ) );
+    mOpen.reset();
+  }
+
+  // Retires every batch whose fence signaled and frees its part of the ring, never waits
+  void collect() {
+    while ( !mInFlight.empty() && mDevice.getFenceStatus( mInFlight.front().fence ) == vk::Result::eSuccess ) {
+      retire();
+    }
+  }
+
+  bool isComplete( uint64_t ticket ) const {
+    return ticket <= mCompleted;
+  }
+
+  // Makes the data of completed batches visible to the graphics queue, record before the commands that read it
+  void recordAcquires( vk::CommandBuffer commandBuffer ) {
+    if ( mPendingStages && ownershipTransfer() ) {
+      commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, mPendingStages, vk::DependencyFlags(),
+                                     nullptr, mPendingBufferAcquires, mPendingImageAcquires );
+    } else if ( mPendingStages ) {
+      // Same queue family: the copies are ordered before us, their writes only need to become visible
+      vk::MemoryBarrier visibility = {};
+      visibility.srcAccessMask     = vk::AccessFlagBits::eTransferWrite;
+      visibility.dstAccessMask     = mPendingAccess;
+      commandBuffer.pipelineBarrier( vk::PipelineStageFlagBits::eTransfer, mPendingStages, vk::DependencyFlags(),
+                                     visibility, nullptr, nullptr );
+    }
+    mPendingBufferAcquires.clear();
+    mPendingImageAcquires.clear();
+    mPendingStages = vk::PipelineStageFlags();
+    mPendingAccess = vk::AccessFlags();
+  }
+
+  // Blocks until every submitted batch completed, for shutdown and loading screens
+  void waitIdle() {
+    flush();
+    while ( !mInFlight.empty() ) {
+      waitOldest();
+    }
+  }
+
+  // Largest single image upload
+  vk::DeviceSize capacity() const {
+    return mRingSize;
+  }
+
+  const TransferStats& stats() const {
+    return mStats;
+  }
+
+  void report() const {
+    VFS_LOG_INFO << "Transfers: " << mStats.bytes << " bytes in " << mStats.copies << " copies, " << mStats.batches
+                 << " batches, " << mStats.stalls << " stalls on a full staging ring";
+  }
+
+  private:
+  struct Batch {
+    vk::CommandBuffer                    commandBuffer;
+    vk::Fence                            fence;
+    uint64_t                             ticket { 0 };
+    uint64_t                             copies { 0 };
+    vk::DeviceSize                       ringBytes { 0 }; // Ring space used, including alignment and wrap padding
+    vk::DeviceSize                       ringEnd { 0 };
+    vk::PipelineStageFlags               dstStages;
+    vk::AccessFlags                      dstAccess;
+    std::vector<vk::BufferMemoryBarrier> bufferAcquires;
+    std::vector<vk::ImageMemoryBarrier>  imageAcquires;
+  };
+
+  bool ownershipTransfer() const {
+    return mQueueFamily != mGraphicsFamily;
+  }
+
+  // Copies `data` into the ring and returns its offset there, making room by flushing and waiting if needed
+  vk::DeviceSize stage( const void* data, vk::DeviceSize size, vk::DeviceSize alignment ) {
+    vk::DeviceSize offset = 0;
+    while ( !reserve( size, alignment, offset ) ) {
+      // The open batch may hold the space we are waiting for, so it has to go out first
+      flush();
+      if ( mInFlight.empty() ) {
+        throw std::runtime_error( "Staging ring is too small for the upload." );
+      }
+      mStats.stalls++;
+      waitOldest();
+    }
+
+    std::memcpy( static_cast<uint8_t*>( mRing.allocation.mapped ) + offset, data, size );
+    mStats.bytes += size;
+    return offset;
+  }
+
+  bool reserve( vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize& offset ) {
+    if ( mUsed == 0 ) {
+      mHead = mTail = 0;
+    } else if ( mHead == mTail ) {
+      return false; // Completely full
+    }
+
+    vk::DeviceSize aligned = alignUp( mHead, alignment );
+    vk::DeviceSize newHead = 0;
+    if ( mHead >= mTail && aligned + size <= mRingSize ) {
+      offset  = aligned;
+      newHead = aligned + size;
+    } else if ( mHead >= mTail && size <= mTail ) {
+      offset  = 0; // Wrap around, the space left at the end is wasted until the tail passes it
+      newHead = size;
+    } else if ( mHead < mTail && aligned + size <= mTail ) {
+      offset  = aligned;
+      newHead = aligned + size;
+    } else {
+      return false;
+    }
+
+    vk::DeviceSize consumed = newHead >= mHead ? newHead - mHead : mRingSize - mHead + newHead;
+    mHead                   = newHead;
+    mUsed += consumed;
+    openBatch();
+    mOpen->ringBytes += consumed;
+    return true;
+  }
+
+  void openBatch() {
+    if ( mOpen ) {
+      return;
+    }
+
+    if ( mFreeBatches.empty() ) {
+      vk::CommandBufferAllocateInfo commandInfo = {};
+      commandInfo.commandPool                   = mCommandPool;
+      commandInfo.level                         = vk::CommandBufferLevel::ePrimary;
+      commandInfo.commandBufferCount            = 1;
+
+      Batch batch;
+      batch.commandBuffer = mDevice.allocateCommandBuffers( commandInfo ).front();
+      batch.fence         = mDevice.createFence( vk::FenceCreateInfo() );
+      mFreeBatches.push_back( std::move( batch ) );
+    }
+
+    mOpen = std::move( mFreeBatches.back() );
+    mFreeBatches.pop_back();
+    mOpen->ticket = ++mSubmitted;
+
+    vk::CommandBufferBeginInfo beginInfo = {};
+    beginInfo.flags                      = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    mOpen->commandBuffer.reset();
+    mOpen->commandBuffer.begin( beginInfo );
+  }
+
+  void waitOldest() {
+    if ( mDevice.waitForFences( mInFlight.front().fence, VK_TRUE, UINT64_MAX ) != vk::Result::eSuccess ) {
+      throw std::runtime_error( "Failed waiting for an upload batch." );
+    }
+    retire();
+  }
+
+  // Batches complete in submission order, so the oldest one always owns the tail of the ring
+  void retire() {
+    Batch batch = std::move( mInFlight.front() );
+    mInFlight.pop_front();
+
+    mTail = batch.ringEnd;
+    mUsed -= batch.ringBytes;
+    mCompleted = batch.ticket;
+
+    mPendingBufferAcquires.insert( mPendingBufferAcquires.end(), batch.bufferAcquires.begin(),
+                                   batch.bufferAcquires.end() );
+    mPendingImageAcquires.insert( mPendingImageAcquires.end(), batch.imageAcquires.begin(),
+                                  batch.imageAcquires.end() );
+    mPendingStages |= batch.dstStages;
+    mPendingAccess |= batch.dstAccess;
+
+    mDevice.resetFences( batch.fence );
+    batch.copies    = 0;
+    batch.ringBytes = 0;
+    batch.dstStages = vk::PipelineStageFlags();
+    batch.dstAccess = vk::AccessFlags();
+    batch.bufferAcquires.clear();
+    batch.imageAcquires.clear();
+    mFreeBatches.push_back( std::move( batch ) );
+  }
+
+  vk::Device       mDevice;
+  DeviceAllocator* mAllocator { nullptr };
+  vk::Queue        mQueue;
+  uint32_t         mQueueFamily { 0 };
+  uint32_t         mGraphicsFamily { 0 };
+  vk::CommandPool  mCommandPool;
+  vk::DeviceSize   mCopyAlignment { 16 };
+
+  BufferAllocation mRing;
+  vk::DeviceSize   mRingSize { 0 };
+  vk::DeviceSize   mHead { 0 };
+  vk::DeviceSize   mTail { 0 };
+  vk::DeviceSize   mUsed { 0 };
+
+  std::optional<Batch> mOpen;
+  std::deque<Batch>    mInFlight;
+  std::vector<Batch>   mFreeBatches;
+  uint64_t             mSubmitted { 0 };
+  uint64_t             mCompleted { 0 };
+
+  std::vector<vk::BufferMemoryBarrier> mPendingBufferAcquires;
+  std::vector<vk::ImageMemoryBarrier>  mPendingImageAcquires;
+  vk::PipelineStageFlags               mPendingStages;
+  vk::AccessFlags                      mPendingAccess;
+
+  TransferStats mStats;
+};
+} // namespace utils
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "allocator.h"
+#include "descriptors.h"
+#include <atomic>
+
+// Per draw data stuff
+namespace utils {
+// Every implementation supports at least this much push constant space, data up to this size skips the ring
+constexpr uint32_t kMaxPushConstantBytes = 128;
+
+// A slice of the current frame's ring, written through `data` and bound by its `offset`
+struct RingSlice {
+  void*    data { nullptr };
+  uint32_t offset { 0 };
+  uint32_t size { 0 };
+};
+
+// Persistently mapped uniform/storage ring, one region per frame in flight. Slices are bump allocated from the
+// current frame's region and bound with dynamic offsets through one descriptor set written at creation, so steady
+// state draws neither allocate nor write descriptors. The region of a frame is reused once its fence signaled.
+// allocate() is lock free and may be called from recording workers.
+class FrameRing {
+  public:
+  static constexpr uint32_t kUniformBinding = 0;
+  static constexpr uint32_t kStorageBinding = 1;
+
+  FrameRing() = default;
+  FrameRing( const FrameRing& )            = delete;
+  FrameRing& operator=( const FrameRing& ) = delete;
+
+  void create( vk::Device device, const DeviceCapabilities& capabilities, DeviceAllocator& allocator,
+               DescriptorLayoutCache& layouts, uint32_t framesInFlight, vk::DeviceSize regionSize = 4ull << 20 ) {
+    mDevice    = device;
+    mAllocator = &allocator;
+
+    // Slices are aligned for both bindings, so any slice can be bound at either one
+    const vk::PhysicalDeviceLimits& limits = capabilities.limits();
+
+    mAlignment    = std::max( limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment );
+    mRegionSize   = alignUp( regionSize, mAlignment );
+    mUniformRange = static_cast<uint32_t>( std::min<vk::DeviceSize>( limits.maxUniformBufferRange, 64u << 10 ) );
+    mStorageRange = static_cast<uint32_t>( std::min<vk::DeviceSize>( limits.maxStorageBufferRange, mRegionSize ) );
+
+    // The descriptor ranges are fixed, so the last slice still needs a full range behind its offset
+    vk::BufferCreateInfo bufferInfo = {};
+    bufferInfo.size                 = mRegionSize * framesInFlight + std::max( mUniformRange, mStorageRange );
+    bufferInfo.usage                = vk::BufferUsageFlagBits::eUniformBuffer;
+    bufferInfo.usage               |= vk::BufferUsageFlagBits::eStorageBuffer;
+    bufferInfo.sharingMode          = vk::SharingMode::eExclusive;
+
+    AllocationCreateInfo allocInfo = {};
+    allocInfo.usage                = MemoryUsage::eCpuToGpu;
+    mBuffer                        = allocator.createBuffer( bufferInfo, allocInfo );
+
+    vk::ShaderStageFlags stages = vk::ShaderStageFlagBits::eAllGraphics | vk::ShaderStageFlagBits::eCompute;
+    mLayout                     = layouts.get( {
+        { kUniformBinding, vk::DescriptorType::eUniformBufferDynamic, 1, stages },
+        { kStorageBinding, vk::DescriptorType::eStorageBufferDynamic, 1, stages },
+    } );
+
+    std::array<vk::DescriptorPoolSize, 2> sizes = {
+      vk::DescriptorPoolSize( vk::DescriptorType::eUniformBufferDynamic, 1 ),
+      vk::DescriptorPoolSize( vk::DescriptorType::eStorageBufferDynamic, 1 ),
+    };
+    vk::DescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.maxSets                      = 1;
+    poolInfo.poolSizeCount                = static_cast<uint32_t>( sizes.size() );
+    poolInfo.pPoolSizes                   = sizes.data();
+    mPool                                 = mDevice.createDescriptorPool( poolInfo );
+
+    vk::DescriptorSetAllocateInfo setInfo = {};
+    setInfo.descriptorPool                = mPool;
+    setInfo.descriptorSetCount            = 1;
+    setInfo.pSetLayouts                   = &mLayout;
+    mSet                                  = mDevice.allocateDescriptorSets( setInfo ).front();
+
+    vk::DescriptorBufferInfo              uniformInfo( mBuffer.buffer, 0, mUniformRange );
+    vk::DescriptorBufferInfo              storageInfo( mBuffer.buffer, 0, mStorageRange );
+    std::array<vk::WriteDescriptorSet, 2> writes = {
+      vk::WriteDescriptorSet( mSet, kUniformBinding, 0, 1, vk::DescriptorType::eUniformBufferDynamic, nullptr,
+                              &uniformInfo ),
+      vk::WriteDescriptorSet( mSet, kStorageBinding, 0, 1, vk::DescriptorType::eStorageBufferDynamic, nullptr,
+                              &storageInfo ),
+    };
+    mDevice.updateDescriptorSets( writes, nullptr );
+  }
+
+  // The layout belongs to the layout cache
+  void destroy() {
+    if ( mAllocator ) {
+      mAllocator->destroyBuffer( mBuffer );
+    }
+    mDevice.destroyDescriptorPool( mPool );
+    mPool = nullptr;
+  }
+
+  vk::DescriptorSetLayout layout() const {
+    return mLayout;
+  }
+
+  vk::DescriptorSet set() const {
+    return mSet;
+  }
+
+  // Starts allocating from the region of `frame`, call after its fence signaled
+  void beginFrame( uint32_t frame ) {
+    mBegin = frame * mRegionSize;
+    mHead  = mBegin;
+  }
+
+  // Makes the frame's writes visible to the GPU (non coherent memory only), call before submitting
+  void endFrame() {
+    vk::DeviceSize used = std::min( mHead.load(), mBegin + mRegionSize ) - mBegin;
+    mAllocator->flush( mBuffer.allocation, mBegin, used );
+  }
+
+  RingSlice allocate( vk::DeviceSize size ) {
+    // Sizes are rounded up, so every offset handed out stays aligned
+    vk::DeviceSize offset = mHead.fetch_add( alignUp( size, mAlignment ) );
+    if ( offset + size > mBegin + mRegionSize ) {
+      throw std::runtime_error( "Frame ring region is full, create the ring with a larger region." );
+    }
+
+    RingSlice slice;
+    slice.data   = static_cast<char*>( mBuffer.allocation.mapped ) + offset;
+    slice.offset = static_cast<uint32_t>( offset );
+    slice.size   = static_cast<uint32_t>( size );
+    return slice;
+  }
+
+  template <typename T>
+  RingSlice push( const T& value ) {
+    RingSlice slice = allocate( sizeof( T ) );
+    std::memcpy( slice.data, &value, sizeof( T ) );
+    return slice;
+  }
+
+  // Binds the ring set with `uniform` at the uniform binding and `storage` (or the region start) at the storage one
+  void bind( vk::CommandBuffer commandBuffer, vk::PipelineBindPoint bindPoint, vk::PipelineLayout layout,
+             uint32_t set, const RingSlice& uniform, const RingSlice* storage = nullptr ) const {
+    std::array<uint32_t, 2> offsets = { uniform.offset,
+                                        storage ? storage->offset : static_cast<uint32_t>( mBegin ) };
+    commandBuffer.bindDescriptorSets( bindPoint, layout, set, mSet, offsets );
+  }
+
+  uint32_t uniformRange() const {
+    return mUniformRange;
+  }
+
+  private:
+  vk::Device                  mDevice;
+  DeviceAllocator*            mAllocator { nullptr };
+  BufferAllocation            mBuffer;
+  vk::DescriptorSetLayout     mLayout;
+  vk::DescriptorPool          mPool;
+  vk::DescriptorSet           mSet;
+  vk::DeviceSize              mAlignment { 256 };
+  vk::DeviceSize              mRegionSize { 0 };
+  uint32_t                    mUniformRange { 0 };
+  uint32_t                    mStorageRange { 0 };
+  vk::DeviceSize              mBegin { 0 };
+  std::atomic<vk::DeviceSize> mHead { 0 };
+};
+
+// Push constant range for per draw data of type T, see pushDrawData
+template <typename T>
+vk::PushConstantRange drawDataRange( vk::ShaderStageFlags stages ) {
+  static_assert( sizeof( T ) <= kMaxPushConstantBytes, "Per draw data this large goes through the FrameRing" );
+  return vk::PushConstantRange( stages, 0, sizeof( T ) );
+}
+
+// Hands per draw data to the shaders: push constants when it fits into kMaxPushConstantBytes, otherwise a ring slice
+// bound at `ringSet` with a dynamic offset. Which path a type takes is decided at compile time, so its shaders know
+// where to read it from.
+template <typename T>
+void pushDrawData( vk::CommandBuffer commandBuffer, vk::PipelineBindPoint bindPoint, vk::PipelineLayout layout,
+                   vk::ShaderStageFlags stages, const T& data, FrameRing& ring, uint32_t ringSet ) {
+  if constexpr ( sizeof( T ) <= kMaxPushConstantBytes ) {
+    commandBuffer.pushConstants( layout, stages, 0, sizeof( T ), &data );
+  } else {
+    static_assert( sizeof( T ) <= 16384, "Larger than the uniform range every implementation supports" );
+    ring.bind( commandBuffer, bindPoint, layout, ringSet, ring.push( data ) );
+  }
+}
+} // namespace utils
@@ -1,27 +1,26 @@
 #pragma once
 
-#include "pch.h"
+#include "capabilities.h"
+#include "deletion_queue.h"
+#include "logger.h"
+#include "pipeline_cache.h"
+#include "shader_registry.h"
+#include "vertex.h"
 #include <GLFW/glfw3.h>
-#include <fstream>
+#include <cerrno>
+#include <limits>
+#include <type_traits>
 
 namespace utils {
 
-std::vector<char> readFile( const std::string& filename ) {
-  std::ifstream file( filename, std::ios::ate | std::ios::binary );
-  if ( !file.is_open() ) {
-    std::cerr << "Failed to load \"" << filename << "\"" << std::endl;
+// Creates a standalone module the caller has to destroy, use ShaderModuleRegistry to share modules instead
+vk::ShaderModule createModule( const std::string& filepath, vk::Device device ) {
+  // Mapped instead of read, the driver copies the code during creation anyway
+  MappedFile sourceCode;
+  if ( !sourceCode.open( filepath ) ) {
+    throw std::runtime_error( "Failed to load \"" + filepath + "\"." );
   }
 
-  size_t            filesize { static_cast<size_t>( file.tellg() ) };
-  std::vector<char> buffer( filesize );
-  file.seekg( 0 );
-  file.read( buffer.data(), filesize );
-  file.close();
-  return buffer;
-}
-
-vk::ShaderModule createModule( const std::string& filepath, vk::Device device ) {
-  std::vector<char>          sourceCode = readFile( filepath );
   vk::ShaderModuleCreateInfo moduleInfo;
   moduleInfo.flags    = vk::ShaderModuleCreateFlags();
   moduleInfo.codeSize = sourceCode.size();
@@ -30,16 +29,18 @@ vk::ShaderModule createModule( const std::string& filepath, vk::Device device )
   try {
     return device.createShaderModule( moduleInfo );
   } catch ( vk::SystemError& err ) {
-    std::cerr << "Failed to create shader module \"" << filepath << "\"" << std::endl;
+    throw std::runtime_error( "Failed to create shader module \"" + filepath + "\"." );
   }
 }
 
 struct QueueFamilyIndices {
   std::optional<uint32_t> graphicsFamily;
   std::optional<uint32_t> presentFamily;
+  std::optional<uint32_t> transferFamily; // Transfer only family (a copy engine), empty when the device has none
+  std::optional<uint32_t> computeFamily;  // Compute without graphics (async compute), empty when the device has none
 
-  bool isComplete() {
-    return graphicsFamily.has_value() && presentFamily.has_value();
+  bool isComplete( bool needsPresent = true ) {
+    return graphicsFamily.has_value() && ( presentFamily.has_value() || !needsPresent );
   }
 };
 
@@ -50,8 +51,10 @@ struct SwapchainSupportDetails {
 };
 
 struct SwapchainFrame {
-  vk::Image     image;
-  vk::ImageView imageView;
+  vk::Image       image;
+  vk::ImageView   imageView;
+  vk::Framebuffer framebuffer;
+  vk::Semaphore   renderFinished; // Presentation of the image waits on it, null for offscreen targets
 };
 
 struct SwapchainBundle {
@@ -59,14 +62,22 @@ struct SwapchainBundle {
   std::vector<SwapchainFrame> frames;
   vk::Format                  format;
   vk::Extent2D                extent;
+  vk::PresentModeKHR          presentMode { vk::PresentModeKHR::eFifo };
+};
+
+enum class PresentPolicy {
+  eLowLatency,  // Mailbox, or immediate (tearing) without it: newest frame wins, nothing queues up
+  ePowerSaving, // FIFO: vsynced, the CPU sleeps in acquire instead of rendering frames nobody sees
+  eFifoRelaxed, // FIFO, but a late frame is shown right away (tearing) instead of waiting a whole refresh
+  eFrameCap,    // Non blocking present plus a CPU side limiter at a fixed rate (see FrameLimiter)
 };
 
 bool supported( std::vector<const char*>& extensions, std::vector<const char*>& layers ) {
   // Show supported extensions
   std::vector<vk::ExtensionProperties> supportedExtensions = vk::enumerateInstanceExtensionProperties();
-  std::cout << "Instance can support following extensions: \n";
+  VFS_LOG_DEBUG << "Instance can support following extensions: ";
   for ( vk::ExtensionProperties supportedExtension : supportedExtensions ) {
-    std::cout << "\t\"" << supportedExtension.extensionName << "\"\n";
+    VFS_LOG_DEBUG << "\t\"" << supportedExtension.extensionName << "\"";
   }
 
   // Check extension support
@@ -75,23 +86,23 @@ bool supported( std::vector<const char*>& extensions, std::vector<const char*>&
     found = false;
     for ( vk::ExtensionProperties supportedExtension : supportedExtensions ) {
       if ( strcmp( extension, supportedExtension.extensionName ) == 0 ) {
-        std::cout << "Extension \"" << extension << "\" is supported!\n";
+        VFS_LOG_DEBUG << "Extension \"" << extension << "\" is supported!";
         found = true;
         break;
       }
     }
 
     if ( !found ) {
-      std::cout << "Extension \"" << extension << "\" is not supported!\n";
+      VFS_LOG_WARN << "Extension \"" << extension << "\" is not supported!";
       return false;
     }
   }
 
   // Show supported layers
   std::vector<vk::LayerProperties> supportedLayers = vk::enumerateInstanceLayerProperties();
-  std::cout << "Device can support following layers: \n";
+  VFS_LOG_DEBUG << "Device can support following layers: ";
   for ( vk::LayerProperties supportedLayer : supportedLayers ) {
-    std::cout << "\t\"" << supportedLayer.layerName << "\"\n";
+    VFS_LOG_DEBUG << "\t\"" << supportedLayer.layerName << "\"";
   }
 
   // Check extension support
@@ -99,14 +110,14 @@ bool supported( std::vector<const char*>& extensions, std::vector<const char*>&
     found = false;
     for ( vk::LayerProperties supportedLayer : supportedLayers ) {
       if ( strcmp( layer, supportedLayer.layerName ) == 0 ) {
-        std::cout << "Layer \"" << layer << "\" is supported!\n";
+        VFS_LOG_DEBUG << "Layer \"" << layer << "\" is supported!";
         found = true;
         break;
       }
     }
 
     if ( !found ) {
-      std::cout << "Layer \"" << layer << "\" is not supported!\n";
+      VFS_LOG_WARN << "Layer \"" << layer << "\" is not supported!";
       return false;
     }
   }
@@ -118,7 +129,13 @@ VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback( VkDebugUtilsMessageSeverityFlagBit
                                               VkDebugUtilsMessageTypeFlagsEXT             messageType,
                                               const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
                                               void*                                       pUserData ) {
-  std::cerr << "Validation layer: " << pCallbackData->pMessage << std::endl;
+  if ( messageSeverity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT ) {
+    VFS_LOG_ERROR << "Validation layer: " << pCallbackData->pMessage;
+  } else if ( messageSeverity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT ) {
+    VFS_LOG_WARN << "Validation layer: " << pCallbackData->pMessage;
+  } else {
+    VFS_LOG_DEBUG << "Validation layer: " << pCallbackData->pMessage;
+  }
   return VK_FALSE;
 }
 
@@ -143,31 +160,25 @@ vk::Instance vkCreateInstance( const char* applicationName, std::vector<const ch
   uint32_t version { 0 };
   vkEnumerateInstanceVersion( &version );
 
-  std::cout << "System can support vulkan variant: " << VK_API_VERSION_VARIANT( version )
-            << ", Major: " << VK_API_VERSION_MAJOR( version ) << ", Minor: " << VK_API_VERSION_MINOR( version )
-            << ", Patch: " << VK_API_VERSION_PATCH( version ) << "\n";
+  VFS_LOG_INFO << "System can support vulkan variant: " << VK_API_VERSION_VARIANT( version )
+               << ", Major: " << VK_API_VERSION_MAJOR( version ) << ", Minor: " << VK_API_VERSION_MINOR( version )
+               << ", Patch: " << VK_API_VERSION_PATCH( version );
 
-  // Request a lower version
-  version = VK_MAKE_API_VERSION( 0, 1, 0, 0 );
+  // Request at most 1.3, newer core features are enabled per device when the device supports them
+  version = instanceApiVersion();
 
   // Create appinfo
   vk::ApplicationInfo appInfo = vk::ApplicationInfo( applicationName, version, "Venom Engine", version, version );
 
-  // Query extensions (glfw)
-  // glfwinit is needed for glfw based vulkan extensions loading
-  if ( !glfwInit() ) {
-    throw std::runtime_error(
-        "glfw: Could not initialize glfw. glfwInit() is needed for glfw based vulkan extensions loading" );
-  }
-
-  std::cout << "Extensions to be required:\n";
+  // glfw based extensions are resolved by the caller (glfwInit is only needed when a window is used)
+  VFS_LOG_DEBUG << "Extensions to be required:";
   for ( const char* extensionName : extensions ) {
-    std::cout << "\t\"" << extensionName << "\"\n";
+    VFS_LOG_DEBUG << "\t\"" << extensionName << "\"";
   }
 
   // If not supported then no point in creating instance
   if ( !supported( extensions, layers ) ) {
-    std::cerr << "Extensions or layers not supported.\n";
+    VFS_LOG_ERROR << "Extensions or layers not supported.";
     return nullptr;
   }
 
@@ -184,148 +195,310 @@ vk::Instance vkCreateInstance( const char* applicationName, std::vector<const ch
   return instance;
 }
 
-int getDevicePriority( vk::PhysicalDevice& physicalDevice ) {
-  // Get properties
-  vk::PhysicalDeviceProperties properties = physicalDevice.getProperties();
+struct DeviceRequirements {
+  std::vector<const char*>   extensions;
+  vk::PhysicalDeviceFeatures features; // Every feature set to VK_TRUE is required
+  vk::SurfaceKHR             surface;  // When set, a queue family that can present to it is required
+  bool                       allowSoftware { true };
+  std::string                snapshotDirectory; // Capability snapshots are loaded from and saved to it, when set
+};
 
-  switch ( properties.deviceType ) {
-  case ( vk::PhysicalDeviceType::eCpu ):
-    return -1;
+// Explicit device override, the first non empty field wins. When nothing is set the VFS_DEVICE environment
+// variable is parsed instead: a plain number selects by index, 32 hex digits (dashes allowed) by device UUID and
+// anything else by a case insensitive substring of the device name.
+struct DeviceSelection {
+  std::optional<uint32_t> index;
+  std::string             uuid;
+  std::string             name;
+};
 
-  case ( vk::PhysicalDeviceType::eDiscreteGpu ):
-    return 2;
+struct DeviceScore {
+  bool        usable { false };
+  int64_t     score { 0 };
+  std::string reason; // Why the device is not usable
+};
 
-  case ( vk::PhysicalDeviceType::eIntegratedGpu ):
-    return 1;
+std::string toLower( std::string text ) {
+  std::transform( text.begin(), text.end(), text.begin(),
+                  []( unsigned char c ) { return static_cast<char>( std::tolower( c ) ); } );
+  return text;
+}
 
-  case ( vk::PhysicalDeviceType::eVirtualGpu ):
-    return 0;
+DeviceSelection parseDeviceSelection( const std::string& text ) {
+  DeviceSelection selection;
+  if ( text.empty() ) {
+    return selection;
+  }
 
-  case ( vk::PhysicalDeviceType::eOther ):
-    return -1;
+  std::string hex;
+  for ( char c : text ) {
+    if ( c != '-' ) {
+      hex.push_back( c );
+    }
+  }
+
+  // UUIDs first, one can be made of decimal digits only
+  if ( hex.size() == 32
+       && std::all_of( hex.begin(), hex.end(), []( unsigned char c ) { return std::isxdigit( c ); } ) ) {
+    selection.uuid = toLower( hex );
+  } else if ( std::all_of( text.begin(), text.end(), []( unsigned char c ) { return std::isdigit( c ); } ) ) {
+    errno                    = 0;
+    unsigned long long index = std::strtoull( text.c_str(), nullptr, 10 );
+    if ( errno == ERANGE || index > std::numeric_limits<uint32_t>::max() ) {
+      VFS_LOG_WARN << "Device index " << text << " is out of range, matching it as a name instead";
+      selection.name = text;
+    } else {
+      selection.index = static_cast<uint32_t>( index );
+    }
+  } else {
+    selection.name = text;
   }
 
-  return -1;
+  return selection;
 }
 
-void logDeviceProperties( vk::PhysicalDevice& device ) {
-  // Get properties
-  vk::PhysicalDeviceProperties properties = device.getProperties();
+DeviceSelection deviceSelectionFromEnvironment() {
+  const char* value = std::getenv( "VFS_DEVICE" );
+  return parseDeviceSelection( value ? value : "" );
+}
 
-  // Log properties
-  std::cout << "================================================================================\n";
-  std::cout << "Device name: " << properties.deviceName << std::endl;
-  std::cout << "Device type: ";
-  switch ( properties.deviceType ) {
-  case ( vk::PhysicalDeviceType::eCpu ):
-    std::cout << "CPU";
-    break;
+bool hasAllFeatures( const vk::PhysicalDeviceFeatures& supported, const vk::PhysicalDeviceFeatures& required ) {
+  // PhysicalDeviceFeatures is a plain list of VkBool32 members
+  const VkBool32* supportedBits = reinterpret_cast<const VkBool32*>( &supported );
+  const VkBool32* requiredBits  = reinterpret_cast<const VkBool32*>( &required );
+  for ( size_t i = 0; i < sizeof( vk::PhysicalDeviceFeatures ) / sizeof( VkBool32 ); i++ ) {
+    if ( requiredBits[i] && !supportedBits[i] ) {
+      return false;
+    }
+  }
+  return true;
+}
 
+DeviceScore scorePhysicalDevice( const DeviceCapabilities& device, const DeviceRequirements& requirements ) {
+  DeviceScore                               result;
+  const vk::PhysicalDeviceProperties&       properties = device.properties;
+  const vk::PhysicalDeviceMemoryProperties& memory     = device.memory;
+
+  // Hard requirements
+  for ( const char* extension : requirements.extensions ) {
+    if ( !device.hasExtension( extension ) ) {
+      result.reason = std::string( "missing extension " ) + extension;
+      return result;
+    }
+  }
+
+  if ( !hasAllFeatures( device.features, requirements.features ) ) {
+    result.reason = "missing required features";
+    return result;
+  }
+
+  if ( properties.deviceType == vk::PhysicalDeviceType::eCpu && !requirements.allowSoftware ) {
+    result.reason = "software devices are not allowed";
+    return result;
+  }
+
+  bool graphics     = false;
+  bool present      = !requirements.surface;
+  bool transferOnly = false;
+  bool computeOnly  = false;
+  for ( uint32_t i = 0; i < device.queueFamilies.size(); i++ ) {
+    vk::QueueFlags flags      = device.queueFamilies[i].queueFlags;
+    bool           hasGraphic = static_cast<bool>( flags & vk::QueueFlagBits::eGraphics );
+    bool           hasCompute = static_cast<bool>( flags & vk::QueueFlagBits::eCompute );
+    bool           hasCopy    = static_cast<bool>( flags & vk::QueueFlagBits::eTransfer );
+
+    graphics     = graphics || hasGraphic;
+    present      = present || device.physicalDevice.getSurfaceSupportKHR( i, requirements.surface );
+    transferOnly = transferOnly || ( hasCopy && !hasGraphic && !hasCompute );
+    computeOnly  = computeOnly || ( hasCompute && !hasGraphic );
+  }
+
+  if ( !graphics || !present ) {
+    result.reason = "no graphics or present queue family";
+    return result;
+  }
+
+  // Soft preferences, device type dominates so a big integrated heap never beats a discrete GPU
+  switch ( properties.deviceType ) {
   case ( vk::PhysicalDeviceType::eDiscreteGpu ):
-    std::cout << "Discrete GPU";
+    result.score += 4000;
     break;
 
   case ( vk::PhysicalDeviceType::eIntegratedGpu ):
-    std::cout << "Integrated GPU";
+    result.score += 3000;
     break;
 
   case ( vk::PhysicalDeviceType::eVirtualGpu ):
-    std::cout << "Virtual GPU";
+    result.score += 2000;
+    break;
+
+  case ( vk::PhysicalDeviceType::eCpu ):
+    result.score += 500;
     break;
 
   case ( vk::PhysicalDeviceType::eOther ):
-    std::cout << "Other";
+    result.score += 100;
     break;
   }
-  std::cout << std::endl;
-  std::cout << "Priority: " << getDevicePriority( device );
-  std::cout << std::endl;
-  std::cout << "================================================================================\n";
+
+  // Largest device local heap, one point per 64 MiB (capped at 64 GiB)
+  vk::DeviceSize deviceLocal = 0;
+  for ( uint32_t i = 0; i < memory.memoryHeapCount; i++ ) {
+    if ( memory.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal ) {
+      deviceLocal = std::max( deviceLocal, memory.memoryHeaps[i].size );
+    }
+  }
+  result.score += static_cast<int64_t>( std::min<vk::DeviceSize>( deviceLocal >> 26, 1024 ) );
+
+  // Limits that matter for larger workloads
+  result.score += properties.limits.maxImageDimension2D / 1024;
+  result.score += properties.limits.maxComputeWorkGroupInvocations / 128;
+  result.score += std::min<uint32_t>( properties.limits.maxBoundDescriptorSets, 32 );
+
+  // Dedicated queues let uploads and compute overlap graphics work
+  if ( transferOnly ) {
+    result.score += 150;
+  }
+  if ( computeOnly ) {
+    result.score += 150;
+  }
+
+  result.usable = true;
+  return result;
 }
 
+void logDeviceProperties( const DeviceCapabilities& device, const DeviceScore& score ) {
+  const vk::PhysicalDeviceProperties& properties = device.properties;
 
-bool isDeviceSuitable( vk::PhysicalDevice& device, std::vector<const char*> requiredExensions ) {
+  VFS_LOG_DEBUG << "================================================================================";
+  VFS_LOG_DEBUG << "Device name: " << properties.deviceName;
+  VFS_LOG_DEBUG << "Device type: " << vk::to_string( properties.deviceType );
+  if ( score.usable ) {
+    VFS_LOG_DEBUG << "Score: " << score.score;
+  } else {
+    VFS_LOG_DEBUG << "Not usable: " << score.reason;
+  }
+  VFS_LOG_DEBUG << "================================================================================";
+}
 
-  //  // converting vector<const char*> to vector<string>
-  //  std::vector<std::string> requiredExensionsStrings( requiredExensions.begin(),
-  //                                                     requiredExensions.begin() + requiredExensions.size() );
+// Returns the index into `devices` picked by an explicit selection, the first usable one when several devices match
+// (two identical GPUs by name, say)
+std::optional<size_t> findSelectedDevice( const std::vector<DeviceCapabilities>& devices,
+                                          const std::vector<DeviceScore>& scores, const DeviceSelection& selection ) {
+  std::string unusable; // Matching devices that can not be used and why
+  for ( size_t i = 0; i < devices.size(); i++ ) {
+    bool matches = false;
+    if ( selection.index.has_value() ) {
+      matches = selection.index.value() == i;
+    } else if ( !selection.uuid.empty() ) {
+      std::string uuid = toLower( selection.uuid );
+      uuid.erase( std::remove( uuid.begin(), uuid.end(), '-' ), uuid.end() );
+      matches = uuid == devices[i].uuid;
+    } else if ( !selection.name.empty() ) {
+      std::string name = toLower( devices[i].properties.deviceName.data() );
+      matches          = name.find( toLower( selection.name ) ) != std::string::npos;
+    }
 
-  for ( const char* requiredExension : requiredExensions ) {
-    bool found = false;
-    for ( vk::ExtensionProperties& extension : device.enumerateDeviceExtensionProperties() ) {
-      if ( std::strcmp( requiredExension, extension.extensionName ) == 0 ) {
-        std::cout << requiredExension << " is supported.\n";
-        found = true;
-        break;
-      }
+    if ( matches && scores[i].usable ) {
+      return i;
     }
-    if ( !found ) {
-      std::cout << "ERROR: Required extension \"" << requiredExension << "\" is not supported.\n";
-      std::cout << "ERROR: Device \"" << device.getProperties().deviceName << "\" is not suitable.\n";
-      return false;
+    if ( matches ) {
+      unusable += ( unusable.empty() ? "" : ", " ) + std::to_string( i ) + " (" + scores[i].reason + ")";
     }
   }
 
-  // If survived this long then all good
-  std::cout << "All extensions supported. [OK]\n";
-  std::cout << "Device \"" << device.getProperties().deviceName << "\" is suitable. [OK]\n";
-  return true;
+  if ( !unusable.empty() ) {
+    VFS_LOG_WARN << "No requested device is usable: " << unusable << ", ignoring override.";
+  } else if ( selection.index.has_value() || !selection.uuid.empty() || !selection.name.empty() ) {
+    VFS_LOG_WARN << "Requested device override did not match any device, ignoring it.";
+  }
+  return std::nullopt;
 }
 
-vk::PhysicalDevice vkChoosePhysicalDevice( vk::Instance& instance ) {
-  std::cout << "Choosing Physical device\n";
+// Every device is queried once (see DeviceCapabilities), the capabilities of the chosen one are returned
+DeviceCapabilities vkChoosePhysicalDevice( vk::Instance& instance, const DeviceRequirements& requirements,
+                                           DeviceSelection selection = DeviceSelection() ) {
+  VFS_LOG_DEBUG << "Choosing Physical device";
 
   // Query the system for available devices
   std::vector<vk::PhysicalDevice> availableDevices = instance.enumeratePhysicalDevices();
 
-  std::cout << "There are " << availableDevices.size() << " physical devices available on this system.\n";
-
-  // Required extensions (swapchain should be a must have for our case)
-  const std::vector<const char*> requiredExensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+  VFS_LOG_DEBUG << "There are " << availableDevices.size() << " physical devices available on this system.";
 
   // Log required extensions
-  std::cout << "Following extensions will be requested:\n";
-  for ( const char* extension : requiredExensions ) {
-    std::cout << "\t\"" << extension << "\"\n";
+  VFS_LOG_DEBUG << "Following extensions will be requested:";
+  for ( const char* extension : requirements.extensions ) {
+    VFS_LOG_DEBUG << "\t\"" << extension << "\"";
   }
 
-  // Choose a suitable device
-  vk::PhysicalDevice selectedDevice = nullptr;
-  int                maxPriority    = -1;
+  std::vector<DeviceCapabilities> devices;
+  std::vector<DeviceScore>        scores;
   for ( vk::PhysicalDevice device : availableDevices ) {
-    // Log device properties
-    logDeviceProperties( device );
+    devices.push_back( getDeviceCapabilities( device, requirements.snapshotDirectory ) );
+    scores.push_back( scorePhysicalDevice( devices.back(), requirements ) );
+    logDeviceProperties( devices.back(), scores.back() );
+  }
 
-    if ( isDeviceSuitable( device, requiredExensions ) && getDevicePriority( device ) > maxPriority ) {
-      selectedDevice = device;
-      maxPriority    = getDevicePriority( device );
+  // An explicit override beats the score, the API selection beats the environment
+  if ( !selection.index.has_value() && selection.uuid.empty() && selection.name.empty() ) {
+    selection = deviceSelectionFromEnvironment();
+  }
+  std::optional<size_t> selected = findSelectedDevice( devices, scores, selection );
+
+  if ( !selected.has_value() ) {
+    for ( size_t i = 0; i < availableDevices.size(); i++ ) {
+      if ( scores[i].usable && ( !selected.has_value() || scores[i].score > scores[selected.value()].score ) ) {
+        selected = i;
+      }
     }
   }
 
-  std::cout << "================================================================================\n";
-  std::cout << "Selected device: " << selectedDevice.getProperties().deviceName << std::endl;
-  std::cout << "================================================================================\n";
+  if ( !selected.has_value() ) {
+    throw std::runtime_error( "No suitable physical device found." );
+  }
+
+  DeviceCapabilities& selectedDevice = devices[selected.value()];
+  VFS_LOG_INFO << "================================================================================";
+  VFS_LOG_INFO << "Selected device: " << selectedDevice.properties.deviceName;
+  VFS_LOG_INFO << "================================================================================";
 
   return selectedDevice;
 }
 
-QueueFamilyIndices vkFindQueueFamilies( vk::PhysicalDevice device, vk::SurfaceKHR surface ) {
+QueueFamilyIndices vkFindQueueFamilies( const DeviceCapabilities& device, vk::SurfaceKHR surface ) {
   QueueFamilyIndices indices;
 
-  std::vector<vk::QueueFamilyProperties> queueFamilies = device.getQueueFamilyProperties();
-
   uint32_t i = 0;
-  for ( vk::QueueFamilyProperties queueFamily : queueFamilies ) {
+  for ( const vk::QueueFamilyProperties& queueFamily : device.queueFamilies ) {
     if ( queueFamily.queueFlags & vk::QueueFlagBits::eGraphics && !indices.graphicsFamily.has_value() ) {
       indices.graphicsFamily = i;
 
-      std::cout << "Selected graphics family: " << i << std::endl;
+      VFS_LOG_DEBUG << "Selected graphics family: " << i;
     }
 
-    if ( device.getSurfaceSupportKHR( i, surface ) && !indices.presentFamily.has_value() ) {
+    // Headless rendering has no surface and therefore no present family
+    if ( surface && !indices.presentFamily.has_value() && device.physicalDevice.getSurfaceSupportKHR( i, surface ) ) {
       indices.presentFamily = i;
 
-      std::cout << "Selected present family: " << i << std::endl;
+      VFS_LOG_DEBUG << "Selected present family: " << i;
+    }
+
+    // Copies submitted to a dedicated copy engine run alongside rendering instead of between it
+    vk::QueueFlags transferOnly = queueFamily.queueFlags & ( vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute
+                                                            | vk::QueueFlagBits::eTransfer );
+    if ( transferOnly == vk::QueueFlagBits::eTransfer && !indices.transferFamily.has_value() ) {
+      indices.transferFamily = i;
+
+      VFS_LOG_DEBUG << "Selected transfer family: " << i;
+    }
+
+    // Compute submitted to a family without graphics fills the gaps the graphics work leaves on the GPU
+    vk::QueueFlags computeOnly =
+        queueFamily.queueFlags & ( vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute );
+    if ( computeOnly == vk::QueueFlagBits::eCompute && !indices.computeFamily.has_value() ) {
+      indices.computeFamily = i;
+
+      VFS_LOG_DEBUG << "Selected compute family: " << i;
     }
 
     i++;
@@ -336,107 +509,107 @@ QueueFamilyIndices vkFindQueueFamilies( vk::PhysicalDevice device, vk::SurfaceKH
 
 void logTransformBits( vk::SurfaceTransformFlagsKHR bits ) {
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eIdentity ) {
-    std::cout << "Identity" << std::endl;
+    VFS_LOG_DEBUG << "Identity";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eHorizontalMirror ) {
-    std::cout << "Horizontal Mirror" << std::endl;
+    VFS_LOG_DEBUG << "Horizontal Mirror";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eHorizontalMirrorRotate90 ) {
-    std::cout << "Horizontal Mirror Rotate 90" << std::endl;
+    VFS_LOG_DEBUG << "Horizontal Mirror Rotate 90";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eHorizontalMirrorRotate180 ) {
-    std::cout << "Horizontal Mirror Rotate 180" << std::endl;
+    VFS_LOG_DEBUG << "Horizontal Mirror Rotate 180";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eHorizontalMirrorRotate270 ) {
-    std::cout << "Horizontal Mirror Rotate 270" << std::endl;
+    VFS_LOG_DEBUG << "Horizontal Mirror Rotate 270";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eRotate90 ) {
-    std::cout << "Rotate 90" << std::endl;
+    VFS_LOG_DEBUG << "Rotate 90";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eRotate180 ) {
-    std::cout << "Rotate 180" << std::endl;
+    VFS_LOG_DEBUG << "Rotate 180";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eRotate270 ) {
-    std::cout << "Rotate 270" << std::endl;
+    VFS_LOG_DEBUG << "Rotate 270";
   }
 
   if ( bits & vk::SurfaceTransformFlagBitsKHR::eInherit ) {
-    std::cout << "Inherit" << std::endl;
+    VFS_LOG_DEBUG << "Inherit";
   }
 }
 
 void logAlphaCompositeBits( vk::CompositeAlphaFlagsKHR bits ) {
   if ( bits & vk::CompositeAlphaFlagBitsKHR::eOpaque ) {
-    std::cout << "Opaque" << std::endl;
+    VFS_LOG_DEBUG << "Opaque";
   }
 
   if ( bits & vk::CompositeAlphaFlagBitsKHR::eInherit ) {
-    std::cout << "Inherit" << std::endl;
+    VFS_LOG_DEBUG << "Inherit";
   }
 
   if ( bits & vk::CompositeAlphaFlagBitsKHR::ePreMultiplied ) {
-    std::cout << "Pre multiplied" << std::endl;
+    VFS_LOG_DEBUG << "Pre multiplied";
   }
 
   if ( bits & vk::CompositeAlphaFlagBitsKHR::ePostMultiplied ) {
-    std::cout << "Post multiplied" << std::endl;
+    VFS_LOG_DEBUG << "Post multiplied";
   }
 }
 
 void logImageUsageBits( vk::ImageUsageFlags bits ) {
   if ( bits & vk::ImageUsageFlagBits::eShadingRateImageNV ) {
-    std::cout << "eShadingRateImageNV" << std::endl;
+    VFS_LOG_DEBUG << "eShadingRateImageNV";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eAttachmentFeedbackLoopEXT ) {
-    std::cout << "eAttachmentFeedbackLoopEXT" << std::endl;
+    VFS_LOG_DEBUG << "eAttachmentFeedbackLoopEXT";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eColorAttachment ) {
-    std::cout << "eColorAttachment" << std::endl;
+    VFS_LOG_DEBUG << "eColorAttachment";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eColorAttachment ) {
-    std::cout << "eColorAttachment" << std::endl;
+    VFS_LOG_DEBUG << "eColorAttachment";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eDepthStencilAttachment ) {
-    std::cout << "eDepthStencilAttachment" << std::endl;
+    VFS_LOG_DEBUG << "eDepthStencilAttachment";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eFragmentDensityMapEXT ) {
-    std::cout << "eFragmentDensityMapEXT" << std::endl;
+    VFS_LOG_DEBUG << "eFragmentDensityMapEXT";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eFragmentShadingRateAttachmentKHR ) {
-    std::cout << "eFragmentShadingRateAttachmentKHR" << std::endl;
+    VFS_LOG_DEBUG << "eFragmentShadingRateAttachmentKHR";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eInputAttachment ) {
-    std::cout << "eInputAttachment" << std::endl;
+    VFS_LOG_DEBUG << "eInputAttachment";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eSampled ) {
-    std::cout << "eSampled" << std::endl;
+    VFS_LOG_DEBUG << "eSampled";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eStorage ) {
-    std::cout << "eStorage" << std::endl;
+    VFS_LOG_DEBUG << "eStorage";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eTransferSrc ) {
-    std::cout << "eTransferSrc" << std::endl;
+    VFS_LOG_DEBUG << "eTransferSrc";
   }
 
   if ( bits & vk::ImageUsageFlagBits::eTransferDst ) {
-    std::cout << "eTransferDst" << std::endl;
+    VFS_LOG_DEBUG << "eTransferDst";
   }
 }
 
@@ -446,43 +619,100 @@ SwapchainSupportDetails vkQuerySwapchainSupport( vk::PhysicalDevice& device, vk:
   // CAPABILITIES
   support.capabilities = device.getSurfaceCapabilitiesKHR( surface );
 
-  std::cout << "Swapchain can support the following surface capabilites:\n";
-  std::cout << "\tMinimum image count: " << support.capabilities.minImageCount << std::endl;
-  std::cout << "\tMaximum image count: " << support.capabilities.maxImageCount << std::endl;
-  std::cout << "\tCurrent extent:\n";
-  std::cout << "\t\tWidth: " << support.capabilities.currentExtent.width << std::endl;
-  std::cout << "\t\tHeight: " << support.capabilities.currentExtent.height << std::endl;
-  std::cout << "\t\tMinimum width: " << support.capabilities.minImageExtent.width << std::endl;
-  std::cout << "\t\tMinimum height: " << support.capabilities.minImageExtent.height << std::endl;
-  std::cout << "\t\tMaximum width: " << support.capabilities.maxImageExtent.width << std::endl;
-  std::cout << "\t\tMaximum height: " << support.capabilities.maxImageExtent.height << std::endl;
+  VFS_LOG_DEBUG << "Swapchain can support the following surface capabilites:";
+  VFS_LOG_DEBUG << "\tMinimum image count: " << support.capabilities.minImageCount;
+  VFS_LOG_DEBUG << "\tMaximum image count: " << support.capabilities.maxImageCount;
+  VFS_LOG_DEBUG << "\tCurrent extent:";
+  VFS_LOG_DEBUG << "\t\tWidth: " << support.capabilities.currentExtent.width;
+  VFS_LOG_DEBUG << "\t\tHeight: " << support.capabilities.currentExtent.height;
+  VFS_LOG_DEBUG << "\t\tMinimum width: " << support.capabilities.minImageExtent.width;
+  VFS_LOG_DEBUG << "\t\tMinimum height: " << support.capabilities.minImageExtent.height;
+  VFS_LOG_DEBUG << "\t\tMaximum width: " << support.capabilities.maxImageExtent.width;
+  VFS_LOG_DEBUG << "\t\tMaximum height: " << support.capabilities.maxImageExtent.height;
 
-  std::cout << "\tMaximum image array layers: " << support.capabilities.maxImageArrayLayers << std::endl;
+  VFS_LOG_DEBUG << "\tMaximum image array layers: " << support.capabilities.maxImageArrayLayers;
 
-  std::cout << "\tCurrent transform:\n";
+  VFS_LOG_DEBUG << "\tCurrent transform:";
   logTransformBits( support.capabilities.currentTransform );
 
-  std::cout << "\tSupported alpha composite bits:\n";
+  VFS_LOG_DEBUG << "\tSupported alpha composite bits:";
   logAlphaCompositeBits( support.capabilities.supportedCompositeAlpha );
 
-  std::cout << "\tSupported image usage bits:\n";
+  VFS_LOG_DEBUG << "\tSupported image usage bits:";
   logImageUsageBits( support.capabilities.supportedUsageFlags );
 
   // FORMATS
   support.formats = device.getSurfaceFormatsKHR( surface );
   for ( vk::SurfaceFormatKHR supportedFormat : support.formats ) {
-    std::cout << "Supported pixel format: " << vk::to_string( supportedFormat.format ) << std::endl;
-    std::cout << "Supported color space: " << vk::to_string( supportedFormat.colorSpace ) << std::endl;
+    VFS_LOG_DEBUG << "Supported pixel format: " << vk::to_string( supportedFormat.format );
+    VFS_LOG_DEBUG << "Supported color space: " << vk::to_string( supportedFormat.colorSpace );
   }
 
   // PRESENT MODES
-  // TODO: some similar logging shit
+  support.presentModes = device.getSurfacePresentModesKHR( surface );
+  for ( vk::PresentModeKHR presentMode : support.presentModes ) {
+    VFS_LOG_DEBUG << "Supported present mode: " << vk::to_string( presentMode );
+  }
 
   return support;
 }
 
+vk::PresentModeKHR choosePresentMode( PresentPolicy policy, const std::vector<vk::PresentModeKHR>& available ) {
+  std::vector<vk::PresentModeKHR> preferred;
+  switch ( policy ) {
+  case ( PresentPolicy::eLowLatency ):
+  case ( PresentPolicy::eFrameCap ):
+    preferred = { vk::PresentModeKHR::eMailbox, vk::PresentModeKHR::eImmediate };
+    break;
+
+  case ( PresentPolicy::eFifoRelaxed ):
+    preferred = { vk::PresentModeKHR::eFifoRelaxed };
+    break;
+
+  case ( PresentPolicy::ePowerSaving ):
+    break;
+  }
+
+  for ( vk::PresentModeKHR mode : preferred ) {
+    if ( std::find( available.begin(), available.end(), mode ) != available.end() ) {
+      return mode;
+    }
+  }
+  return vk::PresentModeKHR::eFifo; // Always supported
+}
+
+// Mailbox needs a third image to always have one free to render into. FIFO queues every extra image as a frame of
+// latency, so power saving takes the minimum plus one to keep the GPU from stalling, immediate needs no spare at all.
+uint32_t chooseImageCount( vk::PresentModeKHR presentMode, const vk::SurfaceCapabilitiesKHR& capabilities ) {
+  uint32_t imageCount = capabilities.minImageCount;
+  switch ( presentMode ) {
+  case ( vk::PresentModeKHR::eMailbox ):
+    imageCount = std::max( imageCount + 1, 3u );
+    break;
+
+  case ( vk::PresentModeKHR::eImmediate ):
+    imageCount = std::max( imageCount, 2u );
+    break;
+
+  default:
+    imageCount = imageCount + 1;
+    break;
+  }
+
+  // maxImageCount of 0 means there is no upper limit
+  if ( capabilities.maxImageCount > 0 ) {
+    imageCount = std::min( capabilities.maxImageCount, imageCount );
+  }
+  return imageCount;
+}
+
+// Passing the swapchain being replaced as `oldSwapchain` lets the driver reuse its resources and keep presenting the
+// old images until the new ones are ready. The old swapchain is retired either way and has to be destroyed by the
+// caller once nothing uses it anymore.
 SwapchainBundle vkCreateSwapchain( vk::Device logicalDevice, vk::PhysicalDevice physicalDevice, vk::SurfaceKHR surface,
-                                   uint32_t width, uint32_t height ) {
+                                   const QueueFamilyIndices& indices, uint32_t width, uint32_t height,
+                                   vk::SwapchainKHR oldSwapchain = nullptr,
+                                   PresentPolicy presentPolicy = PresentPolicy::eLowLatency ) {
   SwapchainSupportDetails support = vkQuerySwapchainSupport( physicalDevice, surface );
 
   // Choose swapchain surface format
@@ -494,30 +724,28 @@ SwapchainBundle vkCreateSwapchain( vk::Device logicalDevice, vk::PhysicalDevice
   }
 
   // Choose swapchain present mode
-  vk::PresentModeKHR chosenPresentMode = vk::PresentModeKHR::eFifo; // Fifo is the default
-  for ( vk::PresentModeKHR presentMode : support.presentModes ) {
-    if ( presentMode == vk::PresentModeKHR::eMailbox ) {
-      chosenPresentMode = presentMode;
-    }
-  }
+  vk::PresentModeKHR chosenPresentMode = choosePresentMode( presentPolicy, support.presentModes );
 
   // Choose swapchain extent
   vk::Extent2D chosenExtent;
   if ( support.capabilities.currentExtent.width != UINT32_MAX ) {
     chosenExtent = support.capabilities.currentExtent;
   } else {
-    vk::Extent2D extent = { width, height };
+    chosenExtent.width  = std::clamp( width, support.capabilities.minImageExtent.width,
+                                      support.capabilities.maxImageExtent.width );
+    chosenExtent.height = std::clamp( height, support.capabilities.minImageExtent.height,
+                                      support.capabilities.maxImageExtent.height );
   }
 
-  uint32_t imageCount = std::min( support.capabilities.maxImageCount, support.capabilities.minImageCount + 1 );
+  uint32_t imageCount = chooseImageCount( chosenPresentMode, support.capabilities );
+  VFS_LOG_INFO << "Presenting with " << vk::to_string( chosenPresentMode ) << " on " << imageCount << " images";
 
   // Create swapchain createinfo
   vk::SwapchainCreateInfoKHR createInfo =
       vk::SwapchainCreateInfoKHR( vk::SwapchainCreateFlagsKHR(), surface, imageCount, chosenFormat.format,
                                   chosenFormat.colorSpace, chosenExtent, 1, vk::ImageUsageFlagBits::eColorAttachment );
 
-  QueueFamilyIndices indices              = vkFindQueueFamilies( physicalDevice, surface );
-  uint32_t           queueFamilyIndices[] = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+  uint32_t queueFamilyIndices[] = { indices.graphicsFamily.value(), indices.presentFamily.value() };
 
   if ( indices.graphicsFamily.value() != indices.presentFamily.value() ) {
     createInfo.imageSharingMode      = vk::SharingMode::eConcurrent;
@@ -532,7 +760,7 @@ SwapchainBundle vkCreateSwapchain( vk::Device logicalDevice, vk::PhysicalDevice
   createInfo.presentMode    = chosenPresentMode;
   createInfo.clipped        = VK_TRUE;
 
-  createInfo.oldSwapchain = vk::SwapchainKHR( nullptr ); // Inheritance
+  createInfo.oldSwapchain = oldSwapchain;
 
   SwapchainBundle bundle {};
   try {
@@ -558,12 +786,16 @@ SwapchainBundle vkCreateSwapchain( vk::Device logicalDevice, vk::PhysicalDevice
     createInfo.subresourceRange.layerCount     = 1;
     createInfo.format                          = chosenFormat.format;
 
-    bundle.frames[i].image     = images[i];
-    bundle.frames[i].imageView = logicalDevice.createImageView( createInfo );
+    // A semaphore per image rather than per frame slot: the one presentation waits on is only known to be unused
+    // again once the same image is acquired again
+    bundle.frames[i].image          = images[i];
+    bundle.frames[i].imageView      = logicalDevice.createImageView( createInfo );
+    bundle.frames[i].renderFinished = logicalDevice.createSemaphore( vk::SemaphoreCreateInfo() );
   }
 
-  bundle.format = chosenFormat.format;
-  bundle.extent = chosenExtent;
+  bundle.format      = chosenFormat.format;
+  bundle.extent      = chosenExtent;
+  bundle.presentMode = chosenPresentMode;
 
   return bundle;
 }
@@ -571,12 +803,112 @@ SwapchainBundle vkCreateSwapchain( vk::Device logicalDevice, vk::PhysicalDevice
 
 // Pipeline create stuff
 namespace utils {
+// Values for the shader's `layout( constant_id = N )` constants, baked in when the pipeline is created
+class SpecializationConstants {
+  public:
+  template <typename T>
+  SpecializationConstants& set( uint32_t id, const T& value ) {
+    static_assert( std::is_trivially_copyable<T>::value && !std::is_same<T, bool>::value,
+                   "Specialization constants are plain scalars, use VkBool32 for booleans" );
+    uint32_t offset = static_cast<uint32_t>( mData.size() );
+    mData.resize( mData.size() + sizeof( T ) );
+    std::memcpy( mData.data() + offset, &value, sizeof( T ) );
+    mEntries.push_back( vk::SpecializationMapEntry( id, offset, sizeof( T ) ) );
+    return *this;
+  }
+
+  bool empty() const {
+    return mEntries.empty();
+  }
+
+  // Ids, sizes and values, for pipeline state keys
+  uint64_t hash() const {
+    uint64_t hash = hashBytes( mEntries.data(), mEntries.size() * sizeof( vk::SpecializationMapEntry ) );
+    return hashBytes( mData.data(), mData.size(), hash );
+  }
+
+  // Points into this object, which has to outlive the pipeline creation
+  vk::SpecializationInfo info() const {
+    return vk::SpecializationInfo( static_cast<uint32_t>( mEntries.size() ), mEntries.data(), mData.size(),
+                                   mData.data() );
+  }
+
+  private:
+  std::vector<vk::SpecializationMapEntry> mEntries;
+  std::vector<uint8_t>                    mData;
+};
+
+enum class BlendMode : uint8_t {
+  eOpaque,
+  eAlpha,         // Straight alpha
+  ePremultiplied, // Color already multiplied by alpha
+  eAdditive,
+};
+
+// Fixed function state that differs between materials, the rest is the same for every pipeline
+struct PipelineState {
+  vk::PrimitiveTopology topology { vk::PrimitiveTopology::eTriangleList };
+  vk::PolygonMode       polygonMode { vk::PolygonMode::eFill };
+  vk::CullModeFlags     cullMode { vk::CullModeFlagBits::eBack };
+  vk::FrontFace         frontFace { vk::FrontFace::eClockwise };
+  BlendMode             blend { BlendMode::eOpaque };
+
+  // Every field in 12 bits, for pipeline state keys
+  uint32_t pack() const {
+    return static_cast<uint32_t>( topology ) | ( static_cast<uint32_t>( polygonMode ) & 0x3 ) << 4
+           | static_cast<uint32_t>( cullMode ) << 6 | static_cast<uint32_t>( frontFace ) << 8
+           | static_cast<uint32_t>( blend ) << 9;
+  }
+};
+
+vk::PipelineColorBlendAttachmentState blendAttachmentState( BlendMode mode ) {
+  vk::PipelineColorBlendAttachmentState attachment = {};
+  attachment.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG
+                            | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+  attachment.blendEnable         = mode == BlendMode::eOpaque ? VK_FALSE : VK_TRUE;
+  attachment.colorBlendOp        = vk::BlendOp::eAdd;
+  attachment.alphaBlendOp        = vk::BlendOp::eAdd;
+  attachment.srcAlphaBlendFactor = vk::BlendFactor::eOne;
+  attachment.dstAlphaBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha;
+  switch ( mode ) {
+  case ( BlendMode::eOpaque ):
+    break;
+
+  case ( BlendMode::eAlpha ):
+    attachment.srcColorBlendFactor = vk::BlendFactor::eSrcAlpha;
+    attachment.dstColorBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha;
+    break;
+
+  case ( BlendMode::ePremultiplied ):
+    attachment.srcColorBlendFactor = vk::BlendFactor::eOne;
+    attachment.dstColorBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha;
+    break;
+
+  case ( BlendMode::eAdditive ):
+    attachment.srcColorBlendFactor = vk::BlendFactor::eSrcAlpha;
+    attachment.dstColorBlendFactor = vk::BlendFactor::eOne;
+    attachment.dstAlphaBlendFactor = vk::BlendFactor::eOne;
+    break;
+  }
+  return attachment;
+}
+
 struct GraphicsPipelineInBundle {
-  vk::Device   device;
-  std::string  vertexFilepath;
-  std::string  fragmentFilepath;
-  vk::Extent2D swapchainExtent;
-  vk::Format   swapchainImageFormat;
+  vk::Device                           device;
+  std::string                          vertexFilepath;
+  std::string                          fragmentFilepath;
+  vk::Extent2D                         swapchainExtent; // Informational only, viewport and scissor are dynamic state
+  vk::Format                           swapchainImageFormat;
+  vk::ImageLayout                      finalLayout { vk::ImageLayout::ePresentSrcKHR };
+  PipelineCache*                       pipelineCache { nullptr };  // Optional, compiled from scratch without it
+  VertexLayout                         vertexLayout;               // Empty for shaders that generate their vertices
+  std::vector<vk::DescriptorSetLayout> setLayouts;                 // Set 0 first, see DescriptorLayoutCache
+  std::vector<vk::PushConstantRange>   pushConstantRanges;         // Per draw data, see drawDataRange
+  bool                                 dynamicRendering { false }; // No render pass, see DynamicRendering
+  PipelineState                        state;
+  SpecializationConstants              specialization;             // Applied to both stages
+  vk::Pipeline                         basePipeline;               // Parent of a derivative pipeline, optional
+  bool                                 allowDerivatives { false }; // Can be the parent of derivative pipelines
 };
 
 struct GraphicsPipelineOutBundle {
@@ -585,7 +917,8 @@ struct GraphicsPipelineOutBundle {
   vk::Pipeline       pipeline;
 };
 
-vk::RenderPass makeRenderPass( vk::Device device, vk::Format swapchainImageFormat ) {
+vk::RenderPass makeRenderPass( vk::Device device, vk::Format swapchainImageFormat,
+                               vk::ImageLayout finalLayout = vk::ImageLayout::ePresentSrcKHR ) {
   vk::AttachmentDescription colorAttachment = {};
   colorAttachment.flags                     = vk::AttachmentDescriptionFlags();
   colorAttachment.format                    = swapchainImageFormat;
@@ -595,7 +928,7 @@ vk::RenderPass makeRenderPass( vk::Device device, vk::Format swapchainImageForma
   colorAttachment.stencilLoadOp             = vk::AttachmentLoadOp::eDontCare;
   colorAttachment.stencilStoreOp            = vk::AttachmentStoreOp::eDontCare;
   colorAttachment.initialLayout             = vk::ImageLayout::eUndefined;
-  colorAttachment.finalLayout               = vk::ImageLayout::ePresentSrcKHR;
+  colorAttachment.finalLayout               = finalLayout;
 
   vk::AttachmentReference colorAttachmentRef = {};
   colorAttachmentRef.attachment              = 0;
@@ -608,112 +941,121 @@ vk::RenderPass makeRenderPass( vk::Device device, vk::Format swapchainImageForma
   subpass.colorAttachmentCount = 1;
   subpass.pColorAttachments    = &colorAttachmentRef;
 
+  // The image is only available once the acquire semaphore signals, which we wait on at the color output stage
+  vk::SubpassDependency dependency = {};
+  dependency.srcSubpass            = VK_SUBPASS_EXTERNAL;
+  dependency.dstSubpass            = 0;
+  dependency.srcStageMask          = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+  dependency.srcAccessMask         = vk::AccessFlags();
+  dependency.dstStageMask          = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+  dependency.dstAccessMask         = vk::AccessFlagBits::eColorAttachmentWrite;
+
   vk::RenderPassCreateInfo renderPassInfo = {};
   renderPassInfo.flags                    = vk::RenderPassCreateFlags();
   renderPassInfo.attachmentCount          = 1;
   renderPassInfo.pAttachments             = &colorAttachment;
   renderPassInfo.subpassCount             = 1;
   renderPassInfo.pSubpasses               = &subpass;
+  renderPassInfo.dependencyCount          = 1;
+  renderPassInfo.pDependencies            = &dependency;
 
   try {
     return device.createRenderPass( renderPassInfo );
   } catch ( vk::SystemError err ) {
-    std::cerr << "Could not create render pass." << std::endl;
+    throw std::runtime_error( "Failed to create render pass." );
   }
 }
 
-vk::PipelineLayout makePipelineLayout( vk::Device device ) {
+vk::PipelineLayout makePipelineLayout( vk::Device                                  device,
+                                       const std::vector<vk::DescriptorSetLayout>& setLayouts         = {},
+                                       const std::vector<vk::PushConstantRange>&   pushConstantRanges = {} ) {
   vk::PipelineLayoutCreateInfo layoutInfo;
   layoutInfo.flags                  = vk::PipelineLayoutCreateFlags();
-  layoutInfo.setLayoutCount         = 0;
-  layoutInfo.pushConstantRangeCount = 0;
+  layoutInfo.setLayoutCount         = static_cast<uint32_t>( setLayouts.size() );
+  layoutInfo.pSetLayouts            = setLayouts.data();
+  layoutInfo.pushConstantRangeCount = static_cast<uint32_t>( pushConstantRanges.size() );
+  layoutInfo.pPushConstantRanges    = pushConstantRanges.data();
   try {
     return device.createPipelineLayout( layoutInfo );
   } catch ( vk::SystemError err ) {
-    std::cerr << "Could not create pipeline layout." << std::endl;
+    throw std::runtime_error( "Failed to create pipeline layout." );
   }
 }
 
 
-GraphicsPipelineOutBundle makeGraphicsPipeline( GraphicsPipelineInBundle specification ) {
+// Compiles the pipeline from already created modules, layout and render pass. Safe to call from worker threads
+// as long as each thread passes its own pipeline cache (see PipelineCache::threadCache).
+vk::Pipeline compileGraphicsPipeline( const GraphicsPipelineInBundle& specification, vk::ShaderModule vertexShader,
+                                      vk::ShaderModule fragmentShader, vk::PipelineLayout layout,
+                                      vk::RenderPass renderPass, vk::PipelineCache cache = nullptr ) {
   vk::GraphicsPipelineCreateInfo pipelineInfo;
   pipelineInfo.flags = vk::PipelineCreateFlags();
+  if ( specification.allowDerivatives ) {
+    pipelineInfo.flags |= vk::PipelineCreateFlagBits::eAllowDerivatives;
+  }
+
+  // Specialization constants are looked up by id, so one set serves both stages
+  vk::SpecializationInfo  specializationInfo = specification.specialization.info();
+  vk::SpecializationInfo* specialization     = specification.specialization.empty() ? nullptr : &specializationInfo;
 
   std::vector<vk::PipelineShaderStageCreateInfo> shaderStages;
 
   // Vertex input
-  vk::PipelineVertexInputStateCreateInfo vertexInputInfo = {};
-  vertexInputInfo.flags                                  = vk::PipelineVertexInputStateCreateFlags();
-  vertexInputInfo.vertexBindingDescriptionCount          = 0;
-  vertexInputInfo.vertexAttributeDescriptionCount        = 0;
+  vk::PipelineVertexInputStateCreateInfo vertexInputInfo = specification.vertexLayout.createInfo();
 
   pipelineInfo.pVertexInputState = &vertexInputInfo;
 
   // Input assembly
   vk::PipelineInputAssemblyStateCreateInfo inputAssemblyInfo;
   inputAssemblyInfo.flags    = vk::PipelineInputAssemblyStateCreateFlags();
-  inputAssemblyInfo.topology = vk::PrimitiveTopology::eTriangleList;
+  inputAssemblyInfo.topology = specification.state.topology;
 
   pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
 
   // Vertex shader
-  std::cout << "Creating vertex shader module" << std::endl;
-  vk::ShaderModule vertexShader = utils::createModule( specification.vertexFilepath, specification.device );
-
   vk::PipelineShaderStageCreateInfo vertexShaderInfo = {};
   vertexShaderInfo.flags                             = vk::PipelineShaderStageCreateFlags();
   vertexShaderInfo.stage                             = vk::ShaderStageFlagBits::eVertex;
   vertexShaderInfo.module                            = vertexShader;
   vertexShaderInfo.pName                             = "main";
+  vertexShaderInfo.pSpecializationInfo               = specialization;
 
   shaderStages.push_back( vertexShaderInfo );
 
-  // Viewport and scissor
-  // a: viewport
-  vk::Viewport viewport;
-  viewport.x        = 0.0f;
-  viewport.y        = 0.0f;
-  viewport.width    = specification.swapchainExtent.width;
-  viewport.height   = specification.swapchainExtent.height;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-  // b: scissor
-  vk::Rect2D scissor;
-  scissor.offset.x = 0.0f;
-  scissor.offset.y = 0.0f;
-  scissor.extent   = specification.swapchainExtent;
-
+  // Viewport and scissor are dynamic, so pipelines survive swapchain resizes
   vk::PipelineViewportStateCreateInfo viewportState = {};
   viewportState.flags                               = vk::PipelineViewportStateCreateFlags();
   viewportState.viewportCount                       = 1;
-  viewportState.pViewports                          = &viewport;
   viewportState.scissorCount                        = 1;
-  viewportState.pScissors                           = &scissor;
+
+  std::array<vk::DynamicState, 2>    dynamicStates = { vk::DynamicState::eViewport, vk::DynamicState::eScissor };
+  vk::PipelineDynamicStateCreateInfo dynamicState  = {};
+  dynamicState.dynamicStateCount                   = static_cast<uint32_t>( dynamicStates.size() );
+  dynamicState.pDynamicStates                      = dynamicStates.data();
 
   pipelineInfo.pViewportState = &viewportState;
+  pipelineInfo.pDynamicState  = &dynamicState;
 
   // Rasterizer
   vk::PipelineRasterizationStateCreateInfo rasterizer = {};
   rasterizer.flags                                    = vk::PipelineRasterizationStateCreateFlags();
   rasterizer.depthClampEnable                         = VK_FALSE;
   rasterizer.rasterizerDiscardEnable                  = VK_FALSE;
-  rasterizer.polygonMode                              = vk::PolygonMode::eFill;
+  rasterizer.polygonMode                              = specification.state.polygonMode;
   rasterizer.lineWidth                                = 1;
-  rasterizer.cullMode                                 = vk::CullModeFlagBits::eBack;
-  rasterizer.frontFace                                = vk::FrontFace::eCounterClockwise;
+  rasterizer.cullMode                                 = specification.state.cullMode;
+  rasterizer.frontFace                                = specification.state.frontFace;
   rasterizer.depthBiasEnable                          = VK_FALSE;
 
   pipelineInfo.pRasterizationState = &rasterizer;
 
   // Fragment shader
-  std::cout << "Creating vertex shader module" << std::endl;
-  vk::ShaderModule fragmentShader = utils::createModule( specification.fragmentFilepath, specification.device );
-
   vk::PipelineShaderStageCreateInfo fragmentShaderInfo = {};
   fragmentShaderInfo.flags                             = vk::PipelineShaderStageCreateFlags();
   fragmentShaderInfo.stage                             = vk::ShaderStageFlagBits::eFragment;
   fragmentShaderInfo.module                            = fragmentShader;
   fragmentShaderInfo.pName                             = "main";
+  fragmentShaderInfo.pSpecializationInfo               = specialization;
 
   shaderStages.push_back( fragmentShaderInfo );
 
@@ -729,10 +1071,8 @@ GraphicsPipelineOutBundle makeGraphicsPipeline( GraphicsPipelineInBundle specifi
   pipelineInfo.pMultisampleState = &multisampling;
 
   // Color blend
-  vk::PipelineColorBlendAttachmentState colorBlendAttachment = {};
-  colorBlendAttachment.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG
-                                      | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
-  colorBlendAttachment.blendEnable                    = VK_FALSE;
+  vk::PipelineColorBlendAttachmentState colorBlendAttachment = blendAttachmentState( specification.state.blend );
+
   vk::PipelineColorBlendStateCreateInfo colorBlending = {};
   colorBlending.flags                                 = vk::PipelineColorBlendStateCreateFlags();
   colorBlending.logicOpEnable                         = VK_FALSE;
@@ -746,35 +1086,209 @@ GraphicsPipelineOutBundle makeGraphicsPipeline( GraphicsPipelineInBundle specifi
 
   pipelineInfo.pColorBlendState = &colorBlending;
 
-  // Create pipeline layout
-  std::cout << "Creating pipeline layout" << std::endl;
-  vk::PipelineLayout layout = makePipelineLayout( specification.device );
-
-  pipelineInfo.layout = layout;
-
-  // Create renderpass
-  std::cout << "Creating renderpass" << std::endl;
-  vk::RenderPass renderPass = makeRenderPass( specification.device, specification.swapchainImageFormat );
+  // Dynamic rendering describes the attachment formats in the pipeline instead of a render pass
+  vk::PipelineRenderingCreateInfo renderingInfo = {};
+  renderingInfo.colorAttachmentCount            = 1;
+  renderingInfo.pColorAttachmentFormats         = &specification.swapchainImageFormat;
 
-  pipelineInfo.renderPass = renderPass;
+  pipelineInfo.layout     = layout;
+  pipelineInfo.renderPass = specification.dynamicRendering ? vk::RenderPass( nullptr ) : renderPass;
+  pipelineInfo.pNext      = specification.dynamicRendering ? &renderingInfo : nullptr;
 
-  // Extra stuff (basePipelineHandle could be used to inherit from another pipeline)
-  pipelineInfo.basePipelineHandle = nullptr;
+  // Derivative of a parent created with allowDerivatives, drivers may reuse its compiled state
+  if ( specification.basePipeline ) {
+    pipelineInfo.flags |= vk::PipelineCreateFlagBits::eDerivative;
+    pipelineInfo.basePipelineHandle = specification.basePipeline;
+    pipelineInfo.basePipelineIndex  = -1;
+  }
 
   // Create pipeline
-  std::cout << "Creating pipeline" << std::endl;
   vk::Pipeline graphicsPipeline;
   try {
-    graphicsPipeline = ( specification.device.createGraphicsPipeline( nullptr, pipelineInfo ) ).value;
+    if ( specification.pipelineCache ) {
+      graphicsPipeline = specification.pipelineCache->createGraphicsPipeline( pipelineInfo, cache );
+    } else {
+      graphicsPipeline = ( specification.device.createGraphicsPipeline( cache, pipelineInfo ) ).value;
+    }
   } catch ( vk::SystemError err ) {
-    std::cerr << "could not create pipeline" << std::endl;
+    VFS_LOG_ERROR << "could not create pipeline";
+  }
+
+  return graphicsPipeline;
+}
+
+GraphicsPipelineOutBundle makeGraphicsPipeline( GraphicsPipelineInBundle specification ) {
+  // Everything is owned until the pipeline exists, so a failure on the way destroys what was already created
+  vk::Device device = specification.device;
+
+  // Shader modules
+  VFS_LOG_DEBUG << "Creating vertex shader module";
+  Owned<vk::ShaderModule> vertexShader( device, utils::createModule( specification.vertexFilepath, device ) );
+  VFS_LOG_DEBUG << "Creating fragment shader module";
+  Owned<vk::ShaderModule> fragmentShader( device, utils::createModule( specification.fragmentFilepath, device ) );
+
+  // Create pipeline layout
+  VFS_LOG_DEBUG << "Creating pipeline layout";
+  Owned<vk::PipelineLayout> layout(
+      device, makePipelineLayout( device, specification.setLayouts, specification.pushConstantRanges ) );
+
+  // Create renderpass (none for dynamic rendering)
+  Owned<vk::RenderPass> renderPass;
+  if ( !specification.dynamicRendering ) {
+    VFS_LOG_DEBUG << "Creating renderpass";
+    renderPass = Owned<vk::RenderPass>(
+        device, makeRenderPass( device, specification.swapchainImageFormat, specification.finalLayout ) );
+  }
+
+  // Create pipeline, the modules are destroyed on return as the pipeline keeps what it needs from them
+  VFS_LOG_DEBUG << "Creating pipeline";
+  vk::Pipeline graphicsPipeline = compileGraphicsPipeline( specification, vertexShader.get(), fragmentShader.get(),
+                                                           layout.get(), renderPass.get() );
+  if ( !graphicsPipeline ) {
+    throw std::runtime_error( "Failed to create graphics pipeline." );
   }
 
   GraphicsPipelineOutBundle output = {};
-  output.layout                    = layout;
-  output.renderPass                = renderPass;
+  output.layout                    = layout.release();
+  output.renderPass                = renderPass.release();
   output.pipeline                  = graphicsPipeline;
 
   return output;
 }
 } // namespace utils
+
+// Command and sync stuff
+namespace utils {
+struct FrameInFlight {
+  vk::CommandBuffer commandBuffer;
+  vk::Semaphore     imageAvailable;
+  vk::Fence         inFlight; // Rendering finished is signaled per swapchain image, see SwapchainFrame
+};
+
+struct FrameTimings {
+  double fenceWaitMs { 0.0 }; // CPU blocked until the GPU finished this slot's previous frame
+  double acquireMs { 0.0 };   // CPU blocked on acquiring the next swapchain image
+  double imageWaitMs { 0.0 }; // CPU blocked on another slot still rendering to the acquired image
+  double recordMs { 0.0 };    // CPU time spent recording commands
+  double submitMs { 0.0 };    // CPU time spent in submit and present
+  double frameMs { 0.0 };     // Wall time of the whole frame
+};
+
+// Accumulates per-frame timings and prints averages/maximums every `reportInterval` frames
+struct FrameStats {
+  uint64_t     reportInterval { 240 };
+  uint64_t     frameCount { 0 };
+  FrameTimings sum;
+  FrameTimings max;
+
+  void record( const FrameTimings& timings ) {
+    accumulate( sum.fenceWaitMs, max.fenceWaitMs, timings.fenceWaitMs );
+    accumulate( sum.acquireMs, max.acquireMs, timings.acquireMs );
+    accumulate( sum.imageWaitMs, max.imageWaitMs, timings.imageWaitMs );
+    accumulate( sum.recordMs, max.recordMs, timings.recordMs );
+    accumulate( sum.submitMs, max.submitMs, timings.submitMs );
+    accumulate( sum.frameMs, max.frameMs, timings.frameMs );
+    frameCount++;
+
+    if ( reportInterval > 0 && frameCount == reportInterval ) {
+      report();
+    }
+  }
+
+  void report() {
+    if ( frameCount == 0 ) {
+      return;
+    }
+
+    double n = static_cast<double>( frameCount );
+    VFS_LOG_INFO << "Frame timings over " << frameCount << " frames (avg / max ms):";
+    VFS_LOG_INFO << "\tGPU wait (fence):  " << sum.fenceWaitMs / n << " / " << max.fenceWaitMs;
+    VFS_LOG_INFO << "\tGPU wait (image):  " << sum.imageWaitMs / n << " / " << max.imageWaitMs;
+    VFS_LOG_INFO << "\tAcquire:           " << sum.acquireMs / n << " / " << max.acquireMs;
+    VFS_LOG_INFO << "\tCPU record:        " << sum.recordMs / n << " / " << max.recordMs;
+    VFS_LOG_INFO << "\tCPU submit:        " << sum.submitMs / n << " / " << max.submitMs;
+    VFS_LOG_INFO << "\tFrame:             " << sum.frameMs / n << " / " << max.frameMs;
+
+    frameCount = 0;
+    sum        = FrameTimings();
+    max        = FrameTimings();
+  }
+
+  private:
+  static void accumulate( double& total, double& maximum, double value ) {
+    total += value;
+    maximum = std::max( maximum, value );
+  }
+};
+
+double elapsedMs( std::chrono::steady_clock::time_point start ) {
+  return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+vk::CommandPool makeCommandPool( vk::Device device, uint32_t queueFamilyIndex ) {
+  vk::CommandPoolCreateInfo poolInfo = {};
+  poolInfo.flags                     = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+  poolInfo.queueFamilyIndex          = queueFamilyIndex;
+
+  try {
+    return device.createCommandPool( poolInfo );
+  } catch ( vk::SystemError err ) {
+    throw std::runtime_error( "Failed to create command pool." );
+  }
+}
+
+void makeFramebuffers( vk::Device device, vk::RenderPass renderPass, vk::Extent2D extent,
+                       std::vector<SwapchainFrame>& frames ) {
+  for ( SwapchainFrame& frame : frames ) {
+    vk::FramebufferCreateInfo framebufferInfo = {};
+    framebufferInfo.flags                     = vk::FramebufferCreateFlags();
+    framebufferInfo.renderPass                = renderPass;
+    framebufferInfo.attachmentCount           = 1;
+    framebufferInfo.pAttachments              = &frame.imageView;
+    framebufferInfo.width                     = extent.width;
+    framebufferInfo.height                    = extent.height;
+    framebufferInfo.layers                    = 1;
+
+    try {
+      frame.framebuffer = device.createFramebuffer( framebufferInfo );
+    } catch ( vk::SystemError err ) {
+      throw std::runtime_error( "Failed to create framebuffer." );
+    }
+  }
+}
+
+std::vector<FrameInFlight> makeFramesInFlight( vk::Device device, vk::CommandPool commandPool, uint32_t count ) {
+  vk::CommandBufferAllocateInfo allocInfo = {};
+  allocInfo.commandPool                   = commandPool;
+  allocInfo.level                         = vk::CommandBufferLevel::ePrimary;
+  allocInfo.commandBufferCount            = count;
+
+  std::vector<vk::CommandBuffer> commandBuffers;
+  try {
+    commandBuffers = device.allocateCommandBuffers( allocInfo );
+  } catch ( vk::SystemError err ) {
+    throw std::runtime_error( "Failed to allocate frame command buffers." );
+  }
+
+  // Fences start signaled so the first wait on every slot returns immediately
+  vk::FenceCreateInfo     fenceInfo( vk::FenceCreateFlagBits::eSignaled );
+  vk::SemaphoreCreateInfo semaphoreInfo;
+
+  std::vector<FrameInFlight> frames( count );
+  for ( uint32_t i = 0; i < count; i++ ) {
+    frames[i].commandBuffer  = commandBuffers[i];
+    frames[i].imageAvailable = device.createSemaphore( semaphoreInfo );
+    frames[i].inFlight       = device.createFence( fenceInfo );
+  }
+
+  return frames;
+}
+
+void destroyFramesInFlight( vk::Device device, std::vector<FrameInFlight>& frames ) {
+  for ( FrameInFlight& frame : frames ) {
+    device.destroySemaphore( frame.imageAvailable );
+    device.destroyFence( frame.inFlight );
+  }
+  frames.clear();
+}
+} // namespace utils
@@ -0,0 +1,351 @@
+#pragma once
+
+#include "capabilities.h"
+#include "pch.h"
+#include <cmath>
+
+// Vertex format stuff
+namespace utils {
+struct Float2 {
+  float x, y;
+};
+
+struct Float3 {
+  float x, y, z;
+};
+
+struct Float4 {
+  float x, y, z, w;
+};
+
+// Quantized components. Three component 16 and 8 bit formats are rarely supported for vertex fetch, so the fourth
+// component is padding (or a free slot for the caller).
+struct Snorm16x4 {
+  int16_t x, y, z, w;
+};
+
+struct Snorm8x4 {
+  int8_t x, y, z, w;
+};
+
+struct Unorm8x4 {
+  uint8_t x, y, z, w;
+};
+
+struct Half2 {
+  uint16_t x, y;
+};
+
+template <typename T>
+struct VertexFormat;
+
+template <>
+struct VertexFormat<float> {
+  static constexpr vk::Format value = vk::Format::eR32Sfloat;
+};
+
+template <>
+struct VertexFormat<Float2> {
+  static constexpr vk::Format value = vk::Format::eR32G32Sfloat;
+};
+
+template <>
+struct VertexFormat<Float3> {
+  static constexpr vk::Format value = vk::Format::eR32G32B32Sfloat;
+};
+
+template <>
+struct VertexFormat<Float4> {
+  static constexpr vk::Format value = vk::Format::eR32G32B32A32Sfloat;
+};
+
+template <>
+struct VertexFormat<Snorm16x4> {
+  static constexpr vk::Format value = vk::Format::eR16G16B16A16Snorm;
+};
+
+template <>
+struct VertexFormat<Snorm8x4> {
+  static constexpr vk::Format value = vk::Format::eR8G8B8A8Snorm;
+};
+
+template <>
+struct VertexFormat<Unorm8x4> {
+  static constexpr vk::Format value = vk::Format::eR8G8B8A8Unorm;
+};
+
+template <>
+struct VertexFormat<Half2> {
+  static constexpr vk::Format value = vk::Format::eR16G16Sfloat;
+};
+
+int16_t quantizeSnorm16( float value ) {
+  return static_cast<int16_t>( std::lround( std::clamp( value, -1.0f, 1.0f ) * 32767.0f ) );
+}
+
+int8_t quantizeSnorm8( float value ) {
+  return static_cast<int8_t>( std::lround( std::clamp( value, -1.0f, 1.0f ) * 127.0f ) );
+}
+
+uint8_t quantizeUnorm8( float value ) {
+  return static_cast<uint8_t>( std::lround( std::clamp( value, 0.0f, 1.0f ) * 255.0f ) );
+}
+
+// IEEE half precision, rounded to nearest
+uint16_t quantizeHalf( float value ) {
+  uint32_t bits;
+  std::memcpy( &bits, &value, sizeof( bits ) );
+
+  uint32_t sign     = ( bits >> 16 ) & 0x8000u;
+  uint32_t rawExp   = ( bits >> 23 ) & 0xffu;
+  uint32_t mantissa = bits & 0x7fffffu;
+  int32_t  exponent = static_cast<int32_t>( rawExp ) - 127 + 15;
+
+  if ( rawExp == 0xffu ) {
+    return static_cast<uint16_t>( sign | 0x7c00u | ( mantissa ? 0x200u : 0u ) ); // Inf and NaN
+  }
+  if ( exponent >= 31 ) {
+    return static_cast<uint16_t>( sign | 0x7c00u ); // Too large, becomes Inf
+  }
+  if ( exponent <= 0 ) {
+    if ( exponent < -10 ) {
+      return static_cast<uint16_t>( sign ); // Too small even for a subnormal
+    }
+    mantissa |= 0x800000u;
+    uint32_t shift = static_cast<uint32_t>( 14 - exponent );
+    uint32_t half  = mantissa >> shift;
+    if ( ( mantissa >> ( shift - 1 ) ) & 1u ) {
+      half++;
+    }
+    return static_cast<uint16_t>( sign | half );
+  }
+
+  // A carry out of the mantissa correctly bumps the exponent
+  uint32_t half = sign | ( static_cast<uint32_t>( exponent ) << 10 ) | ( mantissa >> 13 );
+  if ( mantissa & 0x1000u ) {
+    half++;
+  }
+  return static_cast<uint16_t>( half );
+}
+
+// Vertex input state described from C++ vertex structs, handed to pipeline creation as is:
+//   VertexLayout().binding<PackedVertex>( 0 ).attribute( 0, &PackedVertex::position ).attribute( 1, ... )
+class VertexLayout {
+  public:
+  template <typename Vertex>
+  VertexLayout& binding( uint32_t binding, vk::VertexInputRate inputRate = vk::VertexInputRate::eVertex ) {
+    mBindings.push_back( vk::VertexInputBindingDescription( binding, sizeof( Vertex ), inputRate ) );
+    return *this;
+  }
+
+  // Format and offset come from the member, so the struct and the layout can never disagree
+  template <typename Vertex, typename T>
+  VertexLayout& attribute( uint32_t location, T Vertex::*member, uint32_t binding = 0 ) {
+    static const Vertex probe {};
+    uint32_t            offset = static_cast<uint32_t>( reinterpret_cast<const char*>( &( probe.*member ) )
+                                                        - reinterpret_cast<const char*>( &probe ) );
+    mAttributes.push_back( vk::VertexInputAttributeDescription( location, binding, VertexFormat<T>::value, offset ) );
+    return *this;
+  }
+
+  bool empty() const {
+    return mBindings.empty();
+  }
+
+  const std::vector<vk::VertexInputBindingDescription>& bindings() const {
+    return mBindings;
+  }
+
+  const std::vector<vk::VertexInputAttributeDescription>& attributes() const {
+    return mAttributes;
+  }
+
+  // Points into this layout, which therefore has to outlive pipeline creation
+  vk::PipelineVertexInputStateCreateInfo createInfo() const {
+    vk::PipelineVertexInputStateCreateInfo vertexInputInfo = {};
+    vertexInputInfo.flags                                  = vk::PipelineVertexInputStateCreateFlags();
+    vertexInputInfo.vertexBindingDescriptionCount          = static_cast<uint32_t>( mBindings.size() );
+    vertexInputInfo.pVertexBindingDescriptions             = mBindings.data();
+    vertexInputInfo.vertexAttributeDescriptionCount        = static_cast<uint32_t>( mAttributes.size() );
+    vertexInputInfo.pVertexAttributeDescriptions           = mAttributes.data();
+    return vertexInputInfo;
+  }
+
+  bool supportedBy( const DeviceCapabilities& capabilities ) const {
+    for ( const vk::VertexInputAttributeDescription& attribute : mAttributes ) {
+      if ( !( capabilities.formatProperties( attribute.format ).bufferFeatures
+              & vk::FormatFeatureFlagBits::eVertexBuffer ) ) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  private:
+  std::vector<vk::VertexInputBindingDescription>   mBindings;
+  std::vector<vk::VertexInputAttributeDescription> mAttributes;
+};
+
+// Full precision vertex, the input to packing (48 bytes)
+struct Vertex {
+  Float3 position;
+  Float3 normal;
+  Float2 uv;
+  Float4 color;
+};
+
+// Interleaved quantized vertex (20 bytes)
+struct PackedVertex {
+  Snorm16x4 position; // Normalized into the mesh bounds
+  Snorm8x4  normal;
+  Half2     uv;
+  Unorm8x4  color;
+};
+
+// Split streams: positions alone (8 bytes) keep depth only passes from fetching the rest, attributes (12 bytes)
+struct PackedPosition {
+  Snorm16x4 position;
+};
+
+struct PackedAttributes {
+  Snorm8x4 normal;
+  Half2    uv;
+  Unorm8x4 color;
+};
+
+enum class VertexStreams {
+  eInterleaved,
+  eSplit,
+};
+
+// Matches shaders/mesh.vert: position 0, normal 1, uv 2, color 3
+VertexLayout packedVertexLayout( VertexStreams streams ) {
+  VertexLayout layout;
+  if ( streams == VertexStreams::eInterleaved ) {
+    layout.binding<PackedVertex>( 0 )
+        .attribute( 0, &PackedVertex::position )
+        .attribute( 1, &PackedVertex::normal )
+        .attribute( 2, &PackedVertex::uv )
+        .attribute( 3, &PackedVertex::color );
+  } else {
+    layout.binding<PackedPosition>( 0 )
+        .binding<PackedAttributes>( 1 )
+        .attribute( 0, &PackedPosition::position, 0 )
+        .attribute( 1, &PackedAttributes::normal, 1 )
+        .attribute( 2, &PackedAttributes::uv, 1 )
+        .attribute( 3, &PackedAttributes::color, 1 );
+  }
+  return layout;
+}
+
+// Positions are stored relative to a bounding cube, scale by `extent` and add `center` to get them back
+struct MeshBounds {
+  Float3 center { 0.0f, 0.0f, 0.0f };
+  float  extent { 1.0f };
+};
+
+struct MeshData {
+  std::vector<Vertex>   vertices;
+  std::vector<uint32_t> indices;
+};
+
+struct PackedMesh {
+  VertexLayout                      layout;
+  std::vector<std::vector<uint8_t>> streams; // One per layout binding
+  std::vector<uint8_t>              indices;
+  vk::IndexType                     indexType { vk::IndexType::eUint32 };
+  uint32_t                          indexCount { 0 };
+  uint32_t                          vertexCount { 0 };
+  MeshBounds                        bounds;
+};
+
+MeshBounds computeBounds( const std::vector<Vertex>& vertices ) {
+  if ( vertices.empty() ) {
+    return {};
+  }
+
+  Float3 lo = vertices.front().position;
+  Float3 hi = vertices.front().position;
+  for ( const Vertex& vertex : vertices ) {
+    lo = { std::min( lo.x, vertex.position.x ), std::min( lo.y, vertex.position.y ),
+           std::min( lo.z, vertex.position.z ) };
+    hi = { std::max( hi.x, vertex.position.x ), std::max( hi.y, vertex.position.y ),
+           std::max( hi.z, vertex.position.z ) };
+  }
+
+  MeshBounds bounds;
+  bounds.center = { ( lo.x + hi.x ) * 0.5f, ( lo.y + hi.y ) * 0.5f, ( lo.z + hi.z ) * 0.5f };
+  bounds.extent = std::max( { hi.x - lo.x, hi.y - lo.y, hi.z - lo.z } ) * 0.5f;
+  if ( bounds.extent <= 0.0f ) {
+    bounds.extent = 1.0f;
+  }
+  return bounds;
+}
+
+// Renumbers vertices in the order the index buffer first touches them, so neighbouring triangles fetch neighbouring
+// memory. Unreferenced vertices are dropped.
+void optimizeVertexFetch( MeshData& mesh ) {
+  std::vector<uint32_t> remap( mesh.vertices.size(), ~0u );
+  std::vector<Vertex>   vertices;
+  vertices.reserve( mesh.vertices.size() );
+
+  for ( uint32_t& index : mesh.indices ) {
+    if ( remap[index] == ~0u ) {
+      remap[index] = static_cast<uint32_t>( vertices.size() );
+      vertices.push_back( mesh.vertices[index] );
+    }
+    index = remap[index];
+  }
+  mesh.vertices.swap( vertices );
+}
+
+template <typename T>
+void appendBytes( std::vector<uint8_t>& bytes, const T& value ) {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>( &value );
+  bytes.insert( bytes.end(), begin, begin + sizeof( T ) );
+}
+
+// Quantizes `mesh` into the given stream layout, with 16 bit indices whenever the vertex count allows it
+PackedMesh packMesh( const MeshData& mesh, VertexStreams streams ) {
+  PackedMesh packed;
+  packed.layout      = packedVertexLayout( streams );
+  packed.bounds      = computeBounds( mesh.vertices );
+  packed.vertexCount = static_cast<uint32_t>( mesh.vertices.size() );
+  packed.indexCount  = static_cast<uint32_t>( mesh.indices.size() );
+  packed.streams.resize( packed.layout.bindings().size() );
+
+  float scale = 1.0f / packed.bounds.extent;
+  for ( const Vertex& vertex : mesh.vertices ) {
+    Snorm16x4 position = { quantizeSnorm16( ( vertex.position.x - packed.bounds.center.x ) * scale ),
+                           quantizeSnorm16( ( vertex.position.y - packed.bounds.center.y ) * scale ),
+                           quantizeSnorm16( ( vertex.position.z - packed.bounds.center.z ) * scale ), 0 };
+    Snorm8x4  normal   = { quantizeSnorm8( vertex.normal.x ), quantizeSnorm8( vertex.normal.y ),
+                           quantizeSnorm8( vertex.normal.z ), 0 };
+    Half2     uv       = { quantizeHalf( vertex.uv.x ), quantizeHalf( vertex.uv.y ) };
+    Unorm8x4  color    = { quantizeUnorm8( vertex.color.x ), quantizeUnorm8( vertex.color.y ),
+                           quantizeUnorm8( vertex.color.z ), quantizeUnorm8( vertex.color.w ) };
+
+    if ( streams == VertexStreams::eInterleaved ) {
+      appendBytes( packed.streams[0], PackedVertex { position, normal, uv, color } );
+    } else {
+      appendBytes( packed.streams[0], PackedPosition { position } );
+      appendBytes( packed.streams[1], PackedAttributes { normal, uv, color } );
+    }
+  }
+
+  // 0xffff stays free so primitive restart never collides with a real vertex
+  if ( packed.vertexCount < 0xffffu ) {
+    packed.indexType = vk::IndexType::eUint16;
+    for ( uint32_t index : mesh.indices ) {
+      appendBytes( packed.indices, static_cast<uint16_t>( index ) );
+    }
+  } else {
+    packed.indexType = vk::IndexType::eUint32;
+    for ( uint32_t index : mesh.indices ) {
+      appendBytes( packed.indices, index );
+    }
+  }
+
+  return packed;
+}
+} // namespace utils